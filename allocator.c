@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "error.h"
+
+struct slab {
+    struct slab *next;
+    _Alignas(ALLOCATOR_GRANULE) char data[];
+};
+
+struct large {
+    struct large *next;
+    struct large *prev;
+    _Alignas(ALLOCATOR_GRANULE) char data[];
+};
+
+struct allocator program_allocator;
+
+static size_t allocator_class(size_t size) {
+    return size == 0 ? 0 : (size - 1) / ALLOCATOR_GRANULE;
+}
+
+static void *pool_alloc(struct pool *pool, size_t size) {
+    if (pool->free_list) {
+        void *object    = pool->free_list;
+        pool->free_list = *(void **)object;
+        return object;
+    }
+
+    if ((size_t)(pool->end - pool->cursor) < size) {
+        struct slab *slab = malloc(sizeof(struct slab) + ALLOCATOR_SLAB_SIZE);
+        if (!slab)
+            fatalf("error: could not allocate a slab.\n");
+
+        slab->next   = pool->slabs;
+        pool->slabs  = slab;
+        pool->cursor = slab->data;
+        pool->end    = slab->data + ALLOCATOR_SLAB_SIZE;
+    }
+
+    void *object = pool->cursor;
+    pool->cursor += size;
+    return object;
+}
+
+static void pool_free(struct pool *pool, void *object) {
+    *(void **)object = pool->free_list;
+    pool->free_list  = object;
+}
+
+static void pool_reset(struct pool *pool) {
+    while (pool->slabs) {
+        struct slab *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+}
+
+void *allocator_alloc(struct allocator *allocator, size_t size) {
+    size_t class = allocator_class(size);
+
+    if (class < ALLOCATOR_CLASSES)
+        return pool_alloc(&allocator->pools[class],
+                          (class + 1) * ALLOCATOR_GRANULE);
+
+    struct large *large = malloc(sizeof(struct large) + size);
+    if (!large)
+        fatalf("error: could not allocate %zu bytes.\n", size);
+
+    large->next = allocator->large;
+    large->prev = NULL;
+    if (allocator->large)
+        allocator->large->prev = large;
+    allocator->large = large;
+
+    return large->data;
+}
+
+void *allocator_calloc(struct allocator *allocator, size_t size) {
+    void *object = allocator_alloc(allocator, size);
+    memset(object, 0, size);
+    return object;
+}
+
+void *allocator_realloc(struct allocator *allocator, void *object,
+                        size_t old_size, size_t size) {
+    if (object && allocator_class(old_size) == allocator_class(size) &&
+        allocator_class(size) < ALLOCATOR_CLASSES)
+        return object;
+
+    void *resized = allocator_alloc(allocator, size);
+    if (object) {
+        memcpy(resized, object, old_size < size ? old_size : size);
+        allocator_free(allocator, object, old_size);
+    }
+
+    return resized;
+}
+
+void allocator_free(struct allocator *allocator, void *object, size_t size) {
+    if (!object)
+        return;
+
+    size_t class = allocator_class(size);
+
+    if (class < ALLOCATOR_CLASSES) {
+        pool_free(&allocator->pools[class], object);
+        return;
+    }
+
+    struct large *large =
+        (struct large *)((char *)object - offsetof(struct large, data));
+
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        allocator->large = large->next;
+    if (large->next)
+        large->next->prev = large->prev;
+
+    free(large);
+}
+
+char *allocator_strndup(struct allocator *allocator, char const *string,
+                        size_t length) {
+    char *copy = allocator_alloc(allocator, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* Releases every object handed out by the allocator in one pass over its
+ * slabs; pointers into it must not be used afterwards. */
+void allocator_reset(struct allocator *allocator) {
+    for (size_t i = 0; i < ALLOCATOR_CLASSES; i++)
+        pool_reset(&allocator->pools[i]);
+
+    while (allocator->large) {
+        struct large *next = allocator->large->next;
+        free(allocator->large);
+        allocator->large = next;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdlib.h>
+
+/* Small objects are served from per-size-class pools: each class carves
+ * fixed-size cells out of large slabs and recycles freed cells through its
+ * own free list. Requests above the largest class fall back to malloc but
+ * are still tracked, so that allocator_reset can release every object of
+ * an allocator at once without visiting them. */
+#define ALLOCATOR_GRANULE   16
+#define ALLOCATOR_CLASSES   16
+#define ALLOCATOR_SLAB_SIZE (64 * 1024)
+
+struct slab;
+struct large;
+
+struct pool {
+    void *free_list;
+    char *cursor;
+    char *end;
+    struct slab *slabs;
+};
+
+struct allocator {
+    struct pool pools[ALLOCATOR_CLASSES];
+    struct large *large;
+};
+
+/* Owns everything parsed from the program being built, until image_own
+ * hands it over to its image. */
+extern struct allocator program_allocator;
+
+void *allocator_alloc(struct allocator *allocator, size_t size);
+void *allocator_calloc(struct allocator *allocator, size_t size);
+void *allocator_realloc(struct allocator *allocator, void *object,
+                        size_t old_size, size_t size);
+void allocator_free(struct allocator *allocator, void *object, size_t size);
+char *allocator_strndup(struct allocator *allocator, char const *string,
+                        size_t length);
+void allocator_reset(struct allocator *allocator);
+
+#endif
\ No newline at end of file
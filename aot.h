@@ -0,0 +1,402 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "fiber.h"
+#include "kernel.h"
+#include "pool.h"
+#include "symbol.h"
+#include "thread.h"
+#include "vm.h"
+
+/* The runtime of programs translated to C by --emit-c, included by the
+ * translation unit the emitter writes, which is linked against the kernel.
+ *
+ * Every compiled function becomes a C function that takes the top of the
+ * data stack, sp, which points past the top value, and returns it. While
+ * it runs, base and end bound the buffer in locals. The height is written
+ * back to env->stack before calling into the kernel, which may look at the
+ * stack or move it, and read back after. Calls are C calls, so the
+ * program runs on a thread of its own with a stack of AOT_STACK_SIZE
+ * bytes, which is reserved rather than committed.
+ * A function entered with less than AOT_STACK_SLACK bytes of it left, the
+ * room kept for the kernel and for reporting, fails instead of
+ * overflowing it. */
+#ifndef AOT_STACK_SIZE
+#define AOT_STACK_SIZE (256 * 1024 * 1024)
+#endif
+
+#define AOT_STACK_SLACK (256 * 1024)
+
+#ifdef __GNUC__
+#define AOT_FRAME() ((uintptr_t)__builtin_frame_address(0))
+#else
+#define AOT_FRAME() ((uintptr_t)&env)
+#endif
+
+/* Errors are located on the slow paths only, which record the function
+ * and the definition of the instruction that is about to fail. */
+struct aot_location {
+    struct error_location location;
+    struct function *function;
+    uint32_t origin;
+};
+
+static inline void aot_report(struct error_location *error) {
+    struct aot_location *location = (struct aot_location *)error;
+
+    if (location->function)
+        report_location(location->function, location->origin);
+}
+
+/* Workers of the pool run compiled functions for the parallel combinators
+ * too. They have a location of their own that is not linked in, and no
+ * limit, so their calls are not checked against it. */
+static _Thread_local struct aot_location aot_location = {
+    {aot_report, NULL}, NULL, 0};
+
+static _Thread_local uintptr_t aot_stack_limit;
+
+/* Interns the symbols of the program in the order they were given their
+ * ids when it was translated, so the ids written into it stay valid. */
+static inline void aot_init(char const *const *symbols, size_t nsymbols) {
+    for (size_t i = 1; i < nsymbols; i++) {
+        if (symbol_intern(symbols[i], strlen(symbols[i])) != i)
+            fatalf("error: symbol %s was interned out of order.\n",
+                   symbols[i]);
+    }
+
+    struct internal_function *infn = &internal_functions[0];
+    for (; infn->name; infn++)
+        infn->symbol = symbol_intern(infn->name, strlen(infn->name));
+}
+
+/* Runs on the program thread, which has an error location of its own. */
+static void aot_execute(void *env) {
+    aot_stack_limit = AOT_FRAME() - AOT_STACK_SIZE + AOT_STACK_SLACK;
+
+    aot_location.location.prev = error_location;
+    error_location             = &aot_location.location;
+    environment_execute(env);
+}
+
+/* Runs the entry of env on the program thread and waits for it and the
+ * fibers it spawned, with a worker for every other processor and a
+ * scheduler thread for each. */
+static inline void aot_run(struct environment *env) {
+    struct thread thread;
+
+    pool_init(thread_processors() - 1);
+    fiber_init(thread_processors());
+    thread_start(&thread, aot_execute, env, AOT_STACK_SIZE);
+    thread_join(&thread);
+    if (fiber_destroy())
+        exit(EXIT_FAILURE);
+    pool_destroy();
+}
+
+#ifdef ENABLE_FFI
+static inline void aot_load_ffi(struct ffi_function *fn) {
+    HMODULE module = LoadLibraryA(fn->module);
+    if (!module)
+        fatalf("error: LoadLibraryA failed, %lu\n", GetLastError());
+
+    fn->fn = GetProcAddress(module, symbol_name(fn->symbol));
+    if (!fn->fn)
+        fatalf("error: GetProcAddress failed, %lu\n", GetLastError());
+
+    if (ffi_prep_cif(&fn->cif, FFI_DEFAULT_ABI, fn->nargs, &fn->ret_type,
+                     fn->args) != FFI_OK)
+        fatalf("error: ffi_prep_cif failed.\n");
+}
+#endif
+
+#define AOT_ENTER(f)                                                           \
+    if (AOT_FRAME() < aot_stack_limit) {                                       \
+        AOT_LOCATE(f, (f)->symbol);                                            \
+        fatalf("error: call stack overflow, more than %d bytes.\n",            \
+               AOT_STACK_SIZE);                                                \
+    }                                                                          \
+    struct stack *stack = env->stack;                                          \
+    struct value *base  = stack->data;                                         \
+    struct value *end   = base + stack->capacity;                              \
+    (void)end
+
+/* Reads back where the buffer is, which any call may have moved. */
+#define AOT_BOUNDS() (base = stack->data, end = base + stack->capacity)
+
+#define AOT_SYNC()   (stack->ndata = (size_t)(sp - base))
+#define AOT_RELOAD() (AOT_BOUNDS(), sp = base + stack->ndata)
+
+#define AOT_LOCATE(f, o)                                                       \
+    (aot_location.function = (f), aot_location.origin = (o))
+
+#define AOT_DEPTH()       ((size_t)(sp - base))
+#define AOT_IS_INTEGER(n) (sp[-(n)].type == VALUE_TYPE_INTEGER)
+#define AOT_INTEGER(i)                                                         \
+    ((struct value){.type = VALUE_TYPE_INTEGER, .integer = (i)})
+
+/* Runs a statement of the kernel with the stack written back. */
+#define AOT_KERNEL(statement)                                                  \
+    do {                                                                       \
+        AOT_SYNC();                                                            \
+        statement;                                                             \
+        AOT_RELOAD();                                                          \
+    } while (0)
+
+#define AOT_BUILTIN(f, o, cfn)                                                 \
+    do {                                                                       \
+        AOT_LOCATE(f, o);                                                      \
+        AOT_KERNEL(cfn(env));                                                  \
+    } while (0)
+
+/* Values on the stack are copied a field at a time. A copy of the whole
+ * struct is one 16 byte load, which cannot be forwarded from the 8 byte
+ * store that usually just wrote the integer, and stalls. */
+#define AOT_COPY(to, from)                                                     \
+    ((to).type = (from).type, (to).integer = (from).integer)
+
+#define AOT_RESERVE(f, o)                                                      \
+    if (sp == end) {                                                           \
+        AOT_LOCATE(f, o);                                                      \
+        AOT_KERNEL(stack_grow(stack));                                         \
+    }
+
+#define AOT_PUSH(f, o, v)                                                      \
+    do {                                                                       \
+        struct value aot_value = (v);                                          \
+        AOT_RESERVE(f, o);                                                     \
+        *sp++ = aot_value;                                                     \
+    } while (0)
+
+#define AOT_RETURN() return sp
+
+#define AOT_CALL(callee) (sp = callee(env, sp), AOT_BOUNDS())
+
+/* A call in tail position returns what the callee returns, which the C
+ * compiler turns into a jump. */
+#define AOT_TAIL_CALL(callee) return callee(env, sp)
+
+/* Quotations of the program are called directly; the ones built at run
+ * time have no C function and are left to environment_call. A missing or
+ * non-lambda operand is left to the builtin to report. */
+#define AOT_POP_LAMBDA(f, o)                                                   \
+    if (sp == base || sp[-1].type != VALUE_TYPE_LAMBDA)                        \
+        AOT_BUILTIN(f, o, __applyfunction);                                    \
+    struct function *aot_lambda = (--sp)->lambda
+
+#define AOT_APPLY(f, o)                                                        \
+    do {                                                                       \
+        AOT_POP_LAMBDA(f, o);                                                  \
+        if (aot_lambda->compiled)                                              \
+            AOT_CALL(aot_lambda->compiled);                                    \
+        else                                                                   \
+            AOT_KERNEL(environment_call(env, aot_lambda));                     \
+    } while (0)
+
+#define AOT_TAIL_APPLY(f, o)                                                   \
+    do {                                                                       \
+        AOT_POP_LAMBDA(f, o);                                                  \
+        if (aot_lambda->compiled)                                              \
+            return aot_lambda->compiled(env, sp);                              \
+        AOT_KERNEL(environment_call(env, aot_lambda));                         \
+        return sp;                                                             \
+    } while (0)
+
+#ifdef ENABLE_FFI
+#define AOT_CALL_FFI(f, o, fn)                                                 \
+    do {                                                                       \
+        AOT_LOCATE(f, o);                                                      \
+        AOT_KERNEL(environment_call_ffi(env, fn));                             \
+    } while (0)
+#endif
+
+/* Conditions are checked inline; a missing or non-integer one is left to
+ * environment_condition to report. */
+#define AOT_JUMP_IF(f, o, test, label)                                         \
+    do {                                                                       \
+        if (sp == base || !AOT_IS_INTEGER(1)) {                                \
+            AOT_LOCATE(f, o);                                                  \
+            AOT_KERNEL(environment_condition(env));                            \
+        }                                                                      \
+        if ((--sp)->integer test 0)                                            \
+            goto label;                                                        \
+    } while (0)
+
+#define AOT_JUMP_IF_FALSE(f, o, label) AOT_JUMP_IF(f, o, ==, label)
+#define AOT_JUMP_IF_TRUE(f, o, label)  AOT_JUMP_IF(f, o, !=, label)
+
+/* Loops compiled to jumps keep their counter in a local struct vm_loop of
+ * the function, one for each level of nesting. */
+#define AOT_LOOP_BEGIN(f, o, loop)                                             \
+    do {                                                                       \
+        if (sp == base) {                                                      \
+            AOT_LOCATE(f, o);                                                  \
+            fatalf("error: stack_pop failed, empty stack\n");                  \
+        }                                                                      \
+        if (!AOT_IS_INTEGER(1)) {                                              \
+            AOT_LOCATE(f, o);                                                  \
+            fatalf("error: times expects an integer and a lambda\n");          \
+        }                                                                      \
+        (loop) = (struct vm_loop){0, (--sp)->integer};                         \
+    } while (0)
+
+#define AOT_LOOP_NEXT(loop, label)                                             \
+    do {                                                                       \
+        if ((loop).index >= (loop).count)                                      \
+            goto label;                                                        \
+        (loop).index++;                                                        \
+    } while (0)
+
+#define AOT_LOOP_NEXT_INDEX(f, o, loop, label)                                 \
+    do {                                                                       \
+        if ((loop).index >= (loop).count)                                      \
+            goto label;                                                        \
+        AOT_PUSH(f, o, AOT_INTEGER((loop).index++));                           \
+    } while (0)
+
+/* The builtins the VM handles itself, inline. The checked forms fall back
+ * to the kernel when their operands are missing or of the wrong type, so
+ * that they fail the same way. */
+#define AOT_ARITHMETIC(f, o, op, cfn)                                          \
+    do {                                                                       \
+        if (AOT_DEPTH() < 2 || !AOT_IS_INTEGER(1) || !AOT_IS_INTEGER(2))       \
+            AOT_BUILTIN(f, o, cfn);                                            \
+        else                                                                   \
+            sp[-2].integer = op(sp[-2].integer, sp[-1].integer), sp--;         \
+    } while (0)
+
+#define AOT_ADD(f, o)       AOT_ARITHMETIC(f, o, integer_add, __addfunction)
+#define AOT_MUL(f, o)       AOT_ARITHMETIC(f, o, integer_mul, __mulfunction)
+#define AOT_ADD_UNCHECKED()                                                    \
+    (sp[-2].integer = integer_add(sp[-2].integer, sp[-1].integer), sp--)
+#define AOT_MUL_UNCHECKED()                                                    \
+    (sp[-2].integer = integer_mul(sp[-2].integer, sp[-1].integer), sp--)
+#define AOT_EQUAL_UNCHECKED()                                                  \
+    (sp[-2].integer = sp[-2].integer == sp[-1].integer, sp--)
+
+#define AOT_EQUAL(f, o)                                                        \
+    do {                                                                       \
+        if (AOT_DEPTH() < 2 || !AOT_IS_INTEGER(1) || !AOT_IS_INTEGER(2))       \
+            AOT_BUILTIN(f, o, __equalfunction);                                \
+        else                                                                   \
+            AOT_EQUAL_UNCHECKED();                                             \
+    } while (0)
+
+#define AOT_DUP(f, o)                                                          \
+    do {                                                                       \
+        if (sp == base)                                                        \
+            AOT_BUILTIN(f, o, __dupfunction);                                  \
+        else                                                                   \
+            AOT_DUP_UNCHECKED(f, o);                                           \
+    } while (0)
+
+#define AOT_DUP_UNCHECKED(f, o)                                                \
+    do {                                                                       \
+        AOT_RESERVE(f, o);                                                     \
+        AOT_COPY(sp[0], sp[-1]);                                               \
+        sp++;                                                                  \
+    } while (0)
+
+#define AOT_DROP(f, o)                                                         \
+    do {                                                                       \
+        if (sp == base)                                                        \
+            AOT_BUILTIN(f, o, __dropfunction);                                 \
+        else                                                                   \
+            sp--;                                                              \
+    } while (0)
+
+#define AOT_DROP_UNCHECKED() (sp--)
+
+#define AOT_SWAP_UNCHECKED()                                                   \
+    do {                                                                       \
+        struct value aot_value;                                                \
+        AOT_COPY(aot_value, sp[-1]);                                           \
+        AOT_COPY(sp[-1], sp[-2]);                                              \
+        AOT_COPY(sp[-2], aot_value);                                           \
+    } while (0)
+
+#define AOT_SWAP(f, o)                                                         \
+    do {                                                                       \
+        if (AOT_DEPTH() < 2)                                                   \
+            AOT_BUILTIN(f, o, __swapfunction);                                 \
+        else                                                                   \
+            AOT_SWAP_UNCHECKED();                                              \
+    } while (0)
+
+#define AOT_ROT_UNCHECKED()                                                    \
+    do {                                                                       \
+        struct value aot_value;                                                \
+        AOT_COPY(aot_value, sp[-3]);                                           \
+        AOT_COPY(sp[-3], sp[-2]);                                              \
+        AOT_COPY(sp[-2], sp[-1]);                                              \
+        AOT_COPY(sp[-1], aot_value);                                           \
+    } while (0)
+
+#define AOT_ROT(f, o)                                                          \
+    do {                                                                       \
+        if (AOT_DEPTH() < 3)                                                   \
+            AOT_BUILTIN(f, o, __rotfunction);                                  \
+        else                                                                   \
+            AOT_ROT_UNCHECKED();                                               \
+    } while (0)
+
+/* Superinstructions, with the same fallbacks as in the VM. */
+#define AOT_DUP_MUL(f, o)                                                      \
+    do {                                                                       \
+        if (sp == base || !AOT_IS_INTEGER(1)) {                                \
+            AOT_BUILTIN(f, o, __dupfunction);                                  \
+            AOT_BUILTIN(f, o, __mulfunction);                                  \
+        } else {                                                               \
+            sp[-1].integer = integer_mul(sp[-1].integer, sp[-1].integer);      \
+        }                                                                      \
+    } while (0)
+
+#define AOT_DUP_MUL_UNCHECKED()                                                \
+    (sp[-1].integer = integer_mul(sp[-1].integer, sp[-1].integer))
+
+#define AOT_SWAP_DROP(f, o)                                                    \
+    do {                                                                       \
+        if (AOT_DEPTH() < 2)                                                   \
+            AOT_BUILTIN(f, o, __swapfunction);                                 \
+        else                                                                   \
+            AOT_SWAP_DROP_UNCHECKED();                                         \
+    } while (0)
+
+#define AOT_SWAP_DROP_UNCHECKED() (AOT_COPY(sp[-2], sp[-1]), sp--)
+
+#define AOT_ARITHMETIC_INT(f, o, op, cfn, i)                                   \
+    do {                                                                       \
+        if (sp == base || !AOT_IS_INTEGER(1)) {                                \
+            AOT_PUSH(f, o, AOT_INTEGER(i));                                    \
+            AOT_BUILTIN(f, o, cfn);                                            \
+        } else {                                                               \
+            sp[-1].integer = op(sp[-1].integer, (i));                          \
+        }                                                                      \
+    } while (0)
+
+#define AOT_ADD_INT(f, o, i)                                                   \
+    AOT_ARITHMETIC_INT(f, o, integer_add, __addfunction, i)
+#define AOT_MUL_INT(f, o, i)                                                   \
+    AOT_ARITHMETIC_INT(f, o, integer_mul, __mulfunction, i)
+#define AOT_ADD_INT_UNCHECKED(i)                                               \
+    (sp[-1].integer = integer_add(sp[-1].integer, (i)))
+#define AOT_MUL_INT_UNCHECKED(i)                                               \
+    (sp[-1].integer = integer_mul(sp[-1].integer, (i)))
+
+#define AOT_EQUAL_INT(f, o, i)                                                 \
+    do {                                                                       \
+        if (sp == base) {                                                      \
+            AOT_BUILTIN(f, o, __equalfunction);                                \
+        } else {                                                               \
+            sp[-1].integer =                                                   \
+                AOT_IS_INTEGER(1) && sp[-1].integer == (i);                    \
+            sp[-1].type = VALUE_TYPE_INTEGER;                                  \
+        }                                                                      \
+    } while (0)
+
+#endif
\ No newline at end of file
@@ -0,0 +1,509 @@
+#include <string.h>
+
+#include "checker.h"
+#include "error.h"
+
+enum checker_type {
+    CHECKER_TYPE_ANY,
+    CHECKER_TYPE_INTEGER,
+    CHECKER_TYPE_STRING,
+    CHECKER_TYPE_LAMBDA,
+};
+
+/* What is known about a value on the abstract stack. lambda is set for a
+ * literal quotation, whose effect is then used where it is applied. */
+struct checker_value {
+    enum checker_type type;
+    struct function *lambda;
+};
+
+/* count values alike. Runs of unknown values, such as those a callee
+ * leaves or those taken from the caller, are kept as one run however long
+ * they are; other values have a run each. */
+struct checker_run {
+    struct checker_value value;
+    uint64_t count;
+};
+
+/* The abstract stack of the function being checked. runs holds what the
+ * function has pushed and not consumed yet, size values in all, and in
+ * counts the values it took from its caller. Once something with an
+ * unknown effect has run the values below are unknown, and so is the
+ * effect of the function. */
+struct checker {
+    struct error_location location;
+    struct function *function;
+    struct word *word;
+
+    struct checker_run *runs;
+    size_t nruns;
+    size_t capacity;
+    uint64_t size;
+
+    uint64_t in;
+    int64_t peak;
+    _Bool known;
+
+    /* Set while checking main, which is entered with an empty stack, until
+     * anything with an unknown effect has run: running out of values is
+     * then certain to underflow. */
+    _Bool exact;
+};
+
+/* Effects are kept in 32 bits; a function going deeper than that has an
+ * unknown effect and is left for the run-time checks. */
+#define CHECKER_DEPTH_MAX UINT32_MAX
+
+static struct checker_value const checker_any = {CHECKER_TYPE_ANY, NULL};
+
+static void checker_check_function(struct function *function, _Bool exact);
+
+static void checker_report(struct error_location *location) {
+    struct checker *checker = (struct checker *)location;
+
+    if (checker->word)
+        report_location(checker->function, checker->word->origin);
+}
+
+static char const *checker_word_name(struct word *word) {
+    switch (word->function.type) {
+    case FUNCTION_TYPE_CFUNCTION:
+        return word->function.cfn.name;
+    case FUNCTION_TYPE_REGULAR:
+        return symbol_name(word->function.fn->symbol);
+    case FUNCTION_TYPE_FFI:
+#ifdef ENABLE_FFI
+        return symbol_name(word->function.ffi_fn->symbol);
+#endif
+        break;
+    }
+
+    return "?";
+}
+
+static int64_t checker_height(struct checker *checker) {
+    return (int64_t)checker->size - (int64_t)checker->in;
+}
+
+static void checker_grow(struct checker *checker) {
+    if (checker->capacity <= checker->nruns) {
+        checker->capacity = checker->capacity ? checker->capacity * 2 : 16;
+        checker->runs     = realloc(checker->runs,
+                                    sizeof(*checker->runs) * checker->capacity);
+    }
+}
+
+static _Bool checker_unknown(struct checker_value value) {
+    return value.type == CHECKER_TYPE_ANY && !value.lambda;
+}
+
+/* Pushes count values alike, as a run of their own unless they are
+ * unknown and go on top of unknown values. */
+static void checker_push_run(struct checker *checker,
+                             struct checker_value value, uint64_t count) {
+    if (!count)
+        return;
+
+    if (checker->nruns && checker_unknown(value) &&
+        checker_unknown(checker->runs[checker->nruns - 1].value)) {
+        checker->runs[checker->nruns - 1].count += count;
+    } else {
+        checker_grow(checker);
+        checker->runs[checker->nruns++] = (struct checker_run){value, count};
+    }
+
+    checker->size += count;
+    if (checker_height(checker) > checker->peak)
+        checker->peak = checker_height(checker);
+}
+
+static void checker_push(struct checker *checker, enum checker_type type,
+                         struct function *lambda) {
+    checker_grow(checker);
+    checker->runs[checker->nruns++] =
+        (struct checker_run){{type, lambda}, 1};
+
+    checker->size++;
+    if (checker_height(checker) > checker->peak)
+        checker->peak = checker_height(checker);
+}
+
+/* Forgets everything below the top of the stack, after running something
+ * whose effect is not known. */
+static void checker_barrier(struct checker *checker) {
+    checker->nruns = 0;
+    checker->size  = 0;
+    checker->known = 0;
+    checker->exact = 0;
+}
+
+static void checker_underflow(struct checker *checker, uint64_t n,
+                              _Bool quotation) {
+    char const *name = checker_word_name(checker->word);
+
+    if (quotation)
+        fatalf("error: stack underflow, the quotation run by %s takes %zu "
+               "values but the stack holds %zu.\n",
+               name, (size_t)n, (size_t)checker->size);
+
+    fatalf("error: stack underflow, %s takes %zu values but the stack holds "
+           "%zu.\n",
+           name, (size_t)n, (size_t)checker->size);
+}
+
+/* Makes sure there are n values on the abstract stack, taking the missing
+ * ones from the caller. Returns whether they were all pushed by the
+ * function itself, and so are certain to be there. Running out of values
+ * is reported as the fault of the word being checked or, with quotation
+ * set, of the quotation it runs. */
+static _Bool checker_need_for(struct checker *checker, uint64_t n,
+                              _Bool quotation) {
+    if (checker->size >= n)
+        return 1;
+
+    uint64_t missing = n - checker->size;
+
+    if (checker->exact)
+        checker_underflow(checker, n, quotation);
+
+    if (!checker->nruns || !checker_unknown(checker->runs[0].value)) {
+        checker_grow(checker);
+        memmove(checker->runs + 1, checker->runs,
+                sizeof(*checker->runs) * checker->nruns);
+        checker->runs[0] = (struct checker_run){checker_any, 0};
+        checker->nruns++;
+    }
+
+    checker->runs[0].count += missing;
+    checker->size = n;
+    checker->in += missing;
+    return 0;
+}
+
+static _Bool checker_need(struct checker *checker, uint64_t n) {
+    return checker_need_for(checker, n, 0);
+}
+
+/* Takes n values, which must be there, off the abstract stack. */
+static void checker_drop(struct checker *checker, uint64_t n) {
+    checker->size -= n;
+
+    while (n) {
+        struct checker_run *top = &checker->runs[checker->nruns - 1];
+        uint64_t taken          = top->count < n ? top->count : n;
+
+        top->count -= taken;
+        n -= taken;
+        if (!top->count)
+            checker->nruns--;
+    }
+}
+
+/* Gives each of the top n values, which must be there, a run of its own,
+ * so that they can be read and rearranged in place. */
+static void checker_split(struct checker *checker, size_t n) {
+    struct checker_value values[3];
+
+    for (size_t i = 0; i < n; i++) {
+        values[i] = checker->runs[checker->nruns - 1].value;
+        checker_drop(checker, 1);
+    }
+
+    while (n--) {
+        checker_grow(checker);
+        checker->runs[checker->nruns++] = (struct checker_run){values[n], 1};
+        checker->size++;
+    }
+}
+
+static struct checker_value checker_pop(struct checker *checker) {
+    checker_need(checker, 1);
+
+    struct checker_value value = checker->runs[checker->nruns - 1].value;
+    checker_drop(checker, 1);
+    return value;
+}
+
+/* The top n values, split into runs of their own; top[0] is the top of
+ * the stack and top[-1] the value below. */
+static struct checker_run *checker_top(struct checker *checker, size_t n) {
+    checker_split(checker, n);
+    return &checker->runs[checker->nruns - 1];
+}
+
+static _Bool checker_integers(struct checker *checker, int n) {
+    struct checker_run *top = checker_top(checker, n);
+
+    for (int i = 0; i < n; i++) {
+        if (top[-i].value.type != CHECKER_TYPE_INTEGER)
+            return 0;
+    }
+
+    return 1;
+}
+
+static struct stack_effect *checker_effect(struct function *function) {
+    if (function->effect.state == STACK_EFFECT_UNCHECKED)
+        checker_check_function(function, 0);
+
+    return &function->effect;
+}
+
+/* Runs a function, or with quotation set a quotation given to the word
+ * being checked, on the abstract stack through its effect. */
+static void checker_apply(struct checker *checker, struct stack_effect *effect,
+                          _Bool quotation) {
+    if (checker_height(checker) + effect->peak > checker->peak)
+        checker->peak = checker_height(checker) + effect->peak;
+
+    checker_need_for(checker, effect->in, quotation);
+    checker_drop(checker, effect->in);
+    checker_push_run(checker, checker_any, effect->out);
+}
+
+/* The effect of a quotation, or NULL when it is not a literal or its
+ * effect is not known. */
+static struct stack_effect *checker_quotation(struct checker_value quotation) {
+    if (!quotation.lambda)
+        return NULL;
+
+    struct stack_effect *effect = checker_effect(quotation.lambda);
+    return effect->state == STACK_EFFECT_KNOWN ? effect : NULL;
+}
+
+/* Runs a function on the abstract stack through its effect. A function
+ * that is still being checked is recursive and has no effect yet. */
+static void checker_call(struct checker *checker, struct function *callee,
+                         _Bool quotation) {
+    struct stack_effect *effect = checker_effect(callee);
+
+    if (effect->state != STACK_EFFECT_KNOWN) {
+        checker_barrier(checker);
+        return;
+    }
+
+    checker_apply(checker, effect, quotation);
+}
+
+/* For a quotation run any number of times, with pushed values pushed
+ * before each run and left values taken off after it, as by times-i and
+ * the predicate of while. Only a quotation that leaves the stack as high
+ * as it found it has a known effect, and since it may not run at all,
+ * missing operands are not certain to underflow. */
+static void checker_repeat(struct checker *checker,
+                           struct checker_value quotation, uint32_t pushed,
+                           uint32_t left) {
+    struct stack_effect *effect = checker_quotation(quotation);
+
+    if (!effect || effect->in + left != effect->out + pushed ||
+        checker->size + pushed < effect->in) {
+        checker_barrier(checker);
+        return;
+    }
+
+    if (checker_height(checker) + pushed + effect->peak > checker->peak)
+        checker->peak = checker_height(checker) + pushed + effect->peak;
+
+    /* What the quotation takes from below is replaced by what it leaves,
+     * of which nothing is known. */
+    if (effect->in > pushed) {
+        checker_drop(checker, effect->in - pushed);
+        checker_push_run(checker, checker_any, effect->in - pushed);
+    }
+}
+
+/* Both branches of an if must change the height of the stack by the same
+ * amount. When they take different numbers of values, the extra ones are
+ * only certain to be needed if they are already on the stack. */
+static void checker_if(struct checker *checker, struct checker_value then,
+                       struct checker_value otherwise) {
+    struct stack_effect *a = checker_quotation(then);
+    struct stack_effect *b = checker_quotation(otherwise);
+
+    if (!a || !b ||
+        (int64_t)a->out - (int64_t)a->in != (int64_t)b->out - (int64_t)b->in) {
+        checker_barrier(checker);
+        return;
+    }
+
+    struct stack_effect effect = a->in >= b->in ? *a : *b;
+    if (a->in != b->in && checker->size < effect.in) {
+        checker_barrier(checker);
+        return;
+    }
+
+    effect.peak = a->peak > b->peak ? a->peak : b->peak;
+    checker_apply(checker, &effect, 1);
+}
+
+static void checker_builtin(struct checker *checker, struct word *word) {
+    cfunction function = word->function.cfn.function;
+
+    if (function == __addfunction || function == __mulfunction ||
+        function == __equalfunction) {
+        word->unchecked =
+            checker_need(checker, 2) && checker_integers(checker, 2);
+        checker_drop(checker, 2);
+        checker_push(checker, CHECKER_TYPE_INTEGER, NULL);
+    } else if (function == __dupfunction) {
+        word->unchecked          = checker_need(checker, 1);
+        struct checker_value top = checker_top(checker, 1)->value;
+        checker_push(checker, top.type, top.lambda);
+    } else if (function == __dropfunction) {
+        word->unchecked = checker_need(checker, 1);
+        checker_drop(checker, 1);
+    } else if (function == __swapfunction) {
+        word->unchecked         = checker_need(checker, 2);
+        struct checker_run *top = checker_top(checker, 2);
+        struct checker_value a  = top[0].value;
+        top[0].value            = top[-1].value;
+        top[-1].value           = a;
+    } else if (function == __rotfunction) {
+        word->unchecked         = checker_need(checker, 3);
+        struct checker_run *top = checker_top(checker, 3);
+        struct checker_value a  = top[-2].value;
+        top[-2].value           = top[-1].value;
+        top[-1].value           = top[0].value;
+        top[0].value            = a;
+    } else if (function == __printfunction) {
+        checker_pop(checker);
+    } else if (function == __printsfunction) {
+        /* Only reads the stack. */
+    } else if (function == __composefunction ||
+               function == __curryfunction) {
+        checker_need(checker, 2);
+        checker_drop(checker, 2);
+        checker_push(checker, CHECKER_TYPE_LAMBDA, NULL);
+    } else if (function == __applyfunction) {
+        struct checker_value quotation = checker_pop(checker);
+
+        if (quotation.lambda)
+            checker_call(checker, quotation.lambda, 1);
+        else
+            checker_barrier(checker);
+    } else if (function == __bifunction) {
+        checker_need(checker, 3);
+        struct checker_value q = checker_pop(checker);
+        struct checker_value p = checker_pop(checker);
+        struct checker_value x = checker_pop(checker);
+
+        if (!p.lambda || !q.lambda) {
+            checker_barrier(checker);
+            return;
+        }
+
+        checker_push(checker, x.type, x.lambda);
+        checker_call(checker, p.lambda, 1);
+        checker_push(checker, x.type, x.lambda);
+        checker_call(checker, q.lambda, 1);
+    } else if (function == __timesfunction ||
+               function == __timesifunction) {
+        checker_need(checker, 2);
+        struct checker_value quotation = checker_pop(checker);
+        checker_pop(checker);
+        checker_repeat(checker, quotation, function == __timesifunction, 0);
+    } else if (function == __whenfunction) {
+        checker_need(checker, 2);
+        struct checker_value quotation = checker_pop(checker);
+        checker_pop(checker);
+        checker_repeat(checker, quotation, 0, 0);
+    } else if (function == __loopfunction) {
+        checker_repeat(checker, checker_pop(checker), 0, 1);
+    } else if (function == __whilefunction) {
+        checker_need(checker, 2);
+        struct checker_value body      = checker_pop(checker);
+        struct checker_value predicate = checker_pop(checker);
+        checker_repeat(checker, predicate, 0, 1);
+        checker_repeat(checker, body, 0, 0);
+    } else if (function == __iffunction) {
+        checker_need(checker, 3);
+        struct checker_value otherwise = checker_pop(checker);
+        struct checker_value then      = checker_pop(checker);
+        checker_pop(checker);
+        checker_if(checker, then, otherwise);
+    } else {
+        checker_barrier(checker);
+    }
+}
+
+static void checker_word(struct checker *checker, struct word *word) {
+    checker->word = word;
+
+    switch (word->type) {
+    case WORD_TYPE_VALUE:
+        checker_push(checker,
+                     word->value.type == WORD_VALUE_TYPE_INTEGER
+                         ? CHECKER_TYPE_INTEGER
+                         : CHECKER_TYPE_STRING,
+                     NULL);
+        break;
+    case WORD_TYPE_LAMBDA:
+        checker_effect(word->lambda);
+        checker_push(checker, CHECKER_TYPE_LAMBDA, word->lambda);
+        break;
+    case WORD_TYPE_FUNCTION:
+        switch (word->function.type) {
+        case FUNCTION_TYPE_CFUNCTION:
+            checker_builtin(checker, word);
+            break;
+        case FUNCTION_TYPE_REGULAR:
+            checker_call(checker, word->function.fn, 0);
+            break;
+        case FUNCTION_TYPE_FFI:
+#ifdef ENABLE_FFI
+            checker_need(checker, word->function.ffi_fn->nargs);
+            checker_drop(checker, word->function.ffi_fn->nargs);
+            checker_push(checker, CHECKER_TYPE_INTEGER, NULL);
+#else
+            checker_barrier(checker);
+#endif
+            break;
+        }
+        break;
+    }
+}
+
+static void checker_check_function(struct function *function, _Bool exact) {
+    struct checker checker = {{checker_report, error_location}, function};
+    checker.known          = 1;
+    checker.exact          = exact;
+
+    function->effect.state = STACK_EFFECT_CHECKING;
+    error_location         = &checker.location;
+
+    for (size_t i = 0; i < function->size; i++)
+        checker_word(&checker, function->words[i]);
+
+    error_location = checker.location.prev;
+    free(checker.runs);
+
+    if (!checker.known || checker.in > CHECKER_DEPTH_MAX ||
+        checker.size > CHECKER_DEPTH_MAX || checker.peak > CHECKER_DEPTH_MAX) {
+        function->effect.state = STACK_EFFECT_UNKNOWN;
+        return;
+    }
+
+    function->effect = (struct stack_effect){
+        STACK_EFFECT_KNOWN, (uint32_t)checker.in, (uint32_t)checker.size,
+        (uint32_t)checker.peak};
+}
+
+size_t checker_check_program(struct image *image, _Bool inputs) {
+    /* A function can only call those defined before it, so checking in
+     * order finds the effect of every callee first. */
+    for (size_t i = 0; i < image->globals_size; i++) {
+        struct word *global = image->globals[i];
+        if (global->function.type != FUNCTION_TYPE_REGULAR)
+            continue;
+
+        struct function *function = global->function.fn;
+        if (function->effect.state == STACK_EFFECT_UNCHECKED)
+            checker_check_function(function,
+                                   !inputs && function == image->entry);
+    }
+
+    if (!image->entry || image->entry->effect.state != STACK_EFFECT_KNOWN)
+        return 0;
+
+    return image->entry->effect.peak;
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef CHECKER_H
+#define CHECKER_H
+
+#include "kernel.h"
+
+/* Infers the stack effect of every global function and the lambdas nested
+ * in them from the signatures of the builtins, marking the builtin words
+ * whose operands are proven present and well typed as unchecked. Unless
+ * main takes inputs, in which case it is checked like any other function,
+ * a program whose main is certain to underflow the stack is rejected.
+ * Returns the most values main can have on the stack above its inputs, or
+ * 0 when that is not known. */
+size_t checker_check_program(struct image *image, _Bool inputs);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,233 @@
+/* A client for catcat --serve, and a benchmark comparing it with starting
+ * a process for every run:
+ *
+ *     catcat-client <socket> <program.tt> [input...]
+ *     catcat-client --bench <socket> <catcat> <program.tt> <runs>
+ *     catcat-client --quit <socket>
+ *
+ * The first form runs the program on the server with the inputs pushed
+ * onto its stack, prints what it printed and the stack it left, and exits
+ * with failure if it did not run to completion. The second runs it as
+ * many times over one connection, then as many times with fork and exec,
+ * and reports the rate of each. The last stops the server. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+int main(void) {
+    fprintf(stderr, "error: catcat-client needs Unix sockets.\n");
+    return EXIT_FAILURE;
+}
+#else
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct request {
+    char *source;
+    size_t size;
+    char **inputs;
+    size_t ninputs;
+};
+
+static void die(char const *format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+    exit(EXIT_FAILURE);
+}
+
+static void read_file(char const *path, struct request *request) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        die("error: opening file %s.\n", path);
+
+    size_t capacity = 4096;
+    request->source = malloc(capacity);
+    request->size   = 0;
+
+    size_t n;
+    while ((n = fread(request->source + request->size, 1,
+                      capacity - request->size, file)) > 0) {
+        request->size += n;
+        if (request->size == capacity) {
+            capacity *= 2;
+            request->source = realloc(request->source, capacity);
+        }
+    }
+
+    fclose(file);
+}
+
+static int connect_to(char const *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(address.sun_path))
+        die("error: socket path %s is too long.\n", path);
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        die("error: could not connect to %s.\n", path);
+
+    return fd;
+}
+
+static void write_all(int fd, char const *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0)
+            die("error: the server went away.\n");
+
+        data += n;
+        size -= (size_t)n;
+    }
+}
+
+static void send_request(int fd, struct request *request) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "run %zu %zu\n",
+                          request->size, request->ninputs);
+
+    write_all(fd, header, (size_t)length);
+    write_all(fd, request->source, request->size);
+
+    for (size_t i = 0; i < request->ninputs; i++) {
+        write_all(fd, request->inputs[i], strlen(request->inputs[i]));
+        write_all(fd, "\n", 1);
+    }
+}
+
+/* Copies what the program printed to out, if any, up to the NUL that ends
+ * it, then the results line on success. Returns whether the program ran to
+ * completion. */
+static _Bool receive_response(FILE *in, FILE *out) {
+    int c;
+
+    while ((c = getc(in)) != '\0') {
+        if (c == EOF)
+            die("error: the server went away.\n");
+        if (out)
+            putc(c, out);
+    }
+
+    char line[64];
+    if (!fgets(line, sizeof(line), in))
+        die("error: the server went away.\n");
+    if (strcmp(line, "ok\n") != 0)
+        return 0;
+
+    while ((c = getc(in)) != '\n') {
+        if (c == EOF)
+            die("error: the server went away.\n");
+        if (out)
+            putc(c, out);
+    }
+    if (out)
+        putc('\n', out);
+
+    return 1;
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void bench(char const *socket_path, char const *catcat,
+                  char const *path, size_t runs) {
+    struct request request = {0};
+    read_file(path, &request);
+
+    int fd   = connect_to(socket_path);
+    FILE *in = fdopen(fd, "r");
+
+    double start = now();
+    for (size_t i = 0; i < runs; i++) {
+        send_request(fd, &request);
+        if (!receive_response(in, NULL))
+            die("error: %s failed on the server.\n", path);
+    }
+    double served = now() - start;
+    fclose(in);
+
+    start = now();
+    for (size_t i = 0; i < runs; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            die("error: fork failed.\n");
+
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            execl(catcat, catcat, path, (char *)NULL);
+            _exit(127);
+        }
+
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            die("error: %s failed when run by %s.\n", path, catcat);
+    }
+    double spawned = now() - start;
+
+    printf("server:    %zu runs in %.3f s, %.0f runs/s\n", runs, served,
+           runs / served);
+    printf("fork+exec: %zu runs in %.3f s, %.0f runs/s\n", runs, spawned,
+           runs / spawned);
+    printf("speedup:   %.1fx\n", spawned / served);
+
+    free(request.source);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 6 && strcmp(argv[1], "--bench") == 0) {
+        char *end;
+        size_t runs = strtoull(argv[5], &end, 10);
+        if (end == argv[5] || *end != '\0' || runs == 0)
+            die("error: invalid number of runs %s.\n", argv[5]);
+
+        bench(argv[2], argv[3], argv[4], runs);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--quit") == 0) {
+        int fd = connect_to(argv[2]);
+        write_all(fd, "quit\n", 5);
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc < 3)
+        die("usage: %s <socket> <program.tt> [input...]\n"
+            "       %s --bench <socket> <catcat> <program.tt> <runs>\n"
+            "       %s --quit <socket>\n",
+            argv[0], argv[0], argv[0]);
+
+    struct request request = {0};
+    read_file(argv[2], &request);
+    request.inputs  = argv + 3;
+    request.ninputs = (size_t)argc - 3;
+
+    int fd   = connect_to(argv[1]);
+    FILE *in = fdopen(fd, "r");
+
+    send_request(fd, &request);
+    _Bool ok = receive_response(in, stdout);
+
+    fclose(in);
+    free(request.source);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
\ No newline at end of file
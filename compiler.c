@@ -0,0 +1,475 @@
+#include <string.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "jit.h"
+#include "vm.h"
+
+static uint32_t program_add_function(struct program *program,
+                                     struct function *function) {
+    if (program->functions_capacity <= (program->functions_size + 1)) {
+        program->functions_capacity++;
+        program->functions_capacity *= 2;
+        program->functions =
+            realloc(program->functions, sizeof(struct function *) *
+                                            program->functions_capacity);
+    }
+
+    if (program->functions_size > OPERAND_MAX)
+        fatalf("error: too many functions to compile.\n");
+
+    function->index                               = program->functions_size;
+    program->functions[program->functions_size++] = function;
+    return function->index;
+}
+
+static uint32_t program_add_constant(struct program *program,
+                                     struct value value) {
+    if (program->constants_capacity <= (program->constants_size + 1)) {
+        program->constants_capacity++;
+        program->constants_capacity *= 2;
+        program->constants = realloc(program->constants,
+                                     sizeof(struct value) *
+                                         program->constants_capacity);
+    }
+
+    if (program->constants_size > OPERAND_MAX)
+        fatalf("error: too many constants to compile.\n");
+
+    program->constants[program->constants_size] = value;
+    return program->constants_size++;
+}
+
+static uint32_t program_add_ffi_function(struct program *program,
+                                         struct word *word) {
+    if (program->ffi_functions_capacity <=
+        (program->ffi_functions_size + 1)) {
+        program->ffi_functions_capacity++;
+        program->ffi_functions_capacity *= 2;
+        program->ffi_functions =
+            realloc(program->ffi_functions,
+                    sizeof(struct word *) * program->ffi_functions_capacity);
+    }
+
+    if (program->ffi_functions_size > OPERAND_MAX)
+        fatalf("error: too many foreign functions to compile.\n");
+
+    program->ffi_functions[program->ffi_functions_size] = word;
+    return program->ffi_functions_size++;
+}
+
+/* Builtins that the VM dispatches directly instead of through
+ * OP_CALL_BUILTIN and an indirect call, and their opcodes for words the
+ * checker marked as unchecked. */
+static struct {
+    cfunction function;
+    enum opcode opcode;
+    enum opcode unchecked;
+} const builtin_opcodes[] = {
+    {__addfunction, OP_ADD, OP_ADD_UNCHECKED},
+    {__mulfunction, OP_MUL, OP_MUL_UNCHECKED},
+    {__equalfunction, OP_EQUAL, OP_EQUAL_UNCHECKED},
+    {__dupfunction, OP_DUP, OP_DUP_UNCHECKED},
+    {__dropfunction, OP_DROP, OP_DROP_UNCHECKED},
+    {__swapfunction, OP_SWAP, OP_SWAP_UNCHECKED},
+    {__rotfunction, OP_ROT, OP_ROT_UNCHECKED},
+    {__applyfunction, OP_APPLY, OP_APPLY},
+};
+
+static uint32_t builtin_index(cfunction function) {
+    for (uint32_t i = 0; internal_functions[i].name; i++) {
+        if (internal_functions[i].function == function)
+            return i;
+    }
+
+    fatalf("error: compiling call to unknown builtin.\n");
+}
+
+/* Pairs of instructions replaced by a superinstruction, chosen from the
+ * pairs --profile-ngrams reports most often. */
+static struct {
+    enum opcode first;
+    enum opcode second;
+    enum opcode fused;
+} const superinstructions[] = {
+    {OP_DUP, OP_MUL, OP_DUP_MUL},
+    {OP_DUP_UNCHECKED, OP_MUL, OP_DUP_MUL},
+    {OP_DUP_UNCHECKED, OP_MUL_UNCHECKED, OP_DUP_MUL_UNCHECKED},
+    {OP_SWAP, OP_DROP, OP_SWAP_DROP},
+    {OP_SWAP_UNCHECKED, OP_DROP_UNCHECKED, OP_SWAP_DROP_UNCHECKED},
+    {OP_PUSH_INT, OP_ADD, OP_ADD_INT},
+    {OP_PUSH_INT, OP_ADD_UNCHECKED, OP_ADD_INT_UNCHECKED},
+    {OP_PUSH_INT, OP_MUL, OP_MUL_INT},
+    {OP_PUSH_INT, OP_MUL_UNCHECKED, OP_MUL_INT_UNCHECKED},
+    {OP_PUSH_INT, OP_EQUAL, OP_EQUAL_INT},
+    {OP_PUSH_INT, OP_EQUAL_UNCHECKED, OP_EQUAL_INT},
+};
+
+static void compiler_emit(struct function *function, enum opcode op,
+                          uint32_t operand) {
+    if (function->code_capacity <= (function->code_size + 1)) {
+        function->code_capacity++;
+        function->code_capacity *= 2;
+        function->code = realloc(function->code, sizeof(uint32_t) *
+                                                     function->code_capacity);
+        function->origins =
+            realloc(function->origins,
+                    sizeof(uint32_t) * function->code_capacity);
+    }
+
+    function->origins[function->code_size] = SYMBOL_NONE;
+    function->code[function->code_size++]  = INSTRUCTION(op, operand);
+}
+
+static void compiler_compile_function(struct program *program,
+                                      struct function *function,
+                                      _Bool superinstructions);
+
+static void compiler_compile_word(struct program *program,
+                                  struct function *function,
+                                  struct word *word, _Bool superinstructions) {
+    switch (word->type) {
+    case WORD_TYPE_VALUE:
+        if (word->value.type == WORD_VALUE_TYPE_INTEGER &&
+            word->value.integer >= IMMEDIATE_MIN &&
+            word->value.integer <= IMMEDIATE_MAX) {
+            compiler_emit(function, OP_PUSH_INT,
+                          (uint32_t)word->value.integer & OPERAND_MAX);
+        } else {
+            compiler_emit(function, OP_PUSH_CONST,
+                          program_add_constant(program,
+                                               value_from_word(word)));
+        }
+        break;
+    case WORD_TYPE_LAMBDA:
+        program_add_function(program, word->lambda);
+        compiler_compile_function(program, word->lambda, superinstructions);
+        compiler_emit(function, OP_PUSH_CONST,
+                      program_add_constant(program, value_from_word(word)));
+        break;
+    case WORD_TYPE_FUNCTION:
+        switch (word->function.type) {
+        case FUNCTION_TYPE_CFUNCTION: {
+            cfunction cfn = word->function.cfn.function;
+
+            for (size_t i = 0; i < sizeof(builtin_opcodes) /
+                                       sizeof(builtin_opcodes[0]);
+                 i++) {
+                if (builtin_opcodes[i].function == cfn) {
+                    compiler_emit(function,
+                                  word->unchecked
+                                      ? builtin_opcodes[i].unchecked
+                                      : builtin_opcodes[i].opcode,
+                                  0);
+                    return;
+                }
+            }
+
+            compiler_emit(function, OP_CALL_BUILTIN, builtin_index(cfn));
+            break;
+        }
+        case FUNCTION_TYPE_REGULAR:
+            compiler_emit(function, OP_CALL_FN, word->function.fn->index);
+            break;
+        case FUNCTION_TYPE_FFI:
+            compiler_emit(function, OP_CALL_FFI,
+                          program_add_ffi_function(program, word));
+            break;
+        }
+        break;
+    }
+}
+
+static enum opcode compiler_fuse(struct program *program, uint32_t first,
+                                 uint32_t second) {
+    for (size_t i = 0;
+         i < sizeof(superinstructions) / sizeof(superinstructions[0]); i++) {
+        if (superinstructions[i].first == INSTRUCTION_OPCODE(first) &&
+            superinstructions[i].second == INSTRUCTION_OPCODE(second))
+            return superinstructions[i].fused;
+    }
+
+    return OP_RETURN;
+}
+
+/* Pairs of instructions that leave the stack as it was, once the checker
+ * has proven that the values they touch are there. */
+static _Bool compiler_cancels(uint32_t first, uint32_t second) {
+    enum opcode a = INSTRUCTION_OPCODE(first), b = INSTRUCTION_OPCODE(second);
+
+    return (a == OP_DUP_UNCHECKED && b == OP_DROP_UNCHECKED) ||
+           (a == OP_SWAP_UNCHECKED && b == OP_SWAP_UNCHECKED);
+}
+
+static _Bool compiler_is_jump(uint32_t instruction) {
+    switch (INSTRUCTION_OPCODE(instruction)) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP_NEXT:
+    case OP_LOOP_NEXT_INDEX:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Rewrites fusable pairs in place and removes those that cancel out. Both
+ * instructions must come from the same definition, so that errors are
+ * still reported where they were written, and the second must not be a
+ * jump target; the fused instruction keeps the operand of the first.
+ * Jumps are retargeted afterwards. */
+static void compiler_fuse_function(struct program *program,
+                                   struct function *function) {
+    size_t size    = 0;
+    _Bool *targets = calloc(function->code_size + 1, sizeof(_Bool));
+    size_t *moved  = malloc(sizeof(size_t) * (function->code_size + 1));
+
+    for (size_t i = 0; i < function->code_size; i++) {
+        if (compiler_is_jump(function->code[i]))
+            targets[INSTRUCTION_OPERAND(function->code[i])] = 1;
+    }
+
+    for (size_t i = 0; i < function->code_size; i++) {
+        uint32_t instruction = function->code[i];
+        uint32_t origin      = function->origins[i];
+        moved[i]             = size;
+
+        if (i + 1 < function->code_size && !targets[i + 1] &&
+            function->origins[i + 1] == origin) {
+            if (compiler_cancels(instruction, function->code[i + 1])) {
+                moved[++i] = size;
+                continue;
+            }
+
+            enum opcode fused =
+                compiler_fuse(program, instruction, function->code[i + 1]);
+
+            if (fused != OP_RETURN) {
+                instruction =
+                    INSTRUCTION(fused, INSTRUCTION_OPERAND(instruction));
+                i++;
+            }
+        }
+
+        function->code[size]      = instruction;
+        function->origins[size++] = origin;
+    }
+
+    moved[function->code_size] = size;
+    function->code_size        = size;
+
+    for (size_t i = 0; i < size; i++) {
+        uint32_t instruction = function->code[i];
+
+        if (compiler_is_jump(instruction))
+            function->code[i] =
+                INSTRUCTION(INSTRUCTION_OPCODE(instruction),
+                            moved[INSTRUCTION_OPERAND(instruction)]);
+    }
+
+    free(moved);
+    free(targets);
+}
+
+/* Whether running on from position returns without doing anything else,
+ * following unconditional jumps. */
+static _Bool compiler_returns_from(struct function *function,
+                                   size_t position) {
+    while (position < function->code_size &&
+           INSTRUCTION_OPCODE(function->code[position]) == OP_JUMP)
+        position = INSTRUCTION_OPERAND(function->code[position]);
+
+    return position == function->code_size;
+}
+
+/* A call directly followed by the return, including through the jumps out
+ * of an if, becomes a tail call. */
+static void compiler_mark_tail_calls(struct function *function) {
+    for (size_t i = 0; i < function->code_size; i++) {
+        uint32_t *instruction = &function->code[i];
+
+        if (!compiler_returns_from(function, i + 1))
+            continue;
+
+        if (INSTRUCTION_OPCODE(*instruction) == OP_CALL_FN)
+            *instruction = INSTRUCTION(OP_TAIL_CALL_FN,
+                                       INSTRUCTION_OPERAND(*instruction));
+        else if (INSTRUCTION_OPCODE(*instruction) == OP_APPLY)
+            *instruction = INSTRUCTION(OP_TAIL_APPLY, 0);
+    }
+}
+
+static void compiler_compile_words(struct program *program,
+                                   struct function *function,
+                                   struct word **words, size_t size,
+                                   _Bool superinstructions);
+
+/* How many literal quotations a control flow builtin compiles inline. */
+static size_t compiler_control_quotations(struct word *word) {
+    if (word->type != WORD_TYPE_FUNCTION ||
+        word->function.type != FUNCTION_TYPE_CFUNCTION)
+        return 0;
+
+    cfunction cfn = word->function.cfn.function;
+    if (cfn == __iffunction || cfn == __whilefunction)
+        return 2;
+    if (cfn == __whenfunction || cfn == __loopfunction ||
+        cfn == __timesfunction || cfn == __timesifunction)
+        return 1;
+
+    return 0;
+}
+
+static size_t compiler_emit_at(struct function *function, enum opcode op,
+                               uint32_t operand, uint32_t origin) {
+    if (function->code_size > OPERAND_MAX)
+        fatalf("error: function too large to compile.\n");
+
+    compiler_emit(function, op, operand);
+    function->origins[function->code_size - 1] = origin;
+    return function->code_size - 1;
+}
+
+static void compiler_patch(struct function *function, size_t position,
+                           size_t target) {
+    uint32_t *instruction = &function->code[position];
+    *instruction = INSTRUCTION(INSTRUCTION_OPCODE(*instruction), target);
+}
+
+/* Compiles words[0 .. n) followed by a control flow builtin taking n
+ * literal quotations into jumps around their inlined bodies. Returns the
+ * number of words used, or 0 when words do not start such a pattern. */
+static size_t compiler_compile_control(struct program *program,
+                                       struct function *function,
+                                       struct word **words, size_t size,
+                                       _Bool superinstructions) {
+    size_t n = 0;
+    while (n < size && n < 2 && words[n]->type == WORD_TYPE_LAMBDA)
+        n++;
+
+    while (n > 0 && (n >= size || compiler_control_quotations(words[n]) != n))
+        n--;
+
+    if (n == 0)
+        return 0;
+
+    struct function *first  = words[0]->lambda;
+    struct function *second = n == 2 ? words[1]->lambda : NULL;
+    cfunction cfn           = words[n]->function.cfn.function;
+    uint32_t origin         = words[n]->origin;
+
+#define COMPILE_BODY(lambda)                                                   \
+    compiler_compile_words(program, function, (lambda)->words,                 \
+                           (lambda)->size, superinstructions)
+
+    if (cfn == __iffunction) {
+        size_t otherwise = compiler_emit_at(function, OP_JUMP_IF_FALSE, 0,
+                                            origin);
+        COMPILE_BODY(first);
+        size_t end = compiler_emit_at(function, OP_JUMP, 0, origin);
+        compiler_patch(function, otherwise, function->code_size);
+        COMPILE_BODY(second);
+        compiler_patch(function, end, function->code_size);
+    } else if (cfn == __whenfunction) {
+        size_t end = compiler_emit_at(function, OP_JUMP_IF_FALSE, 0, origin);
+        COMPILE_BODY(first);
+        compiler_patch(function, end, function->code_size);
+    } else if (cfn == __whilefunction) {
+        size_t top = function->code_size;
+        COMPILE_BODY(first);
+        size_t end = compiler_emit_at(function, OP_JUMP_IF_FALSE, 0, origin);
+        COMPILE_BODY(second);
+        compiler_emit_at(function, OP_JUMP, top, origin);
+        compiler_patch(function, end, function->code_size);
+    } else if (cfn == __loopfunction) {
+        size_t top = function->code_size;
+        COMPILE_BODY(first);
+        compiler_emit_at(function, OP_JUMP_IF_TRUE, top, origin);
+    } else {
+        compiler_emit_at(function, OP_LOOP_BEGIN, 0, origin);
+        size_t next = compiler_emit_at(
+            function,
+            cfn == __timesifunction ? OP_LOOP_NEXT_INDEX : OP_LOOP_NEXT, 0,
+            origin);
+        COMPILE_BODY(first);
+        compiler_emit_at(function, OP_JUMP, next, origin);
+        compiler_patch(function, next, function->code_size);
+    }
+
+#undef COMPILE_BODY
+
+    return n + 1;
+}
+
+static void compiler_compile_words(struct program *program,
+                                   struct function *function,
+                                   struct word **words, size_t size,
+                                   _Bool superinstructions) {
+    for (size_t i = 0; i < size; i++) {
+        size_t used = compiler_compile_control(program, function, words + i,
+                                               size - i, superinstructions);
+        if (used) {
+            i += used - 1;
+            continue;
+        }
+
+        compiler_compile_word(program, function, words[i], superinstructions);
+        function->origins[function->code_size - 1] = words[i]->origin;
+    }
+}
+
+static void compiler_compile_function(struct program *program,
+                                      struct function *function,
+                                      _Bool superinstructions) {
+    compiler_compile_words(program, function, function->words, function->size,
+                           superinstructions);
+
+    if (superinstructions)
+        compiler_fuse_function(program, function);
+
+    compiler_mark_tail_calls(function);
+    compiler_emit(function, OP_RETURN, 0);
+}
+
+/* Lowers every global function, and the lambdas nested inside them, to
+ * bytecode. Globals are numbered before any body is compiled so that an
+ * OP_CALL_FN operand is known regardless of definition order. */
+void compiler_compile_program(struct image *image, _Bool superinstructions) {
+    struct program *program = calloc(1, sizeof(*program));
+
+    for (size_t i = 0; i < image->globals_size; i++) {
+        struct word *global = image->globals[i];
+        if (global->function.type == FUNCTION_TYPE_REGULAR)
+            program_add_function(program, global->function.fn);
+    }
+
+    size_t nglobals = program->functions_size;
+    for (size_t i = 0; i < nglobals; i++)
+        compiler_compile_function(program, program->functions[i],
+                                  superinstructions);
+
+    vm_prepare(program);
+    image->program = program;
+}
+
+void program_destroy(struct program *program) {
+    for (size_t i = 0; i < program->functions_size; i++) {
+        struct function *function = program->functions[i];
+        free(function->code);
+        free(function->origins);
+        free(function->threaded);
+        jit_release(function);
+
+        function->code          = NULL;
+        function->origins       = NULL;
+        function->threaded      = NULL;
+        function->code_size     = 0;
+        function->code_capacity = 0;
+    }
+
+    free(program->functions);
+    free(program->constants);
+    free(program->ffi_functions);
+    free(program);
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kernel.h"
+
+/* Instructions are 32 bits wide: the opcode lives in the low 8 bits and
+ * the operand in the upper 24 bits. Operands are indices into the program
+ * tables, a builtin index, or a signed immediate for OP_PUSH_INT. */
+enum opcode {
+    OP_RETURN,
+    OP_PUSH_INT,
+    OP_PUSH_CONST,
+    OP_CALL_BUILTIN,
+    OP_CALL_FN,
+    OP_CALL_FFI,
+    OP_TAIL_CALL_FN,
+    OP_APPLY,
+    OP_TAIL_APPLY,
+
+    /* Control flow compiled from if, when, while, loop, times and times-i
+     * with literal quotations. Targets are instruction indices; the loop
+     * instructions keep their counters on a stack of their own. */
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    OP_LOOP_BEGIN,
+    OP_LOOP_NEXT,
+    OP_LOOP_NEXT_INDEX,
+
+    /* Builtins with their own handler in the dispatch loop. */
+    OP_ADD,
+    OP_MUL,
+    OP_EQUAL,
+    OP_DUP,
+    OP_DROP,
+    OP_SWAP,
+    OP_ROT,
+
+    /* The same builtins without the stack and type checks, for operands
+     * the checker proved to be there. */
+    OP_ADD_UNCHECKED,
+    OP_MUL_UNCHECKED,
+    OP_EQUAL_UNCHECKED,
+    OP_DUP_UNCHECKED,
+    OP_DROP_UNCHECKED,
+    OP_SWAP_UNCHECKED,
+    OP_ROT_UNCHECKED,
+
+    /* Superinstructions for the most frequent pairs; the ones taking an
+     * integer have it as an immediate. */
+    OP_DUP_MUL,
+    OP_DUP_MUL_UNCHECKED,
+    OP_SWAP_DROP,
+    OP_SWAP_DROP_UNCHECKED,
+    OP_ADD_INT,
+    OP_ADD_INT_UNCHECKED,
+    OP_MUL_INT,
+    OP_MUL_INT_UNCHECKED,
+    OP_EQUAL_INT,
+
+    OPCODE_COUNT
+};
+
+#define INSTRUCTION(op, operand) ((uint32_t)(op) | ((uint32_t)(operand) << 8))
+#define INSTRUCTION_OPCODE(i)    ((enum opcode)((i)&0xff))
+#define INSTRUCTION_OPERAND(i)   ((uint32_t)(i) >> 8)
+#define INSTRUCTION_IMMEDIATE(i) ((int32_t)(i) >> 8)
+
+#define OPERAND_MAX   0xffffff
+#define IMMEDIATE_MIN (-0x800000)
+#define IMMEDIATE_MAX 0x7fffff
+
+/* Lowers image to bytecode. With superinstructions set, frequent pairs of
+ * instructions are fused into one. */
+void compiler_compile_program(struct image *image, _Bool superinstructions);
+void program_destroy(struct program *program);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,648 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "emitter.h"
+#include "error.h"
+
+/* The names of the builtins in C, for the calls the translation makes to
+ * them directly. */
+#define EMITTER_BUILTIN(function) {function, #function}
+
+static struct {
+    cfunction function;
+    char const *name;
+} const emitter_builtins[] = {
+    EMITTER_BUILTIN(__addfunction),     EMITTER_BUILTIN(__mulfunction),
+    EMITTER_BUILTIN(__applyfunction),   EMITTER_BUILTIN(__printfunction),
+    EMITTER_BUILTIN(__dropfunction),    EMITTER_BUILTIN(__dupfunction),
+    EMITTER_BUILTIN(__swapfunction),    EMITTER_BUILTIN(__bifunction),
+    EMITTER_BUILTIN(__timesfunction),   EMITTER_BUILTIN(__timesifunction),
+    EMITTER_BUILTIN(__iffunction),      EMITTER_BUILTIN(__whenfunction),
+    EMITTER_BUILTIN(__whilefunction),   EMITTER_BUILTIN(__loopfunction),
+    EMITTER_BUILTIN(__rotfunction),     EMITTER_BUILTIN(__composefunction),
+    EMITTER_BUILTIN(__curryfunction),   EMITTER_BUILTIN(__printsfunction),
+    EMITTER_BUILTIN(__equalfunction),   EMITTER_BUILTIN(__pbifunction),
+    EMITTER_BUILTIN(__pcleavefunction), EMITTER_BUILTIN(__pmapfunction),
+    EMITTER_BUILTIN(__preducefunction), EMITTER_BUILTIN(__spawnfunction),
+    EMITTER_BUILTIN(__joinfunction),    EMITTER_BUILTIN(__yieldfunction),
+};
+
+#undef EMITTER_BUILTIN
+
+/* Everything of the program that becomes static data, numbered in the
+ * order it is written. Functions start with the compiled ones, in the
+ * order of the program, followed by the lambdas only reachable through
+ * words, such as the bodies of control flow compiled to jumps. */
+struct emitter {
+    FILE *out;
+    struct program *program;
+
+    struct function **functions;
+    size_t functions_size;
+    size_t functions_capacity;
+
+    char **strings;
+    size_t strings_size;
+    size_t strings_capacity;
+
+    struct word **ffi_functions;
+    size_t ffi_functions_size;
+    size_t ffi_functions_capacity;
+
+    size_t nwords;
+};
+
+#define EMITTER_APPEND(array, size, capacity, item)                            \
+    do {                                                                       \
+        if ((capacity) <= (size) + 1) {                                        \
+            (capacity)++;                                                      \
+            (capacity) *= 2;                                                   \
+            (array) = realloc((array), sizeof(*(array)) * (capacity));         \
+        }                                                                      \
+        (array)[(size)++] = (item);                                            \
+    } while (0)
+
+/* Compiled functions keep their index in the program; the others are
+ * searched for. Returns functions_size for a function not numbered yet. */
+static size_t emitter_find_function(struct emitter *e,
+                                    struct function *function) {
+    if (function->index < e->program->functions_size &&
+        e->program->functions[function->index] == function)
+        return function->index;
+
+    size_t i = e->program->functions_size;
+    while (i < e->functions_size && e->functions[i] != function)
+        i++;
+
+    return i;
+}
+
+static void emitter_add_function(struct emitter *e,
+                                 struct function *function) {
+    if (emitter_find_function(e, function) == e->functions_size)
+        EMITTER_APPEND(e->functions, e->functions_size, e->functions_capacity,
+                       function);
+}
+
+static size_t emitter_function_index(struct emitter *e,
+                                     struct function *function) {
+    size_t i = emitter_find_function(e, function);
+    if (i == e->functions_size)
+        fatalf("error: emitting a function missing from the program.\n");
+
+    return i;
+}
+
+static size_t emitter_string_index(struct emitter *e, char *string) {
+    for (size_t i = 0; i < e->strings_size; i++) {
+        if (e->strings[i] == string)
+            return i;
+    }
+
+    fatalf("error: emitting a string missing from the program.\n");
+}
+
+static size_t emitter_ffi_index(struct emitter *e, struct word *word) {
+#ifdef ENABLE_FFI
+    for (size_t i = 0; i < e->ffi_functions_size; i++) {
+        if (e->ffi_functions[i]->function.ffi_fn == word->function.ffi_fn)
+            return i;
+    }
+#endif
+
+    fatalf("error: emitting a foreign function missing from the program.\n");
+}
+
+static char const *emitter_builtin_name(cfunction function) {
+    for (size_t i = 0;
+         i < sizeof(emitter_builtins) / sizeof(emitter_builtins[0]); i++) {
+        if (emitter_builtins[i].function == function)
+            return emitter_builtins[i].name;
+    }
+
+    fatalf("error: emitting a call to an unknown builtin.\n");
+}
+
+static void emitter_add_string(struct emitter *e, char *string) {
+    for (size_t i = 0; i < e->strings_size; i++) {
+        if (e->strings[i] == string)
+            return;
+    }
+
+    EMITTER_APPEND(e->strings, e->strings_size, e->strings_capacity, string);
+}
+
+static void emitter_add_ffi_function(struct emitter *e, struct word *word) {
+#ifdef ENABLE_FFI
+    for (size_t i = 0; i < e->ffi_functions_size; i++) {
+        if (e->ffi_functions[i]->function.ffi_fn == word->function.ffi_fn)
+            return;
+    }
+#endif
+
+    EMITTER_APPEND(e->ffi_functions, e->ffi_functions_size,
+                   e->ffi_functions_capacity, word);
+}
+
+/* Numbers the functions, strings and foreign functions reachable from the
+ * words of the functions numbered so far, which grows as it goes, and the
+ * words their lambdas were written with. */
+static void emitter_collect(struct emitter *e) {
+    for (size_t i = 0; i < e->functions_size; i++) {
+        struct function *function = e->functions[i];
+        e->nwords += function->size;
+
+        for (size_t j = 0; j < function->size; j++) {
+            struct word *word = function->words[j];
+
+            if (word->type == WORD_TYPE_VALUE &&
+                word->value.type == WORD_VALUE_TYPE_STRING) {
+                emitter_add_string(e, word->value.string);
+            } else if (word->type == WORD_TYPE_LAMBDA) {
+                emitter_add_function(e, word->lambda);
+                emitter_add_function(e, function_source(word->lambda));
+            } else if (word->type == WORD_TYPE_FUNCTION &&
+                       word->function.type == FUNCTION_TYPE_FFI) {
+                emitter_add_ffi_function(e, word);
+            }
+        }
+    }
+}
+
+/* Writes a C string literal, escaping everything but printable
+ * characters. Question marks are escaped too, to rule out trigraphs. */
+static void emitter_string(struct emitter *e, char const *string) {
+    fputc('"', e->out);
+    for (unsigned char const *c = (unsigned char const *)string; *c; c++) {
+        if (*c >= ' ' && *c <= '~' && *c != '"' && *c != '\\' && *c != '?')
+            fputc(*c, e->out);
+        else
+            fprintf(e->out, "\\%03o", *c);
+    }
+    fputc('"', e->out);
+}
+
+static void emitter_integer(struct emitter *e, int64_t integer) {
+    if (integer == INT64_MIN)
+        fprintf(e->out, "INT64_MIN");
+    else
+        fprintf(e->out, "INT64_C(%" PRId64 ")", integer);
+}
+
+static void emitter_value(struct emitter *e, struct value value) {
+    switch (value.type) {
+    case VALUE_TYPE_INTEGER:
+        fprintf(e->out, "{.type = VALUE_TYPE_INTEGER, .integer = ");
+        emitter_integer(e, value.integer);
+        fprintf(e->out, "}");
+        break;
+    case VALUE_TYPE_STRING:
+        fprintf(e->out,
+                "{.type = VALUE_TYPE_STRING, .string = catcat_string_%zu}",
+                emitter_string_index(e, value.string));
+        break;
+    case VALUE_TYPE_LAMBDA:
+        fprintf(e->out,
+                "{.type = VALUE_TYPE_LAMBDA, .lambda = &catcat_functions[%zu]}",
+                emitter_function_index(e, value.lambda));
+        break;
+    }
+}
+
+static void emitter_word(struct emitter *e, struct word *word) {
+    fprintf(e->out, "    {");
+
+    switch (word->type) {
+    case WORD_TYPE_LAMBDA:
+        fprintf(e->out,
+                ".type = WORD_TYPE_LAMBDA, .lambda = &catcat_functions[%zu]",
+                emitter_function_index(e, word->lambda));
+        break;
+    case WORD_TYPE_VALUE:
+        fprintf(e->out, ".type = WORD_TYPE_VALUE, .value = ");
+        if (word->value.type == WORD_VALUE_TYPE_STRING) {
+            fprintf(e->out,
+                    "{.type = WORD_VALUE_TYPE_STRING, .string = "
+                    "catcat_string_%zu}",
+                    emitter_string_index(e, word->value.string));
+        } else if (word->value.type == WORD_VALUE_TYPE_INTEGER) {
+            fprintf(e->out, "{.type = WORD_VALUE_TYPE_INTEGER, .integer = ");
+            emitter_integer(e, word->value.integer);
+            fprintf(e->out, "}");
+        } else {
+            fatalf("error: emitting an unsupported word value type.\n");
+        }
+        break;
+    case WORD_TYPE_FUNCTION:
+        fprintf(e->out, ".type = WORD_TYPE_FUNCTION, .function = ");
+        switch (word->function.type) {
+        case FUNCTION_TYPE_CFUNCTION:
+            fprintf(e->out, "{.type = FUNCTION_TYPE_CFUNCTION, .cfn = {");
+            emitter_string(e, word->function.cfn.name);
+            fprintf(e->out, ", %s, %" PRIu32 "}}",
+                    emitter_builtin_name(word->function.cfn.function),
+                    word->function.cfn.symbol);
+            break;
+        case FUNCTION_TYPE_REGULAR:
+            fprintf(e->out,
+                    "{.type = FUNCTION_TYPE_REGULAR, .fn = "
+                    "&catcat_functions[%zu]}",
+                    emitter_function_index(e, word->function.fn));
+            break;
+        case FUNCTION_TYPE_FFI:
+            fprintf(e->out,
+                    "{.type = FUNCTION_TYPE_FFI, .ffi_fn = "
+                    "&catcat_ffi_functions[%zu]}",
+                    emitter_ffi_index(e, word));
+            break;
+        }
+        break;
+    }
+
+    fprintf(e->out, ", .origin = %" PRIu32 "},\n", word->origin);
+}
+
+static void emitter_emit_data(struct emitter *e) {
+    FILE *out = e->out;
+
+    fprintf(out, "static char const *const catcat_symbols[] = {\n    NULL,\n");
+    size_t nsymbols = symbol_count();
+    for (uint32_t i = 1; i < nsymbols; i++) {
+        fprintf(out, "    ");
+        emitter_string(e, symbol_name(i));
+        fprintf(out, ",\n");
+    }
+    fprintf(out, "};\n\n");
+
+    for (size_t i = 0; i < e->strings_size; i++) {
+        fprintf(out, "static char catcat_string_%zu[] = ", i);
+        emitter_string(e, e->strings[i]);
+        fprintf(out, ";\n");
+    }
+    if (e->strings_size)
+        fprintf(out, "\n");
+
+    fprintf(out, "static struct function catcat_functions[%zu];\n",
+            e->functions_size);
+
+    if (e->ffi_functions_size) {
+        fprintf(out, "\n#ifndef ENABLE_FFI\n"
+                     "#error \"the program calls foreign functions, which "
+                     "need ENABLE_FFI\"\n"
+                     "#else\n"
+                     "static struct ffi_function catcat_ffi_functions[] = {\n");
+    }
+
+#ifdef ENABLE_FFI
+    for (size_t i = 0; i < e->ffi_functions_size; i++) {
+        struct ffi_function *fn = e->ffi_functions[i]->function.ffi_fn;
+
+        fprintf(out, "    {.symbol = %" PRIu32 ", .module = (char *)",
+                fn->symbol);
+        emitter_string(e, fn->module);
+        fprintf(out, ", .nargs = %zu, .args = {", fn->nargs);
+        for (size_t j = 0; j < fn->nargs; j++)
+            fprintf(out, "%s&ffi_type_%s", j ? ", " : "",
+                    fn->args[j] == &ffi_type_pointer ? "pointer" : "sint");
+        fprintf(out, "}},\n");
+    }
+#endif
+
+    if (e->ffi_functions_size)
+        fprintf(out, "};\n#endif\n");
+
+    if (e->nwords) {
+        fprintf(out, "\nstatic struct word catcat_words[] = {\n");
+        for (size_t i = 0; i < e->functions_size; i++) {
+            struct function *function = e->functions[i];
+            for (size_t j = 0; j < function->size; j++)
+                emitter_word(e, function->words[j]);
+        }
+        fprintf(out, "};\n\nstatic struct word *catcat_word_pointers[] = {\n");
+        for (size_t i = 0; i < e->nwords; i++)
+            fprintf(out, "    &catcat_words[%zu],\n", i);
+        fprintf(out, "};\n");
+    }
+
+    if (e->program->constants_size) {
+        fprintf(out, "\nstatic struct value const catcat_constants[] = {\n");
+        for (size_t i = 0; i < e->program->constants_size; i++) {
+            fprintf(out, "    ");
+            emitter_value(e, e->program->constants[i]);
+            fprintf(out, ",\n");
+        }
+        fprintf(out, "};\n");
+    }
+
+    fprintf(out, "\n");
+    for (size_t i = 0; i < e->program->functions_size; i++)
+        fprintf(out,
+                "static struct value *catcat_function_%zu(struct environment "
+                "*env, struct value *sp);\n",
+                i);
+}
+
+static void emitter_emit_functions(struct emitter *e) {
+    FILE *out    = e->out;
+    size_t words = 0;
+
+    fprintf(out, "\nstatic struct function catcat_functions[%zu] = {\n",
+            e->functions_size);
+    for (size_t i = 0; i < e->functions_size; i++) {
+        struct function *function = e->functions[i];
+
+        fprintf(out, "    {.symbol = %" PRIu32 ", ", function->symbol);
+        if (function->size)
+            fprintf(out, ".words = &catcat_word_pointers[%zu], ", words);
+        fprintf(out, ".size = %zu, .capacity = %zu", function->size,
+                function->size);
+        if (function->source)
+            fprintf(out, ", .source = &catcat_functions[%zu]",
+                    emitter_function_index(e, function->source));
+        if (i < e->program->functions_size)
+            fprintf(out, ", .compiled = catcat_function_%zu", i);
+        fprintf(out, "},\n");
+
+        words += function->size;
+    }
+    fprintf(out, "};\n");
+}
+
+static _Bool emitter_is_jump(enum opcode op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE ||
+           op == OP_LOOP_NEXT || op == OP_LOOP_NEXT_INDEX;
+}
+
+/* Writes the C function for the bytecode of function k. Only jump targets
+ * get a label; loops are numbered by how deeply they are nested, as
+ * their bodies lie between the loop instruction and its target. */
+static void emitter_emit_code(struct emitter *e, size_t k) {
+    struct function *function = e->program->functions[k];
+    FILE *out                 = e->out;
+    size_t size               = function->code_size;
+
+    _Bool *targets = calloc(size + 1, sizeof(_Bool));
+    size_t *depths = calloc(size + 1, sizeof(size_t));
+    size_t nloops  = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        uint32_t instruction = function->code[i];
+        enum opcode op       = INSTRUCTION_OPCODE(instruction);
+        uint32_t target      = INSTRUCTION_OPERAND(instruction);
+
+        if (op == OP_TAIL_CALL_FN && target == k)
+            targets[0] = 1;
+
+        if (!emitter_is_jump(op))
+            continue;
+
+        targets[target] = 1;
+        if (op != OP_LOOP_NEXT && op != OP_LOOP_NEXT_INDEX)
+            continue;
+
+        for (size_t j = i; j < target; j++) {
+            if (++depths[j] > nloops)
+                nloops = depths[j];
+        }
+    }
+
+    fprintf(out,
+            "\nstatic struct value *catcat_function_%zu(struct environment "
+            "*env,\n"
+            "                                       struct value *sp) {\n",
+            k);
+    fprintf(out, "    AOT_ENTER(&catcat_functions[%zu]);\n", k);
+    if (nloops)
+        fprintf(out, "    struct vm_loop loops[%zu];\n", nloops);
+
+    /* Where the instruction is from, for the macros that can fail. */
+    char location[64];
+
+    for (size_t i = 0; i < size; i++) {
+        uint32_t instruction = function->code[i];
+        enum opcode op       = INSTRUCTION_OPCODE(instruction);
+        uint32_t operand     = INSTRUCTION_OPERAND(instruction);
+        int32_t immediate    = INSTRUCTION_IMMEDIATE(instruction);
+
+        snprintf(location, sizeof(location),
+                 "&catcat_functions[%zu], %" PRIu32, k, function->origins[i]);
+
+        if (targets[i])
+            fprintf(out, "catcat_%zu_%zu:\n", k, i);
+
+        fprintf(out, "    ");
+        switch (op) {
+        case OP_RETURN:
+            fprintf(out, "AOT_RETURN();\n");
+            break;
+        case OP_PUSH_INT:
+            fprintf(out, "AOT_PUSH(%s, AOT_INTEGER(%" PRId32 "));\n", location,
+                    immediate);
+            break;
+        case OP_PUSH_CONST:
+            fprintf(out, "AOT_PUSH(%s, catcat_constants[%" PRIu32 "]);\n",
+                    location, operand);
+            break;
+        case OP_CALL_BUILTIN:
+            fprintf(out, "AOT_BUILTIN(%s, %s);\n", location,
+                    emitter_builtin_name(internal_functions[operand].function));
+            break;
+        case OP_CALL_FN:
+            fprintf(out, "AOT_CALL(catcat_function_%" PRIu32 ");\n", operand);
+            break;
+        case OP_TAIL_CALL_FN:
+            if (operand == k)
+                fprintf(out, "goto catcat_%zu_0;\n", k);
+            else
+                fprintf(out, "AOT_TAIL_CALL(catcat_function_%" PRIu32 ");\n",
+                        operand);
+            break;
+        case OP_CALL_FFI:
+            fprintf(out, "AOT_CALL_FFI(%s, &catcat_ffi_functions[%zu]);\n",
+                    location,
+                    emitter_ffi_index(e, e->program->ffi_functions[operand]));
+            break;
+        case OP_APPLY:
+            fprintf(out, "AOT_APPLY(%s);\n", location);
+            break;
+        case OP_TAIL_APPLY:
+            fprintf(out, "AOT_TAIL_APPLY(%s);\n", location);
+            break;
+        case OP_JUMP:
+            fprintf(out, "goto catcat_%zu_%" PRIu32 ";\n", k, operand);
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "AOT_JUMP_IF_FALSE(%s, catcat_%zu_%" PRIu32 ");\n",
+                    location, k, operand);
+            break;
+        case OP_JUMP_IF_TRUE:
+            fprintf(out, "AOT_JUMP_IF_TRUE(%s, catcat_%zu_%" PRIu32 ");\n",
+                    location, k, operand);
+            break;
+        case OP_LOOP_BEGIN:
+            fprintf(out, "AOT_LOOP_BEGIN(%s, loops[%zu]);\n", location,
+                    depths[i]);
+            break;
+        case OP_LOOP_NEXT:
+            fprintf(out, "AOT_LOOP_NEXT(loops[%zu], catcat_%zu_%" PRIu32 ");\n",
+                    depths[i] - 1, k, operand);
+            break;
+        case OP_LOOP_NEXT_INDEX:
+            fprintf(out,
+                    "AOT_LOOP_NEXT_INDEX(%s, loops[%zu], catcat_%zu_%" PRIu32
+                    ");\n",
+                    location, depths[i] - 1, k, operand);
+            break;
+        case OP_ADD:
+            fprintf(out, "AOT_ADD(%s);\n", location);
+            break;
+        case OP_MUL:
+            fprintf(out, "AOT_MUL(%s);\n", location);
+            break;
+        case OP_EQUAL:
+            fprintf(out, "AOT_EQUAL(%s);\n", location);
+            break;
+        case OP_DUP:
+            fprintf(out, "AOT_DUP(%s);\n", location);
+            break;
+        case OP_DROP:
+            fprintf(out, "AOT_DROP(%s);\n", location);
+            break;
+        case OP_SWAP:
+            fprintf(out, "AOT_SWAP(%s);\n", location);
+            break;
+        case OP_ROT:
+            fprintf(out, "AOT_ROT(%s);\n", location);
+            break;
+        case OP_ADD_UNCHECKED:
+            fprintf(out, "AOT_ADD_UNCHECKED();\n");
+            break;
+        case OP_MUL_UNCHECKED:
+            fprintf(out, "AOT_MUL_UNCHECKED();\n");
+            break;
+        case OP_EQUAL_UNCHECKED:
+            fprintf(out, "AOT_EQUAL_UNCHECKED();\n");
+            break;
+        case OP_DUP_UNCHECKED:
+            fprintf(out, "AOT_DUP_UNCHECKED(%s);\n", location);
+            break;
+        case OP_DROP_UNCHECKED:
+            fprintf(out, "AOT_DROP_UNCHECKED();\n");
+            break;
+        case OP_SWAP_UNCHECKED:
+            fprintf(out, "AOT_SWAP_UNCHECKED();\n");
+            break;
+        case OP_ROT_UNCHECKED:
+            fprintf(out, "AOT_ROT_UNCHECKED();\n");
+            break;
+        case OP_DUP_MUL:
+            fprintf(out, "AOT_DUP_MUL(%s);\n", location);
+            break;
+        case OP_DUP_MUL_UNCHECKED:
+            fprintf(out, "AOT_DUP_MUL_UNCHECKED();\n");
+            break;
+        case OP_SWAP_DROP:
+            fprintf(out, "AOT_SWAP_DROP(%s);\n", location);
+            break;
+        case OP_SWAP_DROP_UNCHECKED:
+            fprintf(out, "AOT_SWAP_DROP_UNCHECKED();\n");
+            break;
+        case OP_ADD_INT:
+            fprintf(out, "AOT_ADD_INT(%s, %" PRId32 ");\n", location,
+                    immediate);
+            break;
+        case OP_ADD_INT_UNCHECKED:
+            fprintf(out, "AOT_ADD_INT_UNCHECKED(%" PRId32 ");\n", immediate);
+            break;
+        case OP_MUL_INT:
+            fprintf(out, "AOT_MUL_INT(%s, %" PRId32 ");\n", location,
+                    immediate);
+            break;
+        case OP_MUL_INT_UNCHECKED:
+            fprintf(out, "AOT_MUL_INT_UNCHECKED(%" PRId32 ");\n", immediate);
+            break;
+        case OP_EQUAL_INT:
+            fprintf(out, "AOT_EQUAL_INT(%s, %" PRId32 ");\n", location,
+                    immediate);
+            break;
+        default:
+            fatalf("error: emitting invalid opcode %u.\n", op);
+        }
+    }
+
+    fprintf(out, "}\n");
+
+    free(depths);
+    free(targets);
+}
+
+static void emitter_emit_main(struct emitter *e, struct image *image,
+                              size_t stack_size, size_t stack_max) {
+    FILE *out = e->out;
+
+    fprintf(out, "\nint main(void) {\n"
+                 "    aot_init(catcat_symbols,\n"
+                 "             sizeof(catcat_symbols) / "
+                 "sizeof(catcat_symbols[0]));\n");
+
+    if (e->ffi_functions_size) {
+        fprintf(out, "\n#ifdef ENABLE_FFI\n");
+#ifdef ENABLE_FFI
+        for (size_t i = 0; i < e->ffi_functions_size; i++) {
+            struct ffi_function *fn = e->ffi_functions[i]->function.ffi_fn;
+            fprintf(out,
+                    "    catcat_ffi_functions[%zu].ret_type = ffi_type_%s;\n"
+                    "    aot_load_ffi(&catcat_ffi_functions[%zu]);\n",
+                    i,
+                    fn->ret_type.type == ffi_type_pointer.type ? "pointer"
+                                                               : "sint",
+                    i);
+        }
+#endif
+        fprintf(out, "#endif\n");
+    }
+
+    fprintf(out,
+            "\n    struct image image = {.entry = &catcat_functions[%zu]};\n"
+            "    struct environment *env =\n"
+            "        make_environment(&image, %zu, %zu);\n"
+            "    aot_run(env);\n"
+            "    environment_destroy(env);\n\n"
+            "    return EXIT_SUCCESS;\n"
+            "}\n",
+            emitter_function_index(e, image->entry), stack_size, stack_max);
+}
+
+void emitter_emit_program(struct image *image, FILE *out, size_t stack_size,
+                          size_t stack_max) {
+    struct emitter e = {out, image->program};
+
+    if (!e.program)
+        fatalf("error: emitting a program that was not compiled.\n");
+
+    for (size_t i = 0; i < e.program->functions_size; i++)
+        EMITTER_APPEND(e.functions, e.functions_size, e.functions_capacity,
+                       e.program->functions[i]);
+
+    emitter_collect(&e);
+    for (size_t i = 0; i < e.program->constants_size; i++) {
+        if (e.program->constants[i].type == VALUE_TYPE_STRING)
+            emitter_add_string(&e, e.program->constants[i].string);
+    }
+
+    fprintf(out, "/* Translated from catcat by --emit-c. */\n\n"
+                 "#include \"aot.h\"\n\n");
+
+    emitter_emit_data(&e);
+    emitter_emit_functions(&e);
+    for (size_t i = 0; i < e.program->functions_size; i++)
+        emitter_emit_code(&e, i);
+    emitter_emit_main(&e, image, stack_size, stack_max);
+
+    free(e.functions);
+    free(e.strings);
+    free(e.ffi_functions);
+}
\ No newline at end of file
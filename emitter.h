@@ -0,0 +1,18 @@
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include <stdio.h>
+
+#include "kernel.h"
+
+/* Translates a program compiled to bytecode into a standalone C translation
+ * unit written to out, for --emit-c. Every compiled function becomes a C
+ * function built from the macros of aot.h; the functions, lambdas, words,
+ * constants and foreign functions of the program become static data, so
+ * that builtins taking quotations, compose and curry work as they do in
+ * the interpreter. The program starts with a stack of stack_size values
+ * that can grow up to stack_max. */
+void emitter_emit_program(struct image *image, FILE *out, size_t stack_size,
+                          size_t stack_max);
+
+#endif
\ No newline at end of file
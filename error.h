@@ -1,12 +1,34 @@
 #ifndef ERROR_H
 #define ERROR_H
 
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+/* While code runs, the interpreter keeps the innermost running engine
+ * here, so a fatal error can say which function it happened in. Each
+ * thread has its own. */
+struct error_location {
+    void (*report)(struct error_location *location);
+    struct error_location *prev;
+};
+
+extern _Thread_local struct error_location *error_location;
+
+/* When set, a fatal error jumps here instead of ending the process, as the
+ * server does to fail only the request that ran into it. What the request
+ * printed is flushed first, since its errors go to the same client. */
+extern _Thread_local jmp_buf *error_recovery;
+
 #define fatalf(...)                                                            \
     do {                                                                       \
+        if (error_recovery)                                                    \
+            fflush(stdout);                                                    \
         fprintf(stderr, __VA_ARGS__);                                          \
+        if (error_location)                                                    \
+            error_location->report(error_location);                            \
+        if (error_recovery)                                                    \
+            longjmp(*error_recovery, 1);                                       \
         exit(EXIT_FAILURE);                                                    \
     } while (0)
 
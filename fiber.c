@@ -0,0 +1,440 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+#include "error.h"
+#include "fiber.h"
+#include "gc.h"
+#include "jit.h"
+#include "thread.h"
+
+/* The lowest page of a fiber's stack is left inaccessible, so that
+ * overflowing it faults instead of overwriting other memory. */
+#define FIBER_GUARD_SIZE 4096
+
+struct fiber_thread;
+
+struct fiber {
+#ifdef _WIN32
+    LPVOID context;
+#else
+    ucontext_t context;
+    void *stack;
+#endif
+    struct environment *env;
+    struct function *quotation;
+    struct fiber_thread *thread;
+    struct fiber *next;
+
+    /* Only touched on the fiber's thread until it is done. */
+    _Bool started;
+    _Bool finished;
+    _Bool failed;
+
+    /* Guarded by the lock of the scheduler. */
+    _Bool done;
+    struct fiber *joiner;
+};
+
+/* A scheduler thread and the queue of its ready fibers. */
+struct fiber_thread {
+    struct thread thread;
+#ifdef _WIN32
+    LPVOID context;
+#else
+    ucontext_t context;
+#endif
+
+    struct thread_mutex lock;
+    struct thread_condition wake;
+    struct fiber *head;
+    struct fiber *tail;
+    _Bool stopping;
+
+    /* How many unfinished fibers are placed on the thread, guarded by the
+     * lock of the scheduler. */
+    size_t load;
+};
+
+static struct {
+    size_t nthreads;
+    struct fiber_thread *threads;
+
+    /* Guards the fibers that have not been joined, indexed by their id
+     * less one, and the count of unfinished ones. */
+    struct thread_mutex lock;
+    struct thread_condition done;
+    struct fiber **fibers;
+    size_t size;
+    size_t capacity;
+    size_t live;
+} scheduler;
+
+static _Thread_local struct fiber *fiber_running;
+
+/* Switches from the running fiber back to its thread. The error location
+ * and recovery are the fiber's own, so they are put back when the fiber
+ * is resumed. */
+static void fiber_suspend(struct fiber *fiber) {
+    struct error_location *location = error_location;
+    jmp_buf *recovery               = error_recovery;
+
+#ifdef _WIN32
+    SwitchToFiber(fiber->thread->context);
+#else
+    swapcontext(&fiber->context, &fiber->thread->context);
+#endif
+    error_location = location;
+    error_recovery = recovery;
+}
+
+/* An error ends the fiber alone, and fails whoever joins it. */
+static void fiber_body(struct fiber *fiber) {
+    jmp_buf failure;
+
+    if (setjmp(failure)) {
+        fiber->failed = 1;
+    } else {
+        error_recovery = &failure;
+        gc_push_root(fiber->env->gc, &fiber->quotation);
+        environment_call(fiber->env, fiber->quotation);
+        gc_pop_root(fiber->env->gc, 1);
+    }
+
+    error_recovery  = NULL;
+    fiber->finished = 1;
+    fiber_suspend(fiber);
+}
+
+#ifdef _WIN32
+static VOID CALLBACK fiber_entry(LPVOID fiber) { fiber_body(fiber); }
+
+static void fiber_start(struct fiber *fiber) {
+    fiber->context = CreateFiberEx(0, FIBER_STACK_SIZE, FIBER_FLAG_FLOAT_SWITCH,
+                                   fiber_entry, fiber);
+    if (!fiber->context)
+        fatalf("error: CreateFiberEx failed, %lu\n", GetLastError());
+}
+
+static void fiber_release(struct fiber *fiber) { DeleteFiber(fiber->context); }
+#else
+static void fiber_entry(void) { fiber_body(fiber_running); }
+
+static void fiber_start(struct fiber *fiber) {
+    fiber->stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fiber->stack == MAP_FAILED)
+        fatalf("error: could not allocate a fiber stack.\n");
+    mprotect(fiber->stack, FIBER_GUARD_SIZE, PROT_NONE);
+
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp   = fiber->stack;
+    fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    fiber->context.uc_link          = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+}
+
+static void fiber_release(struct fiber *fiber) {
+    munmap(fiber->stack, FIBER_STACK_SIZE);
+}
+#endif
+
+static void fiber_resume(struct fiber_thread *thread, struct fiber *fiber) {
+    if (!fiber->started) {
+        fiber_start(fiber);
+        fiber->started = 1;
+    }
+
+    fiber_running = fiber;
+#ifdef _WIN32
+    SwitchToFiber(fiber->context);
+#else
+    swapcontext(&thread->context, &fiber->context);
+#endif
+    fiber_running  = NULL;
+    error_location = NULL;
+    error_recovery = NULL;
+}
+
+/* Called with the lock of the fiber's thread held. */
+static void fiber_enqueue(struct fiber *fiber) {
+    struct fiber_thread *thread = fiber->thread;
+
+    fiber->next = NULL;
+    if (thread->tail)
+        thread->tail->next = fiber;
+    else
+        thread->head = fiber;
+    thread->tail = fiber;
+}
+
+static void fiber_ready(struct fiber *fiber) {
+    struct fiber_thread *thread = fiber->thread;
+
+    thread_mutex_lock(&thread->lock);
+    fiber_enqueue(fiber);
+    thread_condition_broadcast(&thread->wake);
+    thread_mutex_unlock(&thread->lock);
+}
+
+/* Runs after the fiber has switched away for the last time, so that its
+ * stack is no longer in use, and wakes whoever waits to join it. The
+ * fiber itself stays until it is joined. */
+static void fiber_finish(struct fiber *fiber) {
+    fiber_release(fiber);
+
+    thread_mutex_lock(&scheduler.lock);
+    fiber->done = 1;
+    fiber->thread->load--;
+    scheduler.live--;
+    if (fiber->joiner)
+        fiber_ready(fiber->joiner);
+    thread_condition_broadcast(&scheduler.done);
+    thread_mutex_unlock(&scheduler.lock);
+}
+
+static void fiber_thread_main(void *argument) {
+    struct fiber_thread *thread = argument;
+
+#ifdef _WIN32
+    thread->context = ConvertThreadToFiber(NULL);
+    if (!thread->context)
+        fatalf("error: ConvertThreadToFiber failed, %lu\n", GetLastError());
+#endif
+
+    for (;;) {
+        thread_mutex_lock(&thread->lock);
+        while (!thread->head && !thread->stopping)
+            thread_condition_wait(&thread->wake, &thread->lock);
+
+        struct fiber *fiber = thread->head;
+        if (fiber) {
+            thread->head = fiber->next;
+            if (!thread->head)
+                thread->tail = NULL;
+        }
+        thread_mutex_unlock(&thread->lock);
+
+        if (!fiber)
+            break;
+
+        fiber_resume(thread, fiber);
+        if (fiber->finished)
+            fiber_finish(fiber);
+    }
+
+#ifdef _WIN32
+    ConvertFiberToThread();
+#endif
+}
+
+/* Lets the other ready fibers of the thread run, unless there are none. */
+static void fiber_yield(struct fiber *fiber) {
+    struct fiber_thread *thread = fiber->thread;
+
+    thread_mutex_lock(&thread->lock);
+    _Bool alone = !thread->head;
+    if (!alone)
+        fiber_enqueue(fiber);
+    thread_mutex_unlock(&thread->lock);
+
+    if (!alone)
+        fiber_suspend(fiber);
+}
+
+void fiber_init(size_t nthreads) {
+    scheduler.nthreads = nthreads;
+    thread_mutex_init(&scheduler.lock);
+    thread_condition_init(&scheduler.done);
+}
+
+/* Called with the lock of the scheduler held, on the first spawn. */
+static void fiber_start_threads(void) {
+    scheduler.threads = calloc(scheduler.nthreads, sizeof(struct fiber_thread));
+    if (!scheduler.threads)
+        fatalf("error: could not allocate the scheduler threads.\n");
+
+    for (size_t i = 0; i < scheduler.nthreads; i++) {
+        struct fiber_thread *thread = &scheduler.threads[i];
+
+        thread_mutex_init(&thread->lock);
+        thread_condition_init(&thread->wake);
+        thread_start(&thread->thread, fiber_thread_main, thread,
+                     THREAD_STACK_SIZE);
+    }
+}
+
+_Bool fiber_destroy(void) {
+    _Bool failed = 0;
+
+    thread_mutex_lock(&scheduler.lock);
+    while (scheduler.live)
+        thread_condition_wait(&scheduler.done, &scheduler.lock);
+    thread_mutex_unlock(&scheduler.lock);
+
+    for (size_t i = 0; scheduler.threads && i < scheduler.nthreads; i++) {
+        struct fiber_thread *thread = &scheduler.threads[i];
+
+        thread_mutex_lock(&thread->lock);
+        thread->stopping = 1;
+        thread_condition_broadcast(&thread->wake);
+        thread_mutex_unlock(&thread->lock);
+
+        thread_join(&thread->thread);
+        thread_condition_destroy(&thread->wake);
+        thread_mutex_destroy(&thread->lock);
+    }
+
+    /* Fibers nobody joined. */
+    for (size_t i = 0; i < scheduler.size; i++) {
+        if (scheduler.fibers[i]) {
+            failed |= scheduler.fibers[i]->failed;
+            environment_destroy(scheduler.fibers[i]->env);
+            free(scheduler.fibers[i]);
+        }
+    }
+
+    thread_condition_destroy(&scheduler.done);
+    thread_mutex_destroy(&scheduler.lock);
+    free(scheduler.threads);
+    free(scheduler.fibers);
+    memset(&scheduler, 0, sizeof(scheduler));
+    return failed;
+}
+
+void fiber_preempt(struct environment *env) {
+    if (!env->fiber)
+        return;
+
+    env->budget = FIBER_BUDGET;
+    fiber_yield(env->fiber);
+}
+
+/* Pushes the id of a new fiber running the quotation on top of the stack
+ * on an empty stack of its own. The fiber is placed on the scheduler
+ * thread with the fewest unfinished fibers. */
+void __spawnfunction(struct environment *env) {
+    struct value quotation;
+
+    if (!stack_pop(env->stack, &quotation))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (quotation.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: spawn operating on non lambda type.\n");
+
+    /* Fibers share the program, which must stop changing under them. */
+    image_freeze(env->image);
+
+    struct fiber *fiber = calloc(1, sizeof(*fiber));
+    if (!fiber)
+        fatalf("error: could not allocate a fiber.\n");
+
+    fiber->env =
+        make_environment(env->image, STACK_INITIAL_DEPTH, env->stack->max);
+    fiber->env->fiber  = fiber;
+    fiber->env->budget = FIBER_BUDGET;
+    fiber->quotation   = gc_import(fiber->env->gc, quotation.lambda);
+
+    /* Native code does not count the budget, so as far as the VM can
+     * tell, a fiber is always nested too deep to enter it. */
+    fiber->env->native_depth = JIT_MAXIMUM_DEPTH;
+    fiber->env->nesting_max  = FIBER_NESTING_MAXIMUM_DEPTH;
+
+    thread_mutex_lock(&scheduler.lock);
+    if (!scheduler.threads)
+        fiber_start_threads();
+
+    if (scheduler.size == scheduler.capacity) {
+        scheduler.capacity = scheduler.capacity ? scheduler.capacity * 2 : 64;
+        scheduler.fibers   = realloc(scheduler.fibers, sizeof(struct fiber *) *
+                                                         scheduler.capacity);
+    }
+    scheduler.fibers[scheduler.size++] = fiber;
+    int64_t id                         = (int64_t)scheduler.size;
+
+    struct fiber_thread *thread = &scheduler.threads[0];
+    for (size_t i = 1; i < scheduler.nthreads; i++) {
+        if (scheduler.threads[i].load < thread->load)
+            thread = &scheduler.threads[i];
+    }
+    thread->load++;
+    scheduler.live++;
+    fiber->thread = thread;
+    thread_mutex_unlock(&scheduler.lock);
+
+    fiber_ready(fiber);
+    stack_push(env->stack,
+               (struct value){.type = VALUE_TYPE_INTEGER, .integer = id});
+}
+
+/* Waits for the fiber whose id is on top of the stack to finish and pushes
+ * what it left on its stack. A fiber waiting gives up its thread; any
+ * other caller blocks. */
+void __joinfunction(struct environment *env) {
+    struct value id;
+
+    if (!stack_pop(env->stack, &id))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (id.type != VALUE_TYPE_INTEGER)
+        fatalf("error: join expects the id of a fiber.\n");
+
+    thread_mutex_lock(&scheduler.lock);
+    struct fiber *fiber = NULL;
+    if (id.integer > 0 && (size_t)id.integer <= scheduler.size)
+        fiber = scheduler.fibers[id.integer - 1];
+
+    if (!fiber || fiber == env->fiber) {
+        thread_mutex_unlock(&scheduler.lock);
+        fatalf("error: fiber %lld cannot be joined.\n", (long long)id.integer);
+    }
+
+    scheduler.fibers[id.integer - 1] = NULL;
+    if (fiber->done) {
+        thread_mutex_unlock(&scheduler.lock);
+    } else if (env->fiber) {
+        fiber->joiner = env->fiber;
+        thread_mutex_unlock(&scheduler.lock);
+        fiber_suspend(env->fiber);
+    } else {
+        while (!fiber->done)
+            thread_condition_wait(&scheduler.done, &scheduler.lock);
+        thread_mutex_unlock(&scheduler.lock);
+    }
+
+    if (fiber->failed) {
+        environment_destroy(fiber->env);
+        free(fiber);
+        fatalf("error: fiber %lld failed.\n", (long long)id.integer);
+    }
+
+    struct stack *results = fiber->env->stack;
+    for (size_t i = 0; i < results->ndata; i++) {
+        struct value value = results->data[i];
+        if (value.type == VALUE_TYPE_LAMBDA)
+            value.lambda = gc_import(env->gc, value.lambda);
+        stack_push(env->stack, value);
+    }
+
+    environment_destroy(fiber->env);
+    free(fiber);
+}
+
+/* Lets other fibers run. Outside of a fiber, lets other threads run. */
+void __yieldfunction(struct environment *env) {
+    if (env->fiber)
+        fiber_yield(env->fiber);
+    else
+        thread_yield();
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kernel.h"
+
+/* Fibers run quotations spawned by a program alongside it, each on an
+ * environment of its own and a small C stack, which is reserved rather
+ * than committed and only allocated once the fiber first runs, so a fiber
+ * costs a few kilobytes. A fixed number of scheduler threads multiplex
+ * them: a fiber stays on the thread it was placed on when it was spawned,
+ * which runs its ready fibers in turn. A fiber gives its thread up when
+ * it yields, when it waits to join another, or once it has made
+ * FIBER_BUDGET calls and backward jumps since it was last resumed. The
+ * budget is counted by the VM and the tree walker, so fibers do not run
+ * native code. */
+#ifndef FIBER_STACK_SIZE
+#define FIBER_STACK_SIZE (256 * 1024)
+#endif
+
+#define FIBER_BUDGET 10000
+
+/* How many runs of quotations may be nested in a fiber, which its small
+ * stack limits to far fewer than NESTING_MAXIMUM_DEPTH. */
+#define FIBER_NESTING_MAXIMUM_DEPTH 48
+
+/* Sets the number of scheduler threads, which are started with the first
+ * fiber. */
+void fiber_init(size_t nthreads);
+
+/* Waits for every fiber to finish and stops the scheduler threads. Returns
+ * whether one of the fibers nobody joined failed. */
+_Bool fiber_destroy(void);
+
+/* Called when env has used up its budget. The fiber of env, if any, gets
+ * a new budget and lets the other fibers of its thread run first. */
+void fiber_preempt(struct environment *env);
+
+/* Counts a call or a backward jump against the budget of env. Other
+ * environments start from zero and take 2^32 counts to come back to it. */
+static inline void fiber_count(struct environment *env) {
+    if (!--env->budget)
+        fiber_preempt(env);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,284 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "error.h"
+#include "gc.h"
+
+/* A quotation is a single block: the function, its array of word pointers
+ * and the word cells they point to. */
+static size_t gc_object_size(size_t size) {
+    size_t bytes = sizeof(struct function) +
+                   size * (sizeof(struct word *) + sizeof(struct word));
+    return (bytes + 15) & ~(size_t)15;
+}
+
+static void gc_layout(struct function *function, size_t size) {
+    struct word *cells;
+
+    function->words = (struct word **)(function + 1);
+    cells           = (struct word *)(function->words + size);
+
+    for (size_t i = 0; i < size; i++)
+        function->words[i] = &cells[i];
+}
+
+static struct function *gc_alloc_old(struct gc *gc, size_t bytes) {
+    struct function *function = allocator_alloc(&gc->allocator, bytes);
+
+    function->space   = FUNCTION_SPACE_OLD;
+    function->marked  = 0;
+    function->gc_next = gc->old;
+    gc->old           = function;
+    gc->old_bytes += bytes;
+    return function;
+}
+
+/* Large quotations are filled in the old space, possibly with nursery
+ * quotations, so the next minor collection traces them as roots. */
+static void gc_remember(struct gc *gc, struct function *function) {
+    if (gc->remembered_size == gc->remembered_capacity) {
+        gc->remembered_capacity =
+            gc->remembered_capacity ? gc->remembered_capacity * 2 : 16;
+        gc->remembered = realloc(gc->remembered, sizeof(struct function *) *
+                                                     gc->remembered_capacity);
+    }
+
+    gc->remembered[gc->remembered_size++] = function;
+}
+
+/* The nursery is allocated by the first quotation built at run time, so
+ * environments that build none, such as most fibers and parallel tasks,
+ * do without it. Once it exists, it is emptied by a minor collection. */
+static void gc_make_room(struct gc *gc) {
+    if (gc->nursery) {
+        gc_collect(gc, 0);
+        return;
+    }
+
+    gc->nursery = malloc(GC_NURSERY_SIZE);
+    if (!gc->nursery)
+        fatalf("error: could not allocate the nursery.\n");
+
+    gc->cursor = gc->nursery;
+    gc->end    = gc->nursery + GC_NURSERY_SIZE;
+}
+
+void gc_init(struct gc *gc, struct stack *stack) {
+    memset(gc, 0, sizeof(*gc));
+
+    gc->stack         = stack;
+    gc->old_threshold = GC_OLD_SPACE_MIN;
+}
+
+void gc_destroy(struct gc *gc) {
+    allocator_reset(&gc->allocator);
+    free(gc->nursery);
+    free(gc->slots);
+    free(gc->remembered);
+    free(gc->gray);
+    memset(gc, 0, sizeof(*gc));
+}
+
+struct function *gc_make_quotation(struct gc *gc, uint32_t symbol,
+                                   size_t size) {
+    size_t bytes = gc_object_size(size);
+    struct function *function;
+
+    /* Large quotations go straight to the old space, which is collected
+     * first if they would take it past its threshold. */
+    if (bytes > GC_NURSERY_SIZE / 4) {
+        if (gc->old_bytes + bytes >= gc->old_threshold)
+            gc_collect(gc, 1);
+        function = gc_alloc_old(gc, bytes);
+        gc_remember(gc, function);
+    } else {
+        if ((size_t)(gc->end - gc->cursor) < bytes)
+            gc_make_room(gc);
+
+        function = (struct function *)gc->cursor;
+        gc->cursor += bytes;
+
+        function->space   = FUNCTION_SPACE_NURSERY;
+        function->marked  = 0;
+        function->gc_next = NULL;
+    }
+
+    function->symbol        = symbol;
+    function->size          = size;
+    function->capacity      = size;
+    function->source        = NULL;
+    function->code          = NULL;
+    function->code_size     = 0;
+    function->code_capacity = 0;
+    function->index         = 0;
+    function->origins       = NULL;
+    function->effect        = (struct stack_effect){0};
+    function->threaded      = NULL;
+    function->calls         = 0;
+    function->native        = NULL;
+    function->compiled      = NULL;
+
+    gc_layout(function, size);
+    for (size_t i = 0; i < size; i++)
+        memset(function->words[i], 0, sizeof(struct word));
+
+    return function;
+}
+
+struct function *gc_import(struct gc *gc, struct function *function) {
+    if (function->space == FUNCTION_SPACE_PROGRAM)
+        return function;
+
+    size_t bytes          = gc_object_size(function->size);
+    struct function *copy = gc_alloc_old(gc, bytes);
+    struct function *next = copy->gc_next;
+
+    memcpy(copy, function, bytes);
+    copy->space   = FUNCTION_SPACE_OLD;
+    copy->marked  = 0;
+    copy->gc_next = next;
+    gc_layout(copy, copy->size);
+
+    for (size_t i = 0; i < copy->size; i++) {
+        struct word *word = copy->words[i];
+        if (word->type == WORD_TYPE_LAMBDA)
+            word->lambda = gc_import(gc, word->lambda);
+    }
+    return copy;
+}
+
+void gc_push_root(struct gc *gc, struct function **slot) {
+    if (gc->slots_size == gc->slots_capacity) {
+        gc->slots_capacity = gc->slots_capacity ? gc->slots_capacity * 2 : 16;
+        gc->slots          = realloc(gc->slots, sizeof(struct function **) *
+                                                   gc->slots_capacity);
+    }
+
+    gc->slots[gc->slots_size++] = slot;
+}
+
+void gc_pop_root(struct gc *gc, size_t n) { gc->slots_size -= n; }
+
+void gc_add_roots(struct gc *gc, struct gc_roots *roots) {
+    roots->prev = gc->roots;
+    gc->roots   = roots;
+}
+
+void gc_remove_roots(struct gc *gc, struct gc_roots *roots) {
+    gc->roots = roots->prev;
+}
+
+static void gc_push_gray(struct gc *gc, struct function *function) {
+    if (gc->gray_size == gc->gray_capacity) {
+        gc->gray_capacity = gc->gray_capacity ? gc->gray_capacity * 2 : 64;
+        gc->gray          = realloc(gc->gray, sizeof(struct function *) *
+                                                  gc->gray_capacity);
+    }
+
+    gc->gray[gc->gray_size++] = function;
+}
+
+/* During a minor collection, moves a nursery object to the old space the
+ * first time it is reached and redirects slot to the copy. During a major
+ * collection, marks old objects. */
+void gc_visit(struct gc *gc, struct function **slot) {
+    struct function *function = *slot;
+    if (!function)
+        return;
+
+    if (gc->major) {
+        if (function->space != FUNCTION_SPACE_OLD || function->marked)
+            return;
+
+        function->marked = 1;
+        gc_push_gray(gc, function);
+        return;
+    }
+
+    if (function->space != FUNCTION_SPACE_NURSERY)
+        return;
+
+    if (!function->gc_next) {
+        size_t bytes          = gc_object_size(function->size);
+        struct function *copy = gc_alloc_old(gc, bytes);
+        struct function *next = copy->gc_next;
+
+        memcpy(copy, function, bytes);
+        copy->space   = FUNCTION_SPACE_OLD;
+        copy->gc_next = next;
+        gc_layout(copy, copy->size);
+
+        function->gc_next = copy;
+        gc_push_gray(gc, copy);
+    }
+
+    *slot = function->gc_next;
+}
+
+static void gc_trace(struct gc *gc) {
+    struct stack *stack = gc->stack;
+
+    for (size_t i = 0; i < stack->ndata; i++) {
+        if (stack->data[i].type == VALUE_TYPE_LAMBDA)
+            gc_visit(gc, &stack->data[i].lambda);
+    }
+
+    for (size_t i = 0; i < gc->slots_size; i++)
+        gc_visit(gc, gc->slots[i]);
+
+    for (struct gc_roots *roots = gc->roots; roots; roots = roots->prev)
+        roots->visit(gc, roots);
+
+    if (!gc->major) {
+        for (size_t i = 0; i < gc->remembered_size; i++)
+            gc_push_gray(gc, gc->remembered[i]);
+        gc->remembered_size = 0;
+    }
+
+    while (gc->gray_size) {
+        struct function *function = gc->gray[--gc->gray_size];
+
+        for (size_t i = 0; i < function->size; i++) {
+            struct word *word = function->words[i];
+            if (word->type == WORD_TYPE_LAMBDA)
+                gc_visit(gc, &word->lambda);
+        }
+    }
+}
+
+static void gc_sweep(struct gc *gc) {
+    struct function **link = &gc->old;
+
+    while (*link) {
+        struct function *function = *link;
+
+        if (function->marked) {
+            function->marked = 0;
+            link             = &function->gc_next;
+            continue;
+        }
+
+        size_t bytes = gc_object_size(function->size);
+        *link        = function->gc_next;
+        gc->old_bytes -= bytes;
+        allocator_free(&gc->allocator, function, bytes);
+    }
+}
+
+void gc_collect(struct gc *gc, _Bool major) {
+    gc->major = 0;
+    gc_trace(gc);
+    gc->cursor = gc->nursery;
+
+    if (!major && gc->old_bytes < gc->old_threshold)
+        return;
+
+    gc->major = 1;
+    gc_trace(gc);
+    gc_sweep(gc);
+    gc->major = 0;
+
+    gc->old_threshold = gc->old_bytes * 2;
+    if (gc->old_threshold < GC_OLD_SPACE_MIN)
+        gc->old_threshold = GC_OLD_SPACE_MIN;
+}
\ No newline at end of file
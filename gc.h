@@ -0,0 +1,90 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "kernel.h"
+
+/* Quotations built at run time by compose and curry are owned by a
+ * generational collector. They are bump allocated in a nursery; a minor
+ * collection copies the survivors reachable from the roots into the old
+ * space, which is collected by mark and sweep once it has doubled since
+ * the last major collection. Each collector allocates its old space on
+ * its own, so environments on different threads do not share an
+ * allocator.
+ *
+ * A quotation never changes after it is built and can only refer to
+ * objects that already existed, so no write barrier is needed. The one
+ * way an old object comes to point into the nursery is a large quotation,
+ * which is built in the old space directly; those built since the last
+ * minor collection are remembered, and traced by it. Functions and
+ * lambdas of the program are not moved or freed by the collector, and
+ * cannot refer to runtime quotations, so they are not traced.
+ *
+ * The roots are the data stack, the frames of every running tree walker,
+ * and quotation pointers held in C locals by builtins, which register
+ * them with gc_push_root for as long as they might allocate. */
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+#ifndef GC_OLD_SPACE_MIN
+#define GC_OLD_SPACE_MIN (1024 * 1024)
+#endif
+
+struct gc;
+
+/* A set of roots the collector visits through a callback, used for data
+ * structures that hold several function pointers. */
+struct gc_roots {
+    void (*visit)(struct gc *gc, struct gc_roots *roots);
+    struct gc_roots *prev;
+};
+
+struct gc {
+    struct stack *stack;
+
+    char *nursery;
+    char *cursor;
+    char *end;
+
+    struct allocator allocator;
+    struct function *old;
+    size_t old_bytes;
+    size_t old_threshold;
+
+    struct function **remembered;
+    size_t remembered_size;
+    size_t remembered_capacity;
+
+    struct function ***slots;
+    size_t slots_size;
+    size_t slots_capacity;
+    struct gc_roots *roots;
+
+    struct function **gray;
+    size_t gray_size;
+    size_t gray_capacity;
+    _Bool major;
+};
+
+void gc_init(struct gc *gc, struct stack *stack);
+void gc_destroy(struct gc *gc);
+
+struct function *gc_make_quotation(struct gc *gc, uint32_t symbol,
+                                   size_t size);
+void gc_collect(struct gc *gc, _Bool major);
+
+/* Copies a quotation owned by another collector, with the quotations it
+ * refers to, into the old space of gc, where it stays put. Functions and
+ * lambdas of the program are shared rather than copied. Never collects. */
+struct function *gc_import(struct gc *gc, struct function *function);
+
+void gc_push_root(struct gc *gc, struct function **slot);
+void gc_pop_root(struct gc *gc, size_t n);
+void gc_add_roots(struct gc *gc, struct gc_roots *roots);
+void gc_remove_roots(struct gc *gc, struct gc_roots *roots);
+void gc_visit(struct gc *gc, struct function **slot);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1291 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "compiler.h"
+#include "error.h"
+#include "jit.h"
+
+/* A template JIT: every bytecode instruction is replaced by a fixed
+ * sequence of x86-64 machine code, with the top of the stack kept in a
+ * register while it is an integer. Instructions without a template, and
+ * the checked ones whose operands fail their inline checks, call into C
+ * to run as they do in the VM. */
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X86_64 1
+#else
+#define JIT_X86_64 0
+#endif
+
+/* The deepest nesting of times loops a compiled function may have. */
+#define JIT_LOOPS_MAX 16
+
+uint32_t jit_threshold;
+
+/* What the native code of a function is run with. index is the
+ * instruction last calling into C, so that errors can name the function,
+ * and exit is where returning goes, which depends on how the function was
+ * entered. The loops live here rather than on a stack, since how deeply
+ * each loop is nested is known when compiling; frames built by native code
+ * only have room for the loops of their function. */
+struct jit_frame {
+    struct error_location location;
+    struct function *function;
+    uint32_t index;
+    struct environment *env;
+    void const *exit;
+    struct vm_loop loops[JIT_LOOPS_MAX];
+};
+
+static void jit_report(struct error_location *error) {
+    struct jit_frame *frame = (struct jit_frame *)error;
+    report_location(frame->function, frame->function->origins[frame->index]);
+}
+
+typedef struct function *(*jit_entry)(struct jit_frame *frame,
+                                      void const *start);
+
+/* The machine code of a function, starting with its entry from C, the
+ * entry for calls from native code, and for every instruction, where its
+ * code starts and how many loops are live there. */
+struct jit_code {
+    uint8_t *code;
+    size_t size;
+    uint8_t *internal;
+    uint32_t *offsets;
+    uint8_t *depths;
+};
+
+enum jit_register {
+    JIT_RAX,
+    JIT_RCX,
+    JIT_RDX,
+    JIT_RBX,
+    JIT_RSP,
+    JIT_RBP,
+    JIT_RSI,
+    JIT_RDI,
+    JIT_R8,
+    JIT_R9,
+    JIT_R10,
+    JIT_R11,
+    JIT_R12,
+    JIT_R13,
+    JIT_R14,
+    JIT_R15,
+};
+
+/* The registers the native code keeps its state in, all preserved across
+ * calls into C. JIT_TOP points just past the topmost value in memory; the
+ * cached top of the stack, when there is one, is an integer in JIT_CACHE
+ * with its slot at JIT_TOP reserved. */
+#define JIT_CACHE JIT_RAX
+#define JIT_TOP   JIT_RBX
+#define JIT_BASE  JIT_RBP
+#define JIT_LIMIT JIT_R12
+#define JIT_STACK JIT_R13
+#define JIT_LOOPS JIT_R14
+#define JIT_FRAME JIT_R15
+
+#ifdef _WIN32
+#define JIT_ARG0 JIT_RCX
+#define JIT_ARG1 JIT_RDX
+#else
+#define JIT_ARG0 JIT_RDI
+#define JIT_ARG1 JIT_RSI
+#endif
+
+/* Shadow space for Windows and alignment, below the saved registers. */
+#define JIT_FRAME_SIZE 40
+#define JIT_SHADOW     32
+
+enum jit_condition {
+    JIT_ALWAYS        = -1,
+    JIT_BELOW         = 0x2,
+    JIT_ABOVE_EQUAL   = 0x3,
+    JIT_EQUAL         = 0x4,
+    JIT_UNEQUAL       = 0x5,
+    JIT_GREATER_EQUAL = 0xd,
+};
+
+/* The /digit of the group 1 arithmetic and shift instructions. */
+enum jit_extension {
+    JIT_ADD = 0,
+    JIT_SHL = 4,
+    JIT_SUB = 5,
+    JIT_SHR = 5,
+    JIT_CMP = 7,
+};
+
+_Static_assert(sizeof(struct value) == 16, "values must be 16 bytes");
+#define JIT_VALUE_SHIFT 4
+
+/* Displacements from JIT_TOP of the value n places below the top of the
+ * stack in memory, and of its type and integer. */
+#define JIT_VALUE(n) (-(int32_t)sizeof(struct value) * ((n) + 1))
+#define JIT_TYPE(n)                                                            \
+    (JIT_VALUE(n) + (int32_t)offsetof(struct value, type))
+#define JIT_INTEGER(n)                                                         \
+    (JIT_VALUE(n) + (int32_t)offsetof(struct value, integer))
+
+#define JIT_LOOP_INDEX(k)                                                      \
+    ((int32_t)(sizeof(struct vm_loop) * (k) + offsetof(struct vm_loop, index)))
+#define JIT_LOOP_COUNT(k)                                                      \
+    ((int32_t)(sizeof(struct vm_loop) * (k) + offsetof(struct vm_loop, count)))
+
+struct jit_fixup {
+    size_t at;
+    size_t target;
+};
+
+struct jit_compiler {
+    struct program *program;
+    struct function *function;
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+
+    uint32_t *offsets;
+    uint8_t *depths;
+    _Bool *targets;
+    struct jit_fixup *fixups;
+    size_t nfixups;
+    size_t fixups_capacity;
+
+    /* The deepest nesting of loops, and where the internal entry is. */
+    size_t nloops;
+    size_t internal;
+
+    /* The instruction being compiled, and whether the top of the stack is
+     * in JIT_CACHE at this point of it. */
+    size_t index;
+    _Bool cached;
+};
+
+static void jit_byte(struct jit_compiler *c, uint8_t byte) {
+    if (c->size == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 256;
+        c->code     = realloc(c->code, c->capacity);
+    }
+
+    c->code[c->size++] = byte;
+}
+
+static void jit_u32(struct jit_compiler *c, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        jit_byte(c, (uint8_t)(value >> (8 * i)));
+}
+
+static void jit_u64(struct jit_compiler *c, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        jit_byte(c, (uint8_t)(value >> (8 * i)));
+}
+
+static void jit_rex(struct jit_compiler *c, _Bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | (base >> 3);
+    if (rex != 0x40)
+        jit_byte(c, rex);
+}
+
+/* Opcodes above 0xff are two bytes, starting with 0x0f. */
+static void jit_opcode(struct jit_compiler *c, uint32_t opcode) {
+    if (opcode > 0xff)
+        jit_byte(c, opcode >> 8);
+    jit_byte(c, opcode & 0xff);
+}
+
+/* An instruction with a register and the operand [base + disp]. */
+static void jit_memory(struct jit_compiler *c, _Bool wide, uint32_t opcode,
+                       int reg, int base, int32_t disp) {
+    uint8_t mod = disp == 0 && (base & 7) != JIT_RBP ? 0x00
+                  : disp >= -128 && disp <= 127      ? 0x40
+                                                     : 0x80;
+
+    jit_rex(c, wide, reg, base);
+    jit_opcode(c, opcode);
+    jit_byte(c, mod | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == JIT_RSP)
+        jit_byte(c, 0x24);
+
+    if (mod == 0x40)
+        jit_byte(c, (uint8_t)disp);
+    else if (mod == 0x80)
+        jit_u32(c, (uint32_t)disp);
+}
+
+/* An instruction with two register operands, reg in the ModRM reg field
+ * and rm in its r/m field. */
+static void jit_registers(struct jit_compiler *c, _Bool wide, uint32_t opcode,
+                          int reg, int rm) {
+    jit_rex(c, wide, reg, rm);
+    jit_opcode(c, opcode);
+    jit_byte(c, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void jit_load(struct jit_compiler *c, int reg, int base, int32_t disp) {
+    jit_memory(c, 1, 0x8b, reg, base, disp);
+}
+
+static void jit_store(struct jit_compiler *c, int base, int32_t disp,
+                      int reg) {
+    jit_memory(c, 1, 0x89, reg, base, disp);
+}
+
+static void jit_move(struct jit_compiler *c, int to, int from) {
+    jit_registers(c, 1, 0x89, from, to);
+}
+
+static void jit_move_immediate(struct jit_compiler *c, int reg,
+                               int64_t value) {
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        jit_registers(c, 1, 0xc7, 0, reg);
+        jit_u32(c, (uint32_t)value);
+    } else {
+        jit_rex(c, 1, 0, reg);
+        jit_byte(c, 0xb8 + (reg & 7));
+        jit_u64(c, (uint64_t)value);
+    }
+}
+
+static void jit_arithmetic(struct jit_compiler *c, enum jit_extension op,
+                           int reg, int32_t value) {
+    jit_registers(c, 1, 0x81, op, reg);
+    jit_u32(c, (uint32_t)value);
+}
+
+static void jit_shift(struct jit_compiler *c, enum jit_extension op, int reg,
+                      uint8_t count) {
+    jit_registers(c, 1, 0xc1, op, reg);
+    jit_byte(c, count);
+}
+
+/* Writes VALUE_TYPE_INTEGER to the type at [base + disp]. */
+static void jit_store_integer_type(struct jit_compiler *c, int base,
+                                   int32_t disp) {
+    jit_memory(c, 0, 0xc7, 0, base, disp);
+    jit_u32(c, VALUE_TYPE_INTEGER);
+}
+
+static void jit_push(struct jit_compiler *c, int reg) {
+    if (reg >= JIT_R8)
+        jit_byte(c, 0x41);
+    jit_byte(c, 0x50 + (reg & 7));
+}
+
+static void jit_pop(struct jit_compiler *c, int reg) {
+    if (reg >= JIT_R8)
+        jit_byte(c, 0x41);
+    jit_byte(c, 0x58 + (reg & 7));
+}
+
+/* A jump whose 32 bit displacement is filled in later; returns where. */
+static size_t jit_branch(struct jit_compiler *c,
+                         enum jit_condition condition) {
+    if (condition == JIT_ALWAYS) {
+        jit_byte(c, 0xe9);
+    } else {
+        jit_byte(c, 0x0f);
+        jit_byte(c, 0x80 + condition);
+    }
+
+    jit_u32(c, 0);
+    return c->size - 4;
+}
+
+static void jit_patch(struct jit_compiler *c, size_t at, size_t target) {
+    uint32_t displacement = (uint32_t)(target - (at + 4));
+    memcpy(c->code + at, &displacement, sizeof(displacement));
+}
+
+static void jit_land(struct jit_compiler *c, size_t at) {
+    jit_patch(c, at, c->size);
+}
+
+/* Jumps to the code of instruction target, or to the epilogue when target
+ * is the size of the bytecode. */
+static void jit_jump(struct jit_compiler *c, enum jit_condition condition,
+                     size_t target) {
+    if (c->nfixups == c->fixups_capacity) {
+        c->fixups_capacity = c->fixups_capacity ? c->fixups_capacity * 2 : 16;
+        c->fixups =
+            realloc(c->fixups, sizeof(struct jit_fixup) * c->fixups_capacity);
+    }
+
+    c->fixups[c->nfixups++] = (struct jit_fixup){jit_branch(c, condition),
+                                                 target};
+}
+
+/* Moves the cached top of the stack to its slot in memory. The unchecked
+ * form emits the code without changing what the compiler knows, for slow
+ * paths that the fast path does not go through. */
+static void jit_spill(struct jit_compiler *c) {
+    jit_store_integer_type(c, JIT_TOP, offsetof(struct value, type));
+    jit_store(c, JIT_TOP, offsetof(struct value, integer), JIT_CACHE);
+    jit_arithmetic(c, JIT_ADD, JIT_TOP, sizeof(struct value));
+}
+
+static void jit_flush(struct jit_compiler *c) {
+    if (c->cached)
+        jit_spill(c);
+    c->cached = 0;
+}
+
+/* Pops the integer on top of the stack in memory into JIT_CACHE. */
+static void jit_unspill(struct jit_compiler *c) {
+    jit_load(c, JIT_CACHE, JIT_TOP, JIT_INTEGER(0));
+    jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+    c->cached = 1;
+}
+
+/* Writes the height of the stack back to env->stack. */
+static void jit_sync(struct jit_compiler *c) {
+    jit_move(c, JIT_RCX, JIT_TOP);
+    jit_registers(c, 1, 0x29, JIT_BASE, JIT_RCX);
+    jit_shift(c, JIT_SHR, JIT_RCX, JIT_VALUE_SHIFT);
+    jit_store(c, JIT_STACK, offsetof(struct stack, ndata), JIT_RCX);
+}
+
+/* Loads the stack from env->stack, which C code may have moved. */
+static void jit_reload(struct jit_compiler *c) {
+    jit_load(c, JIT_BASE, JIT_STACK, offsetof(struct stack, data));
+    jit_load(c, JIT_TOP, JIT_STACK, offsetof(struct stack, ndata));
+    jit_shift(c, JIT_SHL, JIT_TOP, JIT_VALUE_SHIFT);
+    jit_registers(c, 1, 0x01, JIT_BASE, JIT_TOP);
+    jit_load(c, JIT_LIMIT, JIT_STACK, offsetof(struct stack, capacity));
+    jit_shift(c, JIT_SHL, JIT_LIMIT, JIT_VALUE_SHIFT);
+    jit_registers(c, 1, 0x01, JIT_BASE, JIT_LIMIT);
+}
+
+/* Calls helper(frame, argument) with the stack written back, leaving its
+ * result in rax. The top of the stack must not be cached. */
+static void jit_call_helper(struct jit_compiler *c, uintptr_t helper,
+                            uint32_t argument) {
+    jit_memory(c, 0, 0xc7, 0, JIT_FRAME, offsetof(struct jit_frame, index));
+    jit_u32(c, (uint32_t)c->index);
+    jit_sync(c);
+    jit_move(c, JIT_ARG0, JIT_FRAME);
+    jit_move_immediate(c, JIT_ARG1, argument);
+    jit_move_immediate(c, JIT_RAX, (int64_t)helper);
+    jit_registers(c, 0, 0xff, 2, JIT_RAX);
+}
+
+static void jit_grow(struct jit_frame *frame, uint32_t unused) {
+    (void)unused;
+    stack_grow(frame->env->stack);
+}
+
+/* Makes room for one more value in memory. */
+static void jit_reserve(struct jit_compiler *c) {
+    jit_registers(c, 1, 0x39, JIT_LIMIT, JIT_TOP);
+    size_t room = jit_branch(c, JIT_BELOW);
+    jit_call_helper(c, (uintptr_t)jit_grow, 0);
+    jit_reload(c);
+    jit_land(c, room);
+}
+
+/* Pushes a new integer, to be put in JIT_CACHE by the caller. */
+static void jit_push_cache(struct jit_compiler *c) {
+    jit_flush(c);
+    jit_reserve(c);
+    c->cached = 1;
+}
+
+/* Branches unless at least n values are in memory, or unless the value n
+ * places below the top is an integer. */
+static size_t jit_guard_depth(struct jit_compiler *c, size_t n) {
+    jit_memory(c, 1, 0x8d, JIT_RCX, JIT_BASE,
+               (int32_t)(sizeof(struct value) * n));
+    jit_registers(c, 1, 0x39, JIT_RCX, JIT_TOP);
+    return jit_branch(c, JIT_BELOW);
+}
+
+static size_t jit_guard_integer(struct jit_compiler *c, size_t n) {
+    jit_memory(c, 0, 0x83, JIT_CMP, JIT_TOP, JIT_TYPE(n));
+    jit_byte(c, VALUE_TYPE_INTEGER);
+    return jit_branch(c, JIT_UNEQUAL);
+}
+
+static struct function *jit_pop_lambda(struct environment *env) {
+    struct value a;
+
+    if (!stack_pop(env->stack, &a))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (a.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: trying to apply to a non-lambda type\n");
+
+    return a.lambda;
+}
+
+/* Runs an instruction that has no template, or the checked form of one
+ * whose operands failed the inline checks, the way the VM does. Returns
+ * the quotation of a tail apply for the caller to run. */
+static struct function *jit_instruction(struct jit_frame *frame,
+                                        uint32_t instruction) {
+    struct environment *env = frame->env;
+    uint32_t operand        = INSTRUCTION_OPERAND(instruction);
+
+    switch (INSTRUCTION_OPCODE(instruction)) {
+    case OP_CALL_BUILTIN:
+        internal_functions[operand].function(env);
+        break;
+    case OP_CALL_FN:
+        vm_execute(env, env->image->program->functions[operand]);
+        break;
+    case OP_CALL_FFI:
+#ifdef ENABLE_FFI
+        environment_call_ffi(
+            env, env->image->program->ffi_functions[operand]->function.ffi_fn);
+#else
+        fatalf("FFI support not enabled.");
+#endif
+        break;
+    case OP_APPLY:
+        environment_call(env, jit_pop_lambda(env));
+        break;
+    case OP_TAIL_APPLY: {
+        struct function *lambda = jit_pop_lambda(env);
+
+        /* Quotations built at run time have no bytecode. */
+        if (lambda->code)
+            return lambda;
+
+        environment_call(env, lambda);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+        environment_condition(env);
+        break;
+    case OP_LOOP_BEGIN: {
+        struct value count;
+
+        if (!stack_pop(env->stack, &count))
+            fatalf("error: stack_pop failed, empty stack\n");
+
+        if (count.type != VALUE_TYPE_INTEGER)
+            fatalf("error: times expects an integer and a lambda\n");
+        break;
+    }
+    case OP_ADD:
+        __addfunction(env);
+        break;
+    case OP_MUL:
+        __mulfunction(env);
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_INT:
+        __equalfunction(env);
+        break;
+    case OP_DUP:
+        __dupfunction(env);
+        break;
+    case OP_DROP:
+        __dropfunction(env);
+        break;
+    case OP_SWAP:
+    case OP_SWAP_DROP:
+        __swapfunction(env);
+        break;
+    case OP_ROT:
+        __rotfunction(env);
+        break;
+    case OP_DUP_MUL:
+        __dupfunction(env);
+        __mulfunction(env);
+        break;
+    case OP_ADD_INT:
+    case OP_MUL_INT: {
+        struct value immediate = {
+            .type    = VALUE_TYPE_INTEGER,
+            .integer = INSTRUCTION_IMMEDIATE(instruction),
+        };
+
+        stack_push(env->stack, immediate);
+        if (INSTRUCTION_OPCODE(instruction) == OP_ADD_INT)
+            __addfunction(env);
+        else
+            __mulfunction(env);
+        break;
+    }
+    default:
+        fatalf("error: invalid opcode %u.\n", INSTRUCTION_OPCODE(instruction));
+    }
+
+    return NULL;
+}
+
+/* Emits the path taken when a guard of a checked instruction fails, on
+ * which the instruction runs in C and reports its error. */
+static void jit_fail(struct jit_compiler *c, size_t const *guards,
+                     size_t nguards, uint32_t instruction) {
+    size_t done = jit_branch(c, JIT_ALWAYS);
+
+    for (size_t i = 0; i < nguards; i++)
+        jit_land(c, guards[i]);
+
+    if (c->cached)
+        jit_spill(c);
+    jit_call_helper(c, (uintptr_t)jit_instruction, instruction);
+
+    /* Not reached: the instruction could only fail. */
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0x0b);
+    jit_land(c, done);
+}
+
+/* Calls into C for an instruction without a template. */
+static void jit_fallback(struct jit_compiler *c, uint32_t instruction) {
+    jit_flush(c);
+    jit_call_helper(c, (uintptr_t)jit_instruction, instruction);
+    jit_reload(c);
+}
+
+static void jit_copy(struct jit_compiler *c, int xmm, int32_t from,
+                     int32_t to) {
+    jit_memory(c, 0, 0x0f10, xmm, JIT_TOP, from);
+    jit_memory(c, 0, 0x0f11, xmm, JIT_TOP, to);
+}
+
+/* + and *, whose operands are integers once past the guards. */
+static void jit_arithmetic_builtin(struct jit_compiler *c, uint32_t opcode,
+                                   uint32_t instruction, _Bool checked) {
+    size_t guards[3], nguards = 0;
+
+    if (c->cached) {
+        if (checked) {
+            guards[nguards++] = jit_guard_depth(c, 1);
+            guards[nguards++] = jit_guard_integer(c, 0);
+            jit_fail(c, guards, nguards, instruction);
+        }
+
+        jit_memory(c, 1, opcode, JIT_CACHE, JIT_TOP, JIT_INTEGER(0));
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        return;
+    }
+
+    if (checked) {
+        guards[nguards++] = jit_guard_depth(c, 2);
+        guards[nguards++] = jit_guard_integer(c, 0);
+        guards[nguards++] = jit_guard_integer(c, 1);
+        jit_fail(c, guards, nguards, instruction);
+    }
+
+    jit_load(c, JIT_CACHE, JIT_TOP, JIT_INTEGER(1));
+    jit_memory(c, 1, opcode, JIT_CACHE, JIT_TOP, JIT_INTEGER(0));
+    jit_arithmetic(c, JIT_SUB, JIT_TOP, 2 * sizeof(struct value));
+    c->cached = 1;
+}
+
+/* Sets JIT_CACHE to whether the last comparison found its operands equal. */
+static void jit_set_equal(struct jit_compiler *c) {
+    jit_registers(c, 0, 0x0f94, 0, JIT_CACHE);
+    jit_registers(c, 0, 0x0fb6, JIT_CACHE, JIT_CACHE);
+}
+
+static void jit_equal(struct jit_compiler *c, uint32_t instruction,
+                      _Bool checked) {
+    if (!checked && c->cached) {
+        jit_memory(c, 1, 0x39, JIT_CACHE, JIT_TOP, JIT_INTEGER(0));
+        jit_set_equal(c);
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        return;
+    }
+
+    jit_flush(c);
+
+    size_t guards[3], slow = 0;
+    if (checked) {
+        guards[0] = jit_guard_depth(c, 2);
+        guards[1] = jit_guard_integer(c, 0);
+        guards[2] = jit_guard_integer(c, 1);
+    }
+
+    jit_load(c, JIT_CACHE, JIT_TOP, JIT_INTEGER(0));
+    jit_memory(c, 1, 0x39, JIT_CACHE, JIT_TOP, JIT_INTEGER(1));
+    jit_set_equal(c);
+    jit_arithmetic(c, JIT_SUB, JIT_TOP, 2 * sizeof(struct value));
+
+    /* equal? on other values is left to the builtin, which leaves an
+     * integer either way. */
+    if (checked) {
+        slow = jit_branch(c, JIT_ALWAYS);
+        for (size_t i = 0; i < 3; i++)
+            jit_land(c, guards[i]);
+
+        jit_call_helper(c, (uintptr_t)jit_instruction, instruction);
+        jit_reload(c);
+        jit_unspill(c);
+        jit_land(c, slow);
+    }
+
+    c->cached = 1;
+}
+
+/* Unary operations on an integer on top of the stack: dup *, and + and *
+ * with an immediate. */
+static void jit_integer_operation(struct jit_compiler *c, uint32_t instruction,
+                                  _Bool checked) {
+    int32_t immediate = INSTRUCTION_IMMEDIATE(instruction);
+
+    if (!c->cached) {
+        if (checked) {
+            size_t guards[2] = {jit_guard_depth(c, 1),
+                                jit_guard_integer(c, 0)};
+            jit_fail(c, guards, 2, instruction);
+        }
+
+        jit_unspill(c);
+    }
+
+    switch (INSTRUCTION_OPCODE(instruction)) {
+    case OP_DUP_MUL:
+    case OP_DUP_MUL_UNCHECKED:
+        jit_registers(c, 1, 0x0faf, JIT_CACHE, JIT_CACHE);
+        break;
+    case OP_ADD_INT:
+    case OP_ADD_INT_UNCHECKED:
+        jit_arithmetic(c, JIT_ADD, JIT_CACHE, immediate);
+        break;
+    default:
+        jit_registers(c, 1, 0x69, JIT_CACHE, JIT_CACHE);
+        jit_u32(c, (uint32_t)immediate);
+        break;
+    }
+}
+
+/* Pops a condition and jumps to target when it is zero, or when it is not
+ * with when_true set. */
+static void jit_branch_on(struct jit_compiler *c, uint32_t instruction,
+                          _Bool when_true) {
+    enum jit_condition condition = when_true ? JIT_UNEQUAL : JIT_EQUAL;
+
+    if (c->cached) {
+        jit_registers(c, 1, 0x85, JIT_CACHE, JIT_CACHE);
+        c->cached = 0;
+    } else {
+        size_t guards[2] = {jit_guard_depth(c, 1), jit_guard_integer(c, 0)};
+        jit_fail(c, guards, 2, instruction);
+
+        jit_load(c, JIT_RCX, JIT_TOP, JIT_INTEGER(0));
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        jit_registers(c, 1, 0x85, JIT_RCX, JIT_RCX);
+    }
+
+    jit_jump(c, condition, INSTRUCTION_OPERAND(instruction));
+}
+
+/* Runs the loop in slot k once more, or leaves it for target. */
+static void jit_loop_next(struct jit_compiler *c, size_t k, size_t target,
+                          _Bool indexed) {
+    jit_load(c, JIT_RCX, JIT_LOOPS, JIT_LOOP_INDEX(k));
+    jit_memory(c, 1, 0x3b, JIT_RCX, JIT_LOOPS, JIT_LOOP_COUNT(k));
+    jit_jump(c, JIT_GREATER_EQUAL, target);
+
+    if (indexed) {
+        jit_push_cache(c);
+        jit_load(c, JIT_CACHE, JIT_LOOPS, JIT_LOOP_INDEX(k));
+    }
+
+    jit_memory(c, 1, 0x83, JIT_ADD, JIT_LOOPS, JIT_LOOP_INDEX(k));
+    jit_byte(c, 1);
+}
+
+/* Returns the function of a tail call, or NULL, left in rax. */
+static void jit_leave(struct jit_compiler *c) {
+    jit_memory(c, 0, 0xff, 4, JIT_FRAME, offsetof(struct jit_frame, exit));
+}
+
+static struct function *jit_continue(struct jit_frame *frame,
+                                     struct function *function) {
+    vm_execute(frame->env, function);
+    return NULL;
+}
+
+/* Calls a compiled function directly through its internal entry, running
+ * any tail call it leaves in C. Functions that are not compiled yet, and
+ * calls nested too deeply, go through C and the VM. */
+static void jit_call_function(struct jit_compiler *c, uint32_t instruction) {
+    struct function *callee =
+        c->program->functions[INSTRUCTION_OPERAND(instruction)];
+    size_t slow[2], nslow = 0;
+
+    jit_flush(c);
+    jit_load(c, JIT_RCX, JIT_FRAME, offsetof(struct jit_frame, env));
+    jit_memory(c, 1, 0x81, JIT_CMP, JIT_RCX,
+               offsetof(struct environment, native_depth));
+    jit_u32(c, JIT_MAXIMUM_DEPTH);
+    slow[nslow++] = jit_branch(c, JIT_ABOVE_EQUAL);
+
+    if (callee == c->function) {
+        jit_byte(c, 0xe8);
+        jit_u32(c, 0);
+        jit_patch(c, c->size - 4, c->internal);
+    } else {
+        jit_move_immediate(c, JIT_RAX, (int64_t)(uintptr_t)&callee->native);
+        jit_load(c, JIT_RAX, JIT_RAX, 0);
+        jit_registers(c, 1, 0x85, JIT_RAX, JIT_RAX);
+        slow[nslow++] = jit_branch(c, JIT_EQUAL);
+        jit_memory(c, 0, 0xff, 2, JIT_RAX, offsetof(struct jit_code, internal));
+    }
+
+    jit_registers(c, 1, 0x85, JIT_RAX, JIT_RAX);
+    size_t returned = jit_branch(c, JIT_EQUAL);
+    jit_memory(c, 0, 0xc7, 0, JIT_FRAME, offsetof(struct jit_frame, index));
+    jit_u32(c, (uint32_t)c->index);
+    jit_sync(c);
+    jit_move(c, JIT_ARG0, JIT_FRAME);
+    jit_move(c, JIT_ARG1, JIT_RAX);
+    jit_move_immediate(c, JIT_RAX, (int64_t)(uintptr_t)jit_continue);
+    jit_registers(c, 0, 0xff, 2, JIT_RAX);
+    jit_reload(c);
+    size_t done = jit_branch(c, JIT_ALWAYS);
+
+    for (size_t i = 0; i < nslow; i++)
+        jit_land(c, slow[i]);
+    jit_call_helper(c, (uintptr_t)jit_instruction, instruction);
+    jit_reload(c);
+
+    jit_land(c, returned);
+    jit_land(c, done);
+}
+
+static void jit_compile_instruction(struct jit_compiler *c,
+                                    uint32_t instruction) {
+    enum opcode op   = INSTRUCTION_OPCODE(instruction);
+    uint32_t operand = INSTRUCTION_OPERAND(instruction);
+    _Bool checked    = 1;
+    size_t guards[2] = {0};
+
+    switch (op) {
+    case OP_RETURN:
+        jit_flush(c);
+        jit_registers(c, 0, 0x31, JIT_RAX, JIT_RAX);
+        jit_leave(c);
+        break;
+    case OP_PUSH_INT:
+        jit_push_cache(c);
+        jit_move_immediate(c, JIT_CACHE, INSTRUCTION_IMMEDIATE(instruction));
+        break;
+    case OP_PUSH_CONST: {
+        struct value *constant = &c->program->constants[operand];
+
+        if (constant->type == VALUE_TYPE_INTEGER) {
+            jit_push_cache(c);
+            jit_move_immediate(c, JIT_CACHE, constant->integer);
+            break;
+        }
+
+        jit_flush(c);
+        jit_reserve(c);
+        jit_move_immediate(c, JIT_RCX, (int64_t)(uintptr_t)constant);
+        jit_memory(c, 0, 0x0f10, 0, JIT_RCX, 0);
+        jit_memory(c, 0, 0x0f11, 0, JIT_TOP, 0);
+        jit_arithmetic(c, JIT_ADD, JIT_TOP, sizeof(struct value));
+        break;
+    }
+    case OP_TAIL_CALL_FN: {
+        struct function *callee = c->program->functions[operand];
+
+        jit_flush(c);
+        if (callee == c->function) {
+            jit_jump(c, JIT_ALWAYS, 0);
+            break;
+        }
+
+        jit_move_immediate(c, JIT_RAX, (int64_t)(uintptr_t)callee);
+        jit_leave(c);
+        break;
+    }
+    case OP_TAIL_APPLY:
+        jit_fallback(c, instruction);
+        jit_registers(c, 1, 0x85, JIT_RAX, JIT_RAX);
+        jit_jump(c, JIT_UNEQUAL, c->function->code_size);
+        break;
+    case OP_CALL_FN:
+        jit_call_function(c, instruction);
+        break;
+    case OP_JUMP:
+        jit_flush(c);
+        jit_jump(c, JIT_ALWAYS, operand);
+        break;
+    case OP_JUMP_IF_FALSE:
+        jit_branch_on(c, instruction, 0);
+        break;
+    case OP_JUMP_IF_TRUE:
+        jit_branch_on(c, instruction, 1);
+        break;
+    case OP_LOOP_BEGIN: {
+        size_t k = c->depths[c->index];
+
+        if (!c->cached) {
+            guards[0] = jit_guard_depth(c, 1);
+            guards[1] = jit_guard_integer(c, 0);
+            jit_fail(c, guards, 2, instruction);
+            jit_unspill(c);
+        }
+
+        jit_memory(c, 1, 0xc7, 0, JIT_LOOPS, JIT_LOOP_INDEX(k));
+        jit_u32(c, 0);
+        jit_store(c, JIT_LOOPS, JIT_LOOP_COUNT(k), JIT_CACHE);
+        c->cached = 0;
+        break;
+    }
+    case OP_LOOP_NEXT:
+    case OP_LOOP_NEXT_INDEX:
+        jit_loop_next(c, c->depths[c->index] - 1, operand,
+                      op == OP_LOOP_NEXT_INDEX);
+        break;
+
+    case OP_ADD_UNCHECKED:
+    case OP_MUL_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_ADD:
+    case OP_MUL:
+        jit_arithmetic_builtin(
+            c, op == OP_ADD || op == OP_ADD_UNCHECKED ? 0x03 : 0x0faf,
+            instruction, checked);
+        break;
+    case OP_EQUAL_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_EQUAL:
+        jit_equal(c, instruction, checked);
+        break;
+
+    case OP_DUP_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_DUP:
+        if (c->cached) {
+            jit_push_cache(c);
+            break;
+        }
+
+        if (checked) {
+            guards[0] = jit_guard_depth(c, 1);
+            jit_fail(c, guards, 1, instruction);
+        }
+
+        jit_reserve(c);
+        jit_copy(c, 0, JIT_VALUE(0), 0);
+        jit_arithmetic(c, JIT_ADD, JIT_TOP, sizeof(struct value));
+        break;
+    case OP_DROP_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_DROP:
+        if (c->cached) {
+            c->cached = 0;
+            break;
+        }
+
+        if (checked) {
+            guards[0] = jit_guard_depth(c, 1);
+            jit_fail(c, guards, 1, instruction);
+        }
+
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        break;
+    case OP_SWAP_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_SWAP:
+        if (checked) {
+            guards[0] = jit_guard_depth(c, c->cached ? 1 : 2);
+            jit_fail(c, guards, 1, instruction);
+        }
+
+        if (c->cached) {
+            jit_memory(c, 0, 0x0f10, 0, JIT_TOP, JIT_VALUE(0));
+            jit_store_integer_type(c, JIT_TOP, JIT_TYPE(0));
+            jit_store(c, JIT_TOP, JIT_INTEGER(0), JIT_CACHE);
+            jit_memory(c, 0, 0x0f11, 0, JIT_TOP, 0);
+            jit_arithmetic(c, JIT_ADD, JIT_TOP, sizeof(struct value));
+            c->cached = 0;
+            break;
+        }
+
+        jit_memory(c, 0, 0x0f10, 0, JIT_TOP, JIT_VALUE(0));
+        jit_copy(c, 1, JIT_VALUE(1), JIT_VALUE(0));
+        jit_memory(c, 0, 0x0f11, 0, JIT_TOP, JIT_VALUE(1));
+        break;
+    case OP_ROT_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_ROT:
+        jit_flush(c);
+        if (checked) {
+            guards[0] = jit_guard_depth(c, 3);
+            jit_fail(c, guards, 1, instruction);
+        }
+
+        jit_memory(c, 0, 0x0f10, 0, JIT_TOP, JIT_VALUE(2));
+        jit_copy(c, 1, JIT_VALUE(1), JIT_VALUE(2));
+        jit_copy(c, 1, JIT_VALUE(0), JIT_VALUE(1));
+        jit_memory(c, 0, 0x0f11, 0, JIT_TOP, JIT_VALUE(0));
+        break;
+
+    case OP_SWAP_DROP_UNCHECKED:
+        checked = 0;
+        /* fallthrough */
+    case OP_SWAP_DROP:
+        if (checked) {
+            guards[0] = jit_guard_depth(c, c->cached ? 1 : 2);
+            jit_fail(c, guards, 1, instruction);
+        }
+
+        if (!c->cached)
+            jit_copy(c, 0, JIT_VALUE(0), JIT_VALUE(1));
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        break;
+    case OP_DUP_MUL_UNCHECKED:
+    case OP_ADD_INT_UNCHECKED:
+    case OP_MUL_INT_UNCHECKED:
+        jit_integer_operation(c, instruction, 0);
+        break;
+    case OP_DUP_MUL:
+    case OP_ADD_INT:
+    case OP_MUL_INT:
+        jit_integer_operation(c, instruction, 1);
+        break;
+    case OP_EQUAL_INT: {
+        int32_t immediate = INSTRUCTION_IMMEDIATE(instruction);
+
+        if (c->cached) {
+            jit_arithmetic(c, JIT_CMP, JIT_CACHE, immediate);
+            jit_set_equal(c);
+            break;
+        }
+
+        guards[0] = jit_guard_depth(c, 1);
+        jit_fail(c, guards, 1, instruction);
+
+        /* Any value other than the integer compares unequal. */
+        jit_registers(c, 0, 0x31, JIT_RCX, JIT_RCX);
+        jit_memory(c, 1, 0x81, JIT_CMP, JIT_TOP, JIT_INTEGER(0));
+        jit_u32(c, (uint32_t)immediate);
+        jit_registers(c, 0, 0x0f94, 0, JIT_RCX);
+        jit_registers(c, 0, 0x31, JIT_CACHE, JIT_CACHE);
+        jit_memory(c, 0, 0x83, JIT_CMP, JIT_TOP, JIT_TYPE(0));
+        jit_byte(c, VALUE_TYPE_INTEGER);
+        jit_registers(c, 0, 0x0f44, JIT_CACHE, JIT_RCX);
+        jit_arithmetic(c, JIT_SUB, JIT_TOP, sizeof(struct value));
+        c->cached = 1;
+        break;
+    }
+
+    case OP_CALL_BUILTIN:
+    case OP_CALL_FFI:
+    case OP_APPLY:
+    default:
+        jit_fallback(c, instruction);
+        break;
+    }
+}
+
+/* lea reg, [rip + disp32] with the displacement filled in later; returns
+ * where, for jit_patch. */
+static size_t jit_address_of(struct jit_compiler *c, int reg) {
+    jit_rex(c, 1, reg, 0);
+    jit_byte(c, 0x8d);
+    jit_byte(c, (reg & 7) << 3 | 0x05);
+    jit_u32(c, 0);
+    return c->size - 4;
+}
+
+/* The entry from C, as a jit_entry: saves the registers C expects to be
+ * kept, loads the stack and jumps to start. Returning comes back here to
+ * write the stack back. */
+static void jit_external_entry(struct jit_compiler *c) {
+    static int const saved[] = {JIT_RBX, JIT_RBP, JIT_R12,
+                                JIT_R13, JIT_R14, JIT_R15};
+
+    for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++)
+        jit_push(c, saved[i]);
+    jit_arithmetic(c, JIT_SUB, JIT_RSP, JIT_FRAME_SIZE);
+
+    jit_move(c, JIT_FRAME, JIT_ARG0);
+    jit_load(c, JIT_RAX, JIT_FRAME, offsetof(struct jit_frame, env));
+    jit_load(c, JIT_STACK, JIT_RAX, offsetof(struct environment, stack));
+    jit_memory(c, 1, 0x8d, JIT_LOOPS, JIT_FRAME,
+               offsetof(struct jit_frame, loops));
+    jit_reload(c);
+
+    size_t exit = jit_address_of(c, JIT_RCX);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, exit), JIT_RCX);
+    jit_registers(c, 0, 0xff, 4, JIT_ARG1);
+
+    jit_land(c, exit);
+    jit_sync(c);
+    jit_arithmetic(c, JIT_ADD, JIT_RSP, JIT_FRAME_SIZE);
+    for (size_t i = sizeof(saved) / sizeof(saved[0]); i-- > 0;)
+        jit_pop(c, saved[i]);
+    jit_byte(c, 0xc3);
+}
+
+/* The size of the frame the internal entry builds, which keeps the
+ * machine stack aligned after the return address and two saved
+ * registers. */
+static int32_t jit_internal_frame_size(struct jit_compiler *c) {
+    size_t size = JIT_SHADOW + offsetof(struct jit_frame, loops) +
+                  sizeof(struct vm_loop) * c->nloops;
+    return (int32_t)((size + 15) / 16 * 16 + 8);
+}
+
+/* The entry for calls from native code, which share the caller's stack
+ * registers: builds a frame on the machine stack, below the caller's,
+ * and runs on into the first instruction. Returns where the exit address
+ * is to be filled in. */
+static size_t jit_internal_entry(struct jit_compiler *c) {
+    c->internal = c->size;
+    jit_push(c, JIT_FRAME);
+    jit_push(c, JIT_LOOPS);
+    jit_arithmetic(c, JIT_SUB, JIT_RSP, jit_internal_frame_size(c));
+
+    jit_load(c, JIT_RAX, JIT_FRAME, offsetof(struct jit_frame, env));
+    jit_memory(c, 1, 0x8d, JIT_FRAME, JIT_RSP, JIT_SHADOW);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, env), JIT_RAX);
+    jit_move_immediate(c, JIT_RAX, (int64_t)(uintptr_t)c->function);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, function), JIT_RAX);
+    jit_memory(c, 1, 0x8d, JIT_LOOPS, JIT_FRAME,
+               offsetof(struct jit_frame, loops));
+
+    jit_move_immediate(c, JIT_RAX, (int64_t)(uintptr_t)jit_report);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, location.report),
+              JIT_RAX);
+    jit_load(c, JIT_RDX, JIT_FRAME, offsetof(struct jit_frame, env));
+    jit_memory(c, 1, 0x83, JIT_ADD, JIT_RDX,
+               offsetof(struct environment, native_depth));
+    jit_byte(c, 1);
+
+    jit_load(c, JIT_RCX, JIT_RDX, offsetof(struct environment, error_location));
+    jit_load(c, JIT_RAX, JIT_RCX, 0);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, location.prev),
+              JIT_RAX);
+    jit_store(c, JIT_RCX, 0, JIT_FRAME);
+
+    size_t exit = jit_address_of(c, JIT_RCX);
+    jit_store(c, JIT_FRAME, offsetof(struct jit_frame, exit), JIT_RCX);
+    return exit;
+}
+
+/* Undoes the internal entry, keeping the result in rax. */
+static void jit_internal_exit(struct jit_compiler *c) {
+    jit_load(c, JIT_RCX, JIT_FRAME, offsetof(struct jit_frame, env));
+    jit_memory(c, 1, 0x83, JIT_SUB, JIT_RCX,
+               offsetof(struct environment, native_depth));
+    jit_byte(c, 1);
+
+    jit_load(c, JIT_RDX, JIT_FRAME, offsetof(struct jit_frame, location.prev));
+    jit_load(c, JIT_RCX, JIT_RCX, offsetof(struct environment, error_location));
+    jit_store(c, JIT_RCX, 0, JIT_RDX);
+
+    jit_arithmetic(c, JIT_ADD, JIT_RSP, jit_internal_frame_size(c));
+    jit_pop(c, JIT_LOOPS);
+    jit_pop(c, JIT_FRAME);
+    jit_byte(c, 0xc3);
+}
+
+/* Finds the jump targets, where the top of the stack is never cached, and
+ * how many times loops are live at each instruction. Returns 0 when the
+ * loops nest too deeply to compile. */
+static _Bool jit_analyze(struct jit_compiler *c) {
+    struct function *function = c->function;
+
+    c->targets[0] = 1;
+    for (size_t i = 0; i < function->code_size; i++) {
+        uint32_t instruction = function->code[i];
+        enum opcode op       = INSTRUCTION_OPCODE(instruction);
+        uint32_t target      = INSTRUCTION_OPERAND(instruction);
+
+        if (op != OP_JUMP && op != OP_JUMP_IF_FALSE &&
+            op != OP_JUMP_IF_TRUE && op != OP_LOOP_NEXT &&
+            op != OP_LOOP_NEXT_INDEX)
+            continue;
+
+        c->targets[target] = 1;
+        if (op != OP_LOOP_NEXT && op != OP_LOOP_NEXT_INDEX)
+            continue;
+
+        for (size_t j = i; j < target; j++) {
+            if (++c->depths[j] > JIT_LOOPS_MAX)
+                return 0;
+            if (c->depths[j] > c->nloops)
+                c->nloops = c->depths[j];
+        }
+    }
+
+    return 1;
+}
+
+static void *jit_map(uint8_t const *code, size_t size) {
+#ifdef _WIN32
+    DWORD old;
+    void *memory =
+        VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!memory)
+        return NULL;
+
+    memcpy(memory, code, size);
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old)) {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return NULL;
+    }
+#else
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+
+    memcpy(memory, code, size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+#endif
+
+    return memory;
+}
+
+static void jit_unmap(void *memory, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+void jit_init(enum jit_mode mode) {
+    jit_threshold = mode == JIT_MODE_OFF      ? 0
+                    : mode == JIT_MODE_ALWAYS ? 1
+                                              : JIT_THRESHOLD;
+}
+
+void jit_compile(struct program *program, struct function *function) {
+    if (!JIT_X86_64 || !function->code || function->native)
+        return;
+
+    size_t size           = function->code_size;
+    struct jit_compiler c = {program, function};
+    c.offsets             = calloc(size + 1, sizeof(uint32_t));
+    c.depths              = calloc(size + 1, sizeof(uint8_t));
+    c.targets             = calloc(size + 1, sizeof(_Bool));
+
+    uint8_t *code = NULL;
+    if (jit_analyze(&c)) {
+        jit_external_entry(&c);
+        size_t exit = jit_internal_entry(&c);
+
+        for (c.index = 0; c.index < size; c.index++) {
+            if (c.targets[c.index])
+                jit_flush(&c);
+
+            c.offsets[c.index] = (uint32_t)c.size;
+            jit_compile_instruction(&c, function->code[c.index]);
+        }
+
+        /* Jumps to the end leave with what is in rax. */
+        c.offsets[size] = (uint32_t)c.size;
+        jit_leave(&c);
+        jit_land(&c, exit);
+        jit_internal_exit(&c);
+
+        for (size_t i = 0; i < c.nfixups; i++)
+            jit_patch(&c, c.fixups[i].at, c.offsets[c.fixups[i].target]);
+
+        code = jit_map(c.code, c.size);
+    }
+
+    free(c.code);
+    free(c.targets);
+    free(c.fixups);
+
+    /* Loops nested too deeply, or no executable memory: the VM keeps the
+     * function. */
+    if (!code) {
+        free(c.offsets);
+        free(c.depths);
+        return;
+    }
+
+    struct jit_code *native = malloc(sizeof(*native));
+    *native          = (struct jit_code){code, c.size, code + c.internal,
+                                c.offsets, c.depths};
+    function->native = native;
+}
+
+void jit_freeze(struct program *program) {
+    if (program->frozen)
+        return;
+
+    if (jit_threshold) {
+        for (size_t i = 0; i < program->functions_size; i++)
+            jit_compile(program, program->functions[i]);
+    }
+
+    program->frozen = 1;
+}
+
+void jit_release(struct function *function) {
+    struct jit_code *native = function->native;
+    if (!native)
+        return;
+
+    jit_unmap(native->code, native->size);
+    free(native->offsets);
+    free(native->depths);
+    free(native);
+    function->native = NULL;
+}
+
+struct function *jit_call(struct environment *env,
+                          struct function *function) {
+    return jit_resume(env, function, 0, NULL, NULL);
+}
+
+struct function *jit_resume(struct environment *env,
+                            struct function *function, size_t index,
+                            struct vm_loop *loops, size_t *nloops) {
+    struct jit_frame frame;
+    frame.location = (struct error_location){jit_report, error_location};
+    frame.env      = env;
+    frame.index    = 0;
+    error_location = &frame.location;
+
+    /* Native code reaches the error location of the thread through env,
+     * since its address differs between threads. */
+    env->error_location = &error_location;
+    env->native_depth++;
+
+    size_t depth = ((struct jit_code *)function->native)->depths[index];
+    if (depth) {
+        *nloops -= depth;
+        memcpy(frame.loops, loops + *nloops, sizeof(struct vm_loop) * depth);
+    }
+
+    do {
+        struct jit_code *native = function->native;
+        jit_entry entry         = (jit_entry)(uintptr_t)native->code;
+
+        frame.function = function;
+        function       = entry(&frame, native->code + native->offsets[index]);
+        index          = 0;
+    } while (function && jit_ready(env, function));
+
+    env->native_depth--;
+    error_location = frame.location.prev;
+    return function;
+}
\ No newline at end of file
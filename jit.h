@@ -0,0 +1,62 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "kernel.h"
+#include "vm.h"
+
+/* With --jit=on, a function is compiled to x86-64 machine code once the VM
+ * has counted JIT_THRESHOLD calls of it or jumps back in one of its loops.
+ * --jit=always compiles every function the first time it runs, and
+ * --jit=off leaves everything to the VM. */
+enum jit_mode {
+    JIT_MODE_OFF,
+    JIT_MODE_ON,
+    JIT_MODE_ALWAYS,
+};
+
+#define JIT_THRESHOLD 1000
+
+/* Native code runs on the C stack, so past this many nested native calls
+ * the VM takes over, keeping deep recursion in its own frames. */
+#define JIT_MAXIMUM_DEPTH 256
+
+extern uint32_t jit_threshold;
+
+void jit_init(enum jit_mode mode);
+
+/* Compiles function to native code. When that is not possible, native is
+ * left NULL and the function stays with the VM. */
+void jit_compile(struct program *program, struct function *function);
+void jit_release(struct function *function);
+
+/* Compiles every function of program it can, unless the JIT is off, and
+ * marks the program frozen, after which calls are no longer counted. A
+ * frozen program is left as it is. */
+void jit_freeze(struct program *program);
+
+/* Counts a call of function, or a jump back in it, and tells whether it
+ * can run as native code now. */
+static inline _Bool jit_ready(struct environment *env,
+                              struct function *function) {
+    if (!function->native && jit_threshold &&
+        !env->image->program->frozen && ++function->calls == jit_threshold)
+        jit_compile(env->image->program, function);
+
+    return function->native && env->native_depth < JIT_MAXIMUM_DEPTH;
+}
+
+/* Runs the native code of function, following its tail calls into other
+ * compiled functions. Returns the function of a tail call left for the VM
+ * to run, or NULL. */
+struct function *jit_call(struct environment *env, struct function *function);
+
+/* Like jit_call, but continues a call the VM has been running from the
+ * jump target index, taking the loops that are live there off the top of
+ * the VM's loops. */
+struct function *jit_resume(struct environment *env,
+                            struct function *function, size_t index,
+                            struct vm_loop *loops, size_t *nloops);
+
+#endif
\ No newline at end of file
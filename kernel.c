@@ -1,15 +1,43 @@
-#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "allocator.h"
 #include "error.h"
+#include "fiber.h"
+#include "gc.h"
+#include "jit.h"
 #include "kernel.h"
+#include "thread.h"
+#include "vm.h"
+
+_Thread_local struct error_location *error_location;
+_Thread_local jmp_buf *error_recovery;
+
+/* Names the function an error happened in, and the definition the failing
+ * word came from when that was inlined into it. */
+void report_location(struct function *function, uint32_t origin) {
+    if (origin == SYMBOL_NONE || origin == function->symbol)
+        fprintf(stderr, "  in %s\n", symbol_name(function->symbol));
+    else
+        fprintf(stderr, "  in %s, inlined into %s\n", symbol_name(origin),
+                symbol_name(function->symbol));
+}
 
 void function_add_word(struct function f[static 1], struct word *w) {
     if (f->capacity <= (f->size + 1)) {
+        size_t capacity = f->capacity;
+
         f->capacity++;
         f->capacity *= 2;
-        f->words = realloc(f->words, sizeof(struct word *) * f->capacity);
+        f->words = allocator_realloc(&program_allocator, f->words,
+                                     sizeof(struct word *) * capacity,
+                                     sizeof(struct word *) * f->capacity);
     }
 
     f->words[f->size++] = w;
@@ -20,8 +48,12 @@ void function_destroy(struct function *function) {
         word_destroy(function->words[i]);
     }
 
-    free(function->name);
-    free(function);
+    if (function->source)
+        function_destroy(function->source);
+
+    allocator_free(&program_allocator, function->words,
+                   sizeof(struct word *) * function->capacity);
+    allocator_free(&program_allocator, function, sizeof(*function));
 }
 
 void word_value_destroy(struct word *word) {
@@ -29,13 +61,14 @@ void word_value_destroy(struct word *word) {
     case WORD_VALUE_TYPE_INTEGER:
         break;
     case WORD_VALUE_TYPE_STRING:
-        free(word->value.string);
+        allocator_free(&program_allocator, word->value.string,
+                       strlen(word->value.string) + 1);
         break;
     default:
         fatalf("panic: word_value_destroy called on unsupported type.\n");
     }
 
-    free(word);
+    allocator_free(&program_allocator, word, sizeof(*word));
 }
 
 void word_function_destroy(struct word *word) {
@@ -50,10 +83,13 @@ void word_function_destroy(struct word *word) {
         fatalf("panic: word_function_destroy called on unsupported type.\n");
     }
 
-    free(word);
+    allocator_free(&program_allocator, word, sizeof(*word));
 }
 
-void word_lambda_destroy(struct word *word) { function_destroy(word->lambda); }
+void word_lambda_destroy(struct word *word) {
+    function_destroy(word->lambda);
+    allocator_free(&program_allocator, word, sizeof(*word));
+}
 
 void word_destroy(struct word *word) {
     switch (word->type) {
@@ -71,7 +107,13 @@ void word_destroy(struct word *word) {
     }
 }
 
-_Bool stack_pop(struct stack *s, struct word **out) {
+/* Words are copied shallowly: a copied function or lambda word refers to the
+ * same struct function as the original, which stays owned by its parent. */
+void word_copy(struct word *dest, struct word *src) {
+    memcpy(dest, src, sizeof(*dest));
+}
+
+_Bool stack_pop(struct stack *s, struct value *out) {
     if (s->ndata == 0) {
         return 0;
     }
@@ -80,14 +122,128 @@ _Bool stack_pop(struct stack *s, struct word **out) {
     return 1;
 }
 
-void stack_push(struct stack *s, struct word *in) { s->data[s->ndata++] = in; }
+static struct value *stack_allocate(size_t capacity) {
+    size_t size = sizeof(struct value) * capacity;
+#ifdef _WIN32
+    struct value *data = _aligned_malloc(size, STACK_ALIGNMENT);
+#else
+    size = (size + STACK_ALIGNMENT - 1) & ~(size_t)(STACK_ALIGNMENT - 1);
+    struct value *data = aligned_alloc(STACK_ALIGNMENT, size);
+#endif
+    if (!data)
+        fatalf("error: could not allocate a stack of %zu values.\n",
+               capacity);
+
+    return data;
+}
+
+static void stack_free(struct value *data) {
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+void stack_init(struct stack *s, size_t capacity, size_t max) {
+    if (capacity == 0)
+        capacity = 1;
+    if (max < capacity)
+        max = capacity;
+
+    s->data     = stack_allocate(capacity);
+    s->ndata    = 0;
+    s->capacity = capacity;
+    s->max      = max;
+}
+
+void stack_destroy(struct stack *s) {
+    stack_free(s->data);
+    memset(s, 0, sizeof(*s));
+}
+
+/* The slow path of stack_push, taken when the buffer is full. */
+void stack_grow(struct stack *s) {
+    if (s->capacity >= s->max)
+        fatalf("error: stack overflow, more than %zu values.\n", s->max);
+
+    size_t capacity = s->capacity * 2;
+    if (capacity > s->max)
+        capacity = s->max;
+
+    struct value *data = stack_allocate(capacity);
+    memcpy(data, s->data, sizeof(struct value) * s->ndata);
+    stack_free(s->data);
+
+    s->data     = data;
+    s->capacity = capacity;
+}
+
+/* Checks that the stack holds at least n values and returns a pointer to
+ * the top one, so builtins can work on their operands in place. */
+static struct value *stack_top(struct stack *s, size_t n) {
+    if (s->ndata < n)
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    return &s->data[s->ndata - 1];
+}
+
+struct value value_from_word(struct word *word) {
+    struct value value = {0};
+
+    switch (word->type) {
+    case WORD_TYPE_VALUE:
+        switch (word->value.type) {
+        case WORD_VALUE_TYPE_INTEGER:
+            value.type    = VALUE_TYPE_INTEGER;
+            value.integer = word->value.integer;
+            break;
+        case WORD_VALUE_TYPE_STRING:
+            value.type   = VALUE_TYPE_STRING;
+            value.string = word->value.string;
+            break;
+        default:
+            fatalf("error: unsupported word value type for a value.\n");
+        }
+        break;
+    case WORD_TYPE_LAMBDA:
+        value.type   = VALUE_TYPE_LAMBDA;
+        value.lambda = word->lambda;
+        break;
+    default:
+        fatalf("error: function words are not values.\n");
+    }
+
+    return value;
+}
+
+static void word_from_value(struct word *word, struct value value) {
+    memset(word, 0, sizeof(*word));
+
+    switch (value.type) {
+    case VALUE_TYPE_INTEGER:
+        word->type          = WORD_TYPE_VALUE;
+        word->value.type    = WORD_VALUE_TYPE_INTEGER;
+        word->value.integer = value.integer;
+        break;
+    case VALUE_TYPE_STRING:
+        word->type         = WORD_TYPE_VALUE;
+        word->value.type   = WORD_VALUE_TYPE_STRING;
+        word->value.string = value.string;
+        break;
+    case VALUE_TYPE_LAMBDA:
+        word->type   = WORD_TYPE_LAMBDA;
+        word->lambda = value.lambda;
+        break;
+    }
+}
 
 void print_word(struct word *word) {
     switch (word->type) {
     case WORD_TYPE_VALUE:
         switch (word->value.type) {
         case WORD_VALUE_TYPE_INTEGER:
-            printf("%lld", word->value.integer);
+            printf("%lld", (long long)word->value.integer);
             break;
         case WORD_VALUE_TYPE_STRING:
             printf("%s", word->value.string);
@@ -97,433 +253,652 @@ void print_word(struct word *word) {
         }
         break;
 
-    case WORD_TYPE_LAMBDA:
+    case WORD_TYPE_LAMBDA: {
+        struct function *lambda = function_source(word->lambda);
+
         printf("[ ");
-        for (size_t i = 0; i < word->lambda->size; i++) {
-            print_word(word->lambda->words[i]);
+        for (size_t i = 0; i < lambda->size; i++) {
+            print_word(lambda->words[i]);
             printf(" ");
         }
 
         printf("]");
         break;
+    }
     case WORD_TYPE_FUNCTION:
         switch (word->function.type) {
         case FUNCTION_TYPE_REGULAR:
-            printf("%s", word->function.fn->name);
+            printf("%s", symbol_name(word->function.fn->symbol));
             break;
         case FUNCTION_TYPE_CFUNCTION:
             printf("%s", word->function.cfn.name);
+            break;
+        case FUNCTION_TYPE_FFI:
+#ifdef ENABLE_FFI
+            printf("%s", symbol_name(word->function.ffi_fn->symbol));
+#endif
+            break;
         }
         break;
     }
 }
 
+void print_value(struct value value) {
+    struct word word;
+    word_from_value(&word, value);
+    print_word(&word);
+}
+
 void stack_print(struct stack *stack) {
+    thread_lock_stream(stdout);
     printf("[ ");
     for (size_t i = 0; i < stack->ndata; i++) {
-        struct word *w = stack->data[i];
-        print_word(w);
+        print_value(stack->data[i]);
         printf(" ");
     }
     printf("]\n");
+    thread_unlock_stream(stdout);
 }
 
-_Bool any_fail(size_t n, ...) {
-    va_list vargs;
-
-    va_start(vargs, n);
+void __addfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-    for (size_t i = 0; i < n; i++) {
-        if (!va_arg(vargs, int)) {
-            return 0;
-        }
-    }
+    if (top[0].type != VALUE_TYPE_INTEGER || top[-1].type != VALUE_TYPE_INTEGER)
+        fatalf("error: trying to add non-capatiable value types\n");
 
-    return 1;
+    top[-1].integer = integer_add(top[-1].integer, top[0].integer);
+    env->stack->ndata--;
 }
 
-void __addfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
+static _Bool value_equal(struct value a, struct value b) {
+    if (a.type != b.type)
+        return 0;
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    switch (a.type) {
+    case VALUE_TYPE_INTEGER:
+        return a.integer == b.integer;
+    case VALUE_TYPE_STRING:
+        return strcmp(a.string, b.string) == 0;
+    default:
+        return 0;
+    }
+}
 
-    if (a->type != WORD_TYPE_VALUE || b->type != WORD_TYPE_VALUE)
-        fatalf("error: trying to add non-value types\n");
+void __equalfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-    if (a->value.type != WORD_VALUE_TYPE_INTEGER ||
-        b->value.type != WORD_VALUE_TYPE_INTEGER)
-        fatalf("error: trying to add non-capatiable value types\n");
+    _Bool are_equal = value_equal(top[-1], top[0]);
+    top[-1].type    = VALUE_TYPE_INTEGER;
+    top[-1].integer = are_equal;
+    env->stack->ndata--;
+}
+
+void __mulfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-    int64_t add_result         = a->value.integer + b->value.integer;
-    struct word *word_result   = calloc(1, sizeof(*word_result));
-    word_result->type          = WORD_TYPE_VALUE;
-    word_result->value.type    = WORD_VALUE_TYPE_INTEGER;
-    word_result->value.integer = add_result;
-    stack_push(env->stack, word_result);
+    if (top[0].type != VALUE_TYPE_INTEGER || top[-1].type != VALUE_TYPE_INTEGER)
+        fatalf("error: trying to multiply non-capatiable value types\n");
 
-    word_destroy(a);
-    word_destroy(b);
+    top[-1].integer = integer_mul(top[-1].integer, top[0].integer);
+    env->stack->ndata--;
 }
 
-void __equalfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
-    _Bool are_equal = 1;
+void __applyfunction(struct environment *env) {
+    struct value a;
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
+    if (!stack_pop(env->stack, &a))
         fatalf("error: stack_pop failed, empty stack\n");
 
-    if (a->type != b->type) {
-        are_equal = 0;
-    } else if (a->type == WORD_TYPE_VALUE) {
-        if (a->value.type != b->value.type) {
-            are_equal = 0;
-        } else {
-            switch (a->value.type) {
-            case WORD_VALUE_TYPE_INTEGER:
-                are_equal = a->value.integer == b->value.integer;
-                break;
-            case WORD_VALUE_TYPE_STRING:
-                are_equal = strcmp(a->value.string, b->value.string) == 0;
-                break;
-            default:
-                fatalf("error: unsupported equality compairson for type.\n");
-            }
-        }
-    } else {
-        are_equal = 0;
-    }
-
-    int64_t equality_result    = are_equal;
-    struct word *word_result   = calloc(1, sizeof(*word_result));
-    word_result->type          = WORD_TYPE_VALUE;
-    word_result->value.type    = WORD_VALUE_TYPE_INTEGER;
-    word_result->value.integer = equality_result;
-    stack_push(env->stack, word_result);
+    if (a.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: trying to apply to a non-lambda type\n");
 
-    word_destroy(a);
-    word_destroy(b);
+    environment_call(env, a.lambda);
 }
 
-void __mulfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
+void __printfunction(struct environment *env) {
+    struct value a;
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
+    if (!stack_pop(env->stack, &a))
         fatalf("error: stack_pop failed, empty stack\n");
 
-    if (a->type != WORD_TYPE_VALUE || b->type != WORD_TYPE_VALUE)
-        fatalf("error: trying to add non-value types\n");
+    thread_lock_stream(stdout);
+    print_value(a);
+    printf("\n");
+    thread_unlock_stream(stdout);
+}
 
-    if (a->value.type != WORD_VALUE_TYPE_INTEGER ||
-        b->value.type != WORD_VALUE_TYPE_INTEGER)
-        fatalf("error: trying to add non-capatiable value types\n");
+void __printsfunction(struct environment *env) { stack_print(env->stack); }
 
-    int64_t add_result         = a->value.integer * b->value.integer;
-    struct word *word_result   = calloc(1, sizeof(*word_result));
-    word_result->type          = WORD_TYPE_VALUE;
-    word_result->value.type    = WORD_VALUE_TYPE_INTEGER;
-    word_result->value.integer = add_result;
-    stack_push(env->stack, word_result);
+void __dropfunction(struct environment *env) {
+    stack_top(env->stack, 1);
+    env->stack->ndata--;
+}
+
+void __swapfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-    word_destroy(a);
-    word_destroy(b);
+    struct value a = top[0];
+    top[0]         = top[-1];
+    top[-1]        = a;
 }
 
-void __applyfunction(struct environment *env) {
-    struct word *a;
-    _Bool result;
+void __rotfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 3);
+
+    struct value a = top[-2];
+    top[-2]        = top[-1];
+    top[-1]        = top[0];
+    top[0]         = a;
+}
+
+void __bifunction(struct environment *env) {
+    struct value x, p, q;
 
-    result = stack_pop(env->stack, &a);
-    if (!result)
+    if (!stack_pop(env->stack, &q) || !stack_pop(env->stack, &p) ||
+        !stack_pop(env->stack, &x))
         fatalf("error: stack_pop failed, empty stack\n");
 
-    if (a->type != WORD_TYPE_LAMBDA)
-        fatalf("error: trying to apply to a non-lambda type\n");
+    if (p.type != VALUE_TYPE_LAMBDA || q.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: bi operating on non lambda type.\n");
+
+    /* The quotations may allocate, so they are kept visible to the
+     * collector while they run. */
+    size_t nroots = 2;
+    gc_push_root(env->gc, &p.lambda);
+    gc_push_root(env->gc, &q.lambda);
+    if (x.type == VALUE_TYPE_LAMBDA) {
+        gc_push_root(env->gc, &x.lambda);
+        nroots++;
+    }
 
-    struct environment subenv;
-    environment_copy(&subenv, env);
-    subenv.entry = a->lambda;
-    environment_execute(&subenv);
+    stack_push(env->stack, x);
+    environment_call(env, p.lambda);
 
-    word_destroy(a);
+    stack_push(env->stack, x);
+    environment_call(env, q.lambda);
+
+    gc_pop_root(env->gc, nroots);
 }
 
-void __printfunction(struct environment *env) {
-    struct word *a;
-    _Bool result;
+/* compose and curry build a new quotation while their operands are still
+ * on the stack, where the collector can see and move them, from the words
+ * the operands were written with. */
+void __composefunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-    result = stack_pop(env->stack, &a);
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    if (top[-1].type != VALUE_TYPE_LAMBDA || top[0].type != VALUE_TYPE_LAMBDA)
+        fatalf("error: compose operating on non lambda type.\n");
 
-    print_word(a);
-    printf("\n");
+    size_t asize       = function_source(top[-1].lambda)->size;
+    size_t bsize       = function_source(top[0].lambda)->size;
+    struct function *c = gc_make_quotation(env->gc, top[-1].lambda->symbol,
+                                           asize + bsize);
+
+    top                  = stack_top(env->stack, 2);
+    struct function *afn = function_source(top[-1].lambda);
+    struct function *bfn = function_source(top[0].lambda);
 
-    word_destroy(a);
+    for (size_t i = 0; i < asize; i++)
+        memcpy(c->words[i], afn->words[i], sizeof(struct word));
+
+    for (size_t i = 0; i < bsize; i++)
+        memcpy(c->words[asize + i], bfn->words[i], sizeof(struct word));
+
+    env->stack->ndata--;
+    top[-1].lambda = c;
 }
 
-void __printsfunction(struct environment *env) { stack_print(env->stack); }
+void __curryfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 2);
 
-void __dropfunction(struct environment *env) {
-    struct word *a;
-    _Bool result;
+    if (top[0].type != VALUE_TYPE_LAMBDA)
+        fatalf("error: curry is operating on non lambda type.\n");
 
-    result = stack_pop(env->stack, &a);
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    size_t size = function_source(top[0].lambda)->size;
+    struct function *c =
+        gc_make_quotation(env->gc, top[0].lambda->symbol, size + 1);
 
-    word_destroy(a);
+    top                  = stack_top(env->stack, 2);
+    struct function *bfn = function_source(top[0].lambda);
+
+    word_from_value(c->words[0], top[-1]);
+    for (size_t i = 0; i < size; i++)
+        memcpy(c->words[i + 1], bfn->words[i], sizeof(struct word));
+
+    env->stack->ndata--;
+    top[-1] = (struct value){.type = VALUE_TYPE_LAMBDA, .lambda = c};
 }
 
-void __swapfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
+/* The compiler turns these into jumps when their quotations are literals;
+ * the builtins run the others. */
+static void environment_times(struct environment *env, _Bool indexed) {
+    struct value a, b;
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
+    if (!stack_pop(env->stack, &b) || !stack_pop(env->stack, &a))
         fatalf("error: stack_pop failed, empty stack\n");
 
-    stack_push(env->stack, b);
-    stack_push(env->stack, a);
+    if (a.type != VALUE_TYPE_INTEGER || b.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: times expects an integer and a lambda\n");
+
+    gc_push_root(env->gc, &b.lambda);
+    for (int64_t i = 0; i < a.integer; i++) {
+        if (indexed)
+            stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                                  .integer = i});
+        environment_call(env, b.lambda);
+    }
+    gc_pop_root(env->gc, 1);
 }
 
-void __rotfunction(struct environment *env) {
-    struct word *a, *b, *c;
-    _Bool result;
+void __timesfunction(struct environment *env) { environment_times(env, 0); }
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b),
-                      stack_pop(env->stack, &c));
-    if (!result)
+void __timesifunction(struct environment *env) { environment_times(env, 1); }
+
+/* Pops a condition, which is true unless it is the integer 0. */
+_Bool environment_condition(struct environment *env) {
+    struct value a;
+
+    if (!stack_pop(env->stack, &a))
         fatalf("error: stack_pop failed, empty stack\n");
 
-    stack_push(env->stack, b);
-    stack_push(env->stack, c);
-    stack_push(env->stack, a);
+    if (a.type != VALUE_TYPE_INTEGER)
+        fatalf("error: condition is not an integer.\n");
+
+    return a.integer != 0;
 }
 
-void lambda_copy(struct function *dest, struct function *src) {
-    memcpy(dest, src, sizeof(*dest));
+static struct function *environment_pop_lambda(struct environment *env,
+                                               char const *name) {
+    struct value a;
 
-    dest->words = malloc(sizeof(struct word *) * sizeof(dest->size));
-    for (size_t i = 0; i < dest->size; i++) {
-        dest->words[i] = malloc(sizeof(struct word));
-        memcpy(dest->words[i], src->words[i], sizeof(struct word));
-    }
+    if (!stack_pop(env->stack, &a))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (a.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: %s operating on non lambda type.\n", name);
+
+    return a.lambda;
 }
 
-void word_copy(struct word *dest, struct word *src) {
-    memcpy(dest, src, sizeof(*dest));
+void __iffunction(struct environment *env) {
+    struct function *otherwise = environment_pop_lambda(env, "if");
+    struct function *then      = environment_pop_lambda(env, "if");
 
-    switch (src->type) {
-    case WORD_TYPE_LAMBDA:
-        dest->lambda = malloc(sizeof(struct function));
-        lambda_copy(dest->lambda, src->lambda);
-        break;
-    default:
-        break;
-    }
+    environment_call(env, environment_condition(env) ? then : otherwise);
 }
 
-void __bifunction(struct environment *env) {
-    struct word *a, *b, *c;
-    _Bool result;
+void __whenfunction(struct environment *env) {
+    struct function *then = environment_pop_lambda(env, "when");
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b),
-                      stack_pop(env->stack, &c));
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    if (environment_condition(env))
+        environment_call(env, then);
+}
 
-    if (b->type != WORD_TYPE_LAMBDA || c->type != WORD_TYPE_LAMBDA)
-        fatalf("error: bi operating on non lambda type.\n");
+void __whilefunction(struct environment *env) {
+    struct function *body      = environment_pop_lambda(env, "while");
+    struct function *predicate = environment_pop_lambda(env, "while");
 
-    struct word *d = calloc(1, sizeof(*d));
-    word_copy(d, a);
+    gc_push_root(env->gc, &body);
+    gc_push_root(env->gc, &predicate);
+    while (environment_call(env, predicate), environment_condition(env))
+        environment_call(env, body);
+    gc_pop_root(env->gc, 2);
+}
 
-    stack_push(env->stack, a);
-    stack_push(env->stack, b);
-    __applyfunction(env);
+void __loopfunction(struct environment *env) {
+    struct function *body = environment_pop_lambda(env, "loop");
 
-    stack_push(env->stack, d);
-    stack_push(env->stack, c);
-    __applyfunction(env);
+    gc_push_root(env->gc, &body);
+    do
+        environment_call(env, body);
+    while (environment_condition(env));
+    gc_pop_root(env->gc, 1);
 }
 
-void __composefunction(struct environment *env) {
-    struct word *a, *b, *c;
-    _Bool result;
+void __dupfunction(struct environment *env) {
+    struct value *top = stack_top(env->stack, 1);
+    stack_push(env->stack, *top);
+}
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+struct internal_function internal_functions[] = {
+    {"apply", __applyfunction},
+    {"print", __printfunction},
+    {"prints", __printsfunction},
+    {"dup", __dupfunction},
+    {"swap", __swapfunction},
+    {"rot", __rotfunction},
+    {"bi", __bifunction},
+    {"times", __timesfunction},
+    {"times-i", __timesifunction},
+    {"if", __iffunction},
+    {"when", __whenfunction},
+    {"while", __whilefunction},
+    {"loop", __loopfunction},
+    {"+", __addfunction},
+    {"*", __mulfunction},
+    {".", __dropfunction},
+    {"compose", __composefunction},
+    {"curry", __curryfunction},
+    {"equal?", __equalfunction},
+    {"pbi", __pbifunction},
+    {"pcleave", __pcleavefunction},
+    {"pmap", __pmapfunction},
+    {"preduce", __preducefunction},
+    {"spawn", __spawnfunction},
+    {"join", __joinfunction},
+    {"yield", __yieldfunction},
+    {NULL, NULL}};
+
+struct environment *make_environment(struct image *image, size_t stack_size,
+                                     size_t stack_max) {
+    struct environment *env = calloc(1, sizeof(*env));
+    env->image              = image;
+    env->stack              = calloc(1, sizeof(*env->stack));
+    stack_init(env->stack, stack_size, stack_max);
+    env->gc = malloc(sizeof(*env->gc));
+    gc_init(env->gc, env->stack);
+    env->nesting_max = NESTING_MAXIMUM_DEPTH;
+    return env;
+}
 
-    if (a->type != WORD_TYPE_LAMBDA && b->type != WORD_TYPE_LAMBDA)
-        fatalf("error: compose operating on non lambda type.\n");
+/* Only the run state is released; the image outlives its environments. */
+void environment_destroy(struct environment *env) {
+    stack_destroy(env->stack);
+    free(env->stack);
+    gc_destroy(env->gc);
+    free(env->gc);
+    free(env);
+}
 
-    struct function *afn = a->lambda;
-    struct function *bfn = b->lambda;
+struct image *make_image(void) { return calloc(1, sizeof(struct image)); }
 
-    c         = calloc(1, sizeof(*c));
-    c->type   = WORD_TYPE_LAMBDA;
-    c->lambda = afn;
+/* Does up front what running would otherwise do lazily to the shared
+ * program: the JIT compiles every function it can now, and stops counting
+ * calls. */
+void image_freeze(struct image *image) {
+    if (image->program)
+        jit_freeze(image->program);
+}
 
-    for (size_t i = 0; i < bfn->size; i++) {
-        function_add_word(c->lambda, bfn->words[i]);
-    }
+/* Takes over everything the program allocator holds, once the front end
+ * is done with the program, so that images built one after the other can
+ * be released separately. */
+void image_own(struct image *image) {
+    image->allocator  = program_allocator;
+    program_allocator = (struct allocator){0};
+}
 
-    stack_push(env->stack, c);
+void image_destroy(struct image *image) {
+    /* Every word, function and string of the program lives in its
+     * allocator, so they are released together instead of one by one. */
+    allocator_reset(&image->allocator);
 
-    word_destroy(a);
-    word_destroy(b);
+    free(image->globals);
+    free(image->lookup);
+    free(image);
 }
 
-void __curryfunction(struct environment *env) {
-    struct word *a, *b, *c;
-    _Bool result;
+/* Symbol ids are dense, so a multiplicative hash spreads them over the
+ * table without collisions until it wraps around. */
+static size_t image_slot(uint32_t symbol, size_t capacity) {
+    return (symbol * 2654435769u) & (capacity - 1);
+}
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+static void image_rehash(struct image *image, size_t capacity) {
+    struct global_slot *old = image->lookup;
+    size_t old_capacity     = image->lookup_capacity;
 
-    if (b->type != WORD_TYPE_LAMBDA)
-        fatalf("error: curry is operating on non lambda type.\n");
+    image->lookup          = calloc(capacity, sizeof(struct global_slot));
+    image->lookup_capacity = capacity;
+    if (!image->lookup)
+        fatalf("error: could not allocate global lookup table.\n");
 
-    struct function *bfn = b->lambda;
-    c                    = calloc(1, sizeof(*c));
-    c->type              = WORD_TYPE_LAMBDA;
-    c->lambda            = bfn;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].symbol == SYMBOL_NONE)
+            continue;
 
-    function_add_word(c->lambda, a);
-    struct word *temp   = c->lambda->words[0];
-    c->lambda->words[0] = c->lambda->words[c->lambda->size - 1];
-    c->lambda->words[c->lambda->size - 1] = temp;
+        size_t j = image_slot(old[i].symbol, capacity);
+        while (image->lookup[j].symbol != SYMBOL_NONE)
+            j = (j + 1) & (capacity - 1);
 
-    stack_push(env->stack, c);
+        image->lookup[j] = old[i];
+    }
 
-    word_destroy(a);
-    word_destroy(b);
+    free(old);
 }
 
-void __timesfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
+/* Binds symbol to word unless the symbol is already bound, in which case
+ * the first definition is kept and 0 is returned. */
+_Bool image_define(struct image *image, uint32_t symbol, struct word *word) {
+    if ((image->lookup_size + 1) * 2 > image->lookup_capacity)
+        image_rehash(image,
+                     image->lookup_capacity ? image->lookup_capacity * 2 : 64);
 
-    result = any_fail(2, stack_pop(env->stack, &a), stack_pop(env->stack, &b));
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    size_t mask = image->lookup_capacity - 1;
+    size_t i    = image_slot(symbol, image->lookup_capacity);
 
-    if (a->type != WORD_TYPE_VALUE ||
-        (a->type == WORD_TYPE_VALUE &&
-         a->value.type != WORD_VALUE_TYPE_INTEGER) ||
-        b->type != WORD_TYPE_LAMBDA)
-        fatalf("error: times expects an integer and a lambda\n");
+    for (; image->lookup[i].symbol != SYMBOL_NONE; i = (i + 1) & mask) {
+        if (image->lookup[i].symbol == symbol)
+            return 0;
+    }
 
-    for (int64_t i = 0; i < a->value.integer; i++) {
-        struct word *c = calloc(1, sizeof(*c));
-        word_copy(c, b);
+    image->lookup[i].symbol = symbol;
+    image->lookup[i].word   = word;
+    image->lookup_size++;
+    return 1;
+}
+
+struct word *image_lookup(struct image *image, uint32_t symbol) {
+    if (image->lookup_capacity == 0)
+        return NULL;
+
+    size_t mask = image->lookup_capacity - 1;
+    size_t i    = image_slot(symbol, image->lookup_capacity);
 
-        stack_push(env->stack, c);
-        __applyfunction(env);
+    for (; image->lookup[i].symbol != SYMBOL_NONE; i = (i + 1) & mask) {
+        if (image->lookup[i].symbol == symbol)
+            return image->lookup[i].word;
     }
 
-    word_destroy(a);
-    word_destroy(b);
+    return NULL;
 }
 
-void __dupfunction(struct environment *env) {
-    struct word *a, *b;
-    _Bool result;
+#ifdef ENABLE_FFI
+void environment_call_ffi(struct environment *env, struct ffi_function *fn) {
+    struct value args[fn->nargs];
+    void *values[fn->nargs];
 
-    b      = malloc(sizeof(*a));
-    result = stack_pop(env->stack, &a);
-    if (!result)
-        fatalf("error: stack_pop failed, empty stack\n");
+    for (int i = 0; i < fn->nargs; i++) {
+        if (!stack_pop(env->stack, &args[i]))
+            fatalf("error: stack_pop failed, empty stack\n");
 
-    b = malloc(sizeof(*a));
-    word_copy(b, a);
+        switch (args[i].type) {
+        case VALUE_TYPE_INTEGER:
+            values[i] = &args[i].integer;
+            break;
+        case VALUE_TYPE_STRING:
+            values[i] = &args[i].string;
+            break;
+        default:
+            fatalf("error: ffi functions only accept values.\n");
+        }
+    }
+
+    ffi_arg result;
+    ffi_call(&fn->cif, fn->fn, &result, values);
 
-    stack_push(env->stack, a);
-    stack_push(env->stack, b);
+    stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                          .integer = (int64_t)result});
 }
+#endif
 
-struct environment *make_environment() {
-    struct environment *env = calloc(1, sizeof(*env));
-    env->stack              = calloc(1, sizeof(*env->stack));
-    return env;
+/* A call in progress in the tree walker: the function being run and the
+ * position of its next word. */
+struct frame {
+    struct function *function;
+    size_t position;
+};
+
+#define FRAMES_INLINE 32
+
+/* The frame stack of one running tree walker, registered with the
+ * collector because frames may run quotations it owns, and as the error
+ * location. */
+struct walker {
+    struct gc_roots roots;
+    struct error_location location;
+    struct frame *frames;
+    size_t nframes;
+};
+
+static void walker_visit(struct gc *gc, struct gc_roots *roots) {
+    struct walker *walker = (struct walker *)roots;
+
+    for (size_t i = 0; i < walker->nframes; i++)
+        gc_visit(gc, &walker->frames[i].function);
 }
 
-void environment_copy(struct environment dest[static 1],
-                      struct environment src[static 1]) {
-    memcpy(dest, src, sizeof(struct environment));
+static void walker_report(struct error_location *location) {
+    struct walker *walker =
+        (struct walker *)((char *)location - offsetof(struct walker, location));
+
+    if (walker->nframes == 0)
+        return;
+
+    struct frame *frame = &walker->frames[walker->nframes - 1];
+    struct word *word   = frame->function->words[frame->position - 1];
+    report_location(frame->function, word->origin);
 }
 
-void environment_execute(struct environment *env) {
-    for (int i = 0; i < env->entry->size; i++) {
-        struct word *w = env->entry->words[i];
+/* Runs function and everything it calls from one loop over an explicit
+ * frame stack, so the depth of the program's calls does not grow the C
+ * stack. A call that is the last word of its caller replaces the caller's
+ * frame instead of pushing a new one. */
+void environment_call(struct environment *env, struct function *function) {
+    fiber_count(env);
+
+    /* The runs the builtins start are nested on the C stack, unlike the
+     * calls within each run. */
+    if (env->nesting == env->nesting_max)
+        fatalf("error: call stack overflow, more than %zu nested runs.\n",
+               env->nesting_max);
+
+    env->nesting++;
+
+    if (function->compiled) {
+        struct stack *stack = env->stack;
+        struct value *top =
+            function->compiled(env, stack->data + stack->ndata);
+        stack->ndata = (size_t)(top - stack->data);
+        env->nesting--;
+        return;
+    }
+
+    if (function->code) {
+        vm_execute(env, function);
+        env->nesting--;
+        return;
+    }
+
+    struct frame inline_frames[FRAMES_INLINE];
+    struct walker walker = {
+        {walker_visit, NULL}, {walker_report, error_location}, inline_frames,
+        1};
+    size_t capacity = FRAMES_INLINE;
+
+    inline_frames[0] = (struct frame){function, 0};
+    gc_add_roots(env->gc, &walker.roots);
+    error_location = &walker.location;
+
+    while (walker.nframes) {
+        struct frame *frame = &walker.frames[walker.nframes - 1];
+
+        if (frame->position == frame->function->size) {
+            walker.nframes--;
+            continue;
+        }
+
+        struct word *w          = frame->function->words[frame->position++];
+        struct function *callee = NULL;
 
         switch (w->type) {
         case WORD_TYPE_LAMBDA:
-        case WORD_TYPE_VALUE: {
-            struct word *w_copy = calloc(1, sizeof(*w_copy));
-            word_copy(w_copy, w);
-
-            stack_push(env->stack, w_copy);
+        case WORD_TYPE_VALUE:
+            stack_push(env->stack, value_from_word(w));
             break;
-        }
         case WORD_TYPE_FUNCTION:
             if (w->function.type == FUNCTION_TYPE_CFUNCTION) {
-                w->function.cfn.function(env);
-            } else if (w->function.type == FUNCTION_TYPE_REGULAR) {
-                struct environment subenv;
-                environment_copy(&subenv, env);
-                subenv.entry = w->function.fn;
-                environment_execute(&subenv);
-            } else if (w->function.type == FUNCTION_TYPE_FFI) {
-#ifdef ENABLE_FFI
-                struct ffi_function *fn = w->function.ffi_fn;
-                void *values[fn->nargs];
-
-                for (int i = 0; i < fn->nargs; i++) {
-                    struct word *a;
+                cfunction cfn = w->function.cfn.function;
 
+                /* apply, if and when run their quotation in a frame, so
+                 * that calls in tail position there do not nest. */
+                if (cfn == __applyfunction) {
+                    struct value a;
                     if (!stack_pop(env->stack, &a))
                         fatalf("error: stack_pop failed, empty stack\n");
 
-                    if (a->type != WORD_TYPE_VALUE)
-                        fatalf("error: ffi functions only accept values.\n");
-
-                    switch (a->value.type) {
-                    case WORD_VALUE_TYPE_INTEGER:
-                        values[i] = &(a->value.integer);
-                        break;
-                    case WORD_VALUE_TYPE_STRING:
-                        values[i] = &(a->value.string);
-                        break;
-                    default:
-                        fatalf("error: unsupported word value type for ffi\n");
-                    }
-
-                    // free(a);
-                }
+                    if (a.type != VALUE_TYPE_LAMBDA)
+                        fatalf(
+                            "error: trying to apply to a non-lambda type\n");
+
+                    callee = a.lambda;
+                } else if (cfn == __iffunction) {
+                    struct function *otherwise =
+                        environment_pop_lambda(env, "if");
+                    struct function *then = environment_pop_lambda(env, "if");
 
-                ffi_arg result;
-                ffi_call(&fn->cif, fn->fn, &result, values);
+                    callee = environment_condition(env) ? then : otherwise;
+                } else if (cfn == __whenfunction) {
+                    struct function *then = environment_pop_lambda(env, "when");
 
-                struct word *word_result   = calloc(1, sizeof(*word_result));
-                word_result->type          = WORD_TYPE_VALUE;
-                word_result->value.type    = WORD_VALUE_TYPE_INTEGER;
-                word_result->value.integer = result;
-                stack_push(env->stack, word_result);
+                    if (environment_condition(env))
+                        callee = then;
+                } else {
+                    cfn(env);
+                }
+            } else if (w->function.type == FUNCTION_TYPE_REGULAR) {
+                callee = w->function.fn;
+            } else if (w->function.type == FUNCTION_TYPE_FFI) {
+#ifdef ENABLE_FFI
+                environment_call_ffi(env, w->function.ffi_fn);
 #else
                 fatalf("FFI support not enabled.");
 #endif
             }
             break;
         }
+
+        if (!callee)
+            continue;
+
+        fiber_count(env);
+        if (frame->position == frame->function->size) {
+            walker.nframes--;
+        } else if (walker.nframes == capacity) {
+            if (capacity >= CALL_STACK_MAXIMUM_DEPTH)
+                fatalf("error: call stack overflow, more than %zu calls.\n",
+                       capacity);
+
+            capacity *= 2;
+            if (walker.frames == inline_frames) {
+                walker.frames = malloc(sizeof(struct frame) * capacity);
+                memcpy(walker.frames, inline_frames, sizeof(inline_frames));
+            } else {
+                walker.frames =
+                    realloc(walker.frames, sizeof(struct frame) * capacity);
+            }
+        }
+
+        walker.frames[walker.nframes++] = (struct frame){callee, 0};
     }
+
+    error_location = walker.location.prev;
+    gc_remove_roots(env->gc, &walker.roots);
+    if (walker.frames != inline_frames)
+        free(walker.frames);
+    env->nesting--;
+}
+
+void environment_execute(struct environment *env) {
+    environment_call(env, env->image->entry);
 }
\ No newline at end of file
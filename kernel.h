@@ -8,15 +8,82 @@
 #include <windows.h>
 #endif
 
+#include "allocator.h"
 #include "parser.h"
+#include "symbol.h"
 
 struct word;
+struct gc;
+struct environment;
+struct value;
+struct error_location;
+struct fiber;
+
+enum function_space {
+    FUNCTION_SPACE_PROGRAM,
+    FUNCTION_SPACE_NURSERY,
+    FUNCTION_SPACE_OLD
+};
+
+enum stack_effect_state {
+    STACK_EFFECT_UNCHECKED,
+    STACK_EFFECT_CHECKING,
+    STACK_EFFECT_KNOWN,
+    STACK_EFFECT_UNKNOWN,
+};
+
+/* What running a function does to the stack, as found by the checker: it
+ * takes in values, leaves out values, and holds at most peak values above
+ * the height it was entered at. Only meaningful when the state is known. */
+struct stack_effect {
+    enum stack_effect_state state;
+    uint32_t in;
+    uint32_t out;
+    uint32_t peak;
+};
 
 struct function {
-    char *name;
+    uint32_t symbol;
     struct word **words;
     size_t size;
     size_t capacity;
+
+    /* The words of a quotation as it was written, which printing shows,
+     * if the optimizer rewrote them; NULL otherwise. */
+    struct function *source;
+
+    /* Filled in by the compiler; code is NULL until the function has been
+     * lowered to bytecode, in which case the tree walker is used. */
+    uint32_t *code;
+    size_t code_size;
+    size_t code_capacity;
+    uint32_t index;
+
+    /* For each instruction, the symbol of the function whose source it was
+     * compiled from, which differs from symbol for inlined code. */
+    uint32_t *origins;
+
+    struct stack_effect effect;
+
+    /* The VM's direct-threaded translation of code, built on first call. */
+    void *threaded;
+
+    /* Calls and backward jumps counted by the VM until the JIT compiles
+     * the function, after which native holds its machine code. */
+    uint32_t calls;
+    void *native;
+
+    /* In a program translated to C by --emit-c, the C function the
+     * function was translated to, which environment_call runs instead. It
+     * takes and returns the top of the stack, past the last value. */
+    struct value *(*compiled)(struct environment *env, struct value *top);
+
+    /* Where the function lives: in the program, or for a quotation built
+     * at run time, in one of the collector's spaces. gc_next links the old
+     * space, or forwards a nursery object that has been promoted. */
+    enum function_space space;
+    _Bool marked;
+    struct function *gc_next;
 };
 
 enum word_type { WORD_TYPE_LAMBDA, WORD_TYPE_VALUE, WORD_TYPE_FUNCTION };
@@ -36,13 +103,12 @@ struct word_value {
     };
 };
 
-struct environment;
-
 typedef void (*cfunction)(struct environment *env);
 
 struct internal_function {
     char const *name;
     cfunction function;
+    uint32_t symbol;
 };
 
 enum function_type {
@@ -53,7 +119,8 @@ enum function_type {
 
 #ifdef ENABLE_FFI
 struct ffi_function {
-    char *name;
+    uint32_t symbol;
+    char *module;
     ffi_cif cif;
     ffi_type *args[8];
     ffi_type ret_type;
@@ -80,24 +147,140 @@ struct word {
         struct word_value value;
         struct word_function function;
     };
+
+    /* The definition the word was written in, kept when it is inlined. */
+    uint32_t origin;
+
+    /* Set by the checker when the operands of a builtin are proven to be on
+     * the stack and of the right types, so the checks can be skipped. */
+    _Bool unchecked;
 };
 
-#define NDATA 256
+enum value_type { VALUE_TYPE_INTEGER, VALUE_TYPE_STRING, VALUE_TYPE_LAMBDA };
+
+/* A stack slot. Values are passed and stored by copy; strings are borrowed
+ * from the program and lambdas are either part of the program or owned by
+ * the collector. */
+struct value {
+    enum value_type type;
+    union {
+        int64_t integer;
+        char *string;
+        struct function *lambda;
+    };
+};
+
+/* Integer arithmetic wraps around on overflow, the same way in every
+ * engine and in the optimizer, which folds it ahead of time. */
+static inline int64_t integer_add(int64_t a, int64_t b) {
+    return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static inline int64_t integer_mul(int64_t a, int64_t b) {
+    return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+
+#define STACK_INITIAL_DEPTH 256
+#define STACK_MAXIMUM_DEPTH (1 << 20)
+#define STACK_ALIGNMENT 64
+
+#define CALL_STACK_MAXIMUM_DEPTH (1 << 20)
+
+/* How many runs of quotations that builtins such as times, bi or while
+ * start may be nested in an environment. Each run takes a few kilobytes
+ * of C stack, so this stays well within the stack of a main thread. */
+#define NESTING_MAXIMUM_DEPTH 1024
+
+/* The data stack is a contiguous, cache-line aligned buffer of capacity
+ * values that doubles on overflow, up to max values. */
 struct stack {
-    struct word *data[NDATA];
+    struct value *data;
     size_t ndata;
+    size_t capacity;
+    size_t max;
 };
 
-struct environment {
+struct global_slot {
+    uint32_t symbol;
+    struct word *word;
+};
+
+/* The output of the compiler: every compiled function and lambda indexed
+ * by struct function.index, the constant pool referenced by OP_PUSH_CONST
+ * and the foreign function words referenced by OP_CALL_FFI. Once frozen,
+ * nothing in it is written to anymore, not even by the JIT. */
+struct program {
+    struct function **functions;
+    size_t functions_size;
+    size_t functions_capacity;
+    struct value *constants;
+    size_t constants_size;
+    size_t constants_capacity;
+    struct word **ffi_functions;
+    size_t ffi_functions_size;
+    size_t ffi_functions_capacity;
+    _Bool frozen;
+};
+
+/* A parsed program: its definitions, its entry point and, once compiled,
+ * its bytecode. The front end builds it; after image_freeze it is only
+ * read, so any number of environments on any number of threads can run
+ * it at once without locking. The words, functions and strings the front
+ * end allocated are handed over to the image by image_own. */
+struct image {
+    struct program *program;
     struct word **globals;
     size_t globals_capacity;
     size_t globals_size;
+    struct global_slot *lookup;
+    size_t lookup_capacity;
+    size_t lookup_size;
     struct function *entry;
+    struct allocator allocator;
+};
+
+/* One run of an image, used by one thread at a time: the data stack, the
+ * collector owning the quotations built at run time, how many native
+ * calls and runs of quotations are nested and how many of the latter the
+ * C stack it runs on allows, and where the running thread keeps its error
+ * location, which native code updates directly. A fiber's environment
+ * also counts down the calls it may make before it is preempted. */
+struct environment {
+    struct image *image;
     struct stack *stack;
+    struct gc *gc;
+    size_t native_depth;
+    size_t nesting;
+    size_t nesting_max;
+    struct error_location **error_location;
+    struct fiber *fiber;
+    uint32_t budget;
 };
 
-_Bool stack_pop(struct stack *stack, struct word **out);
-void stack_push(struct stack *stack, struct word *in);
+extern struct internal_function internal_functions[];
+
+void stack_init(struct stack *stack, size_t capacity, size_t max);
+void stack_destroy(struct stack *stack);
+void stack_grow(struct stack *stack);
+_Bool stack_pop(struct stack *stack, struct value *out);
+
+static inline void stack_push(struct stack *stack, struct value in) {
+    if (stack->ndata == stack->capacity)
+        stack_grow(stack);
+
+    stack->data[stack->ndata++] = in;
+}
+void stack_print(struct stack *stack);
+
+struct value value_from_word(struct word *word);
+void print_word(struct word *word);
+void print_value(struct value value);
+
+/* The words function was written with, which printing shows and the
+ * quotations built from it at run time are made of. */
+static inline struct function *function_source(struct function *function) {
+    return function->source ? function->source : function;
+}
 
 void __addfunction(struct environment *env);
 void __mulfunction(struct environment *env);
@@ -108,6 +291,11 @@ void __dupfunction(struct environment *env);
 void __swapfunction(struct environment *env);
 void __bifunction(struct environment *env);
 void __timesfunction(struct environment *env);
+void __timesifunction(struct environment *env);
+void __iffunction(struct environment *env);
+void __whenfunction(struct environment *env);
+void __whilefunction(struct environment *env);
+void __loopfunction(struct environment *env);
 void __rotfunction(struct environment *env);
 void __composefunction(struct environment *env);
 void __curryfunction(struct environment *env);
@@ -115,9 +303,35 @@ void __printsfunction(struct environment *env);
 void __equalfunction(struct environment *env);
 void __putstestffifunction(struct environment *env);
 
-void environment_copy(struct environment *dest, struct environment *src);
+/* The parallel combinators, in parallel.c, which run their quotations as
+ * tasks of the worker pool. They only give the same results as running
+ * them in turn for quotations without side effects. */
+void __pbifunction(struct environment *env);
+void __pcleavefunction(struct environment *env);
+void __pmapfunction(struct environment *env);
+void __preducefunction(struct environment *env);
+
+/* The fiber builtins, in fiber.c. */
+void __spawnfunction(struct environment *env);
+void __joinfunction(struct environment *env);
+void __yieldfunction(struct environment *env);
+
+_Bool image_define(struct image *image, uint32_t symbol, struct word *word);
+struct word *image_lookup(struct image *image, uint32_t symbol);
+struct image *make_image(void);
+void image_freeze(struct image *image);
+void image_own(struct image *image);
+void image_destroy(struct image *image);
+
+void environment_call(struct environment *env, struct function *function);
+_Bool environment_condition(struct environment *env);
 void environment_execute(struct environment *env);
-struct environment *make_environment();
+#ifdef ENABLE_FFI
+void environment_call_ffi(struct environment *env, struct ffi_function *fn);
+#endif
+struct environment *make_environment(struct image *image, size_t stack_size,
+                                     size_t stack_max);
+void environment_destroy(struct environment *env);
 
 void word_copy(struct word *dest, struct word *src);
 void word_value_destroy(struct word *word);
@@ -126,6 +340,7 @@ void word_lambda_destroy(struct word *word);
 void word_destroy(struct word *word);
 
 void function_destroy(struct function *function);
+void report_location(struct function *function, uint32_t origin);
 void function_add_word(struct function *function, struct word *word);
 
 #endif
\ No newline at end of file
@@ -1,46 +1,159 @@
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #include "error.h"
 #include "lexer.h"
+#include "symbol.h"
 
-struct token *token_make(enum token_type type, struct cursor *cursor,
-                         char const *lexeme) {
-    struct token *token = calloc(1, sizeof(*token));
-    if (!token)
-        return NULL;
+enum char_class {
+    CHAR_CLASS_SPACE  = 1 << 0,
+    CHAR_CLASS_DIGIT  = 1 << 1,
+    CHAR_CLASS_ALPHA  = 1 << 2,
+    CHAR_CLASS_IDENT  = 1 << 3,
+    CHAR_CLASS_SYNTAX = 1 << 4,
+    CHAR_CLASS_QUOTE  = 1 << 5
+};
 
-    token->type = type;
+static unsigned char char_classes[256];
 
-    memcpy(&token->cursor, cursor, sizeof(*cursor));
-    token->lexeme = lexeme;
-    return token;
-}
+static void char_classes_init(void) {
+    if (char_classes['0'])
+        return;
 
-void token_destroy(struct token *token) {
-    free(token->lexeme);
+    char const *spaces = " \t\n\v\f\r";
+    for (; *spaces; spaces++)
+        char_classes[(unsigned char)*spaces] = CHAR_CLASS_SPACE;
 
-    if (token->type == TOKEN_TYPE_LITERAL) {
-        switch (token->type) {
-        case LITERAL_TYPE_STRING:
-            free(token->literal.string);
-            break;
-        }
+    for (int c = '0'; c <= '9'; c++)
+        char_classes[c] = CHAR_CLASS_DIGIT | CHAR_CLASS_IDENT;
+
+    for (int c = 'a'; c <= 'z'; c++) {
+        char_classes[c]             = CHAR_CLASS_ALPHA | CHAR_CLASS_IDENT;
+        char_classes[c - 'a' + 'A'] = CHAR_CLASS_ALPHA | CHAR_CLASS_IDENT;
     }
 
+    char const *ident = "-?!@";
+    for (; *ident; ident++)
+        char_classes[(unsigned char)*ident] = CHAR_CLASS_IDENT;
+
+    char const *syntax = "[]:;+.";
+    for (; *syntax; syntax++)
+        char_classes[(unsigned char)*syntax] = CHAR_CLASS_SYNTAX;
+
+    char_classes['*'] = CHAR_CLASS_SYNTAX | CHAR_CLASS_IDENT;
+    char_classes['"'] = CHAR_CLASS_QUOTE;
+}
+
+static inline unsigned char char_class(char c) {
+    return char_classes[(unsigned char)c];
+}
+
+/* The vector scanners classify a whole block at once and return one bit
+ * per byte. Each class test is a handful of compares: ranges such as
+ * 'a'..'z' are checked with a wrapping subtract followed by an unsigned
+ * saturating subtract, which is zero exactly for bytes inside the range. */
+#if defined(__AVX2__)
+#define LEXER_BLOCK 32
+typedef __m256i lexer_vector;
+#define vector_load(p)    _mm256_loadu_si256((__m256i const *)(p))
+#define vector_set(c)     _mm256_set1_epi8((char)(c))
+#define vector_eq(a, b)   _mm256_cmpeq_epi8((a), (b))
+#define vector_or(a, b)   _mm256_or_si256((a), (b))
+#define vector_sub(a, b)  _mm256_sub_epi8((a), (b))
+#define vector_subs(a, b) _mm256_subs_epu8((a), (b))
+#define vector_mask(a)    ((uint32_t)_mm256_movemask_epi8((a)))
+#elif defined(__SSE2__) || defined(_M_X64)
+#define LEXER_BLOCK 16
+typedef __m128i lexer_vector;
+#define vector_load(p)    _mm_loadu_si128((__m128i const *)(p))
+#define vector_set(c)     _mm_set1_epi8((char)(c))
+#define vector_eq(a, b)   _mm_cmpeq_epi8((a), (b))
+#define vector_or(a, b)   _mm_or_si128((a), (b))
+#define vector_sub(a, b)  _mm_sub_epi8((a), (b))
+#define vector_subs(a, b) _mm_subs_epu8((a), (b))
+#define vector_mask(a)    ((uint32_t)_mm_movemask_epi8((a)))
+#endif
+
+#ifdef LEXER_BLOCK
+#define LEXER_BLOCK_FULL ((uint32_t)(((uint64_t)1 << LEXER_BLOCK) - 1))
+
+static inline lexer_vector vector_in_range(lexer_vector v, char lo, char hi) {
+    lexer_vector offset = vector_sub(v, vector_set(lo));
+    return vector_eq(vector_subs(offset, vector_set(hi - lo)), vector_set(0));
+}
+
+static inline uint32_t block_space_mask(char const *p) {
+    lexer_vector v = vector_load(p);
+    return vector_mask(
+        vector_or(vector_eq(v, vector_set(' ')), vector_in_range(v, 9, 13)));
+}
+
+static inline uint32_t block_newline_mask(char const *p) {
+    return vector_mask(vector_eq(vector_load(p), vector_set('\n')));
+}
+
+static inline uint32_t block_quote_mask(char const *p) {
+    return vector_mask(vector_eq(vector_load(p), vector_set('"')));
+}
+
+static inline uint32_t block_digit_mask(char const *p) {
+    return vector_mask(vector_in_range(vector_load(p), '0', '9'));
+}
+
+static inline uint32_t block_ident_mask(char const *p) {
+    lexer_vector v     = vector_load(p);
+    lexer_vector lower = vector_or(v, vector_set(0x20));
+    lexer_vector alpha = vector_in_range(lower, 'a', 'z');
+    lexer_vector punct =
+        vector_or(vector_or(vector_eq(v, vector_set('-')),
+                            vector_eq(v, vector_set('?'))),
+                  vector_or(vector_or(vector_eq(v, vector_set('!')),
+                                      vector_eq(v, vector_set('@'))),
+                            vector_eq(v, vector_set('*'))));
+    return vector_mask(
+        vector_or(vector_or(alpha, vector_in_range(v, '0', '9')), punct));
+}
+
+static inline unsigned count_trailing_zeros(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
+
+static inline unsigned count_leading_zeros(uint32_t mask) {
+    return __builtin_clz(mask);
+}
+
+static inline unsigned count_ones(uint32_t mask) {
+    return __builtin_popcount(mask);
+}
+#endif
+
+void token_init(struct token *token, enum token_type type,
+                struct cursor *cursor, char const *lexeme, size_t length) {
     memset(token, 0, sizeof(*token));
-    free(token);
+    token->type = type;
+
+    memcpy(&token->cursor, cursor, sizeof(*cursor));
+    token->lexeme = lexeme;
+    token->length = length;
 }
 
-struct token *token_make_syntax(char c, struct cursor *cursor) {
-    struct token *token = calloc(1, sizeof(*token));
-    if (!token)
-        return NULL;
+_Bool token_is(struct token const *token, char const *string) {
+    size_t length = strlen(string);
+    return token->length == length &&
+           memcmp(token->lexeme, string, length) == 0;
+}
 
+void token_init_syntax(struct token *token, char const *lexeme,
+                       struct cursor *cursor) {
     enum token_type type;
 
-    switch (c) {
+    switch (*lexeme) {
     case '[':
         type = TOKEN_TYPE_LEFT_BRACKET;
         break;
@@ -60,186 +173,236 @@ struct token *token_make_syntax(char c, struct cursor *cursor) {
         type = TOKEN_TYPE_IDENTIFIER;
         break;
     default:
-        fatalf("recieved non-syntax token in token_make_syntax '%c'\n", c);
+        fatalf("recieved non-syntax token in token_init_syntax '%c'\n",
+               *lexeme);
     }
 
-    token->type = type;
-    memcpy(&token->cursor, cursor, sizeof(*cursor));
-
-    char *lexeme = malloc(sizeof(char) * 2);
-    lexeme[0]    = c;
-    lexeme[1]    = '\0';
+    token_init(token, type, cursor, lexeme, 1);
 
-    token->lexeme = lexeme;
-    return token;
+    if (type == TOKEN_TYPE_IDENTIFIER)
+        token->symbol = symbol_intern(lexeme, 1);
 }
 
-void tokens_prepend(struct token **tokens, struct token *token) {
-    struct token *head = *tokens;
-    token->next        = head;
-    *tokens            = token;
-}
+void tokens_init(struct tokens *tokens, size_t capacity) {
+    if (capacity == 0)
+        capacity = 1;
 
-void tokens_reverse(struct token **tokens) {
-    struct token *current = *tokens;
-    struct token *prev = NULL, *next = NULL;
+    tokens->data = malloc(sizeof(struct token) * capacity);
+    if (!tokens->data)
+        fatalf("error: could not allocate %zu tokens.\n", capacity);
 
-    while (current != NULL) {
-        next          = current->next;
-        current->next = prev;
+    tokens->size     = 0;
+    tokens->capacity = capacity;
+}
 
-        prev    = current;
-        current = next;
+void tokens_destroy(struct tokens *tokens) {
+    free(tokens->data);
+    memset(tokens, 0, sizeof(*tokens));
+}
+
+struct token *tokens_push(struct tokens *tokens) {
+    if (tokens->size == tokens->capacity) {
+        tokens->capacity *= 2;
+        tokens->data =
+            realloc(tokens->data, sizeof(struct token) * tokens->capacity);
+        if (!tokens->data)
+            fatalf("error: could not allocate %zu tokens.\n",
+                   tokens->capacity);
     }
 
-    *tokens = prev;
+    return &tokens->data[tokens->size++];
 }
 
-void tokens_pop(struct token **tokens, struct token **out) {
-    struct token *head = *tokens;
+char lexer_peek(struct lexer *lexer) {
+    return lexer->source < lexer->end ? *lexer->source : '\0';
+}
 
-    if (!head) {
-        *out = NULL;
-    } else {
-        *tokens = head->next;
-        *out    = head;
-    }
+void lexer_init(struct lexer *lexer) {
+    memset(lexer, 0, sizeof(*lexer));
+    char_classes_init();
 }
 
-char lexer_advance(struct lexer *lexer) {
-    char c = *lexer->source;
-    if (c == '\n') {
-        lexer->cursor.line++;
-        lexer->cursor.column = 0;
-    } else {
-        lexer->cursor.column++;
-    }
+struct cursor lexer_cursor(struct lexer *lexer) {
+    struct cursor cursor = {lexer->line,
+                            (size_t)(lexer->source - lexer->line_start)};
+    return cursor;
+}
 
-    if (c != '\0') {
-        lexer->source++;
+/* Records the newlines found in [from, to) so cursors can be computed from
+ * the current line start instead of being updated for every byte. */
+static void lexer_count_lines(struct lexer *lexer, char const *from,
+                              char const *to) {
+    for (char const *p = from; p < to; p++) {
+        if (*p == '\n') {
+            lexer->line++;
+            lexer->line_start = p + 1;
+        }
     }
-
-    return c;
 }
 
-char lexer_peek(struct lexer *lexer) { return *lexer->source; }
+void lexer_skip_whitespace(struct lexer *lexer) {
+    char const *p = lexer->source;
+
+#ifdef LEXER_BLOCK
+    if (!lexer->scalar) {
+        while (lexer->end - p >= LEXER_BLOCK) {
+            uint32_t space    = block_space_mask(p);
+            uint32_t newlines = block_newline_mask(p);
+            unsigned run      = LEXER_BLOCK;
+
+            if (space != LEXER_BLOCK_FULL) {
+                run = count_trailing_zeros(~space);
+                newlines &= ((uint32_t)1 << run) - 1;
+            }
+
+            if (newlines) {
+                lexer->line += count_ones(newlines);
+                lexer->line_start = p + 32 - count_leading_zeros(newlines);
+            }
+
+            p += run;
+            if (run != LEXER_BLOCK) {
+                lexer->source = p;
+                return;
+            }
+        }
+    }
+#endif
 
-void lexer_init(struct lexer *lexer) { memset(lexer, 0, sizeof(*lexer)); }
+    char const *start = p;
+    while (p < lexer->end && (char_class(*p) & CHAR_CLASS_SPACE))
+        p++;
 
-_Bool isvalid_ident(char c) {
-    return isalpha(c) || isdigit(c) || c == '-' || c == '?' || c == '!' ||
-           c == '@' || c == '*';
+    lexer_count_lines(lexer, start, p);
+    lexer->source = p;
 }
 
-struct token *lexer_lex_identifier(struct lexer *lexer) {
-    size_t length        = 0;
-    struct cursor cursor = lexer->cursor;
-    char c;
-
-    while (isvalid_ident(c = lexer_peek(lexer))) {
-        length++;
-        lexer_advance(lexer);
+/* Returns the first character at or after p that is not in class. */
+static char const *lexer_scan_class(struct lexer *lexer, char const *p,
+                                    enum char_class class) {
+#ifdef LEXER_BLOCK
+    if (!lexer->scalar) {
+        while (lexer->end - p >= LEXER_BLOCK) {
+            uint32_t mask = class == CHAR_CLASS_DIGIT ? block_digit_mask(p)
+                                                      : block_ident_mask(p);
+            if (mask != LEXER_BLOCK_FULL)
+                return p + count_trailing_zeros(~mask);
+
+            p += LEXER_BLOCK;
+        }
     }
+#endif
 
-    char *identifier = malloc(sizeof(char) * (length + 1));
-    if (!identifier)
-        return NULL;
-
-    identifier[length] = '\0';
-
-    memcpy(identifier, lexer->source - length, sizeof(char) * length);
+    while (p < lexer->end && (char_class(*p) & class))
+        p++;
 
-    struct token *token =
-        token_make(TOKEN_TYPE_IDENTIFIER, &cursor, identifier);
-    return token;
+    return p;
 }
 
-struct token *lexer_lex_string(struct lexer *lexer) {
-    size_t length        = 0;
-    struct cursor cursor = lexer->cursor;
-    char c;
+void lexer_lex_identifier(struct lexer *lexer, struct token *token) {
+    struct cursor cursor = lexer_cursor(lexer);
+    char const *start    = lexer->source;
 
-    lexer_advance(lexer);
+    lexer->source = lexer_scan_class(lexer, start, CHAR_CLASS_IDENT);
 
-    while ((c = lexer_peek(lexer)) != '"') {
-        length++;
-        lexer_advance(lexer);
+    token_init(token, TOKEN_TYPE_IDENTIFIER, &cursor, start,
+               lexer->source - start);
+    token->symbol = symbol_intern(start, token->length);
+}
+
+void lexer_lex_string(struct lexer *lexer, struct token *token) {
+    struct cursor cursor = lexer_cursor(lexer);
+    char const *string   = lexer->source + 1;
+    char const *p        = string;
+
+#ifdef LEXER_BLOCK
+    if (!lexer->scalar) {
+        while (lexer->end - p >= LEXER_BLOCK) {
+            uint32_t quotes = block_quote_mask(p);
+            if (quotes) {
+                p += count_trailing_zeros(quotes);
+                goto lexer_lex_string_found;
+            }
+
+            p += LEXER_BLOCK;
+        }
     }
+#endif
 
-    lexer_advance(lexer);
+    while (p < lexer->end && *p != '"')
+        p++;
 
-    char *string   = malloc(sizeof(char) * (length + 1));
-    string[length] = '\0';
+    if (p == lexer->end)
+        fatalf("error: unterminated string literal at line %zu.\n",
+               cursor.line + 1);
 
-    memcpy(string, lexer->source - length - 1, sizeof(char) * length);
+#ifdef LEXER_BLOCK
+lexer_lex_string_found:
+#endif
+    lexer_count_lines(lexer, string, p);
+    lexer->source = p + 1;
 
-    struct token *token   = token_make(TOKEN_TYPE_LITERAL, &cursor, string);
+    token_init(token, TOKEN_TYPE_LITERAL, &cursor, string, p - string);
     token->literal.type   = LITERAL_TYPE_STRING;
     token->literal.string = string;
-
-    return token;
 }
 
-struct token *lexer_lex_number(struct lexer *lexer) {
-    size_t length        = 0;
-    struct cursor cursor = lexer->cursor;
-    char c;
+void lexer_lex_number(struct lexer *lexer, struct token *token) {
+    struct cursor cursor = lexer_cursor(lexer);
+    char const *start    = lexer->source;
+    int64_t value        = 0;
 
-    while (isdigit(c = lexer_peek(lexer))) {
-        length++;
-        lexer_advance(lexer);
-    }
+    lexer->source = lexer_scan_class(lexer, start, CHAR_CLASS_DIGIT);
 
-    char *number   = malloc(sizeof(char) * (length + 1));
-    number[length] = '\0';
+    for (char const *p = start; p < lexer->source; p++) {
+        int digit = *p - '0';
 
-    memcpy(number, lexer->source - length, sizeof(char) * length);
+        if (value > (INT64_MAX - digit) / 10)
+            fatalf("error: integer literal %.*s at line %zu is too large.\n",
+                   (int)(lexer->source - start), start, cursor.line + 1);
+        value = value * 10 + digit;
+    }
 
-    struct token *token    = token_make(TOKEN_TYPE_LITERAL, &cursor, number);
+    token_init(token, TOKEN_TYPE_LITERAL, &cursor, start,
+               lexer->source - start);
     token->literal.type    = LITERAL_TYPE_INTEGER;
-    token->literal.integer = atoi(number);
-
-    return token;
+    token->literal.integer = value;
 }
 
-struct token *lexer_tokenize(struct lexer *lexer, char const *source) {
-    char c;
-    lexer->source        = source;
-    struct token *tokens = NULL;
+void lexer_tokenize(struct lexer *lexer, char const *source, size_t size,
+                    struct tokens *tokens) {
+    lexer->source     = source;
+    lexer->end        = source + size;
+    lexer->line_start = source;
+    lexer->line       = 0;
 
-    while ((c = lexer_peek(lexer)) != '\0') {
-        struct token *token = NULL;
+    /* Tokens are at least one character long and mostly separated by
+     * whitespace, so a quarter of the source size is a good first guess
+     * for typical programs and keeps regrowth of the arena rare. */
+    tokens_init(tokens, size / 4 + 16);
 
-        if (isspace(c)) {
-            lexer_advance(lexer);
-            continue;
-        }
+    while (1) {
+        lexer_skip_whitespace(lexer);
 
-        switch (c) {
-        case '[':
-        case ']':
-        case ':':
-        case ';':
-        case '+':
-        case '*':
-        case '.':
-            token = token_make_syntax(c, &lexer->cursor);
-            lexer_advance(lexer);
-            goto add_token_to_list;
-        case '"':
-            token = lexer_lex_string(lexer);
-        }
+        char c = lexer_peek(lexer);
+        if (c == '\0')
+            break;
 
-        if (isalpha(c)) {
-            token = lexer_lex_identifier(lexer);
-        } else if (isdigit(c)) {
-            token = lexer_lex_number(lexer);
+        unsigned char class = char_class(c);
+
+        if (class & CHAR_CLASS_SYNTAX) {
+            struct cursor cursor = lexer_cursor(lexer);
+            token_init_syntax(tokens_push(tokens), lexer->source, &cursor);
+            lexer->source++;
+        } else if (class & CHAR_CLASS_QUOTE) {
+            lexer_lex_string(lexer, tokens_push(tokens));
+        } else if (class & CHAR_CLASS_ALPHA) {
+            lexer_lex_identifier(lexer, tokens_push(tokens));
+        } else if (class & CHAR_CLASS_DIGIT) {
+            lexer_lex_number(lexer, tokens_push(tokens));
+        } else {
+            fatalf("error: unexpected character '%c' at line %zu.\n", c,
+                   lexer->line + 1);
         }
-
-    add_token_to_list:
-        tokens_prepend(&tokens, token);
     }
-
-    tokens_reverse(&tokens);
-    return tokens;
 }
\ No newline at end of file
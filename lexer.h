@@ -38,31 +38,44 @@ struct cursor {
 struct token {
     enum token_type type;
     char const *lexeme;
+    size_t length;
+    uint32_t symbol;
     struct literal literal;
     struct cursor cursor;
+};
 
-    struct token *next;
+struct tokens {
+    struct token *data;
+    size_t size;
+    size_t capacity;
 };
 
 struct lexer {
     char const *source;
-    struct cursor cursor;
+    char const *end;
+    char const *line_start;
+    size_t line;
+    _Bool scalar;
 };
 
-void token_destroy(struct token *token);
-struct token *token_make(enum token_type type, struct cursor *cursor,
-                         char const *lexeme);
-struct token *token_make_syntax(char c, struct cursor *cursor);
+void token_init(struct token *token, enum token_type type,
+                struct cursor *cursor, char const *lexeme, size_t length);
+void token_init_syntax(struct token *token, char const *lexeme,
+                       struct cursor *cursor);
+_Bool token_is(struct token const *token, char const *string);
 
-void tokens_prepend(struct token **tokens, struct token *token);
-void tokens_reverse(struct token **tokens);
-void tokens_pop(struct token **tokens, struct token **out);
+void tokens_init(struct tokens *tokens, size_t capacity);
+void tokens_destroy(struct tokens *tokens);
+struct token *tokens_push(struct tokens *tokens);
 
-char lexer_advance(struct lexer *lexer);
 char lexer_peek(struct lexer *lexer);
 void lexer_init(struct lexer *lexer);
-struct token *lexer_lex_identifier(struct lexer *lexer);
-struct token *lexer_lex_number(struct lexer *lexer);
-struct token *lexer_tokenize(struct lexer *lexer, char const *source);
+struct cursor lexer_cursor(struct lexer *lexer);
+void lexer_skip_whitespace(struct lexer *lexer);
+void lexer_lex_identifier(struct lexer *lexer, struct token *token);
+void lexer_lex_string(struct lexer *lexer, struct token *token);
+void lexer_lex_number(struct lexer *lexer, struct token *token);
+void lexer_tokenize(struct lexer *lexer, char const *source, size_t size,
+                    struct tokens *tokens);
 
 #endif
\ No newline at end of file
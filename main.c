@@ -3,31 +3,418 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "checker.h"
+#include "compiler.h"
+#include "emitter.h"
 #include "error.h"
+#include "fiber.h"
+#include "jit.h"
 #include "lexer.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "pool.h"
+#include "server.h"
+#include "source.h"
+#include "thread.h"
+#include "tti.h"
+#include "vm.h"
+
+/* How many of the most frequent n-grams --profile-ngrams prints. */
+#define PROFILE_NGRAMS_TOP 10
+
+static _Bool tokens_equal(struct tokens *a, struct tokens *b) {
+    if (a->size != b->size)
+        return 0;
+
+    for (size_t i = 0; i < a->size; i++) {
+        struct token *x = &a->data[i], *y = &b->data[i];
+        if (x->type != y->type || x->lexeme != y->lexeme ||
+            x->length != y->length || x->cursor.line != y->cursor.line ||
+            x->cursor.column != y->cursor.column)
+            return 0;
+
+        if (x->type == TOKEN_TYPE_LITERAL &&
+            x->literal.type == LITERAL_TYPE_INTEGER &&
+            x->literal.integer != y->literal.integer)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Tokenizes the file repeatedly with the vector and the scalar scanner,
+ * checks that both produce the same tokens and reports their throughput. */
+static void bench_lex(char const *path) {
+    struct source source;
+    struct tokens tokens[2];
+
+    if (!source_map(&source, path))
+        fatalf("error: opening file %s.\n", path);
+
+    for (int scalar = 0; scalar < 2; scalar++) {
+        struct lexer lexer;
+        lexer_init(&lexer);
+        lexer.scalar = scalar;
+
+        size_t runs   = 0;
+        clock_t start = clock(), elapsed;
+
+        do {
+            if (runs)
+                tokens_destroy(&tokens[scalar]);
+
+            lexer_tokenize(&lexer, source.data, source.size, &tokens[scalar]);
+            runs++;
+            elapsed = clock() - start;
+        } while (elapsed < CLOCKS_PER_SEC / 2);
+
+        double seconds = (double)elapsed / CLOCKS_PER_SEC;
+        double mbytes  = (double)source.size * runs / (1024.0 * 1024.0);
+        printf("%s: %zu tokens, %zu runs, %.1f MB/s\n",
+               scalar ? "scalar" : "vector", tokens[scalar].size, runs,
+               mbytes / seconds);
+    }
+
+    if (!tokens_equal(&tokens[0], &tokens[1]))
+        fatalf("error: vector and scalar lexers disagree on %s.\n", path);
+
+    tokens_destroy(&tokens[0]);
+    tokens_destroy(&tokens[1]);
+    source_unmap(&source);
+}
+
+/* Parses the argument of --stack, an initial depth optionally followed by
+ * a colon and a maximum depth, as in 1024:65536. */
+static void parse_stack_depth(char const *argument, size_t *initial,
+                              size_t *max) {
+    char *end;
+
+    *initial = strtoull(argument, &end, 10);
+    if (*end == ':')
+        *max = strtoull(end + 1, &end, 10);
+
+    if (end == argument || *end != '\0' || *initial == 0 || *max < *initial)
+        fatalf("error: invalid stack depth %s.\n", argument);
+}
+
+static void run_environment(void *env) { environment_execute(env); }
+
+/* Runs the entry of image on nthreads threads at once, each with an
+ * environment of its own, after freezing the image they share. */
+static void run_threads(struct image *image, size_t nthreads,
+                        size_t stack_size, size_t stack_max) {
+    struct environment **envs = malloc(sizeof(*envs) * nthreads);
+    struct thread *threads    = malloc(sizeof(*threads) * nthreads);
+
+    image_freeze(image);
+
+    for (size_t i = 0; i < nthreads; i++) {
+        envs[i] = make_environment(image, stack_size, stack_max);
+        thread_start(&threads[i], run_environment, envs[i],
+                     THREAD_STACK_SIZE);
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        thread_join(&threads[i]);
+        environment_destroy(envs[i]);
+    }
+
+    free(threads);
+    free(envs);
+}
+
+/* Parses, optimizes and checks the program at path, leaving in depth how
+ * many stack values its main needs. */
+static struct image *build_image(struct lexer *lexer, char const *path,
+                                 enum optimizer_level level,
+                                 size_t inline_threshold,
+                                 _Bool optimizer_report, size_t *depth) {
+    struct source source;
+
+    if (!source_map(&source, path))
+        fatalf("error: opening file %s.\n", path);
+
+    struct tokens tokens;
+    lexer_tokenize(lexer, source.data, source.size, &tokens);
+
+    struct parser parser = {&tokens};
+    struct image *image  = parser_parse_program(&parser);
+    tokens_destroy(&tokens);
+
+    if (!parser_success(&parser)) {
+        fprintf(stderr, "%s", parser.error.message);
+        parser_error_finish(&parser);
+        exit(EXIT_FAILURE);
+    }
+
+    optimizer_optimize_program(image, level, inline_threshold,
+                               optimizer_report);
+
+    /* When the checker knows how deep main goes, the whole stack is
+     * allocated up front. */
+    *depth = checker_check_program(image, 0);
+    image_own(image);
+    source_unmap(&source);
+
+    return image;
+}
+
+static _Bool has_suffix(char const *string, char const *suffix) {
+    size_t length = strlen(string), suffix_length = strlen(suffix);
+
+    return length >= suffix_length &&
+           strcmp(string + length - suffix_length, suffix) == 0;
+}
+
+/* Loads the precompiled image at path, first rebuilding it with the level
+ * and inline threshold given if it was built with others, if its source
+ * changed since or if another catcat wrote it. */
+static struct image *load_image(struct lexer *lexer, char const *path,
+                                enum optimizer_level level,
+                                size_t inline_threshold, size_t *depth) {
+    struct tti_build build = {.level            = level,
+                              .inline_threshold = inline_threshold};
+    struct image *image    = tti_load(path, &build);
+
+    if (!image && !build.source[0])
+        fatalf("error: %s is not a catcat image.\n", path);
+
+    if (!image) {
+        image = build_image(lexer, build.source, build.level,
+                            build.inline_threshold, 0, &build.depth);
+        compiler_compile_program(image, build.level > OPTIMIZER_LEVEL_NONE);
+
+        if (!tti_write(path, image, &build))
+            fprintf(stderr, "warning: could not rebuild %s.\n", path);
+    }
+
+    *depth = build.depth;
+    return image;
+}
 
 int main(int argc, char **argv) {
-    FILE *fp;
-    char buffer[1024] = {0};
+    char const *path  = NULL;
+    _Bool tree_walk   = 0;
+    size_t stack_size = STACK_INITIAL_DEPTH;
+    size_t stack_max  = STACK_MAXIMUM_DEPTH;
+
+    enum optimizer_level level = OPTIMIZER_LEVEL_FULL;
+    size_t inline_threshold    = OPTIMIZER_INLINE_THRESHOLD;
+    _Bool optimizer_report     = 0;
+    _Bool profile_ngrams       = 0;
+    enum jit_mode jit          = JIT_MODE_ON;
+    _Bool emit_c               = 0;
+    size_t nthreads            = 1;
+    size_t nworkers            = thread_processors() - 1;
+    size_t nfiber_threads      = thread_processors();
+    char const *serve          = NULL;
+    _Bool compile              = 0;
+    char const *output         = NULL;
 
     struct lexer lexer;
     lexer_init(&lexer);
 
-    if (argc >= 2) {
-        fp = fopen(argv[1], "r");
-        if (!fp)
-            fatalf("error: opening file %s.\n", argv[1]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench-lex") == 0 && i + 1 < argc) {
+            bench_lex(argv[i + 1]);
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--tree-walk") == 0) {
+            tree_walk = 1;
+        } else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc) {
+            parse_stack_depth(argv[++i], &stack_size, &stack_max);
+        } else if (strcmp(argv[i], "-O0") == 0) {
+            level = OPTIMIZER_LEVEL_NONE;
+        } else if (strcmp(argv[i], "-O1") == 0) {
+            level = OPTIMIZER_LEVEL_BASIC;
+        } else if (strcmp(argv[i], "-O2") == 0) {
+            level = OPTIMIZER_LEVEL_FULL;
+        } else if (strcmp(argv[i], "--inline-threshold") == 0 &&
+                   i + 1 < argc) {
+            char *end;
+            inline_threshold = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0')
+                fatalf("error: invalid inline threshold %s.\n", argv[i]);
+        } else if (strcmp(argv[i], "--optimizer-report") == 0) {
+            optimizer_report = 1;
+        } else if (strcmp(argv[i], "--profile-ngrams") == 0) {
+            profile_ngrams = 1;
+        } else if (strcmp(argv[i], "--jit=off") == 0) {
+            jit = JIT_MODE_OFF;
+        } else if (strcmp(argv[i], "--jit=on") == 0) {
+            jit = JIT_MODE_ON;
+        } else if (strcmp(argv[i], "--jit=always") == 0) {
+            jit = JIT_MODE_ALWAYS;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            nthreads = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || nthreads == 0)
+                fatalf("error: invalid number of threads %s.\n", argv[i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            char *end;
+            nworkers = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0')
+                fatalf("error: invalid number of workers %s.\n", argv[i]);
+        } else if (strcmp(argv[i], "--fiber-threads") == 0 && i + 1 < argc) {
+            char *end;
+            nfiber_threads = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || nfiber_threads == 0)
+                fatalf("error: invalid number of fiber threads %s.\n",
+                       argv[i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve = argv[++i];
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compile = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strncmp(argv[i], "--jit=", 6) == 0) {
+            fatalf("error: invalid JIT mode %s, expected off, on or always.\n",
+                   argv[i] + 6);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    /* The server runs the programs its clients send, built with the options
+     * it was given, instead of one of its own. */
+    if (serve) {
+        struct server_options options = {level,     inline_threshold,
+                                         tree_walk, stack_size,
+                                         stack_max, nfiber_threads};
+
+        jit_init(jit);
+        pool_init(nworkers);
+        server_serve(serve, &options);
+        pool_destroy();
+        return EXIT_SUCCESS;
+    }
+
+    /* Options that do not go together are rejected before the program is
+     * built. */
+    if (profile_ngrams && tree_walk)
+        fatalf("error: --profile-ngrams profiles the VM, not the tree "
+               "walker.\n");
+    if (profile_ngrams && nthreads > 1)
+        fatalf("error: --profile-ngrams profiles a single thread.\n");
+    if (emit_c && tree_walk)
+        fatalf("error: --emit-c translates the bytecode, not the tree "
+               "walker.\n");
+
+    if (path) {
+        struct image *image;
+        size_t depth;
+
+        if (has_suffix(path, ".tti")) {
+            if (compile)
+                fatalf("error: %s is already compiled.\n", path);
+            image = load_image(&lexer, path, level, inline_threshold,
+                               &depth);
+        } else {
+            image = build_image(&lexer, path, level, inline_threshold,
+                                optimizer_report, &depth);
+        }
+
+        if (depth > stack_max) {
+            if (image->program)
+                program_destroy(image->program);
+            image_destroy(image);
+            fatalf("error: main needs %zu stack values, more than the maximum "
+                   "of %zu.\n",
+                   depth, stack_max);
+        }
+        if (depth > stack_size)
+            stack_size = depth;
+
+        /* The program is saved as an image next to its source, or where -o
+         * says, instead of being run. */
+        if (compile) {
+            struct tti_build build = {.level            = level,
+                                      .inline_threshold = inline_threshold,
+                                      .depth            = depth};
+            char *default_output   = NULL;
+
+            if (!output) {
+                default_output = malloc(strlen(path) + 5);
+                sprintf(default_output, has_suffix(path, ".tt") ? "%si"
+                                                                : "%s.tti",
+                        path);
+                output = default_output;
+            }
+
+            if (!tti_set_source(&build, path))
+                fatalf("error: could not resolve the path of %s.\n", path);
+
+            compiler_compile_program(image, level > OPTIMIZER_LEVEL_NONE);
+            if (!tti_write(output, image, &build))
+                fatalf("error: could not write %s.\n", output);
+
+            free(default_output);
+            program_destroy(image->program);
+            image_destroy(image);
+            return EXIT_SUCCESS;
+        }
+
+        /* The program is translated from its bytecode instead of being
+         * run. */
+        if (emit_c) {
+            if (!image->program)
+                compiler_compile_program(image, level > OPTIMIZER_LEVEL_NONE);
+            emitter_emit_program(image, stdout, stack_size, stack_max);
+
+            program_destroy(image->program);
+            image_destroy(image);
+            return EXIT_SUCCESS;
+        }
+
+        /* Superinstructions would hide the pairs being profiled, native
+         * code is not profiled at all, and workers would update the
+         * profile from other threads. */
+        if (profile_ngrams) {
+            vm_profile_start();
+            jit      = JIT_MODE_OFF;
+            nworkers = 0;
+        }
+
+        jit_init(jit);
+
+        /* The threads running the program help with the parallel
+         * combinators they call, so by default there is one worker less
+         * than there are processors. */
+        pool_init(nworkers);
+        fiber_init(nfiber_threads);
+
+        /* An image comes compiled, but is lowered again without
+         * superinstructions to be profiled, and not at all to be walked. */
+        if (image->program && (tree_walk || profile_ngrams)) {
+            program_destroy(image->program);
+            image->program = NULL;
+        }
+
+        if (!tree_walk && !image->program)
+            compiler_compile_program(image, level > OPTIMIZER_LEVEL_NONE &&
+                                                !profile_ngrams);
 
-        fread(buffer, 1, sizeof(buffer), fp);
-        char const *program = &buffer[0];
+        if (nthreads > 1) {
+            run_threads(image, nthreads, stack_size, stack_max);
+        } else {
+            struct environment *env =
+                make_environment(image, stack_size, stack_max);
+            environment_execute(env);
+            environment_destroy(env);
+        }
+        /* A fiber that failed without being joined fails the program. */
+        if (fiber_destroy())
+            exit(EXIT_FAILURE);
+        pool_destroy();
+        vm_profile_report(PROFILE_NGRAMS_TOP);
 
-        struct token *tokens    = lexer_tokenize(&lexer, program);
-        struct parser parser    = {tokens};
-        struct environment *env = parser_parse_program(&parser);
-        environment_execute(env);
-        free(env);
+        if (image->program)
+            program_destroy(image->program);
+        image_destroy(image);
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,487 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "error.h"
+#include "optimizer.h"
+#include "parser.h"
+
+static _Bool word_is_builtin(struct word *word, cfunction function) {
+    return word->type == WORD_TYPE_FUNCTION &&
+           word->function.type == FUNCTION_TYPE_CFUNCTION &&
+           word->function.cfn.function == function;
+}
+
+static _Bool word_is_integer(struct word *word) {
+    return word->type == WORD_TYPE_VALUE &&
+           word->value.type == WORD_VALUE_TYPE_INTEGER;
+}
+
+static _Bool word_is_literal(struct word *word) {
+    return word->type == WORD_TYPE_VALUE || word->type == WORD_TYPE_LAMBDA;
+}
+
+/* Counts the words of function including those of its nested lambdas. */
+static size_t function_count_words(struct function *function) {
+    size_t count = function->size;
+
+    for (size_t i = 0; i < function->size; i++) {
+        if (function->words[i]->type == WORD_TYPE_LAMBDA)
+            count += function_count_words(function->words[i]->lambda);
+    }
+
+    return count;
+}
+
+/* Call graph over the regular globals, with each function numbered by its
+ * position in functions through function->index until the compiler
+ * renumbers them. */
+struct inliner {
+    struct function **functions;
+    size_t nfunctions;
+    size_t threshold;
+
+    /* Callees of each function, including calls made by its lambdas. */
+    size_t **callees;
+    size_t *ncallees;
+
+    /* Functions that can reach themselves, which are never inlined. */
+    _Bool *recursive;
+};
+
+static _Bool word_is_call(struct word *word) {
+    return word->type == WORD_TYPE_FUNCTION &&
+           word->function.type == FUNCTION_TYPE_REGULAR;
+}
+
+static void inliner_add_callees(struct inliner *inliner, size_t caller,
+                                struct function *function) {
+    for (size_t i = 0; i < function->size; i++) {
+        struct word *word = function->words[i];
+
+        if (word->type == WORD_TYPE_LAMBDA) {
+            inliner_add_callees(inliner, caller, word->lambda);
+            continue;
+        }
+
+        if (!word_is_call(word))
+            continue;
+
+        size_t count = inliner->ncallees[caller]++;
+        inliner->callees[caller] =
+            realloc(inliner->callees[caller], sizeof(size_t) * (count + 1));
+        inliner->callees[caller][count] = word->function.fn->index;
+    }
+}
+
+static struct word *word_clone(struct word *word);
+
+static struct function *function_clone(struct function *function) {
+    struct function *clone = make_function(function->symbol);
+
+    for (size_t i = 0; i < function->size; i++)
+        function_add_word(clone, word_clone(function->words[i]));
+
+    if (function->source)
+        clone->source = function_clone(function->source);
+
+    return clone;
+}
+
+/* Copies word deeply, so the copy can be optimized and destroyed on its
+ * own. The origin is kept, naming the definition the word came from. */
+static struct word *word_clone(struct word *word) {
+    struct word *clone = allocator_alloc(&program_allocator, sizeof(*clone));
+    word_copy(clone, word);
+
+    if (word->type == WORD_TYPE_LAMBDA) {
+        clone->lambda = function_clone(word->lambda);
+    } else if (word->type == WORD_TYPE_VALUE &&
+               word->value.type == WORD_VALUE_TYPE_STRING) {
+        clone->value.string =
+            allocator_strndup(&program_allocator, word->value.string,
+                              strlen(word->value.string));
+    }
+
+    return clone;
+}
+
+static _Bool inliner_should_inline(struct inliner *inliner, struct word *word) {
+    if (!word_is_call(word))
+        return 0;
+
+    struct function *callee = word->function.fn;
+    return !inliner->recursive[callee->index] &&
+           function_count_words(callee) <= inliner->threshold;
+}
+
+/* Replaces the calls of function, and of its lambdas, to small functions
+ * with copies of their bodies. Callees have been expanded already. */
+static void inliner_expand(struct inliner *inliner,
+                           struct function *function) {
+    struct function out = {0};
+
+    for (size_t i = 0; i < function->size; i++) {
+        struct word *word = function->words[i];
+
+        if (word->type == WORD_TYPE_LAMBDA)
+            inliner_expand(inliner, word->lambda);
+
+        if (!inliner_should_inline(inliner, word)) {
+            function_add_word(&out, word);
+            continue;
+        }
+
+        struct function *callee = word->function.fn;
+        for (size_t j = 0; j < callee->size; j++)
+            function_add_word(&out, word_clone(callee->words[j]));
+
+        word_destroy(word);
+    }
+
+    allocator_free(&program_allocator, function->words,
+                   sizeof(struct word *) * function->capacity);
+
+    function->words    = out.words;
+    function->size     = out.size;
+    function->capacity = out.capacity;
+}
+
+/* A function on the DFS path and the next of its callees to visit. */
+struct inliner_visit {
+    size_t function;
+    size_t edge;
+};
+
+/* Tarjan's strongly connected components, iteratively so that long call
+ * chains do not exhaust the C stack. Components are completed callees
+ * first, which is the order functions are expanded in. */
+static void inliner_run(struct inliner *inliner) {
+    size_t n        = inliner->nfunctions;
+    size_t *order   = malloc(sizeof(size_t) * n);
+    size_t *low     = malloc(sizeof(size_t) * n);
+    size_t *members = malloc(sizeof(size_t) * n);
+    _Bool *onstack  = calloc(n, sizeof(_Bool));
+
+    struct inliner_visit *path = malloc(sizeof(*path) * n);
+
+    size_t visited = 0, nmembers = 0;
+
+    for (size_t i = 0; i < n; i++)
+        order[i] = SIZE_MAX;
+
+    for (size_t root = 0; root < n; root++) {
+        if (order[root] != SIZE_MAX)
+            continue;
+
+        size_t depth = 0;
+        path[depth++] = (struct inliner_visit){root, 0};
+        order[root] = low[root] = visited++;
+        members[nmembers++]     = root;
+        onstack[root]           = 1;
+
+        while (depth) {
+            size_t v = path[depth - 1].function;
+
+            if (path[depth - 1].edge < inliner->ncallees[v]) {
+                size_t w = inliner->callees[v][path[depth - 1].edge++];
+
+                if (order[w] == SIZE_MAX) {
+                    path[depth++] = (struct inliner_visit){w, 0};
+                    order[w] = low[w] = visited++;
+                    members[nmembers++] = w;
+                    onstack[w]          = 1;
+                } else if (onstack[w] && order[w] < low[v]) {
+                    low[v] = order[w];
+                }
+                continue;
+            }
+
+            if (--depth && low[v] < low[path[depth - 1].function])
+                low[path[depth - 1].function] = low[v];
+
+            if (low[v] != order[v])
+                continue;
+
+            size_t first = nmembers;
+            do
+                onstack[members[--first]] = 0;
+            while (members[first] != v);
+
+            _Bool recursive = nmembers - first > 1;
+            for (size_t j = 0; j < inliner->ncallees[v]; j++)
+                recursive |= inliner->callees[v][j] == v;
+
+            for (size_t j = first; j < nmembers; j++)
+                inliner->recursive[members[j]] = recursive;
+
+            for (size_t j = first; j < nmembers; j++)
+                inliner_expand(inliner, inliner->functions[members[j]]);
+
+            nmembers = first;
+        }
+    }
+
+    free(path);
+    free(onstack);
+    free(members);
+    free(low);
+    free(order);
+}
+
+static void optimizer_inline_program(struct image *image, size_t threshold) {
+    struct inliner inliner = {0};
+    inliner.threshold      = threshold;
+    inliner.functions = malloc(sizeof(struct function *) * image->globals_size);
+
+    for (size_t i = 0; i < image->globals_size; i++) {
+        struct word *global = image->globals[i];
+        if (global->function.type != FUNCTION_TYPE_REGULAR)
+            continue;
+
+        global->function.fn->index = inliner.nfunctions;
+        inliner.functions[inliner.nfunctions++] = global->function.fn;
+    }
+
+    inliner.callees   = calloc(inliner.nfunctions, sizeof(size_t *));
+    inliner.ncallees  = calloc(inliner.nfunctions, sizeof(size_t));
+    inliner.recursive = calloc(inliner.nfunctions, sizeof(_Bool));
+
+    for (size_t i = 0; i < inliner.nfunctions; i++)
+        inliner_add_callees(&inliner, i, inliner.functions[i]);
+
+    inliner_run(&inliner);
+
+    for (size_t i = 0; i < inliner.nfunctions; i++)
+        free(inliner.callees[i]);
+
+    free(inliner.recursive);
+    free(inliner.ncallees);
+    free(inliner.callees);
+    free(inliner.functions);
+}
+
+static void optimizer_optimize_function(struct function *function,
+                                        enum optimizer_level level);
+
+/* Appends word to out and rewrites the end of out while it matches one of
+ * the patterns, so that a fold can enable another one before it. */
+static void optimizer_emit(struct function *out, struct word *word,
+                           enum optimizer_level level) {
+    function_add_word(out, word);
+
+    while (out->size >= 2) {
+        struct word **tail = &out->words[out->size - 1];
+        struct word *last  = tail[0];
+        struct word *prev  = tail[-1];
+
+        /* A literal that is dropped right away. */
+        if (word_is_literal(prev) && word_is_builtin(last, __dropfunction)) {
+            word_destroy(prev);
+            word_destroy(last);
+            out->size -= 2;
+            continue;
+        }
+
+        /* [ ... ] apply runs the words of the quotation in place. */
+        if (level >= OPTIMIZER_LEVEL_FULL && prev->type == WORD_TYPE_LAMBDA &&
+            word_is_builtin(last, __applyfunction)) {
+            struct function *lambda = prev->lambda;
+            out->size -= 2;
+
+            word_destroy(last);
+            allocator_free(&program_allocator, prev, sizeof(*prev));
+
+            for (size_t i = 0; i < lambda->size; i++)
+                optimizer_emit(out, lambda->words[i], level);
+
+            if (lambda->source)
+                function_destroy(lambda->source);
+            allocator_free(&program_allocator, lambda->words,
+                           sizeof(struct word *) * lambda->capacity);
+            allocator_free(&program_allocator, lambda, sizeof(*lambda));
+            return;
+        }
+
+        if (out->size < 3)
+            break;
+
+        struct word *first = tail[-2];
+
+        /* Integer arithmetic, wrapping like the builtins on overflow. */
+        if (word_is_integer(first) && word_is_integer(prev) &&
+            (word_is_builtin(last, __addfunction) ||
+             word_is_builtin(last, __mulfunction))) {
+            int64_t a = first->value.integer;
+            int64_t b = prev->value.integer;
+
+            first->value.integer = word_is_builtin(last, __addfunction)
+                                       ? integer_add(a, b)
+                                       : integer_mul(a, b);
+
+            word_destroy(prev);
+            word_destroy(last);
+            out->size -= 2;
+            continue;
+        }
+
+        if (word_is_literal(first) && word_is_literal(prev) &&
+            word_is_builtin(last, __equalfunction)) {
+            _Bool equal = 0;
+
+            /* Lambdas never compare equal, as at run time. */
+            if (first->type == WORD_TYPE_VALUE &&
+                prev->type == WORD_TYPE_VALUE &&
+                first->value.type == prev->value.type) {
+                if (first->value.type == WORD_VALUE_TYPE_INTEGER)
+                    equal = first->value.integer == prev->value.integer;
+                else if (first->value.type == WORD_VALUE_TYPE_STRING)
+                    equal = strcmp(first->value.string,
+                                   prev->value.string) == 0;
+            }
+
+            word_destroy(first);
+            word_destroy(prev);
+            first = last;
+
+            first->type          = WORD_TYPE_VALUE;
+            first->value.type    = WORD_VALUE_TYPE_INTEGER;
+            first->value.integer = equal;
+
+            out->size -= 2;
+            out->words[out->size - 1] = first;
+            continue;
+        }
+
+        break;
+    }
+}
+
+static void optimizer_optimize_function(struct function *function,
+                                        enum optimizer_level level) {
+    for (size_t i = 0; i < function->size; i++) {
+        if (function->words[i]->type == WORD_TYPE_LAMBDA)
+            optimizer_optimize_function(function->words[i]->lambda, level);
+    }
+
+    struct function out = {0};
+    for (size_t i = 0; i < function->size; i++)
+        optimizer_emit(&out, function->words[i], level);
+
+    allocator_free(&program_allocator, function->words,
+                   sizeof(struct word *) * function->capacity);
+
+    function->words    = out.words;
+    function->size     = out.size;
+    function->capacity = out.capacity;
+}
+
+/* Keeps a copy of the words of each lambda of function as they were
+ * written, for printing, before they are rewritten. */
+static void optimizer_keep_sources(struct function *function) {
+    for (size_t i = 0; i < function->size; i++) {
+        struct word *word = function->words[i];
+
+        if (word->type == WORD_TYPE_LAMBDA) {
+            word->lambda->source = function_clone(word->lambda);
+            optimizer_keep_sources(word->lambda);
+        }
+    }
+}
+
+/* Whether function prints the same words as source, a copy of its words
+ * as written. A lambda calling a foreign function keeps its copy. */
+static _Bool optimizer_same_words(struct function *function,
+                                  struct function *source) {
+    if (function->size != source->size)
+        return 0;
+
+    for (size_t i = 0; i < function->size; i++) {
+        struct word *a = function->words[i];
+        struct word *b = source->words[i];
+
+        if (a->type != b->type)
+            return 0;
+
+        switch (a->type) {
+        case WORD_TYPE_VALUE:
+            if (a->value.type != b->value.type ||
+                (a->value.type == WORD_VALUE_TYPE_INTEGER
+                     ? a->value.integer != b->value.integer
+                     : strcmp(a->value.string, b->value.string) != 0))
+                return 0;
+            break;
+        case WORD_TYPE_LAMBDA:
+            if (!optimizer_same_words(function_source(a->lambda), b->lambda))
+                return 0;
+            break;
+        case WORD_TYPE_FUNCTION:
+            if (a->function.type != b->function.type ||
+                a->function.type == FUNCTION_TYPE_FFI)
+                return 0;
+            if (a->function.type == FUNCTION_TYPE_CFUNCTION
+                    ? a->function.cfn.function != b->function.cfn.function
+                    : a->function.fn != b->function.fn)
+                return 0;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/* Drops the copies of the lambdas of function that the optimizer left as
+ * they were written, innermost first. */
+static void optimizer_drop_sources(struct function *function) {
+    for (size_t i = 0; i < function->size; i++) {
+        struct word *word = function->words[i];
+        if (word->type != WORD_TYPE_LAMBDA)
+            continue;
+
+        struct function *lambda = word->lambda;
+        optimizer_drop_sources(lambda);
+
+        if (lambda->source && optimizer_same_words(lambda, lambda->source)) {
+            function_destroy(lambda->source);
+            lambda->source = NULL;
+        }
+    }
+}
+
+void optimizer_optimize_program(struct image *image,
+                                enum optimizer_level level,
+                                size_t inline_threshold, _Bool report) {
+    size_t *before = malloc(sizeof(size_t) * image->globals_size);
+
+    for (size_t i = 0; i < image->globals_size; i++) {
+        struct word *global = image->globals[i];
+        if (global->function.type != FUNCTION_TYPE_REGULAR)
+            continue;
+
+        before[i] = function_count_words(global->function.fn);
+        if (level > OPTIMIZER_LEVEL_NONE)
+            optimizer_keep_sources(global->function.fn);
+    }
+
+    if (level >= OPTIMIZER_LEVEL_FULL && inline_threshold > 0)
+        optimizer_inline_program(image, inline_threshold);
+
+    for (size_t i = 0; i < image->globals_size; i++) {
+        struct word *global = image->globals[i];
+        if (global->function.type != FUNCTION_TYPE_REGULAR)
+            continue;
+
+        struct function *function = global->function.fn;
+
+        if (level > OPTIMIZER_LEVEL_NONE) {
+            optimizer_optimize_function(function, level);
+            optimizer_drop_sources(function);
+        }
+
+        if (report)
+            fprintf(stderr, "%s: %zu -> %zu words\n",
+                    symbol_name(function->symbol), before[i],
+                    function_count_words(function));
+    }
+
+    free(before);
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "kernel.h"
+
+/* Optimization levels. -O1 folds arithmetic and comparisons on literals
+ * and removes literals that are dropped right away; -O2 also splices
+ * literal quotations that are immediately applied, and the bodies of
+ * small non-recursive functions, into the surrounding code. A quotation
+ * whose words are rewritten keeps those it was written with, which is
+ * what printing it shows. */
+enum optimizer_level {
+    OPTIMIZER_LEVEL_NONE,
+    OPTIMIZER_LEVEL_BASIC,
+    OPTIMIZER_LEVEL_FULL,
+};
+
+#define OPTIMIZER_INLINE_THRESHOLD 8
+
+/* Rewrites every global function of image, and the lambdas nested in them,
+ * in place. Functions of at most inline_threshold words, counting their
+ * lambdas, are inlined at -O2; zero disables inlining. With report set,
+ * prints the number of words of each function before and after to
+ * stderr. */
+void optimizer_optimize_program(struct image *image,
+                                enum optimizer_level level,
+                                size_t inline_threshold, _Bool report);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,340 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "gc.h"
+#include "kernel.h"
+#include "pool.h"
+
+/* pmap and preduce split their range into at most this many tasks,
+ * however many workers there are, so a reduction combines the same
+ * partial results in the same order on any machine. */
+#define PARALLEL_CHUNKS 64
+
+enum parallel_kind { PARALLEL_APPLY, PARALLEL_MAP, PARALLEL_REDUCE };
+
+/* A piece of the work of a parallel builtin. It runs on an environment of
+ * its own, into which it copies the quotations it is given, so that what
+ * it builds is not seen by the caller or the other tasks. The caller takes
+ * the results, in the order of the tasks, once they have all finished,
+ * unless one of them failed. */
+struct parallel_task {
+    struct pool_task task;
+    struct gc_roots roots;
+    enum parallel_kind kind;
+    _Bool failed;
+
+    struct image *image;
+    size_t stack_max;
+    struct environment *env;
+
+    struct value input;
+    struct function *quotation;
+    struct function *combine;
+    int64_t begin;
+    int64_t end;
+
+    struct value *results;
+    size_t nresults;
+    size_t results_capacity;
+};
+
+static void parallel_visit(struct gc *gc, struct gc_roots *roots) {
+    struct parallel_task *task =
+        (struct parallel_task *)((char *)roots -
+                                 offsetof(struct parallel_task, roots));
+
+    gc_visit(gc, &task->quotation);
+    gc_visit(gc, &task->combine);
+    if (task->input.type == VALUE_TYPE_LAMBDA)
+        gc_visit(gc, &task->input.lambda);
+
+    for (size_t i = 0; i < task->nresults; i++) {
+        if (task->results[i].type == VALUE_TYPE_LAMBDA)
+            gc_visit(gc, &task->results[i].lambda);
+    }
+}
+
+/* Moves everything on the task's stack to its results. */
+static void parallel_keep(struct parallel_task *task) {
+    struct stack *stack = task->env->stack;
+
+    if (task->nresults + stack->ndata > task->results_capacity) {
+        while (task->nresults + stack->ndata > task->results_capacity)
+            task->results_capacity =
+                task->results_capacity ? task->results_capacity * 2 : 16;
+        task->results = realloc(task->results, sizeof(struct value) *
+                                                   task->results_capacity);
+    }
+
+    for (size_t i = 0; i < stack->ndata; i++)
+        task->results[task->nresults++] = stack->data[i];
+    stack->ndata = 0;
+}
+
+static void parallel_expect_one(struct environment *env, size_t base) {
+    if (env->stack->ndata != base + 1)
+        fatalf("error: preduce expects its quotations to leave one value.\n");
+}
+
+static void parallel_work(struct parallel_task *task) {
+    struct environment *env = task->env;
+
+    task->quotation = gc_import(env->gc, task->quotation);
+    if (task->combine)
+        task->combine = gc_import(env->gc, task->combine);
+    if (task->input.type == VALUE_TYPE_LAMBDA)
+        task->input.lambda = gc_import(env->gc, task->input.lambda);
+    gc_add_roots(env->gc, &task->roots);
+
+    switch (task->kind) {
+    case PARALLEL_APPLY:
+        stack_push(env->stack, task->input);
+        environment_call(env, task->quotation);
+        parallel_keep(task);
+        break;
+    case PARALLEL_MAP:
+        for (int64_t i = task->begin; i < task->end; i++) {
+            stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                                  .integer = i});
+            environment_call(env, task->quotation);
+            parallel_keep(task);
+        }
+        break;
+    case PARALLEL_REDUCE:
+        /* Each index is mapped on an empty stack; the running result is
+         * kept aside and only brought back to be combined. */
+        for (int64_t i = task->begin; i < task->end; i++) {
+            stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                                  .integer = i});
+            environment_call(env, task->quotation);
+            parallel_expect_one(env, 0);
+
+            if (i > task->begin) {
+                struct value x = env->stack->data[0];
+                env->stack->data[0] = task->results[0];
+                stack_push(env->stack, x);
+                environment_call(env, task->combine);
+                parallel_expect_one(env, 0);
+            }
+
+            task->nresults = 0;
+            parallel_keep(task);
+        }
+        break;
+    }
+
+    gc_remove_roots(env->gc, &task->roots);
+}
+
+/* The other tasks of the job may still be running when this one fails, so
+ * an error ends the task alone, on whichever thread runs it, and the
+ * caller reports it once they have all finished. */
+static void parallel_run(struct pool_task *pool_task) {
+    struct parallel_task *task      = (struct parallel_task *)pool_task;
+    jmp_buf *recovery               = error_recovery;
+    struct error_location *location = error_location;
+    jmp_buf failure;
+
+    task->env =
+        make_environment(task->image, STACK_INITIAL_DEPTH, task->stack_max);
+
+    if (setjmp(failure)) {
+        task->failed = 1;
+    } else {
+        error_recovery = &failure;
+        parallel_work(task);
+    }
+
+    error_location = location;
+    error_recovery = recovery;
+}
+
+static struct parallel_task *parallel_tasks(struct environment *env,
+                                            size_t ntasks) {
+    struct parallel_task *tasks = calloc(ntasks, sizeof(*tasks));
+    if (!tasks)
+        fatalf("error: could not allocate parallel tasks.\n");
+
+    for (size_t i = 0; i < ntasks; i++) {
+        tasks[i].task.run    = parallel_run;
+        tasks[i].roots.visit = parallel_visit;
+        tasks[i].image       = env->image;
+        tasks[i].stack_max   = env->stack->max;
+        tasks[i].input.type  = VALUE_TYPE_INTEGER;
+    }
+    return tasks;
+}
+
+/* Runs the tasks to completion. The caller's quotations they were given
+ * are no longer on its stack by then, but nothing runs on the caller's
+ * environment meanwhile that could collect them. If a task failed, all of
+ * them are released and the builtin named fails in turn. */
+static void parallel_run_tasks(struct environment *env,
+                               struct parallel_task *tasks, size_t ntasks,
+                               char const *name) {
+    struct pool_task **pending = malloc(sizeof(*pending) * ntasks);
+    for (size_t i = 0; i < ntasks; i++)
+        pending[i] = &tasks[i].task;
+
+    /* The tasks share the program, which must stop changing under them. */
+    image_freeze(env->image);
+    pool_run(pending, ntasks);
+    free(pending);
+
+    _Bool failed = 0;
+    for (size_t i = 0; i < ntasks; i++)
+        failed |= tasks[i].failed;
+
+    if (!failed)
+        return;
+
+    for (size_t i = 0; i < ntasks; i++) {
+        environment_destroy(tasks[i].env);
+        free(tasks[i].results);
+    }
+    free(tasks);
+    fatalf("error: a task of %s failed.\n", name);
+}
+
+/* Pushes the results of a finished task, copying the quotations among
+ * them into the caller's collector, and releases the task's environment. */
+static void parallel_take(struct environment *env,
+                          struct parallel_task *task) {
+    for (size_t i = 0; i < task->nresults; i++) {
+        struct value value = task->results[i];
+        if (value.type == VALUE_TYPE_LAMBDA)
+            value.lambda = gc_import(env->gc, value.lambda);
+        stack_push(env->stack, value);
+    }
+
+    environment_destroy(task->env);
+    free(task->results);
+}
+
+static void parallel_take_all(struct environment *env,
+                              struct parallel_task *tasks, size_t ntasks) {
+    for (size_t i = 0; i < ntasks; i++)
+        parallel_take(env, &tasks[i]);
+    free(tasks);
+}
+
+/* Applies the n quotations on top of the stack to copies of the value
+ * below them, all at once. */
+static void parallel_apply(struct environment *env, size_t n,
+                           char const *name) {
+    struct stack *stack = env->stack;
+
+    if (stack->ndata < n + 1)
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    struct value *operands      = stack->data + stack->ndata - n - 1;
+    struct parallel_task *tasks = parallel_tasks(env, n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (operands[i + 1].type != VALUE_TYPE_LAMBDA)
+            fatalf("error: %s operating on non lambda type.\n", name);
+
+        tasks[i].kind      = PARALLEL_APPLY;
+        tasks[i].input     = operands[0];
+        tasks[i].quotation = operands[i + 1].lambda;
+    }
+
+    stack->ndata -= n + 1;
+    parallel_run_tasks(env, tasks, n, name);
+    parallel_take_all(env, tasks, n);
+}
+
+void __pbifunction(struct environment *env) { parallel_apply(env, 2, "pbi"); }
+
+void __pcleavefunction(struct environment *env) {
+    struct value n;
+
+    if (!stack_pop(env->stack, &n))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (n.type != VALUE_TYPE_INTEGER || n.integer < 0)
+        fatalf("error: pcleave expects a count of quotations.\n");
+
+    parallel_apply(env, (size_t)n.integer, "pcleave");
+}
+
+/* Splits 0 to count into chunks whose bounds depend on count alone. */
+static struct parallel_task *parallel_split(struct environment *env,
+                                            int64_t count,
+                                            enum parallel_kind kind,
+                                            struct function *quotation,
+                                            size_t *ntasks) {
+    size_t n = count < PARALLEL_CHUNKS ? (size_t)count : PARALLEL_CHUNKS;
+    struct parallel_task *tasks = parallel_tasks(env, n);
+    int64_t size = count / (int64_t)n, rest = count % (int64_t)n, begin = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        tasks[i].kind      = kind;
+        tasks[i].quotation = quotation;
+        tasks[i].begin     = begin;
+        begin += size + ((int64_t)i < rest);
+        tasks[i].end = begin;
+    }
+
+    *ntasks = n;
+    return tasks;
+}
+
+void __pmapfunction(struct environment *env) {
+    struct value count, quotation;
+
+    if (!stack_pop(env->stack, &quotation) || !stack_pop(env->stack, &count))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (count.type != VALUE_TYPE_INTEGER ||
+        quotation.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: pmap expects an integer and a lambda\n");
+
+    if (count.integer <= 0)
+        return;
+
+    size_t ntasks;
+    struct parallel_task *tasks = parallel_split(
+        env, count.integer, PARALLEL_MAP, quotation.lambda, &ntasks);
+    parallel_run_tasks(env, tasks, ntasks, "pmap");
+    parallel_take_all(env, tasks, ntasks);
+}
+
+/* Each task folds its chunk into one value, and the caller folds those
+ * from the first chunk to the last. */
+void __preducefunction(struct environment *env) {
+    struct value count, quotation, combine;
+
+    if (!stack_pop(env->stack, &combine) ||
+        !stack_pop(env->stack, &quotation) || !stack_pop(env->stack, &count))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (count.type != VALUE_TYPE_INTEGER ||
+        quotation.type != VALUE_TYPE_LAMBDA ||
+        combine.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: preduce expects an integer and two lambdas\n");
+
+    if (count.integer <= 0)
+        fatalf("error: preduce needs at least one index.\n");
+
+    size_t ntasks;
+    struct parallel_task *tasks = parallel_split(
+        env, count.integer, PARALLEL_REDUCE, quotation.lambda, &ntasks);
+    for (size_t i = 0; i < ntasks; i++)
+        tasks[i].combine = combine.lambda;
+
+    size_t base = env->stack->ndata;
+    parallel_run_tasks(env, tasks, ntasks, "preduce");
+    parallel_take(env, &tasks[0]);
+
+    gc_push_root(env->gc, &combine.lambda);
+    for (size_t i = 1; i < ntasks; i++) {
+        parallel_take(env, &tasks[i]);
+        environment_call(env, combine.lambda);
+        parallel_expect_one(env, base);
+    }
+    gc_pop_root(env->gc, 1);
+    free(tasks);
+}
\ No newline at end of file
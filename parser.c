@@ -11,23 +11,10 @@
 #include <windows.h>
 #endif
 
+#include "allocator.h"
 #include "error.h"
 #include "parser.h"
 
-#define GET_NEXT_TOKEN(p, t)                                                   \
-    do {                                                                       \
-        token_destroy((t));                                                    \
-        tokens_pop(&(p)->tokens, &(t));                                        \
-    } while (0)
-
-#ifndef ENABLE_FFI
-char *strdup(char const *str) {
-    char *copy = malloc(strlen(str) + 1);
-    memcpy(copy, str, strlen(str) + 1);
-    return copy;
-}
-#endif
-
 void parser_errorf(struct parser *parser, char *fmt, ...) {
     va_list vargs, vargsd;
 
@@ -39,7 +26,10 @@ void parser_errorf(struct parser *parser, char *fmt, ...) {
         fatalf("error: vsnprintf %d\n", msg_size);
 
     char *error_msg = malloc(msg_size + 1);
-    vsnprintf(error_msg, msg_size, fmt, vargs);
+    vsnprintf(error_msg, msg_size + 1, fmt, vargsd);
+
+    va_end(vargsd);
+    va_end(vargs);
 
     parser->error.message  = error_msg;
     parser->error.needfree = 1;
@@ -60,44 +50,62 @@ void parser_error_finish(struct parser *parser) {
     parser->error.message = NULL;
 }
 
-static struct internal_function internal_functions[] = {
-    {"apply", __applyfunction},
-    {"print", __printfunction},
-    {"prints", __printsfunction},
-    {"dup", __dupfunction},
-    {"swap", __swapfunction},
-    {"rot", __rotfunction},
-    {"bi", __bifunction},
-    {"times", __timesfunction},
-    {"+", __addfunction},
-    {"*", __mulfunction},
-    {".", __dropfunction},
-    {"compose", __composefunction},
-    {"curry", __curryfunction},
-    {"equal?", __equalfunction},
-    {NULL, NULL}};
-
-struct function *make_function(char const *name) {
-    struct function *f = malloc(sizeof(*f));
-    f->name            = strdup("[lambda]");
-
-    if (name)
-        f->name = strdup(name);
-
-    f->words    = calloc(NFUNCTION_WORDS, sizeof(struct word));
+struct token *parser_next_token(struct parser *parser) {
+    if (parser->position >= parser->tokens->size)
+        return NULL;
+
+    return &parser->tokens->data[parser->position++];
+}
+
+static uint32_t main_symbol;
+
+static void parser_init_symbols(void) {
+    if (main_symbol != SYMBOL_NONE)
+        return;
+
+    main_symbol = symbol_intern("main", 4);
+
+    struct internal_function *infn = &internal_functions[0];
+    for (; infn->name; infn++)
+        infn->symbol = symbol_intern(infn->name, strlen(infn->name));
+}
+
+void parser_forget_symbols(void) { main_symbol = SYMBOL_NONE; }
+
+struct function *make_function(uint32_t symbol) {
+    struct function *f = allocator_alloc(&program_allocator, sizeof(*f));
+    f->symbol          = symbol;
+
+    f->words    = allocator_alloc(&program_allocator,
+                                  sizeof(struct word *) * NFUNCTION_WORDS);
     f->capacity = NFUNCTION_WORDS;
     f->size     = 0;
+    f->source   = NULL;
+
+    f->code          = NULL;
+    f->code_size     = 0;
+    f->code_capacity = 0;
+    f->index         = 0;
+    f->origins       = NULL;
+    f->effect        = (struct stack_effect){0};
+    f->threaded      = NULL;
+    f->calls         = 0;
+    f->native        = NULL;
+    f->compiled      = NULL;
+    f->space         = FUNCTION_SPACE_PROGRAM;
+    f->marked        = 0;
+    f->gc_next       = NULL;
 
     return f;
 }
 
-struct word *make_word_string(char const *string) {
+struct word *make_word_string(char const *string, size_t length) {
     struct word *word = NULL;
 
-    word               = malloc(sizeof(*word));
+    word               = allocator_alloc(&program_allocator, sizeof(*word));
     word->type         = WORD_TYPE_VALUE;
     word->value.type   = WORD_VALUE_TYPE_STRING;
-    word->value.string = strdup(string);
+    word->value.string = allocator_strndup(&program_allocator, string, length);
 
     return word;
 }
@@ -105,7 +113,7 @@ struct word *make_word_string(char const *string) {
 struct word *make_word_integer(uint64_t value) {
     struct word *word = NULL;
 
-    word                = malloc(sizeof(*word));
+    word                = allocator_alloc(&program_allocator, sizeof(*word));
     word->type          = WORD_TYPE_VALUE;
     word->value.type    = WORD_VALUE_TYPE_INTEGER;
     word->value.integer = value;
@@ -113,14 +121,13 @@ struct word *make_word_integer(uint64_t value) {
     return word;
 }
 
-struct word *make_word_cfunction(const char *name, cfunction cfn) {
+struct word *make_word_cfunction(struct internal_function *infn) {
     struct word *word = NULL;
 
-    word                        = calloc(1, sizeof(*word));
-    word->type                  = WORD_TYPE_FUNCTION;
-    word->function.type         = FUNCTION_TYPE_CFUNCTION;
-    word->function.cfn.function = cfn;
-    word->function.cfn.name     = strdup(name);
+    word                = allocator_calloc(&program_allocator, sizeof(*word));
+    word->type          = WORD_TYPE_FUNCTION;
+    word->function.type = FUNCTION_TYPE_CFUNCTION;
+    word->function.cfn  = *infn;
 
     return word;
 }
@@ -128,7 +135,7 @@ struct word *make_word_cfunction(const char *name, cfunction cfn) {
 struct word *make_word_regular_function(struct function *fn) {
     struct word *word = NULL;
 
-    word                = calloc(1, sizeof(*word));
+    word                = allocator_calloc(&program_allocator, sizeof(*word));
     word->type          = WORD_TYPE_FUNCTION;
     word->function.type = FUNCTION_TYPE_REGULAR;
     word->function.fn   = fn;
@@ -136,60 +143,77 @@ struct word *make_word_regular_function(struct function *fn) {
     return word;
 }
 
-void environment_add_global(struct environment *env, struct word *function) {
-    if (env->globals_capacity <= (env->globals_size + 1)) {
-        env->globals_capacity++;
-        env->globals_capacity *= 2;
-        env->globals = realloc(env->globals, sizeof(struct function *) *
-                                                 env->globals_capacity);
+void image_add_global(struct image *image, struct word *function) {
+    if (image->globals_capacity <= (image->globals_size + 1)) {
+        image->globals_capacity++;
+        image->globals_capacity *= 2;
+        image->globals   = realloc(image->globals, sizeof(struct function *) *
+                                                     image->globals_capacity);
     }
 
-    env->globals[env->globals_size++] = function;
+    image->globals[image->globals_size++] = function;
+
+    uint32_t symbol = SYMBOL_NONE;
+    switch (function->function.type) {
+    case FUNCTION_TYPE_REGULAR:
+        symbol = function->function.fn->symbol;
+        break;
+#ifdef ENABLE_FFI
+    case FUNCTION_TYPE_FFI:
+        symbol = function->function.ffi_fn->symbol;
+        break;
+#endif
+    default:
+        fatalf("error: unknown function type added as global\n");
+    }
+
+    image_define(image, symbol, function);
+}
+
+static void image_add_builtins(struct image *image) {
+    struct internal_function *infn = &internal_functions[0];
+    for (; infn->name; infn++)
+        image_define(image, infn->symbol, make_word_cfunction(infn));
 }
 
-struct environment *parser_parse_program(struct parser *parser) {
-    struct environment *env = make_environment();
+struct image *parser_parse_program(struct parser *parser) {
+    struct image *image = make_image();
+
+    parser_init_symbols();
+    image_add_builtins(image);
 
     while (1) {
-        struct word *fn = parser_parse_function(parser, env);
+        struct word *fn = parser_parse_function(parser, image);
         if (!parser_success(parser)) {
+            image_destroy(image);
             return NULL;
         }
 
         if (!fn) {
             break;
         }
-
-        environment_add_global(env, fn);
-    }
-
-    _Bool foundmain = 0;
-    for (size_t i = 0; i < env->globals_size; i++) {
-        struct word *word_fn = env->globals[i];
-        if (word_fn->function.type == FUNCTION_TYPE_REGULAR &&
-            strcmp(word_fn->function.fn->name, "main") == 0) {
-            env->entry = word_fn->function.fn;
-            foundmain  = 1;
-            break;
-        }
     }
 
-    if (!foundmain) {
+    struct word *word_main = image_lookup(image, main_symbol);
+    if (word_main && word_main->type == WORD_TYPE_FUNCTION &&
+        word_main->function.type == FUNCTION_TYPE_REGULAR) {
+        image->entry = word_main->function.fn;
+    } else {
         parser_errorf(parser, "error: could not find entry point main.\n");
     }
 
-    return env;
+    return image;
 }
 
 #ifdef ENABLE_FFI
-ffi_type *catcat_identifier_to_ffi_type(char const *ccident) {
-    if (strcmp(ccident, "pointer") == 0) {
+ffi_type *catcat_identifier_to_ffi_type(struct token const *ccident) {
+    if (token_is(ccident, "pointer")) {
         return &ffi_type_pointer;
-    } else if (strcmp(ccident, "int") == 0) {
+    } else if (token_is(ccident, "int")) {
         return &ffi_type_sint;
     } else {
-        fatalf("error: catcat_type_to_ffi_type unsupported type %s.\n",
-               ccident);
+        fatalf("error: catcat_type_to_ffi_type unsupported type %.*s.\n",
+               (int)ccident->length, ccident->lexeme);
     }
 
     return NULL;
@@ -197,62 +221,65 @@ ffi_type *catcat_identifier_to_ffi_type(char const *ccident) {
 #endif
 
 struct word *parser_parse_ffi_function(struct parser *parser,
-                                       struct environment *env,
-                                       char *foreign_function_name) {
+                                       struct image *image, uint32_t symbol) {
 #ifdef ENABLE_FFI
 
-    struct token *token;
-    tokens_pop(&parser->tokens, &token);
+    struct token *token = parser_next_token(parser);
 
     if (token->type != TOKEN_TYPE_COLON) {
         parser_errorf(
             parser,
-            "error: expected colon after ffi definition, but got %s instead.\n",
-            token->lexeme);
+            "error: expected colon after ffi definition, but got %.*s "
+            "instead.\n",
+            (int)token->length, token->lexeme);
         goto parser_error_parse_ffi_function;
     }
 
-    GET_NEXT_TOKEN(parser, token);
+    token = parser_next_token(parser);
 
     if (token->type != TOKEN_TYPE_LITERAL &&
         token->literal.type != LITERAL_TYPE_STRING) {
         parser_errorf(
             parser,
             "error: expected string as first word of ffi definition, but "
-            "got %s instead.\n",
-            token->lexeme);
+            "got %.*s instead.\n",
+            (int)token->length, token->lexeme);
         goto parser_error_parse_ffi_function;
     }
 
-    char const *module_name = token->literal.string;
-    HMODULE module          = LoadLibraryA(module_name);
+    /* The module name is kept for --emit-c, which loads it again. */
+    char *module_name = allocator_strndup(&program_allocator,
+                                          token->literal.string, token->length);
+    HMODULE module    = LoadLibraryA(module_name);
     if (!module) {
         parser_errorf(parser, "error: LoadLibraryA failed, %lu\n",
                       GetLastError());
         goto parser_error_parse_ffi_function;
     }
 
-    FARPROC procaddr = GetProcAddress(module, foreign_function_name);
+    FARPROC procaddr = GetProcAddress(module, symbol_name(symbol));
 
     if (!procaddr)
         fatalf("error: GetProcAddress failed, %lu\n", GetLastError());
 
-    GET_NEXT_TOKEN(parser, token);
+    token = parser_next_token(parser);
     if (token->type != TOKEN_TYPE_IDENTIFIER) {
         parser_errorf(
             parser,
             "error: expected identifier after string in ffi definition, but "
-            "got %s instead.\n",
-            token->lexeme);
+            "got %.*s instead.\n",
+            (int)token->length, token->lexeme);
         goto parser_error_parse_ffi_function;
     }
 
-    struct ffi_function *fn = calloc(1, sizeof(*fn));
-    fn->ret_type            = *catcat_identifier_to_ffi_type(token->lexeme);
+    struct ffi_function *fn =
+        allocator_calloc(&program_allocator, sizeof(*fn));
+    fn->ret_type            = *catcat_identifier_to_ffi_type(token);
     fn->fn                  = procaddr;
-    fn->name                = foreign_function_name;
+    fn->symbol              = symbol;
+    fn->module              = module_name;
 
-    GET_NEXT_TOKEN(parser, token);
+    token = parser_next_token(parser);
 
     while (token && token->type != TOKEN_TYPE_SEMICOLON) {
         if (!token) {
@@ -262,8 +289,8 @@ struct word *parser_parse_ffi_function(struct parser *parser,
             goto parser_error_parse_ffi_function;
         }
 
-        fn->args[fn->nargs++] = catcat_identifier_to_ffi_type(token->lexeme);
-        GET_NEXT_TOKEN(parser, token);
+        fn->args[fn->nargs++] = catcat_identifier_to_ffi_type(token);
+        token = parser_next_token(parser);
     }
 
     if (!token) {
@@ -279,69 +306,73 @@ struct word *parser_parse_ffi_function(struct parser *parser,
         goto parser_error_parse_ffi_function;
     }
 
-    struct word *word     = calloc(1, sizeof(*word));
+    struct word *word     = allocator_calloc(&program_allocator, sizeof(*word));
     word->type            = WORD_TYPE_FUNCTION;
     word->function.type   = FUNCTION_TYPE_FFI;
     word->function.ffi_fn = fn;
+
+    image_add_global(image, word);
     return word;
 
 parser_error_parse_ffi_function:
-    token_destroy(token);
     return NULL;
 #else
     fatalf("FFI support not enabled.");
 #endif
 }
 
-struct word *parser_parse_function(struct parser *parser,
-                                   struct environment *env) {
+struct word *parser_parse_function(struct parser *parser, struct image *image) {
     struct token *token;
     struct word *word;
 
-    tokens_pop(&parser->tokens, &token);
+    token = parser_next_token(parser);
     if (!token)
         return NULL;
 
     if (token->type != TOKEN_TYPE_IDENTIFIER) {
-        parser_errorf(parser,
-                      "error: expected function name, but got %s instead.\n",
-                      token->lexeme);
+        parser_errorf(
+            parser, "error: expected function name, but got %.*s instead.\n",
+            (int)token->length, token->lexeme);
         goto parser_error_parse_function;
     }
 
-    if (strlen(token->lexeme) > 4) {
+    if (token->length > 4) {
         if (memcmp(token->lexeme, "ffi@", 4) == 0) {
-            char *foreign_function_name = strdup(token->lexeme + 4);
-            token_destroy(token);
+            uint32_t symbol =
+                symbol_intern(token->lexeme + 4, token->length - 4);
 
-            return parser_parse_ffi_function(parser, env,
-                                             foreign_function_name);
+            return parser_parse_ffi_function(parser, image, symbol);
         }
     }
 
-    struct function *function = make_function(token->lexeme);
+    struct function *function = make_function(token->symbol);
     word                      = make_word_regular_function(function);
 
-    GET_NEXT_TOKEN(parser, token);
+    /* Defined before its body is parsed so that the body can refer to the
+     * function itself. */
+    image_add_global(image, word);
+
+    token = parser_next_token(parser);
 
     if (token->type != TOKEN_TYPE_COLON) {
         parser_errorf(
             parser,
-            "error: expected colon after function name, but got %s instead.\n",
-            token->lexeme);
+            "error: expected colon after function name, but got %.*s "
+            "instead.\n",
+            (int)token->length, token->lexeme);
         goto parser_error_parse_function;
     }
 
-    parser_parse_function_body(parser, env, function, 0);
+    parser->definition = function->symbol;
+    parser_parse_function_body(parser, image, function, 0);
 
     return word;
 
 parser_error_parse_function:
-    token_destroy(token);
     return NULL;
 }
 
-void parser_parse_function_body(struct parser *parser, struct environment *env,
+void parser_parse_function_body(struct parser *parser, struct image *image,
                                 struct function *function, _Bool islambda) {
     if (!parser_success(parser))
         return;
@@ -350,14 +381,14 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
 
     while (1) {
         struct word *word = NULL;
-        tokens_pop(&parser->tokens, &token);
+        token             = parser_next_token(parser);
 
         if (!token) {
             parser_errorf(
                 parser,
                 "error in function %s: end of tokens, but expected end of "
                 "function.\n",
-                function->name);
+                symbol_name(function->symbol));
             goto parser_error_parse_function_body;
         }
 
@@ -368,7 +399,7 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
         case TOKEN_TYPE_LITERAL: {
             switch (token->literal.type) {
             case LITERAL_TYPE_STRING: {
-                word = make_word_string(token->literal.string);
+                word = make_word_string(token->literal.string, token->length);
                 break;
             }
             case LITERAL_TYPE_INTEGER: {
@@ -376,65 +407,35 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
                 break;
             }
             default: {
-                parser_errorf(parser, "error: unspported literal %s.\n",
-                              token->lexeme);
+                parser_errorf(parser, "error: unspported literal %.*s.\n",
+                              (int)token->length, token->lexeme);
                 goto parser_error_parse_function_body;
             }
             }
             break;
         }
         case TOKEN_TYPE_IDENTIFIER: {
-            _Bool found_internal_function  = 0;
-            struct internal_function *infn = &internal_functions[0];
-            for (; infn->name; infn++) {
-                if (strcmp(infn->name, token->lexeme) == 0) {
-                    word = make_word_cfunction(infn->name, infn->function);
-                    found_internal_function = 1;
-                    break;
-                }
+            struct word *global = image_lookup(image, token->symbol);
+            if (!global) {
+                parser_errorf(
+                    parser,
+                    "error in function %s: found unknown identifier, %.*s.\n",
+                    symbol_name(function->symbol), (int)token->length,
+                    token->lexeme);
+                goto parser_error_parse_function_body;
             }
 
-            if (!found_internal_function) {
-                _Bool found_globalfn = 0;
-                for (size_t i = 0; i < env->globals_size; i++) {
-                    char *fn_name        = NULL;
-                    struct word *word_fn = env->globals[i];
-                    switch (word_fn->function.type) {
-                    case FUNCTION_TYPE_REGULAR:
-                        fn_name = word_fn->function.fn->name;
-                        break;
-#ifdef ENABLE_FFI
-                    case FUNCTION_TYPE_FFI:
-                        fn_name = word_fn->function.ffi_fn->name;
-                        break;
-#endif
-                    default:
-                        fatalf("error: unknown function type matched\n");
-                    }
-
-                    if (strcmp(fn_name, token->lexeme) == 0) {
-                        word = calloc(1, sizeof(*word));
-                        word_copy(word, env->globals[i]);
-                        found_globalfn = 1;
-                        break;
-                    }
-                }
-
-                if (!found_globalfn) {
-                    parser_errorf(
-                        parser,
-                        "error in function %s: found unknown identifier, %s.\n",
-                        function->name, token->lexeme);
-                    goto parser_error_parse_function_body;
-                }
-            }
+            word = allocator_calloc(&program_allocator, sizeof(*word));
+            word_copy(word, global);
             break;
         }
         case TOKEN_TYPE_LEFT_BRACKET: {
-            struct function *lambda = make_function(NULL);
-            parser_parse_function_body(parser, env, lambda, 1);
+            /* Lambdas are named after the definition they are written in,
+             * which is what errors inside them report. */
+            struct function *lambda = make_function(parser->definition);
+            parser_parse_function_body(parser, image, lambda, 1);
 
-            word         = calloc(1, sizeof(*word));
+            word         = allocator_calloc(&program_allocator, sizeof(*word));
             word->type   = WORD_TYPE_LAMBDA;
             word->lambda = lambda;
             break;
@@ -445,7 +446,7 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
                     parser,
                     "error in function %s: found a ending bracket, but not "
                     "parsing a lambda.\n",
-                    function->name);
+                    symbol_name(function->symbol));
                 goto parser_error_parse_function_body;
             }
 
@@ -454,8 +455,10 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
         default: {
             parser_errorf(
                 parser,
-                "error in function %s: unexpected token, %s, while parsing.\n",
-                function->name, token->lexeme);
+                "error in function %s: unexpected token, %.*s, while "
+                "parsing.\n",
+                symbol_name(function->symbol), (int)token->length,
+                token->lexeme);
             goto parser_error_parse_function_body;
         }
         }
@@ -464,12 +467,12 @@ void parser_parse_function_body(struct parser *parser, struct environment *env,
             parser_errorf(parser, "error: unexpectedly recieved NULL word.\n");
             goto parser_error_parse_function_body;
         }
+        word->origin    = parser->definition;
+        word->unchecked = 0;
         function_add_word(function, word);
-        token_destroy(token);
     }
 
 parser_parse_function_body_return:
 parser_error_parse_function_body:
-    token_destroy(token);
     return;
 }
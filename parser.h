@@ -6,6 +6,7 @@
 
 #include "kernel.h"
 #include "lexer.h"
+#include "symbol.h"
 
 #define NFUNCTION_WORDS 256
 
@@ -17,14 +18,27 @@ struct parser_error {
 };
 
 struct parser {
-    struct token *tokens;
+    struct tokens *tokens;
+    size_t position;
     struct parser_error error;
+
+    /* The symbol of the definition being parsed. */
+    uint32_t definition;
 };
 
-struct environment *parser_parse_program(struct parser *parser);
-struct word *parser_parse_function(struct parser *parser,
-                                   struct environment *env);
-void parser_parse_function_body(struct parser *parser, struct environment *env,
+_Bool parser_success(struct parser *parser);
+void parser_error_finish(struct parser *parser);
+struct token *parser_next_token(struct parser *parser);
+
+struct function *make_function(uint32_t symbol);
+
+/* Forgets the symbols of main and the builtins, so that the next program
+ * parsed interns them again. Called after symbols_destroy. */
+void parser_forget_symbols(void);
+
+struct image *parser_parse_program(struct parser *parser);
+struct word *parser_parse_function(struct parser *parser, struct image *image);
+void parser_parse_function_body(struct parser *parser, struct image *image,
                                 struct function *function, _Bool islambda);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,275 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "error.h"
+#include "pool.h"
+#include "thread.h"
+
+/* The deque of Chase and Lev, with the memory orders of Lê et al.: only
+ * its owner moves bottom, and thieves race for the task at top with a
+ * compare and swap. It does not grow; a worker that fills it runs the
+ * next task itself instead of queueing it. */
+struct pool_deque {
+    _Atomic(int64_t) top;
+    _Atomic(int64_t) bottom;
+    _Atomic(struct pool_task *) tasks[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+    struct pool_deque deque;
+    struct thread thread;
+    size_t index;
+};
+
+static struct {
+    struct pool_worker *workers;
+    size_t nworkers;
+
+    /* Guards the queue of tasks from other threads and the sleep of idle
+     * workers, who wait for generation to change. */
+    struct thread_mutex lock;
+    struct thread_condition wake;
+    atomic_size_t generation;
+    size_t sleeping;
+    _Bool stopping;
+
+    struct pool_task **queue;
+    size_t queue_head;
+    size_t queue_size;
+    size_t queue_capacity;
+    atomic_size_t queued;
+} pool;
+
+static _Thread_local struct pool_worker *pool_self;
+
+static _Bool pool_push(struct pool_deque *deque, struct pool_task *task) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (b - t >= POOL_DEQUE_SIZE)
+        return 0;
+
+    atomic_store_explicit(&deque->tasks[b % POOL_DEQUE_SIZE], task,
+                          memory_order_release);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+static struct pool_task *pool_pop(struct pool_deque *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct pool_task *task = atomic_load_explicit(
+        &deque->tasks[b % POOL_DEQUE_SIZE], memory_order_relaxed);
+    if (t == b) {
+        /* The last task: a thief may be taking it at the same time. */
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static struct pool_task *pool_steal(struct pool_deque *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+
+    struct pool_task *task = atomic_load_explicit(
+        &deque->tasks[t % POOL_DEQUE_SIZE], memory_order_acquire);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static void pool_enqueue(struct pool_task **tasks, size_t ntasks) {
+    thread_mutex_lock(&pool.lock);
+
+    if (pool.queue_head + pool.queue_size + ntasks > pool.queue_capacity) {
+        if (pool.queue_size)
+            memmove(pool.queue, pool.queue + pool.queue_head,
+                    sizeof(struct pool_task *) * pool.queue_size);
+        pool.queue_head = 0;
+
+        while (pool.queue_size + ntasks > pool.queue_capacity)
+            pool.queue_capacity =
+                pool.queue_capacity ? pool.queue_capacity * 2 : 64;
+        pool.queue = realloc(pool.queue, sizeof(struct pool_task *) *
+                                             pool.queue_capacity);
+    }
+
+    memcpy(pool.queue + pool.queue_head + pool.queue_size, tasks,
+           sizeof(struct pool_task *) * ntasks);
+    pool.queue_size += ntasks;
+    atomic_store(&pool.queued, pool.queue_size);
+
+    thread_mutex_unlock(&pool.lock);
+}
+
+static struct pool_task *pool_dequeue(void) {
+    struct pool_task *task = NULL;
+
+    if (!atomic_load_explicit(&pool.queued, memory_order_relaxed))
+        return NULL;
+
+    thread_mutex_lock(&pool.lock);
+    if (pool.queue_size) {
+        task = pool.queue[pool.queue_head++];
+        pool.queue_size--;
+        atomic_store(&pool.queued, pool.queue_size);
+    }
+    thread_mutex_unlock(&pool.lock);
+    return task;
+}
+
+/* Looks for a task in the deque of the calling worker first, then among
+ * those handed over by other threads, then in the other workers' deques,
+ * starting past the caller's so that thieves spread out. */
+static struct pool_task *pool_find(struct pool_worker *self) {
+    struct pool_task *task;
+
+    if (self && (task = pool_pop(&self->deque)))
+        return task;
+
+    if ((task = pool_dequeue()))
+        return task;
+
+    size_t start = self ? self->index + 1 : 0;
+    for (size_t i = 0; i < pool.nworkers; i++) {
+        struct pool_worker *victim =
+            &pool.workers[(start + i) % pool.nworkers];
+
+        if (victim != self && (task = pool_steal(&victim->deque)))
+            return task;
+    }
+    return NULL;
+}
+
+/* The job is owned by the thread waiting for it, which may return as
+ * soon as pending drops to zero, so it is not touched after that. */
+static void pool_execute(struct pool_task *task) {
+    struct pool_job *job = task->job;
+
+    task->run(task);
+    atomic_fetch_sub_explicit(&job->pending, 1, memory_order_release);
+}
+
+static void pool_wake(void) {
+    thread_mutex_lock(&pool.lock);
+    atomic_fetch_add(&pool.generation, 1);
+    if (pool.sleeping)
+        thread_condition_broadcast(&pool.wake);
+    thread_mutex_unlock(&pool.lock);
+}
+
+static void pool_worker_main(void *argument) {
+    struct pool_worker *self = argument;
+    pool_self                = self;
+
+    for (;;) {
+        /* Read before looking, so that tasks submitted after the search
+         * came up empty change it and keep the worker from sleeping. */
+        size_t generation = atomic_load(&pool.generation);
+
+        struct pool_task *task = pool_find(self);
+        if (task) {
+            pool_execute(task);
+            continue;
+        }
+
+        thread_mutex_lock(&pool.lock);
+        pool.sleeping++;
+        while (!pool.stopping && atomic_load(&pool.generation) == generation)
+            thread_condition_wait(&pool.wake, &pool.lock);
+        pool.sleeping--;
+        _Bool stopping = pool.stopping;
+        thread_mutex_unlock(&pool.lock);
+
+        if (stopping)
+            return;
+    }
+}
+
+void pool_init(size_t nworkers) {
+    thread_mutex_init(&pool.lock);
+    thread_condition_init(&pool.wake);
+
+    if (!nworkers)
+        return;
+
+    pool.workers = calloc(nworkers, sizeof(struct pool_worker));
+    if (!pool.workers)
+        fatalf("error: could not allocate the worker pool.\n");
+
+    pool.nworkers = nworkers;
+    for (size_t i = 0; i < nworkers; i++) {
+        pool.workers[i].index = i;
+        thread_start(&pool.workers[i].thread, pool_worker_main,
+                     &pool.workers[i], THREAD_STACK_SIZE);
+    }
+}
+
+void pool_destroy(void) {
+    thread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    thread_condition_broadcast(&pool.wake);
+    thread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < pool.nworkers; i++)
+        thread_join(&pool.workers[i].thread);
+
+    thread_condition_destroy(&pool.wake);
+    thread_mutex_destroy(&pool.lock);
+    free(pool.workers);
+    free(pool.queue);
+    memset(&pool, 0, sizeof(pool));
+}
+
+void pool_run(struct pool_task **tasks, size_t ntasks) {
+    struct pool_job job;
+    atomic_init(&job.pending, ntasks);
+
+    for (size_t i = 0; i < ntasks; i++)
+        tasks[i]->job = &job;
+
+    if (!pool.nworkers) {
+        for (size_t i = 0; i < ntasks; i++)
+            pool_execute(tasks[i]);
+        return;
+    }
+
+    struct pool_worker *self = pool_self;
+    if (self) {
+        for (size_t i = 0; i < ntasks; i++) {
+            if (!pool_push(&self->deque, tasks[i]))
+                pool_execute(tasks[i]);
+        }
+    } else {
+        pool_enqueue(tasks, ntasks);
+    }
+    pool_wake();
+
+    while (atomic_load_explicit(&job.pending, memory_order_acquire)) {
+        struct pool_task *task = pool_find(self);
+
+        if (task)
+            pool_execute(task);
+        else
+            thread_yield();
+    }
+}
\ No newline at end of file
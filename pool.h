@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* A work-stealing pool of worker threads. Each worker keeps a deque of
+ * tasks: it pushes and pops its own at the bottom, and idle workers steal
+ * from the top of the others'. Threads that are not workers hand their
+ * tasks over through a shared queue. A thread waiting for its tasks runs
+ * queued ones itself meanwhile, so tasks may submit more and wait on them
+ * without tying up a worker. */
+#define POOL_DEQUE_SIZE 1024
+
+struct pool_job {
+    atomic_size_t pending;
+};
+
+struct pool_task {
+    void (*run)(struct pool_task *task);
+    struct pool_job *job;
+};
+
+/* Starts nworkers threads. With none, tasks run one after the other on
+ * the thread that submits them. */
+void pool_init(size_t nworkers);
+void pool_destroy(void);
+
+/* Runs every task and returns once all of them have finished. */
+void pool_run(struct pool_task **tasks, size_t ntasks);
+
+#endif
\ No newline at end of file
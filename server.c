@@ -0,0 +1,487 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "checker.h"
+#include "compiler.h"
+#include "error.h"
+#include "fiber.h"
+#include "gc.h"
+#include "lexer.h"
+#include "parser.h"
+#include "server.h"
+#include "symbol.h"
+
+#ifdef _WIN32
+void server_serve(char const *path, struct server_options const *options) {
+    (void)path;
+    (void)options;
+    fatalf("error: --serve needs Unix sockets, which this build lacks.\n");
+}
+#else
+/* A program kept from an earlier request, compiled and ready to run. */
+struct server_program {
+    uint64_t hash;
+    char *source;
+    size_t size;
+    struct image *image;
+    size_t depth;
+    uint64_t used;
+};
+
+struct server {
+    struct server_options const *options;
+    struct lexer lexer;
+    int stdout_fd;
+    int stderr_fd;
+    _Bool stopping;
+
+    struct server_program cache[SERVER_CACHE_SIZE];
+    size_t ncached;
+    uint64_t clock;
+    size_t requests;
+    size_t hits;
+
+    /* The request being read. */
+    char *source;
+    size_t source_capacity;
+    struct value *inputs;
+    size_t ninputs;
+    size_t inputs_capacity;
+
+    /* The environment of the last program that ran to completion, which
+     * the next request runs on instead of making one. */
+    struct environment *env;
+
+    /* What a fatal error leaves behind: the tokens and the image being
+     * built, or the environment running. */
+    struct tokens tokens;
+    struct image *building;
+    struct environment *running;
+};
+
+/* FNV-1a. */
+static uint64_t server_hash(char const *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static void server_release(struct server *server,
+                           struct server_program *program) {
+    /* The pooled environment may still point at the image. */
+    if (server->env && server->env->image == program->image) {
+        environment_destroy(server->env);
+        server->env = NULL;
+    }
+
+    if (program->image->program)
+        program_destroy(program->image->program);
+    image_destroy(program->image);
+    free(program->source);
+}
+
+/* Releases every cached program, and with them the last symbols they
+ * use, so that the symbol table can start afresh. */
+static void server_forget(struct server *server) {
+    for (size_t i = 0; i < server->ncached; i++)
+        server_release(server, &server->cache[i]);
+    server->ncached = 0;
+
+    symbols_destroy();
+    parser_forget_symbols();
+}
+
+/* Parses, checks and compiles source. Returns NULL, after reporting why,
+ * when the program is rejected. */
+static struct image *server_build(struct server *server, char const *source,
+                                  size_t size, size_t *depth) {
+    struct server_options const *options = server->options;
+
+    lexer_tokenize(&server->lexer, source, size, &server->tokens);
+
+    struct parser parser = {&server->tokens};
+    struct image *image  = parser_parse_program(&parser);
+    tokens_destroy(&server->tokens);
+
+    if (!parser_success(&parser)) {
+        fprintf(stderr, "%s", parser.error.message);
+        parser_error_finish(&parser);
+        if (image)
+            image_destroy(image);
+        allocator_reset(&program_allocator);
+        return NULL;
+    }
+
+    server->building = image;
+    optimizer_optimize_program(image, options->level,
+                               options->inline_threshold, 0);
+
+    /* main may be given inputs, so its depth is counted above them. */
+    *depth = checker_check_program(image, 1);
+    image_own(image);
+
+    if (!options->tree_walk)
+        compiler_compile_program(image, options->level > OPTIMIZER_LEVEL_NONE);
+    server->building = NULL;
+
+    return image;
+}
+
+/* Finds the program with the given source in the cache, building it and
+ * evicting the least recently used one if it is not there. */
+static struct server_program *server_lookup(struct server *server,
+                                            char const *source, size_t size) {
+    uint64_t hash = server_hash(source, size);
+
+    for (size_t i = 0; i < server->ncached; i++) {
+        struct server_program *program = &server->cache[i];
+        if (program->hash == hash && program->size == size &&
+            memcmp(program->source, source, size) == 0) {
+            program->used = ++server->clock;
+            server->hits++;
+            return program;
+        }
+    }
+
+    if (symbol_count() > SERVER_SYMBOLS_MAX)
+        server_forget(server);
+
+    size_t depth;
+    struct image *image = server_build(server, source, size, &depth);
+    if (!image)
+        return NULL;
+
+    struct server_program *program;
+    if (server->ncached < SERVER_CACHE_SIZE) {
+        program = &server->cache[server->ncached++];
+    } else {
+        program = &server->cache[0];
+        for (size_t i = 1; i < SERVER_CACHE_SIZE; i++) {
+            if (server->cache[i].used < program->used)
+                program = &server->cache[i];
+        }
+        server_release(server, program);
+    }
+
+    program->hash   = hash;
+    program->source = malloc(size ? size : 1);
+    program->size   = size;
+    program->image  = image;
+    program->depth  = depth;
+    program->used   = ++server->clock;
+    memcpy(program->source, source, size);
+    return program;
+}
+
+static void server_run(struct server *server, struct server_program *program) {
+    struct server_options const *options = server->options;
+
+    size_t depth = program->depth + server->ninputs;
+    if (depth > options->stack_max)
+        fatalf("error: main needs %zu stack values, more than the maximum of "
+               "%zu.\n",
+               depth, options->stack_max);
+    if (depth < options->stack_size)
+        depth = options->stack_size;
+
+    struct environment *env = server->env;
+    server->env             = NULL;
+
+    if (env && env->stack->capacity < depth) {
+        environment_destroy(env);
+        env = NULL;
+    }
+
+    if (!env) {
+        env = make_environment(program->image, depth, options->stack_max);
+    } else if (env->image != program->image) {
+        /* Quotations left from another program are dropped with it. */
+        gc_destroy(env->gc);
+        gc_init(env->gc, env->stack);
+        env->image = program->image;
+    }
+    env->stack->ndata = 0;
+    server->running   = env;
+
+    for (size_t i = 0; i < server->ninputs; i++)
+        stack_push(env->stack, server->inputs[i]);
+    environment_execute(env);
+
+    /* Fibers the program left behind may still print or use its inputs,
+     * and fail the request if one of them fails. */
+    _Bool failed = fiber_destroy();
+    fiber_init(options->nfiber_threads);
+    if (failed)
+        fatalf("error: a fiber that was not joined failed.\n");
+
+    server->running = NULL;
+    server->env     = env;
+}
+
+/* Releases what the request that failed was building or running. */
+static void server_recover(struct server *server) {
+    error_location = NULL;
+
+    tokens_destroy(&server->tokens);
+    if (server->building) {
+        if (server->building->program)
+            program_destroy(server->building->program);
+        image_destroy(server->building);
+        server->building = NULL;
+    }
+    allocator_reset(&program_allocator);
+
+    fiber_destroy();
+    fiber_init(server->options->nfiber_threads);
+
+    if (server->running) {
+        environment_destroy(server->running);
+        server->running = NULL;
+    }
+}
+
+/* Runs the request that has been read, with the output of the program
+ * and its errors going to the client. */
+static void server_request(struct server *server, int client, size_t size) {
+    jmp_buf recovery;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(client, STDOUT_FILENO);
+    dup2(client, STDERR_FILENO);
+    server->requests++;
+
+    if (!setjmp(recovery)) {
+        error_recovery = &recovery;
+
+        struct server_program *program =
+            server_lookup(server, server->source, size);
+        if (program) {
+            server_run(server, program);
+            fputc('\0', stdout);
+            fputs("ok\n", stdout);
+            stack_print(server->env->stack);
+        } else {
+            fputc('\0', stdout);
+            fputs("error\n", stdout);
+        }
+    } else {
+        fflush(stderr);
+        server_recover(server);
+        fputc('\0', stdout);
+        fputs("error\n", stdout);
+    }
+    error_recovery = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(server->stdout_fd, STDOUT_FILENO);
+    dup2(server->stderr_fd, STDERR_FILENO);
+    clearerr(stdout);
+    clearerr(stderr);
+}
+
+/* Answers a request that could not be read, after which the connection
+ * is closed, since the rest of what the client sent cannot be trusted. */
+static void server_reject(int client, char const *message) {
+    size_t length = strlen(message);
+
+    if (write(client, message, length) < 0 ||
+        write(client, "\0error\n", 7) < 0)
+        return;
+}
+
+/* Reads an input line, an integer or a double-quoted string, returning why
+ * it could not be read, or NULL. */
+static char const *server_read_input(FILE *in, struct value *value) {
+    char line[SERVER_LINE_MAX];
+
+    if (!fgets(line, sizeof(line), in))
+        return "error: truncated request.\n";
+
+    size_t length = strcspn(line, "\n");
+    if (line[length] != '\n')
+        return "error: truncated request.\n";
+    line[length] = '\0';
+
+    if (length >= 2 && line[0] == '"' && line[length - 1] == '"') {
+        value->type   = VALUE_TYPE_STRING;
+        value->string = strndup(line + 1, length - 2);
+        return value->string ? NULL : "error: out of memory.\n";
+    }
+
+    char *end;
+    errno          = 0;
+    value->type    = VALUE_TYPE_INTEGER;
+    value->integer = strtoll(line, &end, 10);
+    if (end == line || *end != '\0' || errno != 0)
+        return "error: an input is neither an integer nor a quoted "
+               "string.\n";
+    return NULL;
+}
+
+static void server_free_inputs(struct server *server) {
+    for (size_t i = 0; i < server->ninputs; i++) {
+        if (server->inputs[i].type == VALUE_TYPE_STRING)
+            free(server->inputs[i].string);
+    }
+    server->ninputs = 0;
+}
+
+/* Reads the source and the inputs of a run request, returning why it could
+ * not be read, or NULL. */
+static char const *server_read_request(struct server *server, FILE *in,
+                                       size_t size, size_t ninputs) {
+    if (size > server->source_capacity) {
+        free(server->source);
+        server->source          = malloc(size);
+        server->source_capacity = server->source ? size : 0;
+        if (!server->source)
+            return "error: out of memory.\n";
+    }
+
+    if (fread(server->source, 1, size, in) != size)
+        return "error: truncated request.\n";
+
+    if (ninputs > server->inputs_capacity) {
+        free(server->inputs);
+        server->inputs          = malloc(sizeof(struct value) * ninputs);
+        server->inputs_capacity = server->inputs ? ninputs : 0;
+        if (!server->inputs)
+            return "error: out of memory.\n";
+    }
+
+    for (; server->ninputs < ninputs; server->ninputs++) {
+        char const *error =
+            server_read_input(in, &server->inputs[server->ninputs]);
+        if (error)
+            return error;
+    }
+
+    return NULL;
+}
+
+static void server_connection(struct server *server, int client) {
+    FILE *in = fdopen(client, "r");
+    char line[SERVER_LINE_MAX];
+
+    if (!in) {
+        close(client);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        size_t size, ninputs;
+
+        if (strcmp(line, "quit\n") == 0) {
+            server->stopping = 1;
+            break;
+        }
+
+        if (sscanf(line, "run %zu %zu", &size, &ninputs) != 2 ||
+            size > SERVER_SOURCE_MAX || ninputs > SERVER_INPUTS_MAX) {
+            server_reject(client, "error: malformed request.\n");
+            break;
+        }
+
+        char const *error = server_read_request(server, in, size, ninputs);
+        if (!error)
+            server_request(server, client, size);
+        server_free_inputs(server);
+
+        if (error) {
+            server_reject(client, error);
+            break;
+        }
+    }
+
+    fclose(in);
+}
+
+static void server_destroy(struct server *server) {
+    if (server->env) {
+        environment_destroy(server->env);
+        server->env = NULL;
+    }
+    for (size_t i = 0; i < server->ncached; i++)
+        server_release(server, &server->cache[i]);
+
+    close(server->stdout_fd);
+    close(server->stderr_fd);
+    free(server->source);
+    free(server->inputs);
+}
+
+void server_serve(char const *path, struct server_options const *options) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    struct stat status;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+        fatalf("error: socket path %s is too long.\n", path);
+    strcpy(address.sun_path, path);
+
+    /* A socket left by a server that did not stop cleanly is replaced, but
+     * nothing else is. */
+    if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, 16) < 0)
+        fatalf("error: could not listen on %s, %s.\n", path, strerror(errno));
+
+    /* A client that goes away only fails the writes of its request. */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct server server = {options};
+    lexer_init(&server.lexer);
+    server.stdout_fd = dup(STDOUT_FILENO);
+    server.stderr_fd = dup(STDERR_FILENO);
+    fiber_init(options->nfiber_threads);
+
+    while (!server.stopping) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fatalf("error: accept failed, %s.\n", strerror(errno));
+        }
+
+        /* A read that times out ends the connection as if the client had
+         * closed it. */
+        struct timeval timeout = {SERVER_TIMEOUT_SECONDS, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        server_connection(&server, client);
+    }
+
+    fprintf(stderr, "served %zu requests, %zu from the cache.\n",
+            server.requests, server.hits);
+
+    fiber_destroy();
+    server_destroy(&server);
+    close(listener);
+    unlink(path);
+}
+#endif
\ No newline at end of file
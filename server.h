@@ -0,0 +1,50 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdlib.h>
+
+#include "optimizer.h"
+
+/* catcat --serve keeps running on a Unix socket and runs the programs its
+ * clients send it, so that they are spared starting a process and, when
+ * they send the same program again, parsing and compiling it. A client
+ * writes requests of the form
+ *
+ *     run <source size> <number of inputs>\n
+ *     <source><one input per line>
+ *
+ * where an input is an integer or a double-quoted string, pushed onto the
+ * stack before main runs. The server answers with everything the program
+ * printed, a NUL byte, then either ok and a line with the stack main left,
+ * or error. A connection can carry any number of requests; quit stops the
+ * server. Requests are served one at a time, so a connection that the
+ * server waits on for SERVER_TIMEOUT_SECONDS without receiving anything
+ * is closed rather than left to hold up the others.
+ *
+ * The cache keeps the SERVER_CACHE_SIZE programs used last. Names are
+ * interned for the whole process rather than per program, so once the
+ * symbol table holds more than SERVER_SYMBOLS_MAX of them, the cache is
+ * emptied and the table started afresh before the next program is built.
+ * What distinct programs leave behind is bounded that way. */
+#define SERVER_CACHE_SIZE 64
+#define SERVER_SYMBOLS_MAX 65536
+#define SERVER_TIMEOUT_SECONDS 10
+
+/* The largest program, the most inputs and the longest input line a
+ * request may carry. */
+#define SERVER_SOURCE_MAX (16 * 1024 * 1024)
+#define SERVER_INPUTS_MAX 65536
+#define SERVER_LINE_MAX   4096
+
+struct server_options {
+    enum optimizer_level level;
+    size_t inline_threshold;
+    _Bool tree_walk;
+    size_t stack_size;
+    size_t stack_max;
+    size_t nfiber_threads;
+};
+
+void server_serve(char const *path, struct server_options const *options);
+
+#endif
\ No newline at end of file
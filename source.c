@@ -0,0 +1,109 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "source.h"
+
+/* An empty file cannot be mapped, so it is represented by a static empty
+ * buffer instead. */
+static char const empty_source[1] = {'\0'};
+
+#ifdef _WIN32
+_Bool source_map(struct source *source, char const *path) {
+    memset(source, 0, sizeof(*source));
+
+    source->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (source->file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(source->file, &size)) {
+        CloseHandle(source->file);
+        return 0;
+    }
+
+    if (size.QuadPart == 0) {
+        CloseHandle(source->file);
+        source->file = NULL;
+        source->data = empty_source;
+        return 1;
+    }
+
+    source->mapping =
+        CreateFileMappingA(source->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!source->mapping) {
+        CloseHandle(source->file);
+        return 0;
+    }
+
+    source->data = MapViewOfFile(source->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!source->data) {
+        CloseHandle(source->mapping);
+        CloseHandle(source->file);
+        return 0;
+    }
+
+    source->size = (size_t)size.QuadPart;
+    return 1;
+}
+
+void source_unmap(struct source *source) {
+    if (source->data != empty_source) {
+        UnmapViewOfFile(source->data);
+        CloseHandle(source->mapping);
+        CloseHandle(source->file);
+    }
+
+    memset(source, 0, sizeof(*source));
+}
+#else
+_Bool source_map(struct source *source, char const *path) {
+    memset(source, 0, sizeof(*source));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        source->data = empty_source;
+        return 1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return 0;
+
+    source->data = data;
+    source->size = st.st_size;
+    return 1;
+}
+
+void source_unmap(struct source *source) {
+    if (source->data != empty_source)
+        munmap((void *)source->data, source->size);
+
+    memset(source, 0, sizeof(*source));
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+struct source {
+    char const *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+_Bool source_map(struct source *source, char const *path);
+void source_unmap(struct source *source);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "error.h"
+#include "symbol.h"
+
+struct symbol_entry {
+    char *name;
+    size_t length;
+    uint32_t hash;
+};
+
+/* The table keeps the names in id order and an open-addressing index of
+ * ids keyed by the name hash, so interning a name already seen costs one
+ * hash and usually a single probe. */
+static struct {
+    struct symbol_entry *entries;
+    size_t entries_size;
+    size_t entries_capacity;
+    uint32_t *slots;
+    size_t slots_capacity;
+    struct allocator names;
+} symbols;
+
+static uint32_t symbol_hash(char const *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void symbols_rehash(size_t capacity) {
+    free(symbols.slots);
+
+    symbols.slots          = calloc(capacity, sizeof(uint32_t));
+    symbols.slots_capacity = capacity;
+    if (!symbols.slots)
+        fatalf("error: could not allocate symbol table.\n");
+
+    for (size_t id = 1; id < symbols.entries_size; id++) {
+        size_t i = symbols.entries[id].hash & (capacity - 1);
+        while (symbols.slots[i])
+            i = (i + 1) & (capacity - 1);
+
+        symbols.slots[i] = (uint32_t)id;
+    }
+}
+
+uint32_t symbol_intern(char const *name, size_t length) {
+    if (!symbols.slots) {
+        /* Entry 0 is reserved for SYMBOL_NONE. */
+        symbols.entries          = calloc(64, sizeof(struct symbol_entry));
+        symbols.entries_capacity = 64;
+        symbols.entries_size     = 1;
+        symbols_rehash(128);
+    }
+
+    uint32_t hash = symbol_hash(name, length);
+    size_t mask   = symbols.slots_capacity - 1;
+    size_t i      = hash & mask;
+
+    for (; symbols.slots[i]; i = (i + 1) & mask) {
+        struct symbol_entry *entry = &symbols.entries[symbols.slots[i]];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->name, name, length) == 0)
+            return symbols.slots[i];
+    }
+
+    if (symbols.entries_size == symbols.entries_capacity) {
+        symbols.entries_capacity *= 2;
+        symbols.entries =
+            realloc(symbols.entries,
+                    sizeof(struct symbol_entry) * symbols.entries_capacity);
+        if (!symbols.entries)
+            fatalf("error: could not allocate symbol table.\n");
+    }
+
+    uint32_t id                = (uint32_t)symbols.entries_size++;
+    struct symbol_entry *entry = &symbols.entries[id];
+
+    entry->name   = allocator_strndup(&symbols.names, name, length);
+    entry->length = length;
+    entry->hash   = hash;
+
+    symbols.slots[i] = id;
+
+    if (symbols.entries_size * 2 > symbols.slots_capacity)
+        symbols_rehash(symbols.slots_capacity * 2);
+
+    return id;
+}
+
+char const *symbol_name(uint32_t symbol) {
+    if (symbol == SYMBOL_NONE || symbol >= symbols.entries_size)
+        return "";
+
+    return symbols.entries[symbol].name;
+}
+
+size_t symbol_length(uint32_t symbol) {
+    if (symbol == SYMBOL_NONE || symbol >= symbols.entries_size)
+        return 0;
+
+    return symbols.entries[symbol].length;
+}
+
+size_t symbol_count(void) {
+    return symbols.entries_size ? symbols.entries_size : 1;
+}
+
+void symbols_destroy(void) {
+    allocator_reset(&symbols.names);
+    free(symbols.entries);
+    free(symbols.slots);
+    memset(&symbols, 0, sizeof(symbols));
+}
\ No newline at end of file
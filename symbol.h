@@ -0,0 +1,19 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Symbols are small integer ids for interned names. Id 0 is never handed
+ * out, so it can be used to mean "no symbol". */
+#define SYMBOL_NONE 0
+
+uint32_t symbol_intern(char const *name, size_t length);
+char const *symbol_name(uint32_t symbol);
+size_t symbol_length(uint32_t symbol);
+
+/* The number of ids handed out so far, counting SYMBOL_NONE. */
+size_t symbol_count(void);
+void symbols_destroy(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,21 @@
+#!/bin/sh
+# A program whose main the checker finds going deeper than the maximum given
+# with --stack is rejected before it prints anything; given room, it runs.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf 'main: "before" print 1 2 3 4 5 6 7 8 9 10 prints ;' >"$DIR/deep.tt"
+
+failed=0
+expected='error: main needs 10 stack values, more than the maximum of 8.'
+if [ "$("$CATCAT" --stack 4:8 "$DIR/deep.tt" 2>&1)" != "$expected" ]; then
+    echo "deep.tt was not rejected"
+    failed=1
+fi
+expected=$(printf 'before\n[ 1 2 3 4 5 6 7 8 9 10 ]')
+if [ "$("$CATCAT" --stack 4:16 "$DIR/deep.tt" 2>&1)" != "$expected" ]; then
+    echo "deep.tt did not run"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Each test program translated to C by --emit-c and built with make prints
+# the same, and exits with the same status, as it does when catcat runs it.
+# A program the front end rejects must be rejected the same way by both.
+# A translated program bounds its calls by the bytes of C stack they take
+# rather than by their number, so the limit a call stack overflow reports
+# is left out.
+# The runtime objects are built by make as needed, with its own options.
+CATCAT=$1
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+run() {
+    "$@" 2>&1
+    echo "exit $?"
+}
+
+limitless() {
+    sed 's/^\(error: call stack overflow\), more than .*/\1./'
+}
+
+failed=0
+for test in "$ROOT"/tests/*.tt; do
+    name=$(basename "$test" .tt)
+    expected=$(run "$CATCAT" "$test" | limitless)
+
+    if ! "$CATCAT" --emit-c "$test" >"$DIR/$name.tt.c" 2>"$DIR/$name.err"; then
+        if [ "$(cat "$DIR/$name.err"; echo "exit 1")" != "$expected" ]; then
+            echo "$name.tt is rejected differently by --emit-c"
+            failed=1
+        fi
+        continue
+    fi
+
+    if ! ${MAKE:-make} -s -C "$ROOT" "$DIR/$name.exe" >/dev/null; then
+        echo "could not build $name.tt"
+        failed=1
+    elif [ "$(run "$DIR/$name.exe" | limitless)" != "$expected" ]; then
+        echo "$name.tt runs differently when translated to C"
+        failed=1
+    fi
+done
+exit $failed
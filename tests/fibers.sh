@@ -0,0 +1,50 @@
+#!/bin/sh
+# Fibers on one scheduler thread take turns at each yield, in the order
+# they were spawned, join hands back what each left on its stack whatever
+# the number of scheduler threads, and a failing fiber fails its joiner.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat >"$DIR/fibers.tt" <<'END'
+worker: [ 3 [ dup print yield ] times . ] curry ;
+pair: "a" worker spawn "b" worker spawn join join "joined" print ;
+main: [ pair ] spawn join prints
+      [ 1 2 + ] spawn [ 10 [ yield ] times 4 5 * ] spawn join swap join prints
+      100 [ [ dup * ] curry spawn ] times-i
+      0 100 [ . swap join + ] times-i print ;
+END
+printf 'main: "before" print [ "x" 1 + ] spawn join "after" print ;' \
+    >"$DIR/failing.tt"
+
+# Sanitizer builds warn about switching stacks; their lines are left out.
+run() {
+    { "$CATCAT" "$@" 2>&1; echo "exit $?"; } | grep -v '^==[0-9]*=='
+}
+
+failed=0
+expected=$(printf 'a\nb\na\nb\na\nb\njoined\n[ ]\n[ 20 3 ]\n328350\nexit 0')
+actual=$(run --fiber-threads 1 "$DIR/fibers.tt")
+if [ "$actual" != "$expected" ]; then
+    echo "fibers on one thread did not take turns:"
+    echo "$actual"
+    failed=1
+fi
+
+expected=$(printf '[ ]\n[ 20 3 ]\n328350\nexit 0')
+actual=$(run --fiber-threads 4 "$DIR/fibers.tt")
+if [ "$(echo "$actual" | tail -n 4)" != "$expected" ]; then
+    echo "wrong results from fibers on four threads:"
+    echo "$actual"
+    failed=1
+fi
+
+expected=$(printf 'error: fiber 1 failed.\n  in main\nexit 1')
+actual=$(run --fiber-threads 1 "$DIR/failing.tt")
+if [ "$(echo "$actual" | grep -c before)" != 1 ] ||
+    [ "$(echo "$actual" | tail -n 3)" != "$expected" ]; then
+    echo "a failing fiber did not fail its joiner:"
+    echo "$actual"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,39 @@
+#!/bin/sh
+# The template JIT, the bytecode VM and the tree walker agree: every test
+# program, and programs failing in builtins called from loops and tail
+# calls, print the same and exit the same way under each of them as with
+# the JIT off. The default run starts in the VM and switches to compiled
+# code in the middle of hot loops.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+run() {
+    "$CATCAT" "$@" 2>&1
+    echo "exit $?"
+}
+
+i=0
+for program in \
+    'main: 0 10 [ dup print 1 + dup 4 equal? [ "a" + ] when ] times ;' \
+    'f: . . ; main: 3 [ 1 f ] times ;' \
+    'main: 0 [ dup 20 equal? [ "x" ] [ 1 ] if ] [ 1 + ] while ;' \
+    'count: dup 1000 equal? [ "a" * ] [ 1 + count ] if ; main: 0 count ;' \
+    'main: 0 [ 1 + dup 7 equal? [ [ ] ] [ 1 ] if ] loop ;' \
+    'main: 5 [ 3 [ 2 equal? [ 1 2 3 ] [ apply ] if ] times-i ] times-i ;'; do
+    i=$((i + 1))
+    printf '%s' "$program" >"$DIR/error-$i.tt"
+done
+
+failed=0
+for test in "$(dirname "$0")"/*.tt "$DIR"/*.tt; do
+    expected=$(run --jit=off "$test")
+    for engine in "" --jit=always --tree-walk; do
+        if [ "$(run $engine "$test")" != "$expected" ]; then
+            echo "${engine:-the default engine} differs on $test"
+            failed=1
+        fi
+    done
+done
+
+exit $failed
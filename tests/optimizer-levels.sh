@@ -0,0 +1,26 @@
+#!/bin/sh
+# Optimizing never changes what a program does: every test program prints
+# the same and exits the same way at -O1 and -O2, and with inlining off,
+# as at -O0. Only where an error happened may read differently, since it
+# names the functions inlined into, so those lines are left out.
+CATCAT=$1
+
+run() {
+    {
+        "$CATCAT" "$@" 2>&1
+        echo "exit $?"
+    } | grep -v '^  in '
+}
+
+failed=0
+for test in "$(dirname "$0")"/*.tt; do
+    expected=$(run -O0 "$test")
+    for level in -O1 -O2 "-O2 --inline-threshold 0"; do
+        if [ "$(run $level "$test")" != "$expected" ]; then
+            echo "$level differs from -O0 on $test"
+            failed=1
+        fi
+    done
+done
+
+exit $failed
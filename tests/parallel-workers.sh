@@ -0,0 +1,54 @@
+#!/bin/sh
+# The parallel combinators give the same results whatever the number of
+# workers, including preduce with an operation whose result depends on how
+# the range is split, and a failing task fails the whole run.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat >"$DIR/parallel.tt" <<'END'
+square: dup * ;
+main: 7 [ 1 + ] [ 2 * ] pbi prints . .
+      3 [ 1 + ] [ square ] [ 10 * ] 3 pcleave prints . . .
+      10 [ square ] pmap prints 10 [ . ] times
+      1000 [ square ] [ + ] preduce print
+      1000 [ ] [ 7 * 3 + ] compose [ + ] [ 2 * ] compose preduce print
+      3 [ [ 2 * ] [ 5 + ] pbi + ] pmap prints ;
+END
+printf 'main: 100 [ dup 50 equal? [ "x" ] [ 1 ] if + ] pmap ;' \
+    >"$DIR/failing.tt"
+
+failed=0
+expected=$(cat <<'END'
+[ 8 14 ]
+[ 4 9 30 ]
+[ 0 1 4 9 16 25 36 49 64 81 ]
+332833500
+-7605321689435952
+[ 5 8 11 ]
+exit 0
+END
+)
+run() {
+    "$CATCAT" --workers $workers "$1" 2>&1
+    echo "exit $?"
+}
+
+for workers in 0 1 4; do
+    actual=$(run "$DIR/parallel.tt")
+    if [ "$actual" != "$expected" ]; then
+        echo "wrong results with --workers $workers:"
+        echo "$actual"
+        failed=1
+    fi
+
+    # Each failing task reports its own error first, in no particular order.
+    actual=$(run "$DIR/failing.tt")
+    if [ "$(echo "$actual" | tail -n 3)" != \
+         "$(printf 'error: a task of pmap failed.\n  in main\nexit 1')" ]; then
+        echo "a failing task did not fail pmap with --workers $workers:"
+        echo "$actual"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Runs the regression tests with the catcat and catcat-client given:
+#
+#     tests/run.sh ./catcat.exe ./catcat-client.exe
+#
+# Each tests/NAME.tt is run with its memory bounded, and what it prints,
+# followed by its exit status, is compared with tests/NAME.expected. Each
+# tests/NAME.sh is run with the paths of catcat and catcat-client and
+# passes if it exits successfully.
+CATCAT=$1
+CLIENT=$2
+DIR=$(dirname "$0")
+
+# Memory is bounded with ulimit, or for sanitizer builds, which reserve
+# far more address space than they use, by the sanitizer itself, with a
+# quarantine of freed memory small enough not to count against it.
+MEMORY_MB=256
+ASAN_OPTIONS=hard_rss_limit_mb=$MEMORY_MB:quarantine_size_mb=16
+export ASAN_OPTIONS
+LIMIT="ulimit -v $((MEMORY_MB * 1024))"
+sh -c "$LIMIT && \"\$0\"" "$CATCAT" >/dev/null 2>&1 || LIMIT=:
+
+failed=0
+for test in "$DIR"/*.tt; do
+    name=${test%.tt}
+    actual=$( (eval "$LIMIT" && "$CATCAT" "$test") 2>&1; echo "exit $?")
+    if [ "$actual" = "$(cat "$name.expected")" ]; then
+        echo "ok $test"
+    else
+        echo "FAIL $test"
+        echo "$actual" | head -n 20
+        failed=1
+    fi
+done
+
+for test in "$DIR"/*.sh; do
+    case $(basename "$test") in run.sh) continue ;; esac
+    if sh "$test" "$CATCAT" "$CLIENT"; then
+        echo "ok $test"
+    else
+        echo "FAIL $test"
+        failed=1
+    fi
+done
+
+exit $failed
@@ -0,0 +1,55 @@
+#!/bin/sh
+# A server answers each request with what the program printed and its final
+# stack, pushes the inputs given before main runs, builds each program once,
+# and goes on serving after programs that fail or requests it cannot read.
+CATCAT=$1
+CLIENT=$2
+DIR=$(mktemp -d)
+SOCKET=$DIR/catcat.sock
+trap 'rm -rf "$DIR"' EXIT
+
+printf 'main: + print ;' >"$DIR/add.tt"
+printf 'main: swap "left" ;' >"$DIR/swap.tt"
+printf 'main: undefined ;' >"$DIR/unknown.tt"
+
+"$CATCAT" --serve "$SOCKET" 2>"$DIR/server.err" &
+SERVER=$!
+tries=0
+while [ ! -S "$SOCKET" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+failed=0
+request() {
+    expected=$1
+    shift
+    actual=$("$CLIENT" "$SOCKET" "$@" 2>&1; echo "exit $?")
+    if [ "$actual" != "$(printf "$expected")" ]; then
+        echo "wrong answer to $*:"
+        echo "$actual"
+        failed=1
+    fi
+}
+
+request '5\n[ ]\nexit 0' "$DIR/add.tt" 2 3
+request '[ two 1 left ]\nexit 0' "$DIR/swap.tt" 1 '"two"'
+request '30\n[ ]\nexit 0' "$DIR/add.tt" 10 20
+request 'error: trying to add non-capatiable value types\n  in main\nexit 1' \
+    "$DIR/add.tt" '"x"' 1
+request 'error in function main: found unknown identifier, undefined.\nexit 1' \
+    "$DIR/unknown.tt"
+request 'error: an input is neither an integer nor a quoted string.\nexit 1' \
+    "$DIR/add.tt" 1 x
+request '9\n[ ]\nexit 0' "$DIR/add.tt" 4 5
+
+"$CLIENT" --quit "$SOCKET" >/dev/null 2>&1
+wait $SERVER
+
+# The request with an input that could not be read is not counted.
+if ! grep -q "served 6 requests, 3 from the cache" "$DIR/server.err"; then
+    echo "wrong count of requests:"
+    cat "$DIR/server.err"
+    failed=1
+fi
+exit $failed
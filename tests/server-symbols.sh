@@ -0,0 +1,51 @@
+#!/bin/sh
+# A server that has interned more than SERVER_SYMBOLS_MAX names empties its
+# cache and starts its symbol table afresh, and still runs every program.
+# The names come from a program that is rejected, since identifiers are
+# interned as they are read, whether or not they turn out to be defined.
+CATCAT=$1
+CLIENT=$2
+DIR=$(mktemp -d)
+SOCKET=$DIR/catcat.sock
+trap 'rm -rf "$DIR"' EXIT
+
+awk 'BEGIN {
+    printf "main:"
+    for (i = 0; i < 70000; i++)
+        printf " f%d", i
+    printf " ;"
+}' >"$DIR/names.tt"
+printf 'main: 1 2 + print ;' >"$DIR/first.tt"
+printf 'main: 3 4 + print ;' >"$DIR/second.tt"
+
+"$CATCAT" --serve "$SOCKET" 2>"$DIR/server.err" &
+SERVER=$!
+tries=0
+while [ ! -S "$SOCKET" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+failed=0
+for test in first names second first; do
+    case $test in
+    first) expected=$(printf '3\n[ ]') ;;
+    names) expected='error in function main: found unknown identifier, f0.' ;;
+    second) expected=$(printf '7\n[ ]') ;;
+    esac
+    if [ "$("$CLIENT" "$SOCKET" "$DIR/$test.tt" 2>&1)" != "$expected" ]; then
+        echo "wrong answer to $test.tt"
+        failed=1
+    fi
+done
+
+"$CLIENT" --quit "$SOCKET" >/dev/null 2>&1
+wait $SERVER
+
+# Building the second program finds the table full and empties the cache,
+# so the first program is built again when it comes back.
+if ! grep -q "served 4 requests, 0 from the cache" "$DIR/server.err"; then
+    echo "the cache was not emptied"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,39 @@
+#!/bin/sh
+# A request whose pbi, pmap or fiber fails is answered with an error, and
+# the server goes on serving the next ones.
+CATCAT=$1
+CLIENT=$2
+DIR=$(mktemp -d)
+SOCKET=$DIR/catcat.sock
+trap 'rm -rf "$DIR"' EXIT
+
+"$CATCAT" --serve "$SOCKET" 2>"$DIR/server.err" &
+SERVER=$!
+tries=0
+while [ ! -S "$SOCKET" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+failed=0
+for program in \
+    'main: 1 [ "a" + ] [ 1 + ] pbi ;' \
+    'main: 10 [ "a" + ] pmap ;' \
+    'main: [ "a" 1 + ] spawn join ;' \
+    'main: [ "a" 1 + ] spawn . ;'; do
+    printf '%s' "$program" >"$DIR/test.tt"
+    if "$CLIENT" "$SOCKET" "$DIR/test.tt" >/dev/null 2>&1; then
+        echo "no error from $program"
+        failed=1
+    fi
+done
+
+printf 'main: 1 [ 1 + ] [ 2 + ] pbi + print ;' >"$DIR/test.tt"
+if [ "$("$CLIENT" "$SOCKET" "$DIR/test.tt" 2>&1)" != "$(printf '5\n[ ]')" ]; then
+    echo "the server stopped answering"
+    failed=1
+fi
+
+"$CLIENT" --quit "$SOCKET" >/dev/null 2>&1
+wait $SERVER
+exit $failed
@@ -0,0 +1,24 @@
+#!/bin/sh
+# --threads runs main on several threads at once over one image, each
+# building quotations of its own with compose and curry, under each
+# engine, and every thread prints what a single run prints.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat >"$DIR/threads.tt" <<'END'
+step: [ + ] curry apply ;
+main: 0 5000 [ [ 1 ] [ step ] compose apply ] times
+      [ 2 ] [ * ] compose apply print ;
+END
+
+failed=0
+expected=$(printf '10000\n%.0s' 1 2 3 4 5 6 7 8)
+for engine in --jit=off --jit=on --jit=always --tree-walk; do
+    if [ "$("$CATCAT" $engine --threads 8 "$DIR/threads.tt" 2>&1)" != \
+         "$expected" ]; then
+        echo "wrong output from --threads 8 with $engine"
+        failed=1
+    fi
+done
+exit $failed
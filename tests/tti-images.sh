@@ -0,0 +1,31 @@
+#!/bin/sh
+# Each test program saved as an image by --compile prints the same, and
+# exits with the same status, when the image is run as when the program is.
+# A program the front end rejects must be rejected the same way by both.
+CATCAT=$1
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+run() {
+    "$CATCAT" "$@" 2>&1
+    echo "exit $?"
+}
+
+failed=0
+for test in "$ROOT"/tests/*.tt; do
+    name=$(basename "$test" .tt)
+    expected=$(run "$test")
+
+    if ! "$CATCAT" --compile "$test" -o "$DIR/$name.tti" 2>"$DIR/$name.err"
+    then
+        if [ "$(cat "$DIR/$name.err"; echo "exit 1")" != "$expected" ]; then
+            echo "$name.tt is rejected differently by --compile"
+            failed=1
+        fi
+    elif [ "$(run "$DIR/$name.tti")" != "$expected" ]; then
+        echo "$name.tt runs differently from its image"
+        failed=1
+    fi
+done
+exit $failed
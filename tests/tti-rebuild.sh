@@ -0,0 +1,32 @@
+#!/bin/sh
+# An image run with other optimizations than it was built with, or whose
+# header was changed, is rebuilt from its source before it runs.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf 'main: 1 2 + print ;' >"$DIR/test.tt"
+IMAGE=$DIR/test.tti
+
+# The level of an image is the byte after its magic and version.
+level() {
+    od -An -tu1 -j12 -N1 "$IMAGE" | tr -d ' '
+}
+
+failed=0
+"$CATCAT" --compile -O0 "$DIR/test.tt" || exit 1
+if [ "$("$CATCAT" -O2 "$IMAGE" 2>&1)" != "3" ] || [ "$(level)" != 2 ]; then
+    echo "an image built with -O0 was not rebuilt for -O2"
+    failed=1
+fi
+
+# The stack depth main needs is recorded at offset 56; claim it needs none.
+before=$(od -An -tx1 "$IMAGE")
+printf '\000' | dd of="$IMAGE" bs=1 seek=56 conv=notrunc 2>/dev/null
+if [ "$("$CATCAT" -O2 "$IMAGE" 2>&1)" != "3" ] ||
+    [ "$(od -An -tx1 "$IMAGE")" != "$before" ]; then
+    echo "an image whose header was changed was not rebuilt"
+    failed=1
+fi
+
+exit $failed
@@ -0,0 +1,54 @@
+#!/bin/sh
+# --profile-ngrams counts the pairs and triples of instructions the VM runs,
+# named the way they are written, and leaves what the program prints as it
+# was. Instructions counted as often may be listed in any order, so each
+# section is compared sorted.
+CATCAT=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf 'step: dup + 1 + ;\nmain: 1 10 [ step ] times print 2 3 swap . print ;' \
+    >"$DIR/profile.tt"
+
+sections() {
+    awk '/:$/ { section = $0; next } { print section $0 }' | sort
+}
+
+failed=0
+"$CATCAT" --profile-ngrams "$DIR/profile.tt" >"$DIR/out" 2>"$DIR/report"
+if [ "$(cat "$DIR/out")" != "$(printf '2047\n3')" ]; then
+    echo "the program printed something else when profiled"
+    failed=1
+fi
+
+sections <<'END' >"$DIR/expected"
+most frequent pairs:
+          10  <integer> +
+          10  + <integer>
+          10  dup +
+           2  <integer> <integer>
+           1  <integer> swap
+           1  . print
+           1  swap .
+           1  print <integer>
+most frequent triples:
+          10  + <integer> +
+          10  dup + <integer>
+           1  <integer> <integer> swap
+           1  <integer> swap .
+           1  swap . print
+           1  print <integer> <integer>
+END
+if [ "$(sections <"$DIR/report")" != "$(cat "$DIR/expected")" ]; then
+    echo "wrong profile:"
+    cat "$DIR/report"
+    failed=1
+fi
+
+expected='error: --profile-ngrams profiles the VM, not the tree walker.'
+if [ "$("$CATCAT" --profile-ngrams --tree-walk "$DIR/profile.tt" 2>&1)" != \
+     "$expected" ]; then
+    echo "the tree walker was profiled"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,144 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "error.h"
+#include "thread.h"
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID argument) {
+    struct thread *thread = argument;
+    thread->function(thread->argument);
+    return 0;
+}
+
+void thread_start(struct thread *thread, thread_function function,
+                  void *argument, size_t stack_size) {
+    thread->function = function;
+    thread->argument = argument;
+    thread->handle   = CreateThread(NULL, stack_size, thread_main, thread,
+                                    STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+    if (!thread->handle)
+        fatalf("error: CreateThread failed, %lu\n", GetLastError());
+}
+
+void thread_join(struct thread *thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+void thread_yield(void) { SwitchToThread(); }
+
+void thread_lock_stream(FILE *stream) { _lock_file(stream); }
+
+void thread_unlock_stream(FILE *stream) { _unlock_file(stream); }
+
+size_t thread_processors(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+void thread_mutex_init(struct thread_mutex *mutex) {
+    InitializeSRWLock(&mutex->lock);
+}
+
+void thread_mutex_destroy(struct thread_mutex *mutex) { (void)mutex; }
+
+void thread_mutex_lock(struct thread_mutex *mutex) {
+    AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void thread_mutex_unlock(struct thread_mutex *mutex) {
+    ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+void thread_condition_init(struct thread_condition *condition) {
+    InitializeConditionVariable(&condition->condition);
+}
+
+void thread_condition_destroy(struct thread_condition *condition) {
+    (void)condition;
+}
+
+void thread_condition_wait(struct thread_condition *condition,
+                           struct thread_mutex *mutex) {
+    SleepConditionVariableSRW(&condition->condition, &mutex->lock, INFINITE,
+                              0);
+}
+
+void thread_condition_broadcast(struct thread_condition *condition) {
+    WakeAllConditionVariable(&condition->condition);
+}
+#else
+static void *thread_main(void *argument) {
+    struct thread *thread = argument;
+    thread->function(thread->argument);
+    return NULL;
+}
+
+void thread_start(struct thread *thread, thread_function function,
+                  void *argument, size_t stack_size) {
+    pthread_attr_t attributes;
+
+    thread->function = function;
+    thread->argument = argument;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, stack_size);
+    int error =
+        pthread_create(&thread->handle, &attributes, thread_main, thread);
+    pthread_attr_destroy(&attributes);
+
+    if (error)
+        fatalf("error: pthread_create failed, %d\n", error);
+}
+
+void thread_join(struct thread *thread) { pthread_join(thread->handle, NULL); }
+
+void thread_yield(void) { sched_yield(); }
+
+void thread_lock_stream(FILE *stream) { flockfile(stream); }
+
+void thread_unlock_stream(FILE *stream) { funlockfile(stream); }
+
+size_t thread_processors(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+void thread_mutex_init(struct thread_mutex *mutex) {
+    pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void thread_mutex_destroy(struct thread_mutex *mutex) {
+    pthread_mutex_destroy(&mutex->lock);
+}
+
+void thread_mutex_lock(struct thread_mutex *mutex) {
+    pthread_mutex_lock(&mutex->lock);
+}
+
+void thread_mutex_unlock(struct thread_mutex *mutex) {
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+void thread_condition_init(struct thread_condition *condition) {
+    pthread_cond_init(&condition->condition, NULL);
+}
+
+void thread_condition_destroy(struct thread_condition *condition) {
+    pthread_cond_destroy(&condition->condition);
+}
+
+void thread_condition_wait(struct thread_condition *condition,
+                           struct thread_mutex *mutex) {
+    pthread_cond_wait(&condition->condition, &mutex->lock);
+}
+
+void thread_condition_broadcast(struct thread_condition *condition) {
+    pthread_cond_broadcast(&condition->condition);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* Programs run on the C stack as far as builtins running quotations and
+ * native code nest, so their threads get more of it than the host's
+ * default. */
+#define THREAD_STACK_SIZE (64 * 1024 * 1024)
+
+typedef void (*thread_function)(void *argument);
+
+struct thread {
+    thread_function function;
+    void *argument;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+};
+
+/* Starts function(argument) on a new thread with a stack of stack_size
+ * bytes, which is reserved rather than committed up front where the host
+ * allows it. */
+void thread_start(struct thread *thread, thread_function function,
+                  void *argument, size_t stack_size);
+void thread_join(struct thread *thread);
+
+/* Gives up the rest of the time slice to other threads. */
+void thread_yield(void);
+
+/* The number of processors the host can run threads on. */
+size_t thread_processors(void);
+
+/* Keeps other threads from writing to stream until it is unlocked, so a
+ * line printed in several writes is not interleaved with theirs. */
+void thread_lock_stream(FILE *stream);
+void thread_unlock_stream(FILE *stream);
+
+struct thread_mutex {
+#ifdef _WIN32
+    SRWLOCK lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+struct thread_condition {
+#ifdef _WIN32
+    CONDITION_VARIABLE condition;
+#else
+    pthread_cond_t condition;
+#endif
+};
+
+void thread_mutex_init(struct thread_mutex *mutex);
+void thread_mutex_destroy(struct thread_mutex *mutex);
+void thread_mutex_lock(struct thread_mutex *mutex);
+void thread_mutex_unlock(struct thread_mutex *mutex);
+
+void thread_condition_init(struct thread_condition *condition);
+void thread_condition_destroy(struct thread_condition *condition);
+void thread_condition_wait(struct thread_condition *condition,
+                           struct thread_mutex *mutex);
+void thread_condition_broadcast(struct thread_condition *condition);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1016 @@
+#ifndef _WIN32
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "source.h"
+#include "symbol.h"
+#include "tti.h"
+#include "vm.h"
+
+#define TTI_MAGIC "catcati"
+
+struct ffi_function;
+
+/* Sections start on 8 bytes, which is as much as any of their records
+ * needs, so the mapping can be read in place. */
+#define TTI_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+/* The header keeps this layout in every version, so that an image written
+ * by any of them can be rebuilt. It is followed by the path of the source
+ * and by the sections, in the order of their counts, the strings last. */
+struct tti_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t level;
+    uint64_t runtime;
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint64_t hash;
+    uint64_t inline_threshold;
+    uint64_t depth;
+    uint32_t source_length;
+    uint32_t entry;
+    uint32_t nwords;
+    uint32_t nconstants;
+    uint32_t nfunctions;
+    uint32_t nprogram;
+    uint32_t ncode;
+    uint32_t nsymbols;
+    uint32_t nglobals;
+    uint32_t nforeign;
+    uint32_t nffi;
+    uint32_t strings_size;
+};
+
+/* A word refers, depending on its type and kind, to a function, to an
+ * offset into the strings, to a builtin, or to a foreign function, or
+ * holds an integer. */
+struct tti_word {
+    uint8_t type;
+    uint8_t kind;
+    uint8_t unchecked;
+    uint8_t unused;
+    uint32_t origin;
+    int64_t operand;
+};
+
+struct tti_value {
+    uint32_t type;
+    uint32_t unused;
+    int64_t operand;
+};
+
+/* The first nprogram functions are those of the program, in order; the
+ * others are lambdas only reachable through words. The source of a
+ * function is the one holding the words it was written with, which is
+ * itself unless the optimizer rewrote them. */
+struct tti_function {
+    uint32_t symbol;
+    uint32_t index;
+    uint32_t words;
+    uint32_t size;
+    uint32_t source;
+    uint32_t code;
+    uint32_t code_size;
+    uint32_t effect[4];
+};
+
+struct tti_ffi {
+    uint32_t symbol;
+    uint32_t module;
+    uint32_t pointer_result;
+    uint32_t nargs;
+    uint32_t pointer_args[8];
+};
+
+/* The sections of a mapped image. */
+struct tti_image {
+    struct tti_header const *header;
+    struct tti_word const *words;
+    struct tti_value const *constants;
+    struct tti_function const *functions;
+    uint32_t const *code;
+    uint32_t const *origins;
+    uint32_t const *symbols;
+    uint32_t const *globals;
+    uint32_t const *foreign;
+    struct tti_ffi const *ffi;
+    char const *strings;
+};
+
+/* FNV-1a, continuing from hash. */
+static uint64_t tti_hash(uint64_t hash, void const *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((unsigned char const *)data)[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+#define TTI_HASH_START 14695981039346656037ull
+
+/* The hash of an image starts from its header, with the hash itself taken
+ * as zero, so that how the image was built cannot change unnoticed. */
+static uint64_t tti_hash_header(struct tti_header const *header) {
+    struct tti_header copy = *header;
+
+    copy.hash = 0;
+    return tti_hash(TTI_HASH_START, &copy, sizeof(copy));
+}
+
+/* What the bytecode and the words of an image are only meaningful to: the
+ * opcodes and the builtins of the runtime, by number. */
+static uint64_t tti_runtime(void) {
+    uint32_t facts[] = {TTI_VERSION, OPCODE_COUNT, sizeof(void *)};
+    uint64_t hash    = tti_hash(TTI_HASH_START, facts, sizeof(facts));
+
+    for (struct internal_function *infn = internal_functions; infn->name;
+         infn++)
+        hash = tti_hash(hash, infn->name, strlen(infn->name) + 1);
+
+    return hash;
+}
+
+static size_t tti_nbuiltins(void) {
+    size_t n = 0;
+    while (internal_functions[n].name)
+        n++;
+
+    return n;
+}
+
+_Bool tti_set_source(struct tti_build *build, char const *path) {
+#ifdef _WIN32
+    return _fullpath(build->source, path, TTI_PATH_MAX) != NULL;
+#else
+    char *absolute = realpath(path, NULL);
+    if (!absolute)
+        return 0;
+
+    size_t length = strlen(absolute);
+    if (length < TTI_PATH_MAX)
+        memcpy(build->source, absolute, length + 1);
+    free(absolute);
+
+    return length < TTI_PATH_MAX;
+#endif
+}
+
+#define TTI_APPEND(array, size, capacity, item)                                \
+    do {                                                                       \
+        if ((capacity) <= (size) + 1) {                                        \
+            (capacity)++;                                                      \
+            (capacity) *= 2;                                                   \
+            (array) = realloc((array), sizeof(*(array)) * (capacity));         \
+        }                                                                      \
+        (array)[(size)++] = (item);                                            \
+    } while (0)
+
+struct tti_string {
+    char const *address;
+    uint32_t offset;
+};
+
+/* Numbers what the image refers to, like the emitter: the functions of
+ * the program first, then the lambdas reachable from their words. The
+ * strings of the program are written once each, however many words and
+ * constants share them. */
+struct tti_writer {
+    struct program *program;
+
+    struct function **functions;
+    size_t functions_size;
+    size_t functions_capacity;
+
+    struct word **ffi;
+    size_t ffi_size;
+    size_t ffi_capacity;
+
+    struct tti_string *addresses;
+    size_t addresses_size;
+    size_t addresses_capacity;
+
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+
+    size_t nwords;
+};
+
+static size_t tti_find_function(struct tti_writer *w,
+                                struct function *function) {
+    if (function->index < w->program->functions_size &&
+        w->program->functions[function->index] == function)
+        return function->index;
+
+    size_t i = w->program->functions_size;
+    while (i < w->functions_size && w->functions[i] != function)
+        i++;
+
+    return i;
+}
+
+static void tti_add_function(struct tti_writer *w, struct function *function) {
+    if (tti_find_function(w, function) == w->functions_size)
+        TTI_APPEND(w->functions, w->functions_size, w->functions_capacity,
+                   function);
+}
+
+static size_t tti_find_ffi(struct tti_writer *w, struct word *word) {
+    size_t i = 0;
+#ifdef ENABLE_FFI
+    while (i < w->ffi_size &&
+           w->ffi[i]->function.ffi_fn != word->function.ffi_fn)
+        i++;
+#else
+    (void)word;
+    i = w->ffi_size;
+#endif
+
+    return i;
+}
+
+static uint32_t tti_append_string(struct tti_writer *w, char const *string) {
+    size_t length = strlen(string) + 1;
+    size_t offset = w->strings_size;
+
+    while (w->strings_size + length > w->strings_capacity) {
+        w->strings_capacity = w->strings_capacity ? w->strings_capacity * 2
+                                                  : 4096;
+        w->strings          = realloc(w->strings, w->strings_capacity);
+    }
+
+    memcpy(w->strings + offset, string, length);
+    w->strings_size += length;
+    return (uint32_t)offset;
+}
+
+static uint32_t tti_string(struct tti_writer *w, char const *string) {
+    for (size_t i = 0; i < w->addresses_size; i++) {
+        if (w->addresses[i].address == string)
+            return w->addresses[i].offset;
+    }
+
+    struct tti_string entry = {string, tti_append_string(w, string)};
+    TTI_APPEND(w->addresses, w->addresses_size, w->addresses_capacity, entry);
+    return entry.offset;
+}
+
+static uint32_t tti_builtin(cfunction function) {
+    for (uint32_t i = 0; internal_functions[i].name; i++) {
+        if (internal_functions[i].function == function)
+            return i;
+    }
+
+    fatalf("error: writing a call to an unknown builtin.\n");
+}
+
+static void tti_collect(struct tti_writer *w) {
+    for (size_t i = 0; i < w->functions_size; i++) {
+        struct function *function = w->functions[i];
+        w->nwords += function->size;
+
+        for (size_t j = 0; j < function->size; j++) {
+            struct word *word = function->words[j];
+
+            if (word->type == WORD_TYPE_LAMBDA) {
+                tti_add_function(w, word->lambda);
+                tti_add_function(w, function_source(word->lambda));
+            } else if (word->type == WORD_TYPE_FUNCTION &&
+                       word->function.type == FUNCTION_TYPE_REGULAR) {
+                tti_add_function(w, word->function.fn);
+            } else if (word->type == WORD_TYPE_FUNCTION &&
+                       word->function.type == FUNCTION_TYPE_FFI &&
+                       tti_find_ffi(w, word) == w->ffi_size) {
+                TTI_APPEND(w->ffi, w->ffi_size, w->ffi_capacity, word);
+            }
+        }
+    }
+}
+
+static struct tti_word tti_word(struct tti_writer *w, struct word *word) {
+    struct tti_word record = {.type      = word->type,
+                              .unchecked = word->unchecked,
+                              .origin    = word->origin};
+
+    switch (word->type) {
+    case WORD_TYPE_LAMBDA:
+        record.operand = tti_find_function(w, word->lambda);
+        break;
+    case WORD_TYPE_VALUE:
+        record.kind = word->value.type;
+        if (word->value.type == WORD_VALUE_TYPE_STRING)
+            record.operand = tti_string(w, word->value.string);
+        else if (word->value.type == WORD_VALUE_TYPE_INTEGER)
+            record.operand = word->value.integer;
+        else
+            fatalf("error: writing an unsupported word value type.\n");
+        break;
+    case WORD_TYPE_FUNCTION:
+        record.kind = word->function.type;
+        if (word->function.type == FUNCTION_TYPE_CFUNCTION)
+            record.operand = tti_builtin(word->function.cfn.function);
+        else if (word->function.type == FUNCTION_TYPE_REGULAR)
+            record.operand = tti_find_function(w, word->function.fn);
+        else
+            record.operand = tti_find_ffi(w, word);
+        break;
+    }
+
+    return record;
+}
+
+static struct tti_value tti_value(struct tti_writer *w, struct value value) {
+    struct tti_value record = {.type = value.type};
+
+    switch (value.type) {
+    case VALUE_TYPE_INTEGER:
+        record.operand = value.integer;
+        break;
+    case VALUE_TYPE_STRING:
+        record.operand = tti_string(w, value.string);
+        break;
+    case VALUE_TYPE_LAMBDA:
+        record.operand = tti_find_function(w, value.lambda);
+        break;
+    }
+
+    return record;
+}
+
+static struct tti_ffi tti_ffi(struct tti_writer *w, struct word *word) {
+    struct tti_ffi record = {0};
+
+#ifdef ENABLE_FFI
+    struct ffi_function *fn = word->function.ffi_fn;
+
+    record.symbol         = fn->symbol;
+    record.module         = tti_string(w, fn->module);
+    record.pointer_result = fn->ret_type.type == ffi_type_pointer.type;
+    record.nargs          = (uint32_t)fn->nargs;
+    for (size_t i = 0; i < fn->nargs; i++)
+        record.pointer_args[i] = fn->args[i] == &ffi_type_pointer;
+#else
+    (void)w;
+    (void)word;
+#endif
+
+    return record;
+}
+
+/* Writes a section of the image, adding it to the hash of its contents. */
+static void tti_write_section(FILE *out, void const *data, size_t size,
+                              uint64_t *hash) {
+    if (!size)
+        return;
+
+    fwrite(data, 1, size, out);
+    *hash = tti_hash(*hash, data, size);
+}
+
+static _Bool tti_write_file(char const *path, struct tti_header *header,
+                            struct tti_build const *build,
+                            struct tti_image *t) {
+    FILE *out = fopen(path, "wb");
+    if (!out)
+        return 0;
+
+    static char const padding[8];
+    size_t length = header->source_length;
+    uint64_t hash = tti_hash_header(header);
+
+    /* The header goes first, and again once the hash is known. */
+    fwrite(header, 1, sizeof(*header), out);
+    tti_write_section(out, build->source, length, &hash);
+    tti_write_section(out, padding, TTI_ALIGN(length) - length, &hash);
+    tti_write_section(out, t->words, sizeof(*t->words) * header->nwords,
+                      &hash);
+    tti_write_section(out, t->constants,
+                      sizeof(*t->constants) * header->nconstants, &hash);
+    tti_write_section(out, t->functions,
+                      sizeof(*t->functions) * header->nfunctions, &hash);
+    tti_write_section(out, t->code, sizeof(*t->code) * header->ncode, &hash);
+    tti_write_section(out, t->origins, sizeof(*t->origins) * header->ncode,
+                      &hash);
+    tti_write_section(out, t->symbols,
+                      sizeof(*t->symbols) * header->nsymbols, &hash);
+    tti_write_section(out, t->globals,
+                      sizeof(*t->globals) * header->nglobals, &hash);
+    tti_write_section(out, t->foreign,
+                      sizeof(*t->foreign) * header->nforeign, &hash);
+    tti_write_section(out, t->ffi, sizeof(*t->ffi) * header->nffi, &hash);
+    tti_write_section(out, t->strings, header->strings_size, &hash);
+
+    header->hash = hash;
+    if (fseek(out, 0, SEEK_SET) == 0)
+        fwrite(header, 1, sizeof(*header), out);
+
+    _Bool written = !ferror(out);
+    return fclose(out) == 0 && written;
+}
+
+_Bool tti_write(char const *path, struct image *image,
+                struct tti_build const *build) {
+    struct program *program = image->program;
+    struct tti_writer w     = {program};
+    struct source source;
+
+    if (!program)
+        fatalf("error: writing an image that was not compiled.\n");
+    if (!source_map(&source, build->source))
+        return 0;
+
+    struct tti_header header = {
+        .magic            = TTI_MAGIC,
+        .version          = TTI_VERSION,
+        .level            = build->level,
+        .runtime          = tti_runtime(),
+        .source_hash      = tti_hash(TTI_HASH_START, source.data, source.size),
+        .source_size      = source.size,
+        .inline_threshold = build->inline_threshold,
+        .depth            = build->depth,
+        .source_length    = (uint32_t)strlen(build->source),
+    };
+    source_unmap(&source);
+
+    for (size_t i = 0; i < program->functions_size; i++)
+        TTI_APPEND(w.functions, w.functions_size, w.functions_capacity,
+                   program->functions[i]);
+    tti_add_function(&w, image->entry);
+    for (size_t i = 0; i < image->globals_size; i++) {
+        if (image->globals[i]->function.type == FUNCTION_TYPE_REGULAR)
+            tti_add_function(&w, image->globals[i]->function.fn);
+    }
+    tti_collect(&w);
+
+    /* Symbol ids are handed out in order, so they are kept by writing
+     * every name the table holds. */
+    size_t nsymbols   = symbol_count();
+    uint32_t *symbols = calloc(nsymbols, sizeof(uint32_t));
+    for (uint32_t i = 1; i < nsymbols; i++)
+        symbols[i] = tti_append_string(&w, symbol_name(i));
+
+    /* The words of the globals follow those of the functions. */
+    size_t nwords = w.nwords + image->globals_size;
+    struct tti_word *words = malloc(sizeof(*words) * (nwords + 1));
+    uint32_t *globals = malloc(sizeof(uint32_t) * (image->globals_size + 1));
+    struct tti_function *functions =
+        malloc(sizeof(*functions) * w.functions_size);
+    size_t nword = 0, ncode = 0;
+
+    for (size_t i = 0; i < w.functions_size; i++) {
+        struct function *function = w.functions[i];
+        size_t source = tti_find_function(&w, function_source(function));
+
+        functions[i] = (struct tti_function){
+            .symbol    = function->symbol,
+            .index     = function->index,
+            .words     = (uint32_t)nword,
+            .size      = (uint32_t)function->size,
+            .source    = (uint32_t)source,
+            .code      = (uint32_t)ncode,
+            .code_size = i < program->functions_size
+                             ? (uint32_t)function->code_size
+                             : 0,
+            .effect    = {function->effect.state, function->effect.in,
+                          function->effect.out, function->effect.peak},
+        };
+
+        for (size_t j = 0; j < function->size; j++)
+            words[nword++] = tti_word(&w, function->words[j]);
+        ncode += functions[i].code_size;
+    }
+
+    for (size_t i = 0; i < image->globals_size; i++) {
+        globals[i]      = (uint32_t)nword;
+        words[nword++] = tti_word(&w, image->globals[i]);
+    }
+
+    uint32_t *code    = malloc(sizeof(uint32_t) * (ncode + 1));
+    uint32_t *origins = malloc(sizeof(uint32_t) * (ncode + 1));
+    for (size_t i = 0; i < program->functions_size; i++) {
+        struct function *function = program->functions[i];
+        memcpy(code + functions[i].code, function->code,
+               sizeof(uint32_t) * function->code_size);
+        memcpy(origins + functions[i].code, function->origins,
+               sizeof(uint32_t) * function->code_size);
+    }
+
+    struct tti_value *constants =
+        malloc(sizeof(*constants) * (program->constants_size + 1));
+    for (size_t i = 0; i < program->constants_size; i++)
+        constants[i] = tti_value(&w, program->constants[i]);
+
+    uint32_t *foreign =
+        malloc(sizeof(uint32_t) * (program->ffi_functions_size + 1));
+    for (size_t i = 0; i < program->ffi_functions_size; i++)
+        foreign[i] = (uint32_t)tti_find_ffi(&w, program->ffi_functions[i]);
+
+    struct tti_ffi *ffi = malloc(sizeof(*ffi) * (w.ffi_size + 1));
+    for (size_t i = 0; i < w.ffi_size; i++)
+        ffi[i] = tti_ffi(&w, w.ffi[i]);
+
+    if (w.strings_size > UINT32_MAX || nword > UINT32_MAX ||
+        ncode > UINT32_MAX)
+        fatalf("error: the program is too large to be written as an "
+               "image.\n");
+
+    header.entry        = (uint32_t)tti_find_function(&w, image->entry);
+    header.nwords       = (uint32_t)nword;
+    header.nconstants   = (uint32_t)program->constants_size;
+    header.nfunctions   = (uint32_t)w.functions_size;
+    header.nprogram     = (uint32_t)program->functions_size;
+    header.ncode        = (uint32_t)ncode;
+    header.nsymbols     = (uint32_t)nsymbols;
+    header.nglobals     = (uint32_t)image->globals_size;
+    header.nforeign     = (uint32_t)program->ffi_functions_size;
+    header.nffi         = (uint32_t)w.ffi_size;
+    header.strings_size = (uint32_t)w.strings_size;
+
+    struct tti_image t = {&header, words,   constants, functions,
+                          code,    origins, symbols,   globals,
+                          foreign, ffi,     w.strings};
+
+    /* The image is written next to where it goes and moved there, so that
+     * a run never maps a file that is only partly written. */
+    char *temporary = malloc(strlen(path) + 5);
+    sprintf(temporary, "%s.tmp", path);
+
+    _Bool written = tti_write_file(temporary, &header, build, &t);
+#ifdef _WIN32
+    if (written)
+        remove(path);
+#endif
+    if (written)
+        written = rename(temporary, path) == 0;
+    if (!written)
+        remove(temporary);
+
+    free(temporary);
+    free(ffi);
+    free(foreign);
+    free(constants);
+    free(origins);
+    free(code);
+    free(functions);
+    free(globals);
+    free(words);
+    free(symbols);
+    free(w.functions);
+    free(w.ffi);
+    free(w.addresses);
+    free(w.strings);
+    return written;
+}
+
+static void const *tti_section(struct source *file, uint64_t *offset,
+                               uint64_t size) {
+    void const *section = *offset <= file->size ? file->data + *offset : NULL;
+    *offset += size;
+    return section;
+}
+
+/* Finds the sections of the image, whose sizes must add up to the size of
+ * the file. */
+static _Bool tti_locate(struct source *file, struct tti_image *t) {
+    struct tti_header const *h = t->header;
+    uint64_t offset = sizeof(*h) + TTI_ALIGN((uint64_t)h->source_length);
+
+    t->words     = tti_section(file, &offset, sizeof(*t->words) * h->nwords);
+    t->constants = tti_section(file, &offset,
+                               sizeof(*t->constants) * h->nconstants);
+    t->functions = tti_section(file, &offset,
+                               sizeof(*t->functions) * h->nfunctions);
+    t->code      = tti_section(file, &offset, sizeof(*t->code) * h->ncode);
+    t->origins   = tti_section(file, &offset, sizeof(*t->origins) * h->ncode);
+    t->symbols   = tti_section(file, &offset,
+                               sizeof(*t->symbols) * h->nsymbols);
+    t->globals   = tti_section(file, &offset,
+                               sizeof(*t->globals) * h->nglobals);
+    t->foreign   = tti_section(file, &offset,
+                               sizeof(*t->foreign) * h->nforeign);
+    t->ffi       = tti_section(file, &offset, sizeof(*t->ffi) * h->nffi);
+    t->strings   = tti_section(file, &offset, h->strings_size);
+
+    return offset == file->size;
+}
+
+/* Checks that the opcodes of a function exist and that their operands
+ * are in bounds: the VM trusts the compiler with both. */
+static _Bool tti_check_code(struct tti_image const *t,
+                            struct tti_function const *function,
+                            size_t nbuiltins) {
+    struct tti_header const *h = t->header;
+    uint32_t const *code       = t->code + function->code;
+
+    for (uint32_t i = 0; i < function->code_size; i++) {
+        uint32_t operand = INSTRUCTION_OPERAND(code[i]);
+        uint64_t limit   = UINT64_MAX;
+
+        switch (INSTRUCTION_OPCODE(code[i])) {
+        case OP_PUSH_CONST:
+            limit = h->nconstants;
+            break;
+        case OP_CALL_BUILTIN:
+            limit = nbuiltins;
+            break;
+        case OP_CALL_FN:
+        case OP_TAIL_CALL_FN:
+            limit = h->nprogram;
+            break;
+        case OP_CALL_FFI:
+            limit = h->nforeign;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP_NEXT:
+        case OP_LOOP_NEXT_INDEX:
+            limit = function->code_size;
+            break;
+        default:
+            if (INSTRUCTION_OPCODE(code[i]) >= OPCODE_COUNT)
+                return 0;
+            break;
+        }
+
+        if (operand >= limit)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Checks that every index and offset in the image is in bounds, so that a
+ * file that was not written by tti_write, even with a matching hash, is
+ * rebuilt rather than run. */
+static _Bool tti_check(struct tti_image const *t) {
+    struct tti_header const *h = t->header;
+    size_t nbuiltins           = tti_nbuiltins();
+
+    if (!h->strings_size || t->strings[h->strings_size - 1] != '\0' ||
+        !h->nsymbols || h->entry >= h->nfunctions ||
+        h->nprogram > h->nfunctions)
+        return 0;
+
+    for (uint32_t i = 1; i < h->nsymbols; i++) {
+        if (t->symbols[i] >= h->strings_size)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nfunctions; i++) {
+        struct tti_function const *f = &t->functions[i];
+        if (f->symbol >= h->nsymbols ||
+            (uint64_t)f->words + f->size > h->nwords ||
+            f->source >= h->nfunctions ||
+            (uint64_t)f->code + f->code_size > h->ncode ||
+            (i < h->nprogram && (f->index != i || !f->code_size)) ||
+            f->effect[0] > STACK_EFFECT_UNKNOWN ||
+            !tti_check_code(t, f, nbuiltins))
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->ncode; i++) {
+        if (t->origins[i] >= h->nsymbols)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nwords; i++) {
+        struct tti_word const *word = &t->words[i];
+        uint64_t operand            = (uint64_t)word->operand;
+        uint64_t limit              = 0;
+
+        switch (word->type) {
+        case WORD_TYPE_LAMBDA:
+            limit = h->nfunctions;
+            break;
+        case WORD_TYPE_VALUE:
+            if (word->kind == WORD_VALUE_TYPE_STRING)
+                limit = h->strings_size;
+            else if (word->kind == WORD_VALUE_TYPE_INTEGER)
+                limit = UINT64_MAX;
+            break;
+        case WORD_TYPE_FUNCTION:
+            if (word->kind == FUNCTION_TYPE_CFUNCTION)
+                limit = nbuiltins;
+            else if (word->kind == FUNCTION_TYPE_REGULAR)
+                limit = h->nfunctions;
+            else if (word->kind == FUNCTION_TYPE_FFI)
+                limit = h->nffi;
+            break;
+        }
+
+        if (operand >= limit && limit != UINT64_MAX)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nconstants; i++) {
+        struct tti_value const *value = &t->constants[i];
+        uint64_t operand              = (uint64_t)value->operand;
+
+        if ((value->type == VALUE_TYPE_STRING &&
+             operand >= h->strings_size) ||
+            (value->type == VALUE_TYPE_LAMBDA && operand >= h->nfunctions) ||
+            value->type > VALUE_TYPE_LAMBDA)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nglobals; i++) {
+        struct tti_word const *word;
+        if (t->globals[i] >= h->nwords)
+            return 0;
+
+        word = &t->words[t->globals[i]];
+        if (word->type != WORD_TYPE_FUNCTION ||
+            (word->kind != FUNCTION_TYPE_REGULAR &&
+             word->kind != FUNCTION_TYPE_FFI))
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nforeign; i++) {
+        if (t->foreign[i] >= h->nffi)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < h->nffi; i++) {
+        struct tti_ffi const *ffi = &t->ffi[i];
+        if (ffi->symbol >= h->nsymbols || ffi->module >= h->strings_size ||
+            ffi->nargs > 8)
+            return 0;
+    }
+
+#ifndef ENABLE_FFI
+    if (h->nffi)
+        return 0;
+#endif
+
+    return 1;
+}
+
+#ifdef ENABLE_FFI
+static void tti_load_ffi(struct ffi_function *fn, struct tti_ffi const *ffi,
+                         char *strings) {
+    fn->symbol   = ffi->symbol;
+    fn->module   = strings + ffi->module;
+    fn->nargs    = ffi->nargs;
+    fn->ret_type = ffi->pointer_result ? ffi_type_pointer : ffi_type_sint;
+    for (size_t i = 0; i < fn->nargs; i++)
+        fn->args[i] =
+            ffi->pointer_args[i] ? &ffi_type_pointer : &ffi_type_sint;
+
+    HMODULE module = LoadLibraryA(fn->module);
+    if (!module)
+        fatalf("error: LoadLibraryA failed, %lu\n", GetLastError());
+
+    fn->fn = GetProcAddress(module, symbol_name(fn->symbol));
+    if (!fn->fn)
+        fatalf("error: GetProcAddress failed, %lu\n", GetLastError());
+
+    if (ffi_prep_cif(&fn->cif, FFI_DEFAULT_ABI, fn->nargs, &fn->ret_type,
+                     fn->args) != FFI_OK)
+        fatalf("error: ffi_prep_cif failed.\n");
+}
+#endif
+
+static void tti_load_word(struct word *word, struct tti_word const *record,
+                          struct function *functions, char *strings,
+                          struct ffi_function *ffi) {
+    word->type      = record->type;
+    word->unchecked = record->unchecked;
+    word->origin    = record->origin;
+
+    switch (word->type) {
+    case WORD_TYPE_LAMBDA:
+        word->lambda = &functions[record->operand];
+        break;
+    case WORD_TYPE_VALUE:
+        word->value.type = record->kind;
+        if (record->kind == WORD_VALUE_TYPE_STRING)
+            word->value.string = strings + record->operand;
+        else
+            word->value.integer = record->operand;
+        break;
+    case WORD_TYPE_FUNCTION:
+        word->function.type = record->kind;
+        if (record->kind == FUNCTION_TYPE_CFUNCTION)
+            word->function.cfn = internal_functions[record->operand];
+        else if (record->kind == FUNCTION_TYPE_REGULAR)
+            word->function.fn = &functions[record->operand];
+#ifdef ENABLE_FFI
+        else
+            word->function.ffi_fn = &ffi[record->operand];
+#endif
+        break;
+    }
+
+    (void)ffi;
+}
+
+/* Builds the image out of its checked sections. */
+static struct image *tti_read(struct tti_image const *t) {
+    struct tti_header const *h = t->header;
+
+    /* Symbols interned before the image was written keep their ids only if
+     * the same names were interned in the same order since. */
+    for (uint32_t i = 1; i < h->nsymbols; i++) {
+        char const *name = t->strings + t->symbols[i];
+        if (symbol_intern(name, strlen(name)) != i)
+            return NULL;
+    }
+
+    struct image *image         = make_image();
+    struct allocator *allocator = &image->allocator;
+    struct program *program     = calloc(1, sizeof(*program));
+    struct ffi_function *ffi    = NULL;
+
+    /* The builtins are bound first, as the parser binds them. */
+    size_t nbuiltins      = tti_nbuiltins();
+    struct word *builtins =
+        allocator_calloc(allocator, sizeof(*builtins) * nbuiltins);
+
+    for (size_t i = 0; i < nbuiltins; i++) {
+        struct internal_function *infn = &internal_functions[i];
+
+        infn->symbol = symbol_intern(infn->name, strlen(infn->name));
+
+        builtins[i].type          = WORD_TYPE_FUNCTION;
+        builtins[i].function.type = FUNCTION_TYPE_CFUNCTION;
+        builtins[i].function.cfn  = *infn;
+        image_define(image, infn->symbol, &builtins[i]);
+    }
+
+    char *strings = allocator_alloc(allocator, h->strings_size);
+    memcpy(strings, t->strings, h->strings_size);
+
+    struct function *functions =
+        allocator_calloc(allocator, sizeof(*functions) * h->nfunctions);
+    struct word *words =
+        allocator_calloc(allocator, sizeof(*words) * (h->nwords + 1));
+    struct word **pointers =
+        allocator_alloc(allocator, sizeof(*pointers) * (h->nwords + 1));
+
+#ifdef ENABLE_FFI
+    ffi = allocator_calloc(allocator, sizeof(*ffi) * (h->nffi + 1));
+    for (uint32_t i = 0; i < h->nffi; i++)
+        tti_load_ffi(&ffi[i], &t->ffi[i], strings);
+#endif
+
+    for (uint32_t i = 0; i < h->nwords; i++) {
+        pointers[i] = &words[i];
+        tti_load_word(&words[i], &t->words[i], functions, strings, ffi);
+    }
+
+    program->functions          = malloc(sizeof(struct function *) *
+                                         (h->nprogram + 1));
+    program->functions_size     = h->nprogram;
+    program->functions_capacity = h->nprogram + 1;
+
+    for (uint32_t i = 0; i < h->nfunctions; i++) {
+        struct tti_function const *record = &t->functions[i];
+        struct function *function         = &functions[i];
+
+        function->symbol   = record->symbol;
+        function->index    = record->index;
+        function->words    = pointers + record->words;
+        function->size     = record->size;
+        function->capacity = record->size;
+        function->effect   = (struct stack_effect){
+            record->effect[0], record->effect[1], record->effect[2],
+            record->effect[3]};
+
+        if (record->source != i)
+            function->source = &functions[record->source];
+
+        if (i >= h->nprogram)
+            continue;
+
+        size_t bytes = sizeof(uint32_t) * record->code_size;
+        function->code          = malloc(bytes);
+        function->origins       = malloc(bytes);
+        function->code_size     = record->code_size;
+        function->code_capacity = record->code_size;
+        memcpy(function->code, t->code + record->code, bytes);
+        memcpy(function->origins, t->origins + record->code, bytes);
+
+        program->functions[i] = function;
+    }
+
+    program->constants          = malloc(sizeof(struct value) *
+                                         (h->nconstants + 1));
+    program->constants_size     = h->nconstants;
+    program->constants_capacity = h->nconstants + 1;
+
+    for (uint32_t i = 0; i < h->nconstants; i++) {
+        struct tti_value const *record = &t->constants[i];
+        struct value *value            = &program->constants[i];
+
+        value->type = record->type;
+        if (record->type == VALUE_TYPE_INTEGER)
+            value->integer = record->operand;
+        else if (record->type == VALUE_TYPE_STRING)
+            value->string = strings + record->operand;
+        else
+            value->lambda = &functions[record->operand];
+    }
+
+    /* The compiler calls foreign functions through words of their own. */
+    program->ffi_functions          = malloc(sizeof(struct word *) *
+                                             (h->nforeign + 1));
+    program->ffi_functions_size     = h->nforeign;
+    program->ffi_functions_capacity = h->nforeign + 1;
+
+    for (uint32_t i = 0; i < h->nforeign; i++) {
+        struct word *word = allocator_calloc(allocator, sizeof(*word));
+        word->type        = WORD_TYPE_FUNCTION;
+        word->function.type = FUNCTION_TYPE_FFI;
+#ifdef ENABLE_FFI
+        word->function.ffi_fn = &ffi[t->foreign[i]];
+#endif
+        program->ffi_functions[i] = word;
+    }
+
+    image->globals          = malloc(sizeof(struct word *) *
+                                     (h->nglobals + 1));
+    image->globals_size     = h->nglobals;
+    image->globals_capacity = h->nglobals + 1;
+
+    for (uint32_t i = 0; i < h->nglobals; i++) {
+        struct word *global = &words[t->globals[i]];
+        image->globals[i]   = global;
+
+#ifdef ENABLE_FFI
+        if (global->function.type == FUNCTION_TYPE_FFI) {
+            image_define(image, global->function.ffi_fn->symbol, global);
+            continue;
+        }
+#endif
+        image_define(image, global->function.fn->symbol, global);
+    }
+
+    image->entry   = &functions[h->entry];
+    image->program = program;
+    vm_prepare(program);
+
+    return image;
+}
+
+/* Whether the image was written by this runtime, with the optimizations
+ * of build, from its source as it is now. Without a source to rebuild
+ * from, the image is taken as it is. */
+static _Bool tti_fresh(struct tti_header const *header,
+                       struct tti_build const *build) {
+    struct source source;
+
+    if (header->version != TTI_VERSION || header->runtime != tti_runtime() ||
+        header->level != build->level ||
+        header->inline_threshold != build->inline_threshold)
+        return 0;
+    if (!source_map(&source, build->source))
+        return 1;
+
+    _Bool fresh =
+        source.size == header->source_size &&
+        tti_hash(TTI_HASH_START, source.data, source.size) ==
+            header->source_hash;
+
+    source_unmap(&source);
+    return fresh;
+}
+
+struct image *tti_load(char const *path, struct tti_build *build) {
+    struct source file;
+    struct image *image = NULL;
+
+    build->source[0] = '\0';
+    build->depth     = 0;
+    if (!source_map(&file, path))
+        return NULL;
+
+    struct tti_image t = {(struct tti_header const *)file.data};
+    struct tti_header const *h = t.header;
+
+    if (file.size >= sizeof(*h) && memcmp(h->magic, TTI_MAGIC, 8) == 0 &&
+        h->source_length < TTI_PATH_MAX &&
+        sizeof(*h) + (uint64_t)h->source_length <= file.size &&
+        h->level <= OPTIMIZER_LEVEL_FULL) {
+        memcpy(build->source, file.data + sizeof(*h), h->source_length);
+        build->source[h->source_length] = '\0';
+        build->depth                    = h->depth;
+
+        if (tti_fresh(h, build) && tti_locate(&file, &t) &&
+            tti_hash(tti_hash_header(h), file.data + sizeof(*h),
+                     file.size - sizeof(*h)) == h->hash &&
+            tti_check(&t))
+            image = tti_read(&t);
+    }
+
+    source_unmap(&file);
+    return image;
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef TTI_H
+#define TTI_H
+
+#include <stdlib.h>
+
+#include "kernel.h"
+#include "optimizer.h"
+
+/* catcat --compile prog.tt -o prog.tti saves the program as the front end
+ * leaves it, compiled to bytecode, so that running prog.tti maps it and
+ * starts right away. The file refers to everything by index rather than
+ * by address: loading it allocates the functions, words and strings of
+ * the image in one go and points them at each other, and otherwise only
+ * interns the symbols, which get the ids they had when it was written,
+ * and looks up the builtins and foreign functions.
+ *
+ * The header records the version of the format, hashes of the runtime
+ * that wrote it, of its source and of its contents, header included, and
+ * how it was built. An image that another version of catcat wrote, that
+ * was built with other optimizations than those it is run with, that is
+ * older than its source or that is damaged is rebuilt from the source
+ * with the optimizations it is run with, and written again. */
+#define TTI_VERSION 3
+
+#define TTI_PATH_MAX 4096
+
+/* How an image was built: from which file, with which optimizations, and
+ * how many values its main needs on the stack. */
+struct tti_build {
+    char source[TTI_PATH_MAX];
+    enum optimizer_level level;
+    size_t inline_threshold;
+    size_t depth;
+};
+
+/* Records path, made absolute, as the source of build. Returns 0 if it
+ * does not name a file. */
+_Bool tti_set_source(struct tti_build *build, char const *path);
+
+/* Writes image, which must have been compiled, to path. Returns 0 if the
+ * file cannot be written. */
+_Bool tti_write(char const *path, struct image *image,
+                struct tti_build const *build);
+
+/* Loads the image at path, compiled and ready to run, if it was built with
+ * the level and inline threshold of build, and fills in the rest of build.
+ * Returns NULL if the file is not an image, or needs to be rebuilt; in the
+ * latter case build names its source. */
+struct image *tti_load(char const *path, struct tti_build *build);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,856 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "fiber.h"
+#include "jit.h"
+#include "vm.h"
+
+#if VM_THREADED
+#define VM_CASE(op)  vm_##op:
+#define VM_NEXT()    goto *(ip++)->handler
+#define VM_OPERAND   (ip[-1].operand)
+#define VM_IMMEDIATE (ip[-1].operand)
+#else
+#define VM_CASE(op)  case op:
+#define VM_NEXT()    continue
+#define VM_OPERAND   INSTRUCTION_OPERAND(instruction)
+#define VM_IMMEDIATE INSTRUCTION_IMMEDIATE(instruction)
+#endif
+
+#if VM_THREADED
+typedef struct vm_instruction const *vm_ip;
+#define VM_ENTRY(function) ((vm_ip)(function)->threaded)
+#else
+typedef uint32_t const *vm_ip;
+#define VM_ENTRY(function) ((vm_ip)(function)->code)
+#endif
+
+#if VM_THREADED
+/* The handlers of vm_run by opcode, followed by the one that profiles. */
+static void const *const *vm_handlers;
+#endif
+
+/* Counts of the pairs and triples of instructions executed, collected for
+ * --profile-ngrams. Builtins called through OP_CALL_BUILTIN count as
+ * themselves and unchecked instructions as their checked form, so that the
+ * counts read like source. The history is cleared at calls and returns,
+ * which no superinstruction can span. */
+static struct {
+    _Bool enabled;
+    size_t nsymbols;
+    uint64_t *pairs;
+    uint64_t *triples;
+    size_t history[2];
+    size_t nhistory;
+} vm_profile;
+
+static enum opcode vm_checked_opcode(enum opcode op) {
+    switch (op) {
+    case OP_ADD_UNCHECKED:
+        return OP_ADD;
+    case OP_MUL_UNCHECKED:
+        return OP_MUL;
+    case OP_EQUAL_UNCHECKED:
+        return OP_EQUAL;
+    case OP_DUP_UNCHECKED:
+        return OP_DUP;
+    case OP_DROP_UNCHECKED:
+        return OP_DROP;
+    case OP_SWAP_UNCHECKED:
+        return OP_SWAP;
+    case OP_ROT_UNCHECKED:
+        return OP_ROT;
+    case OP_DUP_MUL_UNCHECKED:
+        return OP_DUP_MUL;
+    case OP_SWAP_DROP_UNCHECKED:
+        return OP_SWAP_DROP;
+    case OP_ADD_INT_UNCHECKED:
+        return OP_ADD_INT;
+    case OP_MUL_INT_UNCHECKED:
+        return OP_MUL_INT;
+    default:
+        return op;
+    }
+}
+
+static char const *vm_opcode_name(enum opcode op) {
+    static char const *const names[OPCODE_COUNT] = {
+        [OP_PUSH_INT]    = "<integer>",
+        [OP_PUSH_CONST]  = "<constant>",
+        [OP_CALL_FFI]    = "<ffi>",
+        [OP_ADD]         = "+",
+        [OP_MUL]         = "*",
+        [OP_EQUAL]       = "equal?",
+        [OP_DUP]         = "dup",
+        [OP_DROP]        = ".",
+        [OP_SWAP]        = "swap",
+        [OP_ROT]         = "rot",
+        [OP_DUP_MUL]     = "dup *",
+        [OP_SWAP_DROP]   = "swap .",
+        [OP_ADD_INT]     = "<integer> +",
+        [OP_MUL_INT]     = "<integer> *",
+        [OP_EQUAL_INT]   = "<integer> equal?",
+    };
+
+    return names[op] ? names[op] : "?";
+}
+
+static void vm_profile_record(uint32_t instruction) {
+    enum opcode op = vm_checked_opcode(INSTRUCTION_OPCODE(instruction));
+    size_t symbol  = op;
+
+    switch (op) {
+    case OP_RETURN:
+    case OP_CALL_FN:
+    case OP_TAIL_CALL_FN:
+    case OP_APPLY:
+    case OP_TAIL_APPLY:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP_BEGIN:
+    case OP_LOOP_NEXT:
+    case OP_LOOP_NEXT_INDEX:
+        vm_profile.nhistory = 0;
+        return;
+    case OP_CALL_BUILTIN:
+        symbol = OPCODE_COUNT + INSTRUCTION_OPERAND(instruction);
+        break;
+    default:
+        break;
+    }
+
+    size_t n = vm_profile.nsymbols;
+    size_t *history = vm_profile.history;
+
+    if (vm_profile.nhistory >= 1)
+        vm_profile.pairs[history[1] * n + symbol]++;
+    if (vm_profile.nhistory >= 2)
+        vm_profile.triples[(history[0] * n + history[1]) * n + symbol]++;
+
+    history[0] = history[1];
+    history[1] = symbol;
+    if (vm_profile.nhistory < 2)
+        vm_profile.nhistory++;
+}
+
+void vm_profile_start(void) {
+    size_t n = OPCODE_COUNT;
+    while (internal_functions[n - OPCODE_COUNT].name)
+        n++;
+
+    vm_profile.enabled  = 1;
+    vm_profile.nsymbols = n;
+    vm_profile.pairs    = calloc(n * n, sizeof(uint64_t));
+    vm_profile.triples  = calloc(n * n * n, sizeof(uint64_t));
+}
+
+static void vm_profile_print_symbol(size_t symbol) {
+    if (symbol >= OPCODE_COUNT)
+        fprintf(stderr, " %s", internal_functions[symbol - OPCODE_COUNT].name);
+    else
+        fprintf(stderr, " %s", vm_opcode_name(symbol));
+}
+
+struct vm_ngram {
+    uint64_t count;
+    size_t index;
+};
+
+static int vm_ngram_compare(void const *a, void const *b) {
+    uint64_t x = ((struct vm_ngram const *)a)->count;
+    uint64_t y = ((struct vm_ngram const *)b)->count;
+    return (x < y) - (x > y);
+}
+
+static void vm_profile_print(char const *title, uint64_t *counts,
+                             size_t length, size_t top) {
+    size_t n     = vm_profile.nsymbols;
+    size_t total = 1;
+    for (size_t i = 0; i < length; i++)
+        total *= n;
+
+    struct vm_ngram *ngrams = malloc(sizeof(*ngrams) * total);
+    size_t nngrams          = 0;
+
+    for (size_t i = 0; i < total; i++) {
+        if (counts[i])
+            ngrams[nngrams++] = (struct vm_ngram){counts[i], i};
+    }
+
+    qsort(ngrams, nngrams, sizeof(*ngrams), vm_ngram_compare);
+
+    fprintf(stderr, "%s:\n", title);
+    for (size_t i = 0; i < nngrams && i < top; i++) {
+        fprintf(stderr, "%12llu ", (unsigned long long)ngrams[i].count);
+
+        size_t divisor = total;
+        for (size_t j = 0; j < length; j++) {
+            divisor /= n;
+            vm_profile_print_symbol(ngrams[i].index / divisor % n);
+        }
+
+        fprintf(stderr, "\n");
+    }
+
+    free(ngrams);
+}
+
+void vm_profile_report(size_t top) {
+    if (!vm_profile.enabled)
+        return;
+
+    vm_profile_print("most frequent pairs", vm_profile.pairs, 2, top);
+    vm_profile_print("most frequent triples", vm_profile.triples, 3, top);
+
+    free(vm_profile.pairs);
+    free(vm_profile.triples);
+    vm_profile.enabled = 0;
+}
+
+/* The caller's state saved by a call: the function and instruction to
+ * return to. */
+struct vm_frame {
+    struct function *function;
+    vm_ip ip;
+};
+
+#define VM_FRAMES_INLINE 32
+
+#define VM_LOOPS_INLINE 16
+
+/* The function and instruction pointer of the last instruction that could
+ * fail, saved before calling into the kernel so that errors can name the
+ * function without keeping ip in memory. */
+struct vm_location {
+    struct error_location location;
+    struct function *function;
+    vm_ip ip;
+};
+
+#define VM_LOCATE()                                                            \
+    do {                                                                       \
+        location.function = current;                                           \
+        location.ip       = ip;                                                \
+    } while (0)
+
+static void vm_report(struct error_location *error) {
+    struct vm_location *location = (struct vm_location *)error;
+
+    if (!location->function)
+        return;
+
+    size_t index = location->ip - VM_ENTRY(location->function) - 1;
+    report_location(location->function, location->function->origins[index]);
+}
+
+/* The top of the value stack, for instructions whose operands the checker
+ * proved to be there. */
+#define VM_TOP() (&env->stack->data[env->stack->ndata - 1])
+
+static struct vm_frame *vm_grow_frames(struct vm_frame *frames,
+                                       struct vm_frame *inline_frames,
+                                       size_t *capacity) {
+    if (*capacity >= CALL_STACK_MAXIMUM_DEPTH)
+        fatalf("error: call stack overflow, more than %zu calls.\n",
+               *capacity);
+
+    *capacity *= 2;
+    if (frames != inline_frames)
+        return realloc(frames, sizeof(struct vm_frame) * *capacity);
+
+    frames = malloc(sizeof(struct vm_frame) * *capacity);
+    memcpy(frames, inline_frames, sizeof(struct vm_frame) * VM_FRAMES_INLINE);
+    return frames;
+}
+
+static struct vm_loop *vm_grow_loops(struct vm_loop *loops,
+                                     struct vm_loop *inline_loops,
+                                     size_t *capacity) {
+    *capacity *= 2;
+    if (loops != inline_loops)
+        return realloc(loops, sizeof(struct vm_loop) * *capacity);
+
+    loops = malloc(sizeof(struct vm_loop) * *capacity);
+    memcpy(loops, inline_loops, sizeof(struct vm_loop) * VM_LOOPS_INLINE);
+    return loops;
+}
+
+#define VM_JUMP() (ip = VM_ENTRY(current) + VM_OPERAND)
+
+/* Calls push the caller onto the frame stack and continue in the callee
+ * within the same loop. A call directly followed by a return reuses the
+ * current frame instead. */
+#define VM_CALL(callee)                                                        \
+    do {                                                                       \
+        if (nframes == capacity)                                               \
+            frames = vm_grow_frames(frames, inline_frames, &capacity);         \
+        frames[nframes++] = (struct vm_frame){current, ip};                    \
+        current           = (callee);                                          \
+        ip                = VM_ENTRY(current);                                 \
+    } while (0)
+
+#define VM_TAIL_CALL(callee)                                                   \
+    do {                                                                       \
+        current = (callee);                                                    \
+        ip      = VM_ENTRY(current);                                           \
+    } while (0)
+
+/* Counts the call against the budget of a fiber, then runs callee as
+ * native code once the JIT has compiled it. True when it has returned;
+ * otherwise callee is what is left to run, which is itself or the function
+ * of a tail call it made. */
+#define VM_NATIVE(callee)                                                      \
+    (fiber_count(env),                                                         \
+     jit_ready(env, callee) && !((callee) = jit_call(env, callee)))
+
+/* A backward jump also counts against the budget and towards compiling
+ * the function, after which the rest of the call runs as native code from
+ * the jump target. */
+#define VM_JUMP_BACK()                                                         \
+    do {                                                                       \
+        if (VM_ENTRY(current) + VM_OPERAND < ip &&                             \
+            (fiber_count(env), jit_ready(env, current))) {                     \
+            struct function *callee =                                          \
+                jit_resume(env, current, VM_OPERAND, loops, &nloops);          \
+            if (!callee)                                                       \
+                goto vm_return;                                                \
+            VM_TAIL_CALL(callee);                                              \
+        } else {                                                               \
+            VM_JUMP();                                                         \
+        }                                                                      \
+    } while (0)
+
+static struct function *vm_pop_lambda(struct environment *env) {
+    struct value a;
+
+    if (!stack_pop(env->stack, &a))
+        fatalf("error: stack_pop failed, empty stack\n");
+
+    if (a.type != VALUE_TYPE_LAMBDA)
+        fatalf("error: trying to apply to a non-lambda type\n");
+
+    return a.lambda;
+}
+
+static void vm_run(struct environment *env, struct function *function) {
+#if VM_THREADED
+    static void const *const handlers[OPCODE_COUNT + 1] = {
+        [OP_RETURN]       = &&vm_OP_RETURN,
+        [OP_PUSH_INT]     = &&vm_OP_PUSH_INT,
+        [OP_PUSH_CONST]   = &&vm_OP_PUSH_CONST,
+        [OP_CALL_BUILTIN] = &&vm_OP_CALL_BUILTIN,
+        [OP_CALL_FN]      = &&vm_OP_CALL_FN,
+        [OP_CALL_FFI]     = &&vm_OP_CALL_FFI,
+        [OP_TAIL_CALL_FN] = &&vm_OP_TAIL_CALL_FN,
+        [OP_APPLY]        = &&vm_OP_APPLY,
+        [OP_TAIL_APPLY]   = &&vm_OP_TAIL_APPLY,
+
+        [OP_JUMP]            = &&vm_OP_JUMP,
+        [OP_JUMP_IF_FALSE]   = &&vm_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_TRUE]    = &&vm_OP_JUMP_IF_TRUE,
+        [OP_LOOP_BEGIN]      = &&vm_OP_LOOP_BEGIN,
+        [OP_LOOP_NEXT]       = &&vm_OP_LOOP_NEXT,
+        [OP_LOOP_NEXT_INDEX] = &&vm_OP_LOOP_NEXT_INDEX,
+        [OP_ADD]          = &&vm_OP_ADD,
+        [OP_MUL]          = &&vm_OP_MUL,
+        [OP_EQUAL]        = &&vm_OP_EQUAL,
+        [OP_DUP]          = &&vm_OP_DUP,
+        [OP_DROP]         = &&vm_OP_DROP,
+        [OP_SWAP]         = &&vm_OP_SWAP,
+        [OP_ROT]          = &&vm_OP_ROT,
+
+        [OP_ADD_UNCHECKED]   = &&vm_OP_ADD_UNCHECKED,
+        [OP_MUL_UNCHECKED]   = &&vm_OP_MUL_UNCHECKED,
+        [OP_EQUAL_UNCHECKED] = &&vm_OP_EQUAL_UNCHECKED,
+        [OP_DUP_UNCHECKED]   = &&vm_OP_DUP_UNCHECKED,
+        [OP_DROP_UNCHECKED]  = &&vm_OP_DROP_UNCHECKED,
+        [OP_SWAP_UNCHECKED]  = &&vm_OP_SWAP_UNCHECKED,
+        [OP_ROT_UNCHECKED]   = &&vm_OP_ROT_UNCHECKED,
+
+        [OP_DUP_MUL]             = &&vm_OP_DUP_MUL,
+        [OP_DUP_MUL_UNCHECKED]   = &&vm_OP_DUP_MUL_UNCHECKED,
+        [OP_SWAP_DROP]           = &&vm_OP_SWAP_DROP,
+        [OP_SWAP_DROP_UNCHECKED] = &&vm_OP_SWAP_DROP_UNCHECKED,
+        [OP_ADD_INT]             = &&vm_OP_ADD_INT,
+        [OP_ADD_INT_UNCHECKED]   = &&vm_OP_ADD_INT_UNCHECKED,
+        [OP_MUL_INT]             = &&vm_OP_MUL_INT,
+        [OP_MUL_INT_UNCHECKED]   = &&vm_OP_MUL_INT_UNCHECKED,
+        [OP_EQUAL_INT]           = &&vm_OP_EQUAL_INT,
+
+        [OPCODE_COUNT] = &&vm_PROFILE,
+    };
+
+    if (!function) {
+        vm_handlers = handlers;
+        return;
+    }
+
+    if (!function->threaded)
+        fatalf("error: executing a function that was not prepared.\n");
+
+    struct vm_instruction const *ip = function->threaded;
+#else
+    uint32_t const *ip = function->code;
+#endif
+    struct program *program = env->image->program;
+
+    struct vm_frame inline_frames[VM_FRAMES_INLINE];
+    struct vm_frame *frames  = inline_frames;
+    size_t capacity          = VM_FRAMES_INLINE;
+    size_t nframes           = 0;
+    struct function *current = function;
+
+    struct vm_loop inline_loops[VM_LOOPS_INLINE];
+    struct vm_loop *loops = inline_loops;
+    size_t loops_capacity = VM_LOOPS_INLINE;
+    size_t nloops         = 0;
+
+    struct vm_location location = {{vm_report, error_location}, NULL, NULL};
+    error_location              = &location.location;
+
+    /* A nested run, as for the quotation of times, starts a new history.
+     * Runs that are not profiled leave it alone, since threads may be
+     * running the same program. */
+    size_t history[2] = {0}, nhistory = 0;
+    if (vm_profile.enabled) {
+        nhistory = vm_profile.nhistory;
+        memcpy(history, vm_profile.history, sizeof(history));
+        vm_profile.nhistory = 0;
+    }
+
+#if VM_THREADED
+    VM_NEXT();
+#else
+    while (1) {
+        uint32_t instruction = *ip++;
+
+        if (vm_profile.enabled)
+            vm_profile_record(instruction);
+
+        switch (INSTRUCTION_OPCODE(instruction)) {
+#endif
+
+    VM_CASE(OP_RETURN) {
+    vm_return:
+        if (nframes == 0)
+            goto vm_exit;
+
+        struct vm_frame *frame = &frames[--nframes];
+        current                = frame->function;
+        ip                     = frame->ip;
+        VM_NEXT();
+    }
+    VM_CASE(OP_PUSH_INT) {
+        VM_LOCATE();
+        stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                              .integer = VM_IMMEDIATE});
+        VM_NEXT();
+    }
+    VM_CASE(OP_PUSH_CONST) {
+        VM_LOCATE();
+        stack_push(env->stack, program->constants[VM_OPERAND]);
+        VM_NEXT();
+    }
+    VM_CASE(OP_CALL_BUILTIN) {
+        VM_LOCATE();
+        internal_functions[VM_OPERAND].function(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_CALL_FN) {
+        struct function *callee = program->functions[VM_OPERAND];
+
+        if (VM_NATIVE(callee))
+            VM_NEXT();
+
+        VM_CALL(callee);
+        VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_CALL_FN) {
+        struct function *callee = program->functions[VM_OPERAND];
+
+        if (VM_NATIVE(callee))
+            goto vm_return;
+
+        VM_TAIL_CALL(callee);
+        VM_NEXT();
+    }
+    VM_CASE(OP_APPLY) {
+        VM_LOCATE();
+        struct function *lambda = vm_pop_lambda(env);
+
+        /* Quotations built at run time have no bytecode. */
+        if (!lambda->code) {
+            environment_call(env, lambda);
+            VM_NEXT();
+        }
+
+        if (VM_NATIVE(lambda))
+            VM_NEXT();
+
+        VM_CALL(lambda);
+        VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_APPLY) {
+        VM_LOCATE();
+        struct function *lambda = vm_pop_lambda(env);
+
+        if (!lambda->code) {
+            environment_call(env, lambda);
+            VM_NEXT();
+        }
+
+        if (VM_NATIVE(lambda))
+            goto vm_return;
+
+        VM_TAIL_CALL(lambda);
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP) {
+        VM_JUMP_BACK();
+        VM_NEXT();
+    }
+    /* Conditions are checked inline; a missing or non-integer one is left
+     * to environment_condition to report. */
+    VM_CASE(OP_JUMP_IF_FALSE) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0 ||
+            stack->data[stack->ndata - 1].type != VALUE_TYPE_INTEGER)
+            environment_condition(env);
+
+        if (stack->data[--stack->ndata].integer == 0)
+            VM_JUMP();
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_IF_TRUE) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0 ||
+            stack->data[stack->ndata - 1].type != VALUE_TYPE_INTEGER)
+            environment_condition(env);
+
+        if (stack->data[--stack->ndata].integer != 0)
+            VM_JUMP_BACK();
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOOP_BEGIN) {
+        struct value count;
+
+        VM_LOCATE();
+        if (!stack_pop(env->stack, &count))
+            fatalf("error: stack_pop failed, empty stack\n");
+
+        if (count.type != VALUE_TYPE_INTEGER)
+            fatalf("error: times expects an integer and a lambda\n");
+
+        if (nloops == loops_capacity)
+            loops = vm_grow_loops(loops, inline_loops, &loops_capacity);
+        loops[nloops++] = (struct vm_loop){0, count.integer};
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOOP_NEXT) {
+        struct vm_loop *loop = &loops[nloops - 1];
+
+        if (loop->index >= loop->count) {
+            nloops--;
+            VM_JUMP();
+            VM_NEXT();
+        }
+
+        loop->index++;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOOP_NEXT_INDEX) {
+        struct vm_loop *loop = &loops[nloops - 1];
+
+        if (loop->index >= loop->count) {
+            nloops--;
+            VM_JUMP();
+            VM_NEXT();
+        }
+
+        VM_LOCATE();
+        stack_push(env->stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                              .integer = loop->index++});
+        VM_NEXT();
+    }
+    VM_CASE(OP_CALL_FFI) {
+        VM_LOCATE();
+#ifdef ENABLE_FFI
+        struct word *word = program->ffi_functions[VM_OPERAND];
+        environment_call_ffi(env, word->function.ffi_fn);
+#else
+        fatalf("FFI support not enabled.");
+#endif
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD) {
+        VM_LOCATE();
+        __addfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL) {
+        VM_LOCATE();
+        __mulfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_EQUAL) {
+        VM_LOCATE();
+        __equalfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_DUP) {
+        VM_LOCATE();
+        __dupfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_DROP) {
+        VM_LOCATE();
+        __dropfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_SWAP) {
+        VM_LOCATE();
+        __swapfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_ROT) {
+        VM_LOCATE();
+        __rotfunction(env);
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top[-1].integer = integer_add(top[-1].integer, top[0].integer);
+        env->stack->ndata--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top[-1].integer = integer_mul(top[-1].integer, top[0].integer);
+        env->stack->ndata--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_EQUAL_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top[-1].integer   = top[-1].integer == top[0].integer;
+        env->stack->ndata--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_DUP_UNCHECKED) {
+        VM_LOCATE();
+        stack_push(env->stack, *VM_TOP());
+        VM_NEXT();
+    }
+    VM_CASE(OP_DROP_UNCHECKED) {
+        env->stack->ndata--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_SWAP_UNCHECKED) {
+        struct value *top = VM_TOP();
+        struct value a    = top[0];
+        top[0]            = top[-1];
+        top[-1]           = a;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ROT_UNCHECKED) {
+        struct value *top = VM_TOP();
+        struct value a    = top[-2];
+        top[-2]           = top[-1];
+        top[-1]           = top[0];
+        top[0]            = a;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_DUP_MUL) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0 ||
+            stack->data[stack->ndata - 1].type != VALUE_TYPE_INTEGER) {
+            __dupfunction(env);
+            __mulfunction(env);
+            VM_NEXT();
+        }
+
+        struct value *top = VM_TOP();
+        top->integer      = integer_mul(top->integer, top->integer);
+        VM_NEXT();
+    }
+    VM_CASE(OP_DUP_MUL_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top->integer      = integer_mul(top->integer, top->integer);
+        VM_NEXT();
+    }
+    VM_CASE(OP_SWAP_DROP) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata < 2) {
+            __swapfunction(env);
+            VM_NEXT();
+        }
+
+        stack->data[stack->ndata - 2] = stack->data[stack->ndata - 1];
+        stack->ndata--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_SWAP_DROP_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top[-1]           = top[0];
+        env->stack->ndata--;
+        VM_NEXT();
+    }
+    /* The checked forms fall back to the builtins when their operand is
+     * missing or not an integer, so that they fail the same way. */
+    VM_CASE(OP_ADD_INT) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0 ||
+            stack->data[stack->ndata - 1].type != VALUE_TYPE_INTEGER) {
+            stack_push(stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                             .integer = VM_IMMEDIATE});
+            __addfunction(env);
+            VM_NEXT();
+        }
+
+        struct value *top = VM_TOP();
+        top->integer      = integer_add(top->integer, VM_IMMEDIATE);
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD_INT_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top->integer      = integer_add(top->integer, VM_IMMEDIATE);
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL_INT) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0 ||
+            stack->data[stack->ndata - 1].type != VALUE_TYPE_INTEGER) {
+            stack_push(stack, (struct value){.type    = VALUE_TYPE_INTEGER,
+                                             .integer = VM_IMMEDIATE});
+            __mulfunction(env);
+            VM_NEXT();
+        }
+
+        struct value *top = VM_TOP();
+        top->integer      = integer_mul(top->integer, VM_IMMEDIATE);
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL_INT_UNCHECKED) {
+        struct value *top = VM_TOP();
+        top->integer      = integer_mul(top->integer, VM_IMMEDIATE);
+        VM_NEXT();
+    }
+    VM_CASE(OP_EQUAL_INT) {
+        struct stack *stack = env->stack;
+
+        VM_LOCATE();
+        if (stack->ndata == 0) {
+            __equalfunction(env);
+            VM_NEXT();
+        }
+
+        struct value *top = VM_TOP();
+        top->integer =
+            top->type == VALUE_TYPE_INTEGER && top->integer == VM_IMMEDIATE;
+        top->type = VALUE_TYPE_INTEGER;
+        VM_NEXT();
+    }
+
+#if VM_THREADED
+    /* Every instruction goes through here while profiling. */
+vm_PROFILE: {
+    uint32_t instruction = current->code[ip - 1 - VM_ENTRY(current)];
+    vm_profile_record(instruction);
+    goto *vm_handlers[INSTRUCTION_OPCODE(instruction)];
+}
+#endif
+
+#if !VM_THREADED
+        default:
+            fatalf("error: invalid opcode %u.\n",
+                   INSTRUCTION_OPCODE(instruction));
+        }
+    }
+#endif
+
+vm_exit:
+    error_location = location.location.prev;
+    if (vm_profile.enabled) {
+        memcpy(vm_profile.history, history, sizeof(history));
+        vm_profile.nhistory = nhistory;
+    }
+    if (frames != inline_frames)
+        free(frames);
+    if (loops != inline_loops)
+        free(loops);
+}
+
+#if VM_THREADED
+static _Bool vm_immediate_opcode(enum opcode op) {
+    switch (op) {
+    case OP_PUSH_INT:
+    case OP_ADD_INT:
+    case OP_ADD_INT_UNCHECKED:
+    case OP_MUL_INT:
+    case OP_MUL_INT_UNCHECKED:
+    case OP_EQUAL_INT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+#endif
+
+/* Translates a function's bytecode into handler addresses with decoded
+ * operands, so dispatching an instruction is a single indirect jump. */
+static void vm_prepare_function(struct function *function) {
+#if VM_THREADED
+    struct vm_instruction *threaded =
+        malloc(sizeof(struct vm_instruction) * function->code_size);
+
+    for (size_t i = 0; i < function->code_size; i++) {
+        uint32_t instruction = function->code[i];
+        enum opcode op       = INSTRUCTION_OPCODE(instruction);
+
+        if (op >= OPCODE_COUNT || !vm_handlers[op])
+            fatalf("error: invalid opcode %u.\n", op);
+
+        threaded[i].handler =
+            vm_handlers[vm_profile.enabled ? OPCODE_COUNT : op];
+        threaded[i].operand = vm_immediate_opcode(op)
+                                  ? (int64_t)INSTRUCTION_IMMEDIATE(instruction)
+                                  : (int64_t)INSTRUCTION_OPERAND(instruction);
+    }
+
+    free(function->threaded);
+    function->threaded = threaded;
+#endif
+}
+
+void vm_prepare(struct program *program) {
+#if VM_THREADED
+    if (!vm_handlers)
+        vm_run(NULL, NULL);
+#endif
+
+    for (size_t i = 0; i < program->functions_size; i++)
+        vm_prepare_function(program->functions[i]);
+}
+
+void vm_execute(struct environment *env, struct function *function) {
+    if (jit_ready(env, function) &&
+        !(function = jit_call(env, function)))
+        return;
+
+    vm_run(env, function);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef VM_H
+#define VM_H
+
+#include "kernel.h"
+
+/* The VM dispatches with computed gotos over direct-threaded code when the
+ * compiler supports labels as values (GCC and Clang), and with a switch
+ * over the bytecode otherwise. Defining VM_SWITCH_DISPATCH forces the
+ * switch. */
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+struct vm_instruction {
+    void const *handler;
+    int64_t operand;
+};
+
+/* The counter of a times loop compiled to jumps. Loops are kept on a
+ * stack of their own, which works because a loop always finishes before
+ * the function it is in returns. */
+struct vm_loop {
+    int64_t index;
+    int64_t count;
+};
+
+void vm_prepare(struct program *program);
+void vm_execute(struct environment *env, struct function *function);
+
+/* Starts counting the instruction pairs and triples that run, which must
+ * happen before the program is prepared, and prints the top most frequent
+ * of each to stderr. */
+void vm_profile_start(void);
+void vm_profile_report(size_t top);
+
+#endif
\ No newline at end of file